@@ -31,58 +31,242 @@
 // but slowes down the insert and delete operation by factor 10 due to 'parent search'.
 // The find opeartion is not affected cause finding doesn't need a parent.
 //
+// Tables that are read far more often than written can be frozen: freeze() relayouts
+// the nodes into Eytzinger (BFS) order, so a lookup walks the arrays front to back and
+// the next levels can be prefetched. A frozen tree is still a valid AVL tree, any insert
+// or erase simply leaves the frozen state.
+//
+// The node arrays are provided by a storage class: avl_array embeds them with a
+// compile time Size, avl_dynamic_array allocates them through an allocator and grows
+// by relocating the parallel arrays. Nodes are addressed by index in both, so growing
+// does not touch the tree links.
+//
 // usage:
 // #include "avl_array.h"
 // avl_array<int, int, int, 1024> avl;
 // avl.insert(1, 1);
+// avl.freeze();
+// auto it = avl.lower_bound(1);
+//
+// avl_dynamic_array<int, int, std::uint32_t> table(64U);  // grows on demand
 //
 ///////////////////////////////////////////////////////////////////////////////
 
 #ifndef _AVL_ARRAY_H_
 #define _AVL_ARRAY_H_
 
+#include <bit>
+#include <cstddef>
 #include <cstdint>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+// child index pointer class
+template <typename size_type>
+struct avl_child_type
+{
+    size_type left;
+    size_type right;
+};
+
+/**
+ * Fixed node storage embedded in the container
+ * \param Size Container size
+ */
+template <typename Key, typename T, typename size_type, const size_type Size, const bool Fast>
+class avl_static_storage
+{
+protected:
+    // node storage, due to possible structure packing effects, single arrays are used instead of a 'node' structure
+    Key key_[Size];                          // node key
+    T val_[Size];                            // node value
+    std::int8_t balance_[Size];              // subtree balance
+    avl_child_type<size_type> child_[Size];  // node childs
+    size_type parent_[Fast ? Size : 1];      // node parent, use one element if not needed (zero sized array is not allowed)
+
+    // invalid index (like 'nullptr' in a pointer implementation)
+    static const size_type INVALID_IDX = Size;
+
+    inline size_type capacity() const
+    {
+        return Size;
+    }
+
+    // fixed capacity, cannot grow
+    inline bool grow(size_type, size_type)
+    {
+        return false;
+    }
+};
+
+/**
+ * Node storage allocated at runtime. Key and T must be default constructible and assignable,
+ * like in avl_array all slots up to the capacity hold constructed objects.
+ * \param Allocator Standard allocator model, rebound for every node array (arena, message pool ...)
+ */
+template <typename Key, typename T, typename size_type, const bool Fast, typename Allocator>
+class avl_dynamic_storage
+{
+public:
+    explicit avl_dynamic_storage(size_type capacity = 0U, const Allocator &alloc = Allocator())
+        : key_(nullptr), val_(nullptr), balance_(nullptr), child_(nullptr), parent_(nullptr), capacity_(0U), alloc_(alloc)
+    {
+        if (capacity)
+        {
+            grow(0U, capacity);
+        }
+    }
+
+    ~avl_dynamic_storage()
+    {
+        release();
+    }
+
+    avl_dynamic_storage(const avl_dynamic_storage &) = delete;
+    avl_dynamic_storage &operator=(const avl_dynamic_storage &) = delete;
+
+protected:
+    Key *key_;                          // node key
+    T *val_;                            // node value
+    std::int8_t *balance_;              // subtree balance
+    avl_child_type<size_type> *child_;  // node childs
+    size_type *parent_;                 // node parent, nullptr if not needed
+
+    // invalid index, the capacity never reaches it
+    static const size_type INVALID_IDX = std::numeric_limits<size_type>::max();
+
+    inline size_type capacity() const
+    {
+        return capacity_;
+    }
+
+    /**
+     * Relocate the node arrays to hold at least min_capacity nodes, at least doubling the capacity
+     * \param used Number of nodes to move into the new arrays
+     * \return False if the capacity cannot be represented by size_type
+     */
+    bool grow(size_type used, size_type min_capacity)
+    {
+        const size_type max_capacity = INVALID_IDX - 1U;
+        if (min_capacity > max_capacity)
+        {
+            return false;
+        }
+        size_type capacity = capacity_ > max_capacity / 2U ? max_capacity : static_cast<size_type>(capacity_ * 2U);
+        if (capacity < min_capacity)
+        {
+            capacity = min_capacity;
+        }
+        if (capacity < 16U && max_capacity >= 16U)
+        {
+            capacity = 16U;
+        }
+
+        Key *key = create<Key>(capacity);
+        T *val = create<T>(capacity);
+        std::int8_t *balance = create<std::int8_t>(capacity);
+        avl_child_type<size_type> *child = create<avl_child_type<size_type>>(capacity);
+        size_type *parent = Fast ? create<size_type>(capacity) : nullptr;
+        for (size_type i = 0U; i < used; ++i)
+        {
+            key[i] = std::move(key_[i]);
+            val[i] = std::move(val_[i]);
+            balance[i] = balance_[i];
+            child[i] = child_[i];
+            if (Fast)
+            {
+                parent[i] = parent_[i];
+            }
+        }
+        release();
+        key_ = key;
+        val_ = val;
+        balance_ = balance;
+        child_ = child;
+        parent_ = parent;
+        capacity_ = capacity;
+        return true;
+    }
+
+private:
+    template <typename U>
+    U *create(size_type count)
+    {
+        typedef typename std::allocator_traits<Allocator>::template rebind_alloc<U> alloc_type;
+        typedef std::allocator_traits<alloc_type> traits;
+        alloc_type alloc(alloc_);
+        U *data = traits::allocate(alloc, count);
+        for (size_type i = 0U; i < count; ++i)
+        {
+            traits::construct(alloc, data + i);
+        }
+        return data;
+    }
+
+    template <typename U>
+    void destroy(U *data)
+    {
+        typedef typename std::allocator_traits<Allocator>::template rebind_alloc<U> alloc_type;
+        typedef std::allocator_traits<alloc_type> traits;
+        if (!data)
+        {
+            return;
+        }
+        alloc_type alloc(alloc_);
+        for (size_type i = 0U; i < capacity_; ++i)
+        {
+            traits::destroy(alloc, data + i);
+        }
+        traits::deallocate(alloc, data, capacity_);
+    }
+
+    void release()
+    {
+        destroy(key_);
+        destroy(val_);
+        destroy(balance_);
+        destroy(child_);
+        destroy(parent_);
+    }
+
+    size_type capacity_;
+    Allocator alloc_;
+};
 
 /**
  * \param Key The key type. The type (class) must provide a 'less than' and 'equal to' operator
  * \param T The Data type
  * \param size_type Container size type
- * \param Size Container size
  * \param Fast If true every node stores an extra parent index. This increases memory but speed up insert/erase by factor 10
+ * \param Storage Node storage, avl_static_storage or avl_dynamic_storage
  */
-template <typename Key, typename T, typename size_type, const size_type Size, const bool Fast = true>
-class avl_array
+template <typename Key, typename T, typename size_type, const bool Fast, typename Storage>
+class avl_tree : public Storage
 {
-    // child index pointer class
-    typedef struct tag_child_type
-    {
-        size_type left;
-        size_type right;
-    } child_type;
+    using Storage::key_;
+    using Storage::val_;
+    using Storage::balance_;
+    using Storage::child_;
+    using Storage::parent_;
+    using Storage::INVALID_IDX;
 
-    // node storage, due to possible structure packing effects, single arrays are used instead of a 'node' structure
-    Key key_[Size];                     // node key
-    T val_[Size];                       // node value
-    std::int8_t balance_[Size];         // subtree balance
-    child_type child_[Size];            // node childs
     size_type size_;                    // actual size
     size_type root_;                    // root node
-    size_type parent_[Fast ? Size : 1]; // node parent, use one element if not needed (zero sized array is not allowed)
-
-    // invalid index (like 'nullptr' in a pointer implementation)
-    static const size_type INVALID_IDX = Size;
+    bool frozen_;                       // nodes are in Eytzinger order, node i has the childs 2i+1 and 2i+2
 
     // iterator class
     typedef class tag_avl_array_iterator
     {
-        avl_array *instance_; // array instance
+        avl_tree *instance_;  // array instance
         size_type idx_;       // actual node
 
-        friend avl_array; // avl_array may access index pointer
+        friend avl_tree; // avl_tree may access index pointer
 
     public:
         // ctor
-        tag_avl_array_iterator(avl_array *instance = nullptr, size_type idx = 0U)
+        tag_avl_array_iterator(avl_tree *instance = nullptr, size_type idx = 0U)
             : instance_(instance), idx_(idx)
         {
         }
@@ -126,7 +310,7 @@ class avl_array
         tag_avl_array_iterator &operator++()
         {
             // end reached?
-            if (idx_ >= Size)
+            if (idx_ == INVALID_IDX)
             {
                 return *this;
             }
@@ -178,9 +362,10 @@ public:
     typedef Key key_type;
     typedef avl_array_iterator iterator;
 
-    // ctor
-    avl_array()
-        : size_(0U), root_(Size)
+    // ctor, the arguments are forwarded to the storage
+    template <typename... Args>
+    explicit avl_tree(Args &&...args)
+        : Storage(std::forward<Args>(args)...), size_(0U), root_(INVALID_IDX), frozen_(false)
     {
     }
 
@@ -213,9 +398,19 @@ public:
         return size_ == static_cast<size_type>(0);
     }
 
+    // current capacity, avl_dynamic_array grows beyond it on insert
     inline size_type max_size() const
     {
-        return Size;
+        return this->capacity();
+    }
+
+    /**
+     * Make room for count elements without further relocation
+     * \return False if the storage cannot hold count elements
+     */
+    inline bool reserve(size_type count)
+    {
+        return (count <= max_size()) || this->grow(size_, count);
     }
 
     /**
@@ -225,6 +420,15 @@ public:
     {
         size_ = 0U;
         root_ = INVALID_IDX;
+        frozen_ = false;
+    }
+
+    /**
+     * True if the nodes are in Eytzinger order, see freeze()
+     */
+    inline bool frozen() const
+    {
+        return frozen_;
     }
 
     /**
@@ -237,12 +441,18 @@ public:
     {
         if (root_ == INVALID_IDX)
         {
+            if ((size_ >= max_size()) && !this->grow(size_, size_ + 1U))
+            {
+                // container is full
+                return false;
+            }
             key_[size_] = key;
             val_[size_] = val;
             balance_[size_] = 0;
             child_[size_] = {INVALID_IDX, INVALID_IDX};
             set_parent(size_, INVALID_IDX);
             root_ = size_++;
+            frozen_ = false;
             return true;
         }
 
@@ -252,7 +462,7 @@ public:
             {
                 if (child_[i].left == INVALID_IDX)
                 {
-                    if (size_ >= max_size())
+                    if ((size_ >= max_size()) && !this->grow(size_, size_ + 1U))
                     {
                         // container is full
                         return false;
@@ -263,6 +473,7 @@ public:
                     child_[size_] = {INVALID_IDX, INVALID_IDX};
                     set_parent(size_, i);
                     child_[i].left = size_++;
+                    frozen_ = false;
                     insert_balance(i, 1);
                     return true;
                 }
@@ -277,7 +488,7 @@ public:
             {
                 if (child_[i].right == INVALID_IDX)
                 {
-                    if (size_ >= max_size())
+                    if ((size_ >= max_size()) && !this->grow(size_, size_ + 1U))
                     {
                         // container is full
                         return false;
@@ -288,6 +499,7 @@ public:
                     child_[size_] = {INVALID_IDX, INVALID_IDX};
                     set_parent(size_, i);
                     child_[i].right = size_++;
+                    frozen_ = false;
                     insert_balance(i, -1);
                     return true;
                 }
@@ -305,6 +517,16 @@ public:
      */
     inline bool find(const key_type &key, value_type &val) const
     {
+        if (frozen_)
+        {
+            const size_type i = frozen_lower_bound(key);
+            if ((i != INVALID_IDX) && (key_[i] == key))
+            {
+                val = val_[i];
+                return true;
+            }
+            return false;
+        }
         for (size_type i = root_; i != INVALID_IDX;)
         {
             if (key < key_[i])
@@ -333,6 +555,11 @@ public:
      */
     inline iterator find(const key_type &key)
     {
+        if (frozen_)
+        {
+            const size_type i = frozen_lower_bound(key);
+            return ((i != INVALID_IDX) && (key_[i] == key)) ? iterator(this, i) : end();
+        }
         for (size_type i = root_; i != INVALID_IDX;)
         {
             if (key < key_[i])
@@ -353,6 +580,155 @@ public:
         return end();
     }
 
+    /**
+     * Find the first element whose key is not less than key
+     * \param key The key to compare
+     * \return Iterator to the element, or end() if all keys are less than key
+     */
+    inline iterator lower_bound(const key_type &key)
+    {
+        if (frozen_)
+        {
+            return iterator(this, frozen_lower_bound(key));
+        }
+        size_type candidate = INVALID_IDX;
+        for (size_type i = root_; i != INVALID_IDX;)
+        {
+            if (key_[i] < key)
+            {
+                i = child_[i].right;
+            }
+            else
+            {
+                candidate = i;
+                i = child_[i].left;
+            }
+        }
+        return iterator(this, candidate);
+    }
+
+    /**
+     * Find the first element whose key is greater than key
+     * \param key The key to compare
+     * \return Iterator to the element, or end() if no key is greater than key
+     */
+    inline iterator upper_bound(const key_type &key)
+    {
+        if (frozen_)
+        {
+            return iterator(this, frozen_upper_bound(key));
+        }
+        size_type candidate = INVALID_IDX;
+        for (size_type i = root_; i != INVALID_IDX;)
+        {
+            if (key < key_[i])
+            {
+                candidate = i;
+                i = child_[i].left;
+            }
+            else
+            {
+                i = child_[i].right;
+            }
+        }
+        return iterator(this, candidate);
+    }
+
+    /**
+     * Range of the elements equal to key, as keys are unique the range contains zero or one element
+     * \param key The key to compare
+     * \return Pair of lower_bound(key) and upper_bound(key)
+     */
+    inline std::pair<iterator, iterator> equal_range(const key_type &key)
+    {
+        return std::pair<iterator, iterator>(lower_bound(key), upper_bound(key));
+    }
+
+    /**
+     * Relayout the nodes into Eytzinger (BFS) order of a complete tree, O(n) and without extra memory.
+     * Afterwards find/lower_bound/upper_bound use a branch-free search that touches the arrays
+     * front to back and prefetches the following levels. All iterators are invalidated.
+     */
+    void freeze()
+    {
+        if (frozen_ || empty())
+        {
+            return;
+        }
+
+        // in-order walk of the tree, the target slot of every node is stored in child_[].left,
+        // the left subtree has been walked when a node is visited, so its child_ can be reused.
+        // AVL height is below 1.45 * log2(n + 2), 128 levels covers any size_type.
+        size_type stack[128];
+        std::size_t depth = 0U;
+        size_type slot = eytzinger_first();
+        size_type i = root_;
+        while ((i != INVALID_IDX) || depth)
+        {
+            for (; i != INVALID_IDX; i = child_[i].left)
+            {
+                stack[depth++] = i;
+            }
+            i = stack[--depth];
+            const size_type right = child_[i].right;
+            child_[i].left = slot;
+            slot = eytzinger_next(slot);
+            i = right;
+        }
+
+        // apply the permutation by following its cycles
+        for (size_type n = 0U; n < size_; ++n)
+        {
+            for (size_type target = child_[n].left; target != n; target = child_[n].left)
+            {
+                std::swap(key_[n], key_[target]);
+                std::swap(val_[n], val_[target]);
+                std::swap(child_[n].left, child_[target].left);
+            }
+        }
+        link_eytzinger();
+    }
+
+    /**
+     * Replace the content by count elements sorted ascending by key, in O(n) instead of n inserts.
+     * The result is frozen.
+     * \param keys Strictly ascending keys
+     * \param vals Values of the keys
+     * \param count Number of elements
+     * \return False if count exceeds the capacity or keys are not strictly ascending, the container is unchanged then
+     */
+    bool build_sorted(const key_type *keys, const value_type *vals, size_type count)
+    {
+        if ((count > max_size()) && !this->grow(0U, count))
+        {
+            return false;
+        }
+        for (size_type n = 1U; n < count; ++n)
+        {
+            if (!(keys[n - 1U] < keys[n]))
+            {
+                return false;
+            }
+        }
+        size_ = count;
+        size_type slot = eytzinger_first();
+        for (size_type n = 0U; n < count; ++n)
+        {
+            key_[slot] = keys[n];
+            val_[slot] = vals[n];
+            slot = eytzinger_next(slot);
+        }
+        if (count)
+        {
+            link_eytzinger();
+        }
+        else
+        {
+            clear();
+        }
+        return true;
+    }
+
     /**
      * Count elements with a specific key
      * Searches the container for elements with a key equivalent to key and returns the number of matches.
@@ -519,6 +895,7 @@ public:
             }
         }
         size_--;
+        frozen_ = false;
 
         // relocate the node at the end to the deleted node, if it's not the deleted one
         if (node != size_)
@@ -599,6 +976,107 @@ public:
     /////////////////////////////////////////////////////////////////////////////
     // Helper functions
 private:
+    // 1-based Eytzinger index, a descent reaches 2 * size_ + 1 which may not fit a narrow size_type
+    typedef std::size_t index_type;
+
+    // first slot of an in-order walk over the implicit complete tree of size_ nodes
+    inline size_type eytzinger_first() const
+    {
+        index_type k = 1U;
+        while ((k << 1U) <= static_cast<index_type>(size_))
+        {
+            k <<= 1U;
+        }
+        return static_cast<size_type>(k - 1U);
+    }
+
+    // in-order successor in the implicit complete tree, slots are 0-based
+    inline size_type eytzinger_next(size_type slot) const
+    {
+        const index_type n = static_cast<index_type>(size_);
+        index_type k = static_cast<index_type>(slot) + 1U;
+        if ((k << 1U | 1U) <= n)
+        {
+            for (k = k << 1U | 1U; (k << 1U) <= n; k <<= 1U)
+                ;
+        }
+        else
+        {
+            // climb while k is a right child, then take the parent
+            k >>= std::countr_one(k) + 1;
+        }
+        return k ? static_cast<size_type>(k - 1U) : INVALID_IDX;
+    }
+
+    // height of the implicit subtree rooted at 1-based k
+    inline std::int8_t eytzinger_height(index_type k) const
+    {
+        const index_type n = static_cast<index_type>(size_);
+        if (k > n)
+        {
+            return 0;
+        }
+        const int shift = std::bit_width(n) - std::bit_width(k);
+        return static_cast<std::int8_t>(shift + ((k << shift) <= n ? 1 : 0));
+    }
+
+    // rebuild child_, parent_ and balance_ for nodes stored in Eytzinger order
+    void link_eytzinger()
+    {
+        const index_type n = static_cast<index_type>(size_);
+        for (index_type k = 1U; k <= n; ++k)
+        {
+            const size_type node = static_cast<size_type>(k - 1U);
+            child_[node].left = (k << 1U) <= n ? static_cast<size_type>((k << 1U) - 1U) : INVALID_IDX;
+            child_[node].right = (k << 1U | 1U) <= n ? static_cast<size_type>(k << 1U) : INVALID_IDX;
+            balance_[node] = static_cast<std::int8_t>(eytzinger_height(k << 1U) - eytzinger_height(k << 1U | 1U));
+            set_parent(node, k > 1U ? static_cast<size_type>((k >> 1U) - 1U) : INVALID_IDX);
+        }
+        root_ = 0U;
+        frozen_ = true;
+    }
+
+    inline void prefetch_level(index_type k) const
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        // the 16 descendants 4 levels down are adjacent, one cache line for 4-byte keys
+        const index_type ahead = k << 4U;
+        if (ahead <= static_cast<index_type>(size_))
+        {
+            __builtin_prefetch(key_ + (ahead - 1U));
+        }
+#else
+        (void)k;
+#endif
+    }
+
+    // branch-free lower bound on the Eytzinger layout
+    inline size_type frozen_lower_bound(const key_type &key) const
+    {
+        const index_type n = static_cast<index_type>(size_);
+        index_type k = 1U;
+        while (k <= n)
+        {
+            prefetch_level(k);
+            k = (k << 1U) | static_cast<index_type>(key_[k - 1U] < key);
+        }
+        k >>= std::countr_one(k) + 1;
+        return k ? static_cast<size_type>(k - 1U) : INVALID_IDX;
+    }
+
+    inline size_type frozen_upper_bound(const key_type &key) const
+    {
+        const index_type n = static_cast<index_type>(size_);
+        index_type k = 1U;
+        while (k <= n)
+        {
+            prefetch_level(k);
+            k = (k << 1U) | static_cast<index_type>(!(key < key_[k - 1U]));
+        }
+        k >>= std::countr_one(k) + 1;
+        return k ? static_cast<size_type>(k - 1U) : INVALID_IDX;
+    }
+
     // find parent element
     inline size_type get_parent(size_type node) const
     {
@@ -896,4 +1374,18 @@ private:
     }
 };
 
-#endif // _AVL_ARRAY_H_
\ No newline at end of file
+/**
+ * AVL tree with a compile time capacity, all nodes are embedded in the object
+ * \param Size Container size
+ */
+template <typename Key, typename T, typename size_type, const size_type Size, const bool Fast = true>
+using avl_array = avl_tree<Key, T, size_type, Fast, avl_static_storage<Key, T, size_type, Size, Fast>>;
+
+/**
+ * AVL tree with a runtime capacity, the node arrays are allocated by Allocator and relocated when full.
+ * Construct with an optional initial capacity and allocator instance.
+ */
+template <typename Key, typename T, typename size_type, const bool Fast = true, typename Allocator = std::allocator<Key>>
+using avl_dynamic_array = avl_tree<Key, T, size_type, Fast, avl_dynamic_storage<Key, T, size_type, Fast, Allocator>>;
+
+#endif // _AVL_ARRAY_H_
@@ -1,64 +1,811 @@
 #pragma once
 
+#include <algorithm>
+#include <bit>
+#include <cassert>
 #include <cstdint>
+#include <cstring>
+#include <span>
 #include <string>
+#include <string_view>
+#include <type_traits>
+
+#include "simd.hpp"
 
 namespace SMessage
 {
+    static_assert(std::endian::native == std::endian::little, "SMessage buffers are little-endian.");
+
+    /// Buffer header: `| mainTypeId | trashLength | nextAvailableOffset |`, the root struct starts at 12.
+    constexpr int32_t MainTypeIdOffset = 0;
+    constexpr int32_t TrashLengthOffset = 4;
+    constexpr int32_t NextAvailableOffset = 8;
+    constexpr int32_t RootOffset = 12;
+
+    /// The first typeId of user defined types (enums, structs and accessories), same as msgschema.ts.
+    constexpr int32_t MINUserDefTypeId = 64;
+
+    template <typename T>
+    struct IsNativeType : std::integral_constant<bool, std::is_arithmetic<T>::value || std::is_enum<T>::value> {};
+
+    template <typename V>
+    inline V loadValue(const void *buf, int32_t offset) {
+        if constexpr (std::is_same<V, bool>::value) {
+            return static_cast<const uint8_t*>(buf)[offset] != 0;
+        } else {
+            V value;
+            std::memcpy(&value, static_cast<const uint8_t*>(buf) + offset, sizeof(V));
+            return value;
+        }
+    }
+
+    template <typename V>
+    inline void storeValue(void *buf, int32_t offset, V value) {
+        if constexpr (std::is_same<V, bool>::value) {
+            static_cast<uint8_t*>(buf)[offset] = value ? 1 : 0;
+        } else {
+            std::memcpy(static_cast<uint8_t*>(buf) + offset, &value, sizeof(V));
+        }
+    }
+
+    /// Bytes a value of T occupies inline: sizeof for native types, `T::byteLength` for message views.
+    template <typename T>
+    constexpr int32_t byteLengthOf() {
+        if constexpr (IsNativeType<T>::value) {
+            return static_cast<int32_t>(sizeof(T));
+        } else {
+            return T::byteLength;
+        }
+    }
+
+    /**
+     * 数组数据区的对齐: native为alignof(T)，其他为整除元素大小的最大2的幂(不超过8)，
+     * 这样连续存放的元素之间没有padding，struct数组也可以按它的成员类型读取span。
+     */
+    template <typename T>
+    constexpr int32_t itemAlignment() {
+        if constexpr (IsNativeType<T>::value) {
+            return static_cast<int32_t>(alignof(T));
+        } else {
+            return std::clamp(byteLengthOf<T>() & -byteLengthOf<T>(), 1, 8);
+        }
+    }
+
+    template <typename T>
+    inline T readItem(void *buf, int32_t offset) {
+        if constexpr (IsNativeType<T>::value) {
+            return loadValue<T>(buf, offset);
+        } else {
+            return T(buf, offset);
+        }
+    }
+
+    /**
+     * Zero-copy view over a struct living at `_offset` of a message buffer.
+     * T is the generated struct class, which provides `typeId`, `byteLength` and the member offsets.
+     */
     template <typename T>
     class BaseMessage {
     public:
-        BaseMessage(): _buffer(nullptr) {
+        BaseMessage(): _buffer(nullptr), _offset(0) {
         }
-        BaseMessage(void *buf): _buffer(buf) {}
+        BaseMessage(void *buf): _buffer(static_cast<uint8_t*>(buf)), _offset(RootOffset) {}
+        BaseMessage(void *buf, int32_t offset): _buffer(static_cast<uint8_t*>(buf)), _offset(offset) {}
 
-    private:
-        void* _buffer;
+        /// A reference member whose address is 0 yields a null view.
+        inline bool isNull() const {
+            return _buffer == nullptr || _offset == 0;
+        }
+
+        inline explicit operator bool() const {
+            return !isNull();
+        }
+
+        inline void* buffer() const {
+            return _buffer;
+        }
+
+        inline int32_t offset() const {
+            return _offset;
+        }
+
+        inline int32_t mainTypeId() const {
+            return loadValue<int32_t>(_buffer, MainTypeIdOffset);
+        }
+
+        inline int32_t trashLength() const {
+            return loadValue<int32_t>(_buffer, TrashLengthOffset);
+        }
+
+        inline int32_t nextAvailableOffset() const {
+            return loadValue<int32_t>(_buffer, NextAvailableOffset);
+        }
+
+    protected:
+        template <typename V>
+        inline V loadMember(int32_t memberOffset) const {
+            return loadValue<V>(_buffer, _offset + memberOffset);
+        }
+
+        template <typename V>
+        inline void storeMember(int32_t memberOffset, V value) {
+            storeValue<V>(_buffer, _offset + memberOffset, value);
+        }
+
+        template <typename V>
+        inline V inlineMember(int32_t memberOffset) const {
+            return V(_buffer, _offset + memberOffset);
+        }
+
+        template <typename V>
+        inline V referenceMember(int32_t memberOffset) const {
+            const int32_t addr = loadMember<int32_t>(memberOffset);
+            if (!addr) {
+                return V();
+            }
+            return V(_buffer, addr);
+        }
+
+        uint8_t* _buffer;
+        int32_t _offset;
     };
 
+    template <typename V>
+    inline V loadBigEndian(const void *buf, int32_t offset) {
+        using U = typename std::make_unsigned<V>::type;
+        U value = 0;
+        const uint8_t *bytes = static_cast<const uint8_t*>(buf) + offset;
+        for (size_t i = 0; i < sizeof(V); i++) {
+            value = static_cast<U>((value << 8) | bytes[i]);
+        }
+        return static_cast<V>(value);
+    }
+
+    template <typename V>
+    inline void storeBigEndian(void *buf, int32_t offset, V value) {
+        using U = typename std::make_unsigned<V>::type;
+        U uvalue = static_cast<U>(value);
+        uint8_t *bytes = static_cast<uint8_t*>(buf) + offset;
+        for (size_t i = sizeof(V); i > 0; i--) {
+            bytes[i - 1] = static_cast<uint8_t>(uvalue & 0xFF);
+            uvalue = static_cast<U>(uvalue >> 8);
+        }
+    }
+
+    /**
+     * Memory structure:
+     * `| data offset (big-endian) | str length | str capacity |`
+     * or
+     * `| 0b1 str len -- 1 byte | str Data -- 11 byte |`
+     * The data offset is big-endian so that its first byte never carries the 0x80 short-string flag.
+     * An all-zero string is an empty short string.
+     */
     class MsgString {
     public:
-        MsgString(void *buf, int32_t offset): _buffer(buf), _offset(offset), _str(nullptr) {}
-        ~MsgString() {
-            delete _str;
+        static constexpr int32_t byteLength = 12;
+        static constexpr int32_t maxInlineLength = 11;
+
+        MsgString(): _buffer(nullptr), _offset(0) {}
+        MsgString(void *buf, int32_t offset): _buffer(static_cast<uint8_t*>(buf)), _offset(offset) {}
+
+        inline void* buffer() const {
+            return _buffer;
+        }
+
+        inline int32_t offset() const {
+            return _offset;
+        }
+
+        inline bool isInline() const {
+            return getDataOffset() <= 0;
+        }
+
+        inline int32_t getDataOffset() const {
+            return loadBigEndian<int32_t>(_buffer, _offset);
+        }
+
+        inline int32_t length() const {
+            if (isInline()) {
+                return _buffer[_offset] & 0x7F;
+            }
+            return loadValue<int32_t>(_buffer, _offset + 4);
         }
 
-        const std::string& getUtf8String() {
-            if (_str) {
-                return *_str;
+        /// Out-of-line capacity, short strings always have `maxInlineLength`.
+        inline int32_t capacity() const {
+            if (isInline()) {
+                return maxInlineLength;
             }
-            int32_t strStart = reinterpret_cast<int32_t*>(_buffer)[_offset / 4];
-            int32_t strLen = reinterpret_cast<int32_t*>(_buffer)[_offset / 4 + 1];
-            _str = new std::string(reinterpret_cast<const char*>(_buffer) + strStart, static_cast<size_t>(strLen));
-            return *_str;
+            return loadValue<int32_t>(_buffer, _offset + 8);
+        }
+
+        /// Points straight into the message buffer, valid as long as the buffer is.
+        inline std::string_view getStringView() const {
+            const int32_t dataOffset = getDataOffset();
+            if (dataOffset > 0) {
+                return std::string_view(reinterpret_cast<const char*>(_buffer) + dataOffset, static_cast<size_t>(loadValue<int32_t>(_buffer, _offset + 4)));
+            }
+            return std::string_view(reinterpret_cast<const char*>(_buffer) + _offset + 1, static_cast<size_t>(_buffer[_offset] & 0x7F));
+        }
+
+        inline std::string getUtf8String() const {
+            return std::string(getStringView());
+        }
+
+        inline bool operator==(std::string_view other) const {
+            return getStringView() == other;
+        }
+
+        /**
+         * 在原地写入字符串: 短字符串写为inline格式(原有的out-of-line空间计入trash)，
+         * 长字符串只在capacity足够时写入。
+         * @return false 需要分配新的空间，此时字符串未被修改
+         */
+        bool setString(std::string_view str) {
+            const int32_t len = static_cast<int32_t>(str.size());
+            const int32_t dataOffset = getDataOffset();
+            if (len <= maxInlineLength) {
+                if (dataOffset > 0) {
+                    const int32_t cap = loadValue<int32_t>(_buffer, _offset + 8);
+                    storeValue<int32_t>(_buffer, TrashLengthOffset, loadValue<int32_t>(_buffer, TrashLengthOffset) + cap);
+                }
+                _buffer[_offset] = static_cast<uint8_t>(0x80 | len);
+                std::memcpy(_buffer + _offset + 1, str.data(), str.size());
+                std::memset(_buffer + _offset + 1 + len, 0, static_cast<size_t>(maxInlineLength - len));
+                return true;
+            }
+            if (dataOffset > 0 && loadValue<int32_t>(_buffer, _offset + 8) >= len) {
+                storeValue<int32_t>(_buffer, _offset + 4, len);
+                std::memcpy(_buffer + dataOffset, str.data(), str.size());
+                return true;
+            }
+            return false;
+        }
+
+        /// Point the string to `len` bytes at `dataOffset` which has already been allocated in the buffer.
+        inline void setOutOfLine(int32_t dataOffset, int32_t len, int32_t cap) {
+            storeBigEndian<int32_t>(_buffer, _offset, dataOffset);
+            storeValue<int32_t>(_buffer, _offset + 4, len);
+            storeValue<int32_t>(_buffer, _offset + 8, cap);
         }
 
     private:
-        void* _buffer;
+        uint8_t* _buffer;
+        int32_t _offset;
+    };
+
+    /**
+     * Memory structure:
+     * `| data offset | size | capacity |`
+     */
+    class MsgVectorBase {
+    public:
+        static constexpr int32_t byteLength = 12;
+
+        MsgVectorBase(): _buffer(nullptr), _offset(0) {}
+        MsgVectorBase(void *buf, int32_t offset): _buffer(static_cast<uint8_t*>(buf)), _offset(offset) {}
+
+        inline int32_t getStartOffset() const {
+            return loadValue<int32_t>(_buffer, _offset);
+        }
+
+        inline int32_t getSize() const {
+            return loadValue<int32_t>(_buffer, _offset + 4);
+        }
+
+        inline int32_t getCapacity() const {
+            return loadValue<int32_t>(_buffer, _offset + 8);
+        }
+
+        inline void* buffer() const {
+            return _buffer;
+        }
+
+        inline int32_t offset() const {
+            return _offset;
+        }
+
+    protected:
+        inline void setSize(int32_t size) {
+            storeValue<int32_t>(_buffer, _offset + 4, size);
+        }
+
+        uint8_t* _buffer;
         int32_t _offset;
-        std::string *_str;
     };
 
+    template <typename T, typename Enable = void>
+    class MsgVector : public MsgVectorBase {
+    public:
+        using ItemType = T;
+        using MsgVectorBase::MsgVectorBase;
+
+        T getItem(int32_t index) const {
+            const int32_t offset = getStartOffset() + itemSize() * index;
+            return readItem<T>(_buffer, offset);
+        }
+
+        static constexpr int32_t itemSize() {
+            return byteLengthOf<T>();
+        }
+
+        /// 把数据区按V重新解释，例如`Point2D[]`可以看作x,y交替的double数组
+        template <typename V>
+        std::span<const V> viewAs() const {
+            static_assert(byteLengthOf<T>() % sizeof(V) == 0, "The item must be made of V.");
+            const uint8_t *data = _buffer + getStartOffset();
+            assert(reinterpret_cast<uintptr_t>(data) % alignof(V) == 0);
+            return std::span<const V>(reinterpret_cast<const V*>(data), static_cast<size_t>(getSize()) * (byteLengthOf<T>() / sizeof(V)));
+        }
+    };
+
+    /**
+     * 元素为native类型的数组，数据区是连续的T，可以直接以span访问。
+     * span要求数据区按alignof(T)对齐，MessageBuilder分配的数组满足这个条件。
+     */
     template <typename T>
-    class MsgVector {
+    class MsgVector<T, typename std::enable_if<IsNativeType<T>::value>::type> : public MsgVectorBase {
     public:
-        MsgVector(void *buf, int32_t offset): _buffer(buf), _offset(offset) {}
+        using ItemType = T;
+        using MsgVectorBase::MsgVectorBase;
+
+        inline T getItem(int32_t index) const {
+            return loadValue<T>(_buffer, getStartOffset() + itemSize() * index);
+        }
+
+        inline void setItem(int32_t index, T value) {
+            storeValue<T>(_buffer, getStartOffset() + itemSize() * index, value);
+        }
+
+        static constexpr int32_t itemSize() {
+            return static_cast<int32_t>(sizeof(T));
+        }
+
+        inline bool isAligned() const {
+            return reinterpret_cast<uintptr_t>(_buffer + getStartOffset()) % alignof(T) == 0;
+        }
+
+        inline std::span<const T> getSpan() const {
+            assert(isAligned());
+            return std::span<const T>(reinterpret_cast<const T*>(_buffer + getStartOffset()), static_cast<size_t>(getSize()));
+        }
+
+        inline std::span<T> getMutableSpan() {
+            assert(isAligned());
+            return std::span<T>(reinterpret_cast<T*>(_buffer + getStartOffset()), static_cast<size_t>(getSize()));
+        }
+
+        /**
+         * 用[first, last)替换数组内容
+         * @return false capacity不够，数组未被修改
+         */
+        bool assign(const T *first, const T *last) {
+            const int32_t count = static_cast<int32_t>(last - first);
+            if (count > getCapacity()) {
+                return false;
+            }
+            if (count > 0) {
+                std::memcpy(_buffer + getStartOffset(), first, sizeof(T) * static_cast<size_t>(count));
+            }
+            setSize(count);
+            return true;
+        }
+
+        /**
+         * 在数组末尾追加[first, last)
+         * @return false capacity不够，数组未被修改
+         */
+        bool append(const T *first, const T *last) {
+            const int32_t count = static_cast<int32_t>(last - first);
+            const int32_t size = getSize();
+            if (size + count > getCapacity()) {
+                return false;
+            }
+            if (count > 0) {
+                std::memcpy(_buffer + getStartOffset() + itemSize() * size, first, sizeof(T) * static_cast<size_t>(count));
+            }
+            setSize(size + count);
+            return true;
+        }
+    };
+
+    /**
+     * `@flat`二维数组的行视图: 各行的数据按行顺序连续存放在一个块中，外层数组的元素`| data offset | size | capacity |`就是行表。
+     * `MessageBuilder::setRows`/`flatten`和gc产生这样的布局，某一行扩容搬走后`isFlat()`为false，可以用`flatten`恢复。
+     * Rows为外层数组的类型，例如`MsgVector<MsgVector<Point2D>>`。
+     */
+    template <typename Rows>
+    class MsgFlatRows : public MsgVectorBase {
+    public:
+        using Row = typename Rows::ItemType;
+        using Item = typename Row::ItemType;
+
+        using MsgVectorBase::MsgVectorBase;
+        MsgFlatRows(const Rows &rows): MsgVectorBase(rows.buffer(), rows.offset()) {}
+
+        inline int32_t rowCount() const {
+            return getSize();
+        }
 
-        inline int32_t getStartOffset() {
-            return reinterpret_cast<int32_t*>(_buffer)[_offset / 4];
+        inline Row row(int32_t index) const {
+            return Row(_buffer, getStartOffset() + Row::byteLength * index);
         }
 
-        inline int32_t getSize() {
-            return reinterpret_cast<int32_t*>(_buffer)[_offset / 4 + 1];
+        inline int32_t rowSize(int32_t index) const {
+            return loadValue<int32_t>(_buffer, getStartOffset() + Row::byteLength * index + 4);
         }
 
-        T getItem(int32_t index) {
-            const int32_t offset = getStartOffset() + itemSize * index;
-            return T(_buffer, offset);
+        /// 所有行的元素个数
+        int32_t itemCount() const {
+            int32_t count = 0;
+            for (int32_t i = 0; i < rowCount(); i++) {
+                count += rowSize(i);
+            }
+            return count;
+        }
+
+        /// 非空的行依次紧接着上一行，没有元素时也为true
+        bool isFlat() const {
+            int32_t expected = 0;
+            for (int32_t i = 0; i < rowCount(); i++) {
+                const int32_t size = rowSize(i);
+                if (size == 0) {
+                    continue;
+                }
+                const int32_t data = row(i).getStartOffset();
+                if (expected != 0 && data != expected) {
+                    return false;
+                }
+                expected = data + size * byteLengthOf<Item>();
+            }
+            return true;
+        }
+
+        /// 整个块，struct元素需要指定由哪种native组成，例如`block<double>()`
+        template <typename V = Item>
+        std::span<const V> block() const {
+            assert(isFlat());
+            return viewOf<const V>(blockOffset(), itemCount());
+        }
+
+        template <typename V = Item>
+        std::span<V> mutableBlock() {
+            assert(isFlat());
+            return viewOf<V>(blockOffset(), itemCount());
+        }
+
+        template <typename V = Item>
+        std::span<const V> rowSpan(int32_t index) const {
+            return viewOf<const V>(row(index).getStartOffset(), rowSize(index));
+        }
+
+    private:
+        int32_t blockOffset() const {
+            for (int32_t i = 0; i < rowCount(); i++) {
+                if (rowSize(i) != 0) {
+                    return row(i).getStartOffset();
+                }
+            }
+            return 0;
+        }
+
+        template <typename V>
+        std::span<V> viewOf(int32_t dataOffset, int32_t count) const {
+            static_assert(IsNativeType<V>::value && byteLengthOf<Item>() % sizeof(V) == 0, "The item must be made of V.");
+            if (count == 0) {
+                return std::span<V>();
+            }
+            uint8_t *data = _buffer + dataOffset;
+            assert(reinterpret_cast<uintptr_t>(data) % alignof(V) == 0);
+            return std::span<V>(reinterpret_cast<V*>(data), static_cast<size_t>(count) * (byteLengthOf<Item>() / sizeof(V)));
+        }
+    };
+
+    /// `@soa`数组的一列: 成员在struct中的偏移和字节数
+    struct MsgSoaColumn {
+        int32_t offset;
+        int32_t bytes;
+    };
+
+    /**
+     * `@soa`的struct数组，Memory structure与MsgVectorBase相同，数据区(capacity × struct大小)按列存放:
+     * 偏移为o、大小为s的成员，第i个元素的值在`data + capacity * o + s * i`。
+     * 数据区按8对齐且capacity总是偶数，每一列因此都按成员的大小对齐，可以直接作为span读取。
+     */
+    class MsgSoaVectorBase : public MsgVectorBase {
+    public:
+        static constexpr int32_t dataAlignment = 8;
+
+        using MsgVectorBase::MsgVectorBase;
+
+        /// 容纳count个元素的capacity
+        static constexpr int32_t capacityFor(int32_t count) {
+            return count + (count & 1);
+        }
+
+        /// 偏移为memberOffset的成员的一列，V为成员的类型
+        template <typename V>
+        std::span<const V> column(int32_t memberOffset) const {
+            return columnOf<const V>(memberOffset);
+        }
+
+        template <typename V>
+        std::span<V> mutableColumn(int32_t memberOffset) {
+            return columnOf<V>(memberOffset);
+        }
+
+    private:
+        template <typename V>
+        std::span<V> columnOf(int32_t memberOffset) const {
+            static_assert(IsNativeType<V>::value, "A column is made of native values.");
+            if (getStartOffset() == 0) {
+                return std::span<V>();
+            }
+            uint8_t *data = _buffer + getStartOffset() + getCapacity() * memberOffset;
+            assert(reinterpret_cast<uintptr_t>(data) % alignof(V) == 0);
+            return std::span<V>(reinterpret_cast<V*>(data), static_cast<size_t>(getSize()));
+        }
+    };
+
+    /// `@soa`数组中的一个元素，成员分散在各列。生成的`SoaItem`提供与struct相同的get/set
+    class MsgSoaItemBase {
+    public:
+        MsgSoaItemBase(void *buf, int32_t data, int32_t capacity, int32_t index): _buffer(static_cast<uint8_t*>(buf)), _data(data), _capacity(capacity), _index(index) {}
+
+        inline int32_t index() const {
+            return _index;
+        }
+
+    protected:
+        template <typename V>
+        inline V loadColumn(int32_t memberOffset) const {
+            return loadValue<V>(_buffer, columnOffset<V>(memberOffset));
+        }
+
+        template <typename V>
+        inline void storeColumn(int32_t memberOffset, V value) {
+            storeValue<V>(_buffer, columnOffset<V>(memberOffset), value);
+        }
+
+        uint8_t* _buffer;
+        int32_t _data;
+        int32_t _capacity;
+        int32_t _index;
+
+    private:
+        template <typename V>
+        inline int32_t columnOffset(int32_t memberOffset) const {
+            return _data + _capacity * memberOffset + static_cast<int32_t>(sizeof(V)) * _index;
+        }
+    };
+
+    /**
+     * `@soa`的`T[]`。T生成`SoaColumns`(各列的span，例如`xs()`，以及`columns`)和`SoaItem`(元素)，
+     * 因此T只能包含native和enum成员。
+     */
+    template <typename T>
+    class MsgSoaVector : public T::SoaColumns {
+    public:
+        using ItemType = T;
+        using Item = typename T::SoaItem;
+        using T::SoaColumns::SoaColumns;
+
+        static constexpr int32_t itemSize() {
+            return T::byteLength;
+        }
+
+        inline Item getItem(int32_t index) const {
+            return Item(this->_buffer, this->getStartOffset(), this->getCapacity(), index);
+        }
+    };
+
+    /// Map查找时使用的key类型: 字符串key使用string_view，其他使用自身
+    template <typename K>
+    struct MapKeyArg {
+        using type = K;
+    };
+
+    template <>
+    struct MapKeyArg<MsgString> {
+        using type = std::string_view;
+    };
+
+    /**
+     * Memory structure:
+     * `| size | capacity | data offset |`, entries are `| key | value |` sorted by key ascending.
+     * 数值key使用无分支的二分查找，字符串key使用SIMD比较公共前缀。
+     */
+    template <typename K, typename V>
+    class MsgMap {
+    public:
+        static constexpr int32_t byteLength = 12;
+        using KeyArg = typename MapKeyArg<K>::type;
+
+        class iterator {
+        public:
+            iterator(uint8_t *buf, int32_t entryOffset): _buffer(buf), _entry(entryOffset) {}
+
+            inline K key() const {
+                return readItem<K>(_buffer, _entry);
+            }
+
+            inline V value() const {
+                return readItem<V>(_buffer, _entry + keyByte());
+            }
+
+            inline int32_t entryOffset() const {
+                return _entry;
+            }
+
+            inline iterator& operator++() {
+                _entry += entryByte();
+                return *this;
+            }
+
+            inline const iterator& operator*() const {
+                return *this;
+            }
+
+            inline bool operator==(const iterator &rhs) const {
+                return _entry == rhs._entry;
+            }
+
+            inline bool operator!=(const iterator &rhs) const {
+                return _entry != rhs._entry;
+            }
+
+        private:
+            uint8_t *_buffer;
+            int32_t _entry;
+        };
+
+        MsgMap(): _buffer(nullptr), _offset(0) {}
+        MsgMap(void *buf, int32_t offset): _buffer(static_cast<uint8_t*>(buf)), _offset(offset) {}
+
+        inline int32_t getSize() const {
+            return loadValue<int32_t>(_buffer, _offset);
+        }
+
+        inline int32_t getCapacity() const {
+            return loadValue<int32_t>(_buffer, _offset + 4);
+        }
+
+        inline int32_t getDataOffset() const {
+            return loadValue<int32_t>(_buffer, _offset + 8);
+        }
+
+        static constexpr int32_t keyByte() {
+            return byteLengthOf<K>();
+        }
+
+        static constexpr int32_t valueByte() {
+            return byteLengthOf<V>();
+        }
+
+        static constexpr int32_t entryByte() {
+            return keyByte() + valueByte();
+        }
+
+        inline iterator begin() const {
+            return iterator(_buffer, getDataOffset());
+        }
+
+        inline iterator end() const {
+            return iterator(_buffer, getDataOffset() + entryByte() * getSize());
+        }
+
+        inline iterator at(int32_t index) const {
+            return iterator(_buffer, getDataOffset() + entryByte() * index);
+        }
+
+        /// 第一个key不小于`key`的entry的下标，不存在时返回size
+        int32_t lowerBoundIndex(KeyArg key) const {
+            const int32_t size = getSize();
+            if (size == 0) {
+                return 0;
+            }
+            const int32_t data = getDataOffset();
+            if constexpr (IsNativeType<K>::value) {
+                int32_t base = 0;
+                int32_t len = size;
+                while (len > 1) {
+                    const int32_t half = len / 2;
+                    // 编译为cmov，没有难以预测的分支
+                    base = loadValue<K>(_buffer, data + (base + half) * entryByte()) < key ? base + half : base;
+                    len -= half;
+                }
+                return base + (loadValue<K>(_buffer, data + base * entryByte()) < key ? 1 : 0);
+            } else {
+                int32_t lo = 0;
+                int32_t hi = size;
+                while (lo < hi) {
+                    const int32_t mid = lo + (hi - lo) / 2;
+                    if (compareKey(data + mid * entryByte(), key) < 0) {
+                        lo = mid + 1;
+                    } else {
+                        hi = mid;
+                    }
+                }
+                return lo;
+            }
+        }
+
+        inline iterator lower_bound(KeyArg key) const {
+            return at(lowerBoundIndex(key));
+        }
+
+        iterator find(KeyArg key) const {
+            const int32_t index = lowerBoundIndex(key);
+            if (index < getSize() && compareKey(getDataOffset() + index * entryByte(), key) == 0) {
+                return at(index);
+            }
+            return end();
+        }
+
+        inline bool contains(KeyArg key) const {
+            return find(key) != end();
+        }
+
+    private:
+        /// 比较entry中的key与`key`，返回值同memcmp
+        inline int compareKey(int32_t entryOffset, KeyArg key) const {
+            if constexpr (IsNativeType<K>::value) {
+                const K local = loadValue<K>(_buffer, entryOffset);
+                return local < key ? -1 : (key < local ? 1 : 0);
+            } else {
+                return Simd::compareString(MsgString(_buffer, entryOffset).getStringView(), key);
+            }
+        }
+
+        uint8_t* _buffer;
+        int32_t _offset;
+    };
+
+    template <typename V, typename First, typename... Rest>
+    constexpr uint8_t combineIndexOf() {
+        if constexpr (std::is_same<V, First>::value) {
+            return 1;
+        } else {
+            static_assert(sizeof...(Rest) > 0, "The type is not a candidate of the combine.");
+            return 1 + combineIndexOf<V, Rest...>();
+        }
+    }
+
+    /**
+     * CombineType 使用8字节，第1字节标示类型(从1开始，0为undefined)，后4字节如果类型长度<=4，那么标示为值，否则存储指针
+     */
+    template <typename... Ts>
+    class MsgCombine {
+    public:
+        static constexpr int32_t byteLength = 8;
+
+        MsgCombine(): _buffer(nullptr), _offset(0) {}
+        MsgCombine(void *buf, int32_t offset): _buffer(buf), _offset(offset) {}
+
+        inline uint8_t index() const {
+            return loadValue<uint8_t>(_buffer, _offset);
+        }
+
+        template <typename V>
+        inline bool is() const {
+            return index() == combineIndexOf<V, Ts...>();
+        }
+
+        template <typename V>
+        V get() const {
+            if constexpr (byteLengthOf<V>() <= 4) {
+                return readItem<V>(_buffer, _offset + 4);
+            } else {
+                return readItem<V>(_buffer, loadValue<int32_t>(_buffer, _offset + 4));
+            }
         }
 
-        constexpr int32_t itemSize() {
-            return sizeof(T);
+        /// Only values stored inline (<= 4 bytes) can be set without allocating a sub buffer.
+        template <typename V>
+        void set(V value) {
+            static_assert(IsNativeType<V>::value && byteLengthOf<V>() <= 4, "Only inline native values can be set directly.");
+            storeValue<uint8_t>(_buffer, _offset, combineIndexOf<V, Ts...>());
+            storeValue<V>(_buffer, _offset + 4, value);
         }
 
     private:
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cassert>
+#include <span>
+
+#include "builder.hpp"
+
+namespace SMessage
+{
+    /// 批量消息buffer的mainTypeId，位于内置类型(59~63)之前
+    constexpr int32_t BatchTypeId = 58;
+
+    /// 批量消息中一个消息的索引: `| typeId | offset | length |`
+    class BatchIndexEntry : public BaseMessage<BatchIndexEntry> {
+    public:
+        static constexpr int32_t typeId = 0;
+        static constexpr int32_t byteLength = 12;
+
+        static constexpr int32_t offsetTypeId = 0;
+        static constexpr int32_t offsetOffset = 4;
+        static constexpr int32_t offsetLength = 8;
+
+        using BaseMessage::BaseMessage;
+
+        inline int32_t getTypeId() const {
+            return loadMember<int32_t>(offsetTypeId);
+        }
+
+        /// 消息root在batch buffer中的位置
+        inline int32_t getOffset() const {
+            return loadMember<int32_t>(offsetOffset);
+        }
+
+        /// 消息占用的字节数，从root开始连续存放
+        inline int32_t getLength() const {
+            return loadMember<int32_t>(offsetLength);
+        }
+
+    private:
+        friend class BatchBuilder;
+
+        inline void set(int32_t typeId, int32_t offset, int32_t length) {
+            storeMember<int32_t>(offsetTypeId, typeId);
+            storeMember<int32_t>(offsetOffset, offset);
+            storeMember<int32_t>(offsetLength, length);
+        }
+    };
+
+    /**
+     * 一个buffer中依次存放多个消息，root(12处)是`(typeId, offset, length)`的索引数组。
+     * 所有消息共用batch的header，消息内的offset都是batch buffer中的绝对位置，
+     * 因此读取时直接在batch buffer上构造view，不需要拷贝。与TS的`MessageBatch`布局相同。
+     */
+    class MessageBatch : public BaseMessage<MessageBatch> {
+    public:
+        static constexpr int32_t typeId = BatchTypeId;
+        static constexpr int32_t byteLength = 12;
+
+        using BaseMessage::BaseMessage;
+
+        inline bool isBatch() const {
+            return mainTypeId() == BatchTypeId;
+        }
+
+        inline MsgVector<BatchIndexEntry> getIndex() const {
+            return inlineMember<MsgVector<BatchIndexEntry>>(0);
+        }
+
+        inline int32_t size() const {
+            return getIndex().getSize();
+        }
+
+        inline BatchIndexEntry entry(int32_t index) const {
+            return getIndex().getItem(index);
+        }
+
+        /// 第index个消息，类型必须是T
+        template <typename T>
+        inline T get(int32_t index) const {
+            const BatchIndexEntry item = entry(index);
+            assert(item.getTypeId() == T::typeId);
+            return T(_buffer, item.getOffset());
+        }
+
+        inline std::span<const uint8_t> bytesOf(int32_t index) const {
+            const BatchIndexEntry item = entry(index);
+            return std::span<const uint8_t>(_buffer + item.getOffset(), static_cast<size_t>(item.getLength()));
+        }
+
+        /// 按顺序遍历所有消息的索引
+        template <typename Handler>
+        void forEach(Handler &&handler) const {
+            const MsgVector<BatchIndexEntry> index = getIndex();
+            const int32_t count = index.getSize();
+            for (int32_t i = 0; i < count; i++) {
+                handler(index.getItem(i));
+            }
+        }
+    };
+
+    /**
+     * 向batch中追加消息。`begin<T>`在batch buffer中分配消息的root，之后通过`builder()`构建它的成员，
+     * `end`把消息写入索引。同一时间只能构建一个消息，分配和扩容都由内部的`MessageBuilder`完成。
+     */
+    class BatchBuilder {
+    public:
+        explicit BatchBuilder(int32_t initialCapacity = MessageBuilder::defaultCapacity): _builder(initialCapacity) {
+            _builder.createRoot<MessageBatch>();
+        }
+
+        explicit BatchBuilder(MessagePool &pool, int32_t initialCapacity = MessageBuilder::defaultCapacity): _builder(pool, initialCapacity) {
+            _builder.createRoot<MessageBatch>();
+        }
+
+        /// 开始一个新消息，root按8字节对齐
+        template <typename T>
+        T begin() {
+            assert(_current == 0);
+            _current = _builder.createSubBuffer(T::byteLength, 8);
+            _currentType = T::typeId;
+            return _builder.view<T>(_current);
+        }
+
+        /// 当前消息构建完成
+        void end() {
+            assert(_current != 0);
+            const int32_t length = _builder.nextAvailableOffset() - _current;
+            BatchIndexEntry item = _builder.emplaceBack(batch().getIndex());
+            item.set(_currentType, _current, length);
+            _current = 0;
+        }
+
+        /// 预先分配索引，避免追加过程中索引被移动到末尾产生trash
+        void reserve(int32_t count) {
+            _builder.reserve(batch().getIndex(), count);
+        }
+
+        inline MessageBuilder& builder() {
+            return _builder;
+        }
+
+        inline MessageBatch batch() const {
+            return _builder.root<MessageBatch>();
+        }
+
+        inline int32_t count() const {
+            return batch().size();
+        }
+
+        inline std::span<const uint8_t> bytes() const {
+            return _builder.bytes();
+        }
+
+        /// 结束构建，把buffer交给持有它的`PooledMessage<MessageBatch>`
+        PooledMessage<MessageBatch> finish() {
+            assert(_current == 0);
+            return _builder.finish<MessageBatch>();
+        }
+
+    private:
+        MessageBuilder _builder;
+        int32_t _current = 0;
+        int32_t _currentType = 0;
+    };
+}
@@ -0,0 +1,557 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <new>
+#include <span>
+#include <utility>
+
+#include "base.hpp"
+#include "pool.hpp"
+
+#if defined(__linux__) && !defined(SMESSAGE_NO_MREMAP)
+#include <sys/mman.h>
+#define SMESSAGE_USE_MREMAP 1
+#endif
+
+namespace SMessage
+{
+    /**
+     * 在C++中直接构建消息，buffer布局与TS的StructBase完全一致:
+     * `| mainTypeId | trashLength | nextAvailableOffset | root | sub buffers ... |`
+     *
+     * 扩容会改变buffer地址，扩容后需要通过`root<T>()`/`view<T>(offset)`重新获取view。
+     * 接受view参数的接口只使用view的offset，因此扩容前取得的view仍然可以传入。
+     *
+     * 指定`MessagePool`时buffer从pool分配，扩容换到更大的size class，`finish`把buffer交给`PooledMessage`。
+     * 指定一段外部内存(比如共享内存ring的slot)时直接在其中构建，不会扩容，空间不够时抛出`std::bad_alloc`。
+     */
+    class MessageBuilder {
+    public:
+        static constexpr int32_t defaultCapacity = 256;
+#ifdef SMESSAGE_USE_MREMAP
+        /// 超过此大小后改用匿名映射，之后的扩容通过mremap移动页表而不拷贝数据
+        static constexpr size_t mapThreshold = 64 * 1024;
+        static constexpr size_t pageSize = 4096;
+#endif
+
+        explicit MessageBuilder(int32_t initialCapacity = defaultCapacity): _buffer(nullptr), _capacity(0), _mapped(false), _fixed(false), _pool(nullptr) {
+            init(initialCapacity);
+        }
+
+        explicit MessageBuilder(MessagePool &pool, int32_t initialCapacity = defaultCapacity): _buffer(nullptr), _capacity(0), _mapped(false), _fixed(false), _pool(&pool) {
+            init(initialCapacity);
+        }
+
+        /// 在外部内存中构建，builder不拥有这段内存
+        explicit MessageBuilder(std::span<uint8_t> fixed): _buffer(fixed.data()), _capacity(static_cast<int32_t>(std::min(fixed.size(), static_cast<size_t>(std::numeric_limits<int32_t>::max())))), _mapped(false), _fixed(true), _pool(nullptr) {
+            if (_capacity < RootOffset) {
+                throw std::bad_alloc();
+            }
+            std::memset(_buffer, 0, RootOffset);
+            setNextAvailableOffset(RootOffset);
+        }
+
+        /**
+         * 接管一个装有完整消息的池buffer继续修改，比如`SharedMessage::detach`写时拷贝的结果。
+         * 扩容从buffer所属的pool分配，`finish`再把buffer交出去。
+         */
+        explicit MessageBuilder(PoolBuffer buffer): _buffer(buffer.data()), _capacity(static_cast<int32_t>(std::min(buffer.capacity(), static_cast<size_t>(std::numeric_limits<int32_t>::max())))), _mapped(false), _fixed(false), _pool(buffer.pool()), _pooled(std::move(buffer)) {
+            assert(_buffer && nextAvailableOffset() >= RootOffset && nextAvailableOffset() <= _capacity);
+        }
+
+        ~MessageBuilder() {
+            release();
+        }
+
+        MessageBuilder(const MessageBuilder&) = delete;
+        MessageBuilder& operator=(const MessageBuilder&) = delete;
+
+        MessageBuilder(MessageBuilder &&other) noexcept: _buffer(other._buffer), _capacity(other._capacity), _mapped(other._mapped), _fixed(other._fixed), _pool(other._pool), _pooled(std::move(other._pooled)) {
+            other._buffer = nullptr;
+            other._capacity = 0;
+            other._mapped = false;
+            other._fixed = false;
+        }
+
+        MessageBuilder& operator=(MessageBuilder &&other) noexcept {
+            if (this != &other) {
+                release();
+                std::swap(_buffer, other._buffer);
+                std::swap(_capacity, other._capacity);
+                std::swap(_mapped, other._mapped);
+                std::swap(_fixed, other._fixed);
+                std::swap(_pool, other._pool);
+                _pooled.swap(other._pooled);
+            }
+            return *this;
+        }
+
+        /// 清空buffer并在12处创建root，之前的所有数据都会被丢弃
+        template <typename T>
+        T createRoot() {
+            const int32_t end = RootOffset + T::byteLength;
+            if (end > _capacity) {
+                updateCapacity(end - _capacity);
+            }
+            std::memset(_buffer, 0, static_cast<size_t>(end));
+            storeValue<int32_t>(_buffer, MainTypeIdOffset, T::typeId);
+            setNextAvailableOffset(end);
+            return T(_buffer, RootOffset);
+        }
+
+        template <typename T>
+        inline T root() const {
+            return T(_buffer, RootOffset);
+        }
+
+        template <typename T>
+        inline T view(int32_t offset) const {
+            return T(_buffer, offset);
+        }
+
+        /// 分配一个struct大小的子空间，对应TS中的`createInStruct`，与数组元素一样按itemAlignment对齐
+        template <typename T>
+        T create() {
+            const int32_t offset = createSubBuffer(byteLengthOf<T>(), itemAlignment<T>());
+            return T(_buffer, offset);
+        }
+
+        /// 为引用类型的成员分配空间，并将地址写入`parent`的`memberOffset`处
+        template <typename T, typename P>
+        T createReference(const P &parent, int32_t memberOffset) {
+            const int32_t addrOffset = parent.offset() + memberOffset;
+            const int32_t offset = createSubBuffer(T::byteLength, itemAlignment<T>());
+            storeValue<int32_t>(_buffer, addrOffset, offset);
+            return T(_buffer, offset);
+        }
+
+        /**
+         * 与`$_createSubBuffer`一致: 在nextAvailableOffset处分配，空间已清零。
+         * `alignment`用于native数组，使数据可以直接作为span读取。
+         */
+        int32_t createSubBuffer(int32_t byteLength, int32_t alignment = 1) {
+            const int32_t padding = (alignment - nextAvailableOffset() % alignment) % alignment;
+            const int32_t offset = allocate(padding + byteLength) + padding;
+            std::memset(_buffer + offset - padding, 0, static_cast<size_t>(padding + byteLength));
+            return offset;
+        }
+
+        /**
+         * 与`$_extendSubBuffer`一致: 子空间是最后一次分配时原地扩展，否则分配新空间。
+         * 移动时会拷贝原数据，并将原空间计入trash。
+         */
+        int32_t extendSubBuffer(int32_t offset, int32_t originLength, int32_t toLength) {
+            if (originLength >= toLength) {
+                return offset;
+            }
+            const int32_t nextAvailable = nextAvailableOffset();
+            if (offset + originLength == nextAvailable) {
+                allocate(toLength - originLength);
+                std::memset(_buffer + nextAvailable, 0, static_cast<size_t>(toLength - originLength));
+                return offset;
+            }
+            const int32_t newOffset = allocate(toLength);
+            std::memcpy(_buffer + newOffset, _buffer + offset, static_cast<size_t>(originLength));
+            std::memset(_buffer + newOffset + originLength, 0, static_cast<size_t>(toLength - originLength));
+            addTrash(originLength);
+            return newOffset;
+        }
+
+        /// 与`$_updateCapacity`相同的增长策略: max(2倍, 1.5倍 + minAddCapacity)
+        void updateCapacity(int32_t minAddCapacity) {
+            const size_t capacity = static_cast<size_t>(_capacity);
+            const size_t nextCapacity = std::max(capacity * 2, capacity + capacity / 2 + static_cast<size_t>(minAddCapacity));
+            grow(nextCapacity);
+        }
+
+        /// 写入字符串，短字符串inline保存，长字符串在原空间不够时扩展或重新分配
+        void setString(const MsgString &str, std::string_view value) {
+            const int32_t offset = str.offset();
+            MsgString target(_buffer, offset);
+            if (target.setString(value)) {
+                return;
+            }
+            // value可能指向本buffer，扩容前先记下相对位置
+            const uintptr_t src = reinterpret_cast<uintptr_t>(value.data());
+            const uintptr_t begin = reinterpret_cast<uintptr_t>(_buffer);
+            const bool selfRef = src >= begin && src < begin + static_cast<uintptr_t>(_capacity);
+
+            const int32_t len = static_cast<int32_t>(value.size());
+            int32_t dataOffset;
+            if (target.isInline()) {
+                dataOffset = allocate(len);
+            } else {
+                dataOffset = extendSubBuffer(target.getDataOffset(), target.capacity(), len);
+            }
+            std::memmove(_buffer + dataOffset, selfRef ? static_cast<const void*>(_buffer + (src - begin)) : static_cast<const void*>(value.data()), value.size());
+            MsgString(_buffer, offset).setOutOfLine(dataOffset, len, len);
+        }
+
+        /// 保证数组capacity至少为count，与`StructArray.reserve`一致
+        template <typename T>
+        void reserve(const MsgVector<T> &vec, int32_t count) {
+            const int32_t offset = vec.offset();
+            MsgVectorBase target(_buffer, offset);
+            const int32_t dataOffset = target.getStartOffset();
+            const int32_t capacity = target.getCapacity();
+            if (dataOffset != 0 && capacity >= count) {
+                return;
+            }
+            const int32_t itemBytes = byteLengthOf<T>();
+            const int32_t alignment = itemAlignment<T>();
+            int32_t newOffset;
+            if (dataOffset != 0 && dataOffset + capacity * itemBytes == nextAvailableOffset()) {
+                newOffset = extendSubBuffer(dataOffset, capacity * itemBytes, count * itemBytes);
+            } else {
+                newOffset = createSubBuffer(count * itemBytes, alignment);
+                if (dataOffset != 0) {
+                    std::memcpy(_buffer + newOffset, _buffer + dataOffset, static_cast<size_t>(capacity * itemBytes));
+                    addTrash(capacity * itemBytes);
+                }
+            }
+            storeValue<int32_t>(_buffer, offset, newOffset);
+            storeValue<int32_t>(_buffer, offset + 8, count);
+        }
+
+        /// 追加native元素，capacity不够时按2倍增长
+        template <typename T>
+        void append(const MsgVector<T> &vec, const T *first, const T *last) {
+            static_assert(IsNativeType<T>::value, "append only supports native elements.");
+            const int32_t count = static_cast<int32_t>(last - first);
+            const int32_t size = MsgVectorBase(_buffer, vec.offset()).getSize();
+            ensureVectorCapacity<T>(vec.offset(), size + count);
+            MsgVector<T>(_buffer, vec.offset()).append(first, last);
+        }
+
+        /// 在数组末尾追加一个清零的struct元素并返回它的view
+        template <typename T>
+        T emplaceBack(const MsgVector<T> &vec) {
+            static_assert(!IsNativeType<T>::value, "emplaceBack only supports struct elements.");
+            const int32_t offset = vec.offset();
+            const int32_t size = MsgVectorBase(_buffer, offset).getSize();
+            ensureVectorCapacity<T>(offset, size + 1);
+            storeValue<int32_t>(_buffer, offset + 4, size + 1);
+            return T(_buffer, loadValue<int32_t>(_buffer, offset) + T::byteLength * size);
+        }
+
+        /// 保证`@soa`数组的capacity至少为count，扩容时各列分别搬到新的数据区
+        template <typename T>
+        void reserve(const MsgSoaVector<T> &vec, int32_t count) {
+            const int32_t offset = vec.offset();
+            const MsgVectorBase target(_buffer, offset);
+            const int32_t dataOffset = target.getStartOffset();
+            const int32_t size = target.getSize();
+            const int32_t capacity = target.getCapacity();
+            if (dataOffset != 0 && capacity >= count) {
+                return;
+            }
+            const int32_t newCapacity = MsgSoaVectorBase::capacityFor(count);
+            const int32_t newOffset = createSubBuffer(newCapacity * T::byteLength, MsgSoaVectorBase::dataAlignment);
+            if (dataOffset != 0) {
+                for (const MsgSoaColumn &column : MsgSoaVector<T>::columns) {
+                    std::memcpy(_buffer + newOffset + newCapacity * column.offset, _buffer + dataOffset + capacity * column.offset, static_cast<size_t>(size * column.bytes));
+                }
+                addTrash(capacity * T::byteLength);
+            }
+            storeValue<int32_t>(_buffer, offset, newOffset);
+            storeValue<int32_t>(_buffer, offset + 8, newCapacity);
+        }
+
+        /// 在`@soa`数组末尾追加一个清零的元素
+        template <typename T>
+        typename T::SoaItem emplaceBack(const MsgSoaVector<T> &vec) {
+            const int32_t offset = vec.offset();
+            const int32_t size = MsgVectorBase(_buffer, offset).getSize();
+            resize(vec, size + 1);
+            return MsgSoaVector<T>(_buffer, offset).getItem(size);
+        }
+
+        /// 改变`@soa`数组的元素个数，新增的元素清零，之后可以通过各列的span批量写入
+        template <typename T>
+        void resize(const MsgSoaVector<T> &vec, int32_t count) {
+            const int32_t offset = vec.offset();
+            const int32_t size = MsgVectorBase(_buffer, offset).getSize();
+            const int32_t capacity = MsgVectorBase(_buffer, offset).getCapacity();
+            if (loadValue<int32_t>(_buffer, offset) == 0 || capacity < count) {
+                reserve(MsgSoaVector<T>(_buffer, offset), std::max(count, capacity * 2));
+            }
+            if (count > size) {
+                const MsgVectorBase grown(_buffer, offset);
+                for (const MsgSoaColumn &column : MsgSoaVector<T>::columns) {
+                    std::memset(_buffer + grown.getStartOffset() + grown.getCapacity() * column.offset + size * column.bytes, 0, static_cast<size_t>((count - size) * column.bytes));
+                }
+            }
+            storeValue<int32_t>(_buffer, offset + 4, count);
+        }
+
+        /**
+         * 把二维数组设为`sizes.size()`行，第i行有`sizes[i]`个清零的元素，所有行的数据在一个连续块中(见`MsgFlatRows`)。
+         * 原有的行表和各行的数据计入trash。
+         */
+        template <typename T>
+        MsgFlatRows<MsgVector<MsgVector<T>>> setRows(const MsgVector<MsgVector<T>> &rows, std::span<const int32_t> sizes) {
+            using Row = MsgVector<T>;
+            const int32_t offset = rows.offset();
+            int64_t total = 0;
+            for (const int32_t size : sizes) {
+                assert(size >= 0);
+                total += size;
+            }
+            if (total * byteLengthOf<T>() > std::numeric_limits<int32_t>::max() || static_cast<int64_t>(sizes.size()) * Row::byteLength > std::numeric_limits<int32_t>::max()) {
+                throw std::bad_alloc();
+            }
+            addTrash(rowsDataLength<T>(offset));
+            if (loadValue<int32_t>(_buffer, offset) != 0) {
+                addTrash(MsgVectorBase(_buffer, offset).getCapacity() * Row::byteLength);
+            }
+            const int32_t count = static_cast<int32_t>(sizes.size());
+            const int32_t table = count ? createSubBuffer(count * Row::byteLength, itemAlignment<Row>()) : 0;
+            const int32_t block = total ? createSubBuffer(static_cast<int32_t>(total) * byteLengthOf<T>(), itemAlignment<T>()) : 0;
+            storeValue<int32_t>(_buffer, offset, table);
+            storeValue<int32_t>(_buffer, offset + 4, count);
+            storeValue<int32_t>(_buffer, offset + 8, count);
+            int32_t data = block;
+            for (int32_t i = 0; i < count; i++) {
+                if (sizes[i] == 0) {
+                    continue;
+                }
+                const int32_t rowOffset = table + Row::byteLength * i;
+                storeValue<int32_t>(_buffer, rowOffset, data);
+                storeValue<int32_t>(_buffer, rowOffset + 4, sizes[i]);
+                storeValue<int32_t>(_buffer, rowOffset + 8, sizes[i]);
+                data += sizes[i] * byteLengthOf<T>();
+            }
+            return MsgFlatRows<MsgVector<MsgVector<T>>>(_buffer, offset);
+        }
+
+        /// 把各行的数据拷贝到一个新的连续块中，行表不变，原数据计入trash。已经连续时不做任何事。
+        template <typename T>
+        MsgFlatRows<MsgVector<MsgVector<T>>> flatten(const MsgVector<MsgVector<T>> &rows) {
+            using Flat = MsgFlatRows<MsgVector<MsgVector<T>>>;
+            const int32_t offset = rows.offset();
+            const int32_t total = Flat(_buffer, offset).itemCount();
+            if (Flat(_buffer, offset).isFlat()) {
+                return Flat(_buffer, offset);
+            }
+            const int32_t trash = rowsDataLength<T>(offset);
+            int32_t data = createSubBuffer(total * byteLengthOf<T>(), itemAlignment<T>());
+            const Flat flat(_buffer, offset);
+            for (int32_t i = 0; i < flat.rowCount(); i++) {
+                const int32_t size = flat.rowSize(i);
+                const int32_t rowOffset = flat.row(i).offset();
+                if (size == 0) {
+                    storeValue<int32_t>(_buffer, rowOffset, 0);
+                    storeValue<int32_t>(_buffer, rowOffset + 8, 0);
+                    continue;
+                }
+                std::memcpy(_buffer + data, _buffer + loadValue<int32_t>(_buffer, rowOffset), static_cast<size_t>(size * byteLengthOf<T>()));
+                storeValue<int32_t>(_buffer, rowOffset, data);
+                storeValue<int32_t>(_buffer, rowOffset + 8, size);
+                data += size * byteLengthOf<T>();
+            }
+            addTrash(trash);
+            return flat;
+        }
+
+        /**
+         * 结束构建，把buffer交给一个持有它的消息。pool构建的buffer直接转移，否则拷贝到`MessagePool::shared()`。
+         * 之后builder为空，需要重新赋值才能继续使用。
+         */
+        template <typename T>
+        PooledMessage<T> finish() {
+            PoolBuffer buffer;
+            if (_pool) {
+                buffer = std::move(_pooled);
+                _buffer = nullptr;
+                _capacity = 0;
+            } else {
+                buffer = MessagePool::shared().acquireCopy(_buffer, static_cast<size_t>(size()));
+                release();
+                _capacity = 0;
+                _mapped = false;
+                _fixed = false;
+            }
+            return PooledMessage<T>(std::move(buffer));
+        }
+
+        inline uint8_t* data() const {
+            return _buffer;
+        }
+
+        /// 分配buffer的pool，未使用pool时为nullptr
+        inline MessagePool* pool() const {
+            return _pool;
+        }
+
+        /// 消息的实际长度
+        inline int32_t size() const {
+            return nextAvailableOffset();
+        }
+
+        inline int32_t capacity() const {
+            return _capacity;
+        }
+
+        inline bool isMapped() const {
+            return _mapped;
+        }
+
+        /// 是否在外部内存中构建
+        inline bool isFixed() const {
+            return _fixed;
+        }
+
+        inline std::span<const uint8_t> bytes() const {
+            return std::span<const uint8_t>(_buffer, static_cast<size_t>(size()));
+        }
+
+        inline int32_t trashLength() const {
+            return loadValue<int32_t>(_buffer, TrashLengthOffset);
+        }
+
+        inline int32_t nextAvailableOffset() const {
+            return loadValue<int32_t>(_buffer, NextAvailableOffset);
+        }
+
+        /// 把不再可达的空间计入trash，`$_needGC`据此判断
+        inline void addTrash(int32_t length) {
+            storeValue<int32_t>(_buffer, TrashLengthOffset, trashLength() + length);
+        }
+
+    private:
+        void init(int32_t initialCapacity) {
+            grow(static_cast<size_t>(initialCapacity < RootOffset ? RootOffset : initialCapacity));
+            std::memset(_buffer, 0, RootOffset);
+            setNextAvailableOffset(RootOffset);
+        }
+
+        inline void setNextAvailableOffset(int32_t offset) {
+            storeValue<int32_t>(_buffer, NextAvailableOffset, offset);
+        }
+
+        int32_t allocate(int32_t byteLength) {
+            const int32_t offset = nextAvailableOffset();
+            const int32_t end = offset + byteLength;
+            if (end > _capacity) {
+                updateCapacity(end - _capacity);
+            }
+            setNextAvailableOffset(end);
+            return offset;
+        }
+
+        /// 二维数组各行已分配的数据长度(capacity)
+        template <typename T>
+        int32_t rowsDataLength(int32_t offset) const {
+            const MsgVectorBase rows(_buffer, offset);
+            int32_t length = 0;
+            for (int32_t i = 0; i < rows.getSize(); i++) {
+                const MsgVectorBase row(_buffer, rows.getStartOffset() + MsgVectorBase::byteLength * i);
+                if (row.getStartOffset() != 0) {
+                    length += row.getCapacity() * byteLengthOf<T>();
+                }
+            }
+            return length;
+        }
+
+        template <typename T>
+        void ensureVectorCapacity(int32_t offset, int32_t count) {
+            const int32_t capacity = MsgVectorBase(_buffer, offset).getCapacity();
+            if (loadValue<int32_t>(_buffer, offset) == 0 || capacity < count) {
+                reserve(MsgVector<T>(_buffer, offset), std::max(count, capacity * 2));
+            }
+        }
+
+        void grow(size_t capacity) {
+            if (_fixed) {
+                throw std::bad_alloc();
+            }
+            if (_pool) {
+                growPooled(capacity);
+                return;
+            }
+#ifdef SMESSAGE_USE_MREMAP
+            if (_mapped || capacity >= mapThreshold) {
+                capacity = (capacity + pageSize - 1) & ~(pageSize - 1);
+            }
+#endif
+            // 消息内的地址都是int32
+            if (capacity > static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+                throw std::bad_alloc();
+            }
+#ifdef SMESSAGE_USE_MREMAP
+            if (_mapped || capacity >= mapThreshold) {
+                void *mem;
+                if (_mapped) {
+                    mem = mremap(_buffer, static_cast<size_t>(_capacity), capacity, MREMAP_MAYMOVE);
+                } else {
+                    mem = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                    if (mem != MAP_FAILED && _buffer) {
+                        std::memcpy(mem, _buffer, static_cast<size_t>(nextAvailableOffset()));
+                        std::free(_buffer);
+                    }
+                }
+                if (mem == MAP_FAILED) {
+                    throw std::bad_alloc();
+                }
+                _buffer = static_cast<uint8_t*>(mem);
+                _capacity = static_cast<int32_t>(capacity);
+                _mapped = true;
+                return;
+            }
+#endif
+            void *mem = std::realloc(_buffer, capacity);
+            if (!mem) {
+                throw std::bad_alloc();
+            }
+            _buffer = static_cast<uint8_t*>(mem);
+            _capacity = static_cast<int32_t>(capacity);
+        }
+
+        void growPooled(size_t capacity) {
+            if (capacity > static_cast<size_t>(std::numeric_limits<int32_t>::max())) {
+                throw std::bad_alloc();
+            }
+            PoolBuffer next = _pool->acquire(capacity);
+            if (_buffer) {
+                std::memcpy(next.data(), _buffer, static_cast<size_t>(nextAvailableOffset()));
+            }
+            _pooled = std::move(next);
+            _buffer = _pooled.data();
+            // size class向上取整后多出的空间也可以使用
+            _capacity = static_cast<int32_t>(std::min(_pooled.capacity(), static_cast<size_t>(std::numeric_limits<int32_t>::max())));
+        }
+
+        void release() {
+            if (_fixed) {
+                _buffer = nullptr;
+                return;
+            }
+            if (_pool) {
+                _pooled.reset();
+                _buffer = nullptr;
+                return;
+            }
+            if (!_buffer) {
+                return;
+            }
+#ifdef SMESSAGE_USE_MREMAP
+            if (_mapped) {
+                munmap(_buffer, static_cast<size_t>(_capacity));
+                _buffer = nullptr;
+                return;
+            }
+#endif
+            std::free(_buffer);
+            _buffer = nullptr;
+        }
+
+        uint8_t* _buffer;
+        int32_t _capacity;
+        bool _mapped;
+        bool _fixed;
+        MessagePool *_pool;
+        PoolBuffer _pooled;
+    };
+}
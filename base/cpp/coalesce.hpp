@@ -0,0 +1,225 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <mutex>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
+
+#include "dispatch.hpp"
+#include "pool.hpp"
+
+namespace SMessage
+{
+    /// 消息类型在发送队列中的合并方式，由IDL中struct前的`@coalesce`或`@coalesce(key)`生成
+    struct CoalescePolicy {
+        bool coalesce = false;
+        /// key成员在struct中的offset，按类型合并时为-1
+        int32_t keyOffset = -1;
+        int32_t keyBytes = 0;
+    };
+
+    template <typename T>
+    constexpr CoalescePolicy coalescePolicyOf() {
+        if constexpr (std::is_void_v<T>) {
+            return CoalescePolicy{};
+        } else if constexpr (requires { T::coalesceKeyBytes; }) {
+            return CoalescePolicy{true, T::coalesceKeyOffset, T::coalesceKeyBytes};
+        } else {
+            return CoalescePolicy{};
+        }
+    }
+
+    /// 按`typeId - MINUserDefTypeId`排列的合并方式
+    template <typename List>
+    struct CoalescePolicies;
+
+    template <typename... Ts>
+    struct CoalescePolicies<MessageTypeList<Ts...>> {
+        static constexpr CoalescePolicy entries[] = {coalescePolicyOf<Ts>()..., CoalescePolicy{}};
+    };
+
+    enum class CoalesceResult {
+        /// 追加到队尾
+        Queued,
+        /// 替换了队列中同类型(同key)的旧消息，位置不变
+        Merged,
+        /// 队列已满，或替换后超过maxBytes(旧消息保留)，消息被丢弃
+        Dropped,
+    };
+
+    /**
+     * 合并过期消息的发送队列。可合并类型的新消息在O(1)内替换队列中还未取走的旧消息，
+     * 因此输入风暴时队列长度受(类型, key)的数量限制，消费者的延迟不会随积压增长。
+     * 不可合并的消息按顺序追加，超过`maxMessages`条或`maxBytes`字节时丢弃新消息并计数；
+     * 替换同样受`maxBytes`限制，更大的新消息放不下时丢弃新消息，队列中的旧消息不变。
+     *
+     * List为生成的`Dispatch::MessageTypes`，不在List中的消息(batch等)不合并。
+     * 队列持有`PoolBuffer`，内部使用一把锁，可以在多个生产者和一个消费者之间使用。
+     */
+    template <typename List>
+    class CoalescingQueue {
+    public:
+        struct Counters {
+            uint64_t queued = 0;
+            uint64_t merged = 0;
+            uint64_t dropped = 0;
+        };
+
+        explicit CoalescingQueue(size_t maxMessages, size_t maxBytes = std::numeric_limits<size_t>::max())
+            : _slots(maxMessages), _maxBytes(maxBytes), _counters(typeCount + 1), _typeSlots(typeCount, noSlot), _keySlots(typeCount) {
+            assert(maxMessages > 0);
+        }
+
+        CoalescingQueue(const CoalescingQueue&) = delete;
+        CoalescingQueue& operator=(const CoalescingQueue&) = delete;
+
+        template <typename T>
+        inline CoalesceResult push(const PooledMessage<T> &message) {
+            return push(message.holder());
+        }
+
+        CoalesceResult push(PoolBuffer buffer) {
+            const uint8_t *data = buffer.data();
+            const int32_t typeId = loadValue<int32_t>(data, MainTypeIdOffset);
+            const size_t bytes = static_cast<size_t>(loadValue<int32_t>(data, NextAvailableOffset));
+            const uint32_t index = typeIndex(typeId);
+            const CoalescePolicy &policy = Policies::entries[index];
+            const uint64_t key = policy.keyBytes ? loadKey(data + RootOffset + policy.keyOffset, policy.keyBytes) : 0;
+
+            std::lock_guard<std::mutex> lock(_mutex);
+            Counters &counters = _counters[index];
+            if (policy.coalesce) {
+                const uint64_t seq = findSlot(index, policy, key);
+                if (seq != noSlot) {
+                    Slot &slot = _slots[seq % _slots.size()];
+                    if (_bytes - slot.bytes + bytes > _maxBytes) {
+                        counters.dropped++;
+                        return CoalesceResult::Dropped;
+                    }
+                    _bytes = _bytes - slot.bytes + bytes;
+                    slot.buffer = std::move(buffer);
+                    slot.bytes = bytes;
+                    counters.merged++;
+                    return CoalesceResult::Merged;
+                }
+            }
+            if (_tail - _head == _slots.size() || _bytes + bytes > _maxBytes) {
+                counters.dropped++;
+                return CoalesceResult::Dropped;
+            }
+            Slot &slot = _slots[_tail % _slots.size()];
+            slot.buffer = std::move(buffer);
+            slot.bytes = bytes;
+            slot.index = index;
+            slot.key = key;
+            if (policy.coalesce) {
+                if (policy.keyBytes) {
+                    _keySlots[index].emplace(key, _tail);
+                } else {
+                    _typeSlots[index] = _tail;
+                }
+            }
+            _tail++;
+            _bytes += bytes;
+            counters.queued++;
+            return CoalesceResult::Queued;
+        }
+
+        /// 取出最早的消息
+        bool pop(PoolBuffer &out) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_head == _tail) {
+                return false;
+            }
+            Slot &slot = _slots[_head % _slots.size()];
+            const CoalescePolicy &policy = Policies::entries[slot.index];
+            if (policy.coalesce) {
+                if (policy.keyBytes) {
+                    _keySlots[slot.index].erase(slot.key);
+                } else {
+                    _typeSlots[slot.index] = noSlot;
+                }
+            }
+            out = std::move(slot.buffer);
+            _bytes -= slot.bytes;
+            _head++;
+            return true;
+        }
+
+        /// 依次取出消息交给handler(在锁之外调用)，最多maxCount条
+        template <typename Handler>
+        size_t drain(Handler &&handler, size_t maxCount = std::numeric_limits<size_t>::max()) {
+            size_t count = 0;
+            PoolBuffer buffer;
+            while (count < maxCount && pop(buffer)) {
+                handler(std::move(buffer));
+                count++;
+            }
+            return count;
+        }
+
+        inline size_t size() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return static_cast<size_t>(_tail - _head);
+        }
+
+        inline size_t bytes() const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _bytes;
+        }
+
+        /// 类型的计数，不在List中的类型共用一组
+        Counters counters(int32_t typeId) const {
+            std::lock_guard<std::mutex> lock(_mutex);
+            return _counters[typeIndex(typeId)];
+        }
+
+    private:
+        using Policies = CoalescePolicies<List>;
+
+        static constexpr uint32_t typeCount = static_cast<uint32_t>(List::size);
+        static constexpr uint64_t noSlot = std::numeric_limits<uint64_t>::max();
+
+        struct Slot {
+            PoolBuffer buffer;
+            size_t bytes = 0;
+            uint32_t index = 0;
+            uint64_t key = 0;
+        };
+
+        static inline uint32_t typeIndex(int32_t typeId) {
+            return messageTypeIndex<List>(typeId);
+        }
+
+        /// key按字节比较，不区分有无符号
+        static inline uint64_t loadKey(const uint8_t *src, int32_t keyBytes) {
+            uint64_t key = 0;
+            std::memcpy(&key, src, static_cast<size_t>(keyBytes));
+            return key;
+        }
+
+        inline uint64_t findSlot(uint32_t index, const CoalescePolicy &policy, uint64_t key) const {
+            if (!policy.keyBytes) {
+                return _typeSlots[index];
+            }
+            const auto found = _keySlots[index].find(key);
+            return found == _keySlots[index].end() ? noSlot : found->second;
+        }
+
+        mutable std::mutex _mutex;
+        std::vector<Slot> _slots;
+        uint64_t _head = 0;
+        uint64_t _tail = 0;
+        size_t _bytes = 0;
+        size_t _maxBytes;
+        std::vector<Counters> _counters;
+        /// 按类型合并时队列中该类型消息的序号
+        std::vector<uint64_t> _typeSlots;
+        /// 按key合并时key -> 序号
+        std::vector<std::unordered_map<uint64_t, uint64_t>> _keySlots;
+    };
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <string_view>
+
+#include "base.hpp"
+
+namespace SMessage
+{
+    /**
+     * 一个版本中struct的布局。offsets按当前schema的成员顺序排列，
+     * 该版本中不存在或类型不同的成员为-1，整个struct不存在时byteLength为0。
+     */
+    template <size_t N>
+    struct CompatLayout {
+        int32_t byteLength;
+        int32_t offsets[N];
+    };
+
+    /// 缺失的成员在全0空间中的位置，不为0，这样inline成员的view不是null
+    inline constexpr int32_t compatZerosOffset = 8;
+
+    /**
+     * 缺失的成员从全0的空间读取，得到默认值、空字符串和空数组。
+     * 空间是所有读取者共享的常量，在只读的内存中，兼容类返回的view都包装在`CompatView`中，不能通过它修改。
+     */
+    template <int32_t N>
+    inline uint8_t* compatZeros() {
+        alignas(8) static constexpr uint8_t zeros[compatZerosOffset + N] = {};
+        return const_cast<uint8_t*>(zeros);
+    }
+
+    /**
+     * 兼容类返回的当前版本的view(字符串、数组、map和布局未变的struct)，只能通过`->`和`*`取得const的view，
+     * 拷贝这个包装不会得到可以调用setter的view。缺失的成员指向只读的全0空间，写入会直接崩溃。
+     */
+    template <typename V>
+    class CompatView {
+    public:
+        CompatView() = default;
+        explicit CompatView(V view): _view(view) {}
+
+        inline const V& operator*() const {
+            return _view;
+        }
+
+        inline const V* operator->() const {
+            return &_view;
+        }
+
+        inline const V& get() const {
+            return _view;
+        }
+
+    private:
+        V _view;
+    };
+
+    /// version在versions中的序号，不存在时为-1
+    template <size_t N>
+    constexpr int32_t findCompatVersion(const std::string_view (&versions)[N], std::string_view version) {
+        for (size_t i = 0; i < N; i++) {
+            if (versions[i] == version) {
+                return static_cast<int32_t>(i);
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * 按旧版本的布局读取buffer，不需要重新编码。T为生成的`XxxCompat`类，`T::layouts`按版本序号排列。
+     * 只读，当前版本的view以`CompatView`返回，嵌套的兼容类沿用同一个版本(兼容类和`MsgCompatVector`本身没有setter)。
+     */
+    template <typename T>
+    class CompatMessage {
+    public:
+        CompatMessage(): _buffer(nullptr), _offset(0), _version(0) {}
+        CompatMessage(void *buf, int32_t offset, int32_t version): _buffer(static_cast<uint8_t*>(buf)), _offset(offset), _version(version) {}
+
+        inline bool isNull() const {
+            return _buffer == nullptr || _offset == 0;
+        }
+
+        inline explicit operator bool() const {
+            return !isNull();
+        }
+
+        inline int32_t offset() const {
+            return _offset;
+        }
+
+        inline int32_t version() const {
+            return _version;
+        }
+
+        static constexpr int32_t byteLengthOf(int32_t version) {
+            return T::layouts[version].byteLength;
+        }
+
+        static constexpr int32_t maxByteLength() {
+            int32_t length = 0;
+            for (const auto &layout : T::layouts) {
+                length = layout.byteLength > length ? layout.byteLength : length;
+            }
+            return length;
+        }
+
+    protected:
+        inline int32_t memberOffset(size_t index) const {
+            return T::layouts[_version].offsets[index];
+        }
+
+        template <typename V>
+        inline V loadCompat(size_t index) const {
+            const int32_t offset = memberOffset(index);
+            if (offset < 0) {
+                return V{};
+            }
+            return loadValue<V>(_buffer, _offset + offset);
+        }
+
+        /// 当前版本的类型(字符串、辅助结构或布局未变的struct)
+        template <typename V>
+        inline CompatView<V> inlineCompat(size_t index) const {
+            const int32_t offset = memberOffset(index);
+            if (offset < 0) {
+                return CompatView<V>(V(compatZeros<::SMessage::byteLengthOf<V>()>(), compatZerosOffset));
+            }
+            return CompatView<V>(V(_buffer, _offset + offset));
+        }
+
+        template <typename V>
+        inline CompatView<V> referenceCompat(size_t index) const {
+            const int32_t offset = memberOffset(index);
+            const int32_t addr = offset < 0 ? 0 : loadValue<int32_t>(_buffer, _offset + offset);
+            if (!addr) {
+                return CompatView<V>();
+            }
+            return CompatView<V>(V(_buffer, addr));
+        }
+
+        /// 兼容类型(布局变化的struct或其数组)，沿用当前的版本
+        template <typename V>
+        inline V inlineVersioned(size_t index) const {
+            const int32_t offset = memberOffset(index);
+            if (offset < 0) {
+                return V(compatZeros<V::maxByteLength()>(), compatZerosOffset, _version);
+            }
+            return V(_buffer, _offset + offset, _version);
+        }
+
+        template <typename V>
+        inline V referenceVersioned(size_t index) const {
+            const int32_t offset = memberOffset(index);
+            const int32_t addr = offset < 0 ? 0 : loadValue<int32_t>(_buffer, _offset + offset);
+            if (!addr) {
+                return V();
+            }
+            return V(_buffer, addr, _version);
+        }
+
+        uint8_t* _buffer;
+        int32_t _offset;
+        int32_t _version;
+    };
+
+    /// 元素为兼容类型的数组，元素的长度取决于版本
+    template <typename T>
+    class MsgCompatVector : public MsgVectorBase {
+    public:
+        MsgCompatVector(): _version(0) {}
+        MsgCompatVector(void *buf, int32_t offset, int32_t version): MsgVectorBase(buf, offset), _version(version) {}
+
+        T getItem(int32_t index) const {
+            return T(_buffer, getStartOffset() + T::byteLengthOf(_version) * index, _version);
+        }
+
+        static constexpr int32_t byteLengthOf(int32_t) {
+            return byteLength;
+        }
+
+        static constexpr int32_t maxByteLength() {
+            return byteLength;
+        }
+
+    private:
+        int32_t _version;
+    };
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <type_traits>
+
+#include "base.hpp"
+
+namespace SMessage
+{
+    /// 按`typeId - MINUserDefTypeId`排列的消息类型，空位(enum、辅助结构)为void。由生成的dispatch.h定义
+    template <typename... Ts>
+    struct MessageTypeList {
+        static constexpr int32_t size = static_cast<int32_t>(sizeof...(Ts));
+    };
+
+    /// typeId在List中的下标，不在List中时为List::size
+    template <typename List>
+    inline uint32_t messageTypeIndex(int32_t typeId) {
+        const uint32_t index = static_cast<uint32_t>(typeId - MINUserDefTypeId);
+        return index < static_cast<uint32_t>(List::size) ? index : static_cast<uint32_t>(List::size);
+    }
+
+    /// buffer的mainTypeId在List中的下标，不在List中时为List::size
+    template <typename List>
+    inline uint32_t messageIndexOf(const void *buffer) {
+        return messageTypeIndex<List>(loadValue<int32_t>(buffer, MainTypeIdOffset));
+    }
+
+    /// 消息类型T在List中的下标
+    template <typename List, typename T>
+    constexpr uint32_t typeIndexOf() {
+        static_assert(T::typeId >= MINUserDefTypeId && T::typeId - MINUserDefTypeId < List::size, "T is not a message type of List.");
+        return static_cast<uint32_t>(T::typeId - MINUserDefTypeId);
+    }
+
+    /// 把多个lambda组合成一个handler: `visit(buf, Overloaded{[](Point2D p) {...}, [](auto) {...}})`
+    template <typename... Fs>
+    struct Overloaded : Fs... {
+        using Fs::operator()...;
+    };
+
+    template <typename... Fs>
+    Overloaded(Fs...) -> Overloaded<Fs...>;
+
+    /**
+     * 编译期生成的跳转表: 每个消息类型一项，handler可以接收该类型时调用它，否则(包括空位)直接返回false。
+     * 表和handler类型一一对应，不需要注册，也没有虚函数和分配。
+     */
+    template <typename List, typename Handler>
+    struct DispatchTable;
+
+    template <typename... Ts, typename Handler>
+    struct DispatchTable<MessageTypeList<Ts...>, Handler> {
+        using Entry = bool (*)(uint8_t*, Handler&);
+
+        template <typename T>
+        static bool call(uint8_t *buffer, Handler &handler) {
+            handler(T(buffer, RootOffset));
+            return true;
+        }
+
+        static bool ignore(uint8_t*, Handler&) {
+            return false;
+        }
+
+        template <typename T>
+        static constexpr Entry entryOf() {
+            if constexpr (std::is_void_v<T>) {
+                return &ignore;
+            } else if constexpr (std::is_invocable_v<Handler&, T>) {
+                return &call<T>;
+            } else {
+                return &ignore;
+            }
+        }
+
+        static constexpr Entry entries[] = {entryOf<Ts>()...};
+    };
+
+    /**
+     * 读取buffer的mainTypeId，调用handler中对应消息类型的重载: 一次下标访问和一次调用。
+     * @return false typeId不在List中或者handler不接收该类型
+     */
+    template <typename List, typename Handler>
+    inline bool visitMessage(void *buffer, Handler &&handler) {
+        using Table = DispatchTable<List, std::remove_reference_t<Handler>>;
+        const uint32_t index = messageIndexOf<List>(buffer);
+        if (index == static_cast<uint32_t>(List::size)) {
+            return false;
+        }
+        return Table::entries[index](static_cast<uint8_t*>(buffer), handler);
+    }
+}
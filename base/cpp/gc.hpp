@@ -0,0 +1,375 @@
+#pragma once
+
+#include <unordered_map>
+#include <vector>
+
+#include "builder.hpp"
+
+namespace SMessage
+{
+    class MessageCollector;
+
+    /**
+     * 按schema遍历一个已经拷贝到新buffer的值，把它指向的子空间拷贝过去并改写offset。
+     * 生成的struct通过`traceMembers`提供成员信息，辅助结构在下面特化。
+     */
+    template <typename T, typename Enable = void>
+    struct GcTrace {
+        static void trace(MessageCollector &gc, int32_t offset) {
+            T::traceMembers(gc, offset);
+        }
+    };
+
+    /**
+     * 压缩消息buffer: 从root(12)开始按schema遍历，只把存活的子空间紧密拷贝到新buffer，
+     * 去掉trash以及数组、字符串多余的capacity。
+     *
+     * 使用显式的任务栈，可以通过`step`分多次完成，每次最多拷贝约`budget`字节。
+     * 分步进行时原buffer不能被修改，`IncrementalCollector`会检测到header的变化并重新开始，原地的修改需要调用它的`restart`。
+     *
+     * `beginCopy`用同样的遍历把一个值深拷贝到`MessageBuilder`中，子空间分配在builder末尾，空间不够时扩容。
+     */
+    class MessageCollector {
+    public:
+        /// 压缩到空的`to`中，对齐的padding可能使结果比`from`长，`to`按需扩容
+        template <typename Root>
+        void begin(const uint8_t *from, MessageBuilder &to) {
+            _from = from;
+            _builder = &to;
+            _to = to.data();
+            _tasks.clear();
+            _forward.clear();
+            _next = 0;
+            ensure(RootOffset + Root::byteLength);
+            _next = RootOffset + Root::byteLength;
+            std::memcpy(_to, _from, static_cast<size_t>(_next));
+            storeValue<int32_t>(_to, TrashLengthOffset, 0);
+            storeValue<int32_t>(_to, NextAvailableOffset, _next);
+            visit<Root>(RootOffset);
+        }
+
+        /**
+         * `from`中`fromOffset`处的T拷贝到builder的`toOffset`处，它引用的子空间在`step`中拷贝到builder末尾。
+         * `from`可以是builder自己的buffer，`toOffset`不能在被拷贝的值之内。
+         */
+        template <typename T>
+        void beginCopy(const uint8_t *from, int32_t fromOffset, MessageBuilder &to, int32_t toOffset) {
+            _builder = &to;
+            _to = to.data();
+            _from = from;
+            _tasks.clear();
+            _forward.clear();
+            _next = to.nextAvailableOffset();
+            std::memmove(_to + toOffset, _from + fromOffset, static_cast<size_t>(byteLengthOf<T>()));
+            visit<T>(toOffset);
+        }
+
+        /// @return true 全部完成
+        bool step(int64_t budget = std::numeric_limits<int64_t>::max()) {
+            const int32_t start = _next;
+            while (!_tasks.empty() && static_cast<int64_t>(_next - start) < budget) {
+                const Task task = _tasks.back();
+                _tasks.pop_back();
+                task.trace(*this, task.offset);
+            }
+            storeValue<int32_t>(_to, NextAvailableOffset, _next);
+            return _tasks.empty();
+        }
+
+        inline bool finished() const {
+            return _tasks.empty();
+        }
+
+        /// 压缩后消息的长度
+        inline int32_t size() const {
+            return _next;
+        }
+
+        inline const uint8_t* from() const {
+            return _from;
+        }
+
+        inline uint8_t* to() const {
+            return _to;
+        }
+
+        /// `offset`处(新buffer)的T已经拷贝，稍后处理它引用的子空间
+        template <typename T>
+        void visit(int32_t offset) {
+            if constexpr (!IsNativeType<T>::value) {
+                _tasks.push_back(Task{&GcTrace<T>::trace, offset});
+            }
+        }
+
+        /// 引用类型成员: 被多处引用的struct只拷贝一次
+        template <typename T>
+        void visitReference(int32_t addrOffset) {
+            const int32_t addr = loadValue<int32_t>(_to, addrOffset);
+            if (!addr) {
+                return;
+            }
+            const auto found = _forward.find(addr);
+            if (found != _forward.end()) {
+                storeValue<int32_t>(_to, addrOffset, found->second);
+                return;
+            }
+            const int32_t newOffset = copy(addr, T::byteLength, itemAlignment<T>());
+            _forward.emplace(addr, newOffset);
+            storeValue<int32_t>(_to, addrOffset, newOffset);
+            visit<T>(newOffset);
+        }
+
+        /// 从原buffer拷贝一段子空间到新buffer末尾
+        int32_t copy(int32_t fromOffset, int32_t length, int32_t alignment = 1) {
+            const int32_t padding = (alignment - _next % alignment) % alignment;
+            ensure(padding + length);
+            std::memset(_to + _next, 0, static_cast<size_t>(padding));
+            _next += padding;
+            const int32_t offset = _next;
+            std::memcpy(_to + offset, _from + fromOffset, static_cast<size_t>(length));
+            _next += length;
+            return offset;
+        }
+
+        /// 在新buffer末尾分配清零的子空间
+        int32_t allocate(int32_t length, int32_t alignment = 1) {
+            const int32_t padding = (alignment - _next % alignment) % alignment;
+            ensure(padding + length);
+            std::memset(_to + _next, 0, static_cast<size_t>(padding + length));
+            _next += padding;
+            const int32_t offset = _next;
+            _next += length;
+            return offset;
+        }
+
+    private:
+        struct Task {
+            void (*trace)(MessageCollector&, int32_t);
+            int32_t offset;
+        };
+
+        /// 保证builder末尾还有length字节，扩容前更新nextAvailableOffset，扩容只保留这之前的数据
+        void ensure(int32_t length) {
+            if (length <= _builder->capacity() - _next) {
+                return;
+            }
+            const bool self = _from == _to;
+            storeValue<int32_t>(_to, NextAvailableOffset, _next);
+            _builder->updateCapacity(_next + length - _builder->capacity());
+            _to = _builder->data();
+            if (self) {
+                _from = _to;
+            }
+        }
+
+        const uint8_t* _from = nullptr;
+        uint8_t* _to = nullptr;
+        MessageBuilder *_builder = nullptr;
+        int32_t _next = 0;
+        std::vector<Task> _tasks;
+        std::unordered_map<int32_t, int32_t> _forward;
+    };
+
+    template <>
+    struct GcTrace<MsgString> {
+        static void trace(MessageCollector &gc, int32_t offset) {
+            const MsgString str(gc.to(), offset);
+            if (str.isInline()) {
+                return;
+            }
+            const int32_t len = str.length();
+            // 拷贝到builder时copy可能扩容，之后重新取得buffer
+            const int32_t dataOffset = gc.copy(str.getDataOffset(), len);
+            MsgString(gc.to(), offset).setOutOfLine(dataOffset, len, len);
+        }
+    };
+
+    /**
+     * 数组只保留size个元素，capacity收缩为size。
+     * 元素按倒序入栈、顺序处理，二维数组各行的数据因此按行顺序紧密排列(`MsgFlatRows`)。
+     */
+    template <typename T>
+    struct GcTrace<MsgVector<T>> {
+        static void trace(MessageCollector &gc, int32_t offset) {
+            const int32_t dataOffset = loadValue<int32_t>(gc.to(), offset);
+            const int32_t size = loadValue<int32_t>(gc.to(), offset + 4);
+            if (dataOffset == 0 || size == 0) {
+                storeValue<int32_t>(gc.to(), offset, 0);
+                storeValue<int32_t>(gc.to(), offset + 8, 0);
+                return;
+            }
+            const int32_t newOffset = gc.copy(dataOffset, size * byteLengthOf<T>(), itemAlignment<T>());
+            storeValue<int32_t>(gc.to(), offset, newOffset);
+            storeValue<int32_t>(gc.to(), offset + 8, size);
+            if constexpr (!IsNativeType<T>::value) {
+                for (int32_t i = size - 1; i >= 0; i--) {
+                    gc.visit<T>(newOffset + byteLengthOf<T>() * i);
+                }
+            }
+        }
+    };
+
+    /// `@soa`数组的capacity收缩为容纳size个元素的偶数，各列分别紧密拷贝，列尾清零
+    template <typename T>
+    struct GcTrace<MsgSoaVector<T>> {
+        static void trace(MessageCollector &gc, int32_t offset) {
+            const int32_t dataOffset = loadValue<int32_t>(gc.to(), offset);
+            const int32_t size = loadValue<int32_t>(gc.to(), offset + 4);
+            const int32_t capacity = loadValue<int32_t>(gc.to(), offset + 8);
+            if (dataOffset == 0 || size == 0) {
+                storeValue<int32_t>(gc.to(), offset, 0);
+                storeValue<int32_t>(gc.to(), offset + 8, 0);
+                return;
+            }
+            const int32_t newCapacity = MsgSoaVectorBase::capacityFor(size);
+            const int32_t newOffset = gc.allocate(newCapacity * T::byteLength, MsgSoaVectorBase::dataAlignment);
+            for (const MsgSoaColumn &column : MsgSoaVector<T>::columns) {
+                std::memcpy(gc.to() + newOffset + newCapacity * column.offset, gc.from() + dataOffset + capacity * column.offset, static_cast<size_t>(size * column.bytes));
+            }
+            storeValue<int32_t>(gc.to(), offset, newOffset);
+            storeValue<int32_t>(gc.to(), offset + 8, newCapacity);
+        }
+    };
+
+    template <typename K, typename V>
+    struct GcTrace<MsgMap<K, V>> {
+        static void trace(MessageCollector &gc, int32_t offset) {
+            using Map = MsgMap<K, V>;
+            const int32_t size = loadValue<int32_t>(gc.to(), offset);
+            const int32_t dataOffset = loadValue<int32_t>(gc.to(), offset + 8);
+            if (dataOffset == 0 || size == 0) {
+                storeValue<int32_t>(gc.to(), offset + 4, 0);
+                storeValue<int32_t>(gc.to(), offset + 8, 0);
+                return;
+            }
+            const int32_t newOffset = gc.copy(dataOffset, size * Map::entryByte());
+            storeValue<int32_t>(gc.to(), offset + 4, size);
+            storeValue<int32_t>(gc.to(), offset + 8, newOffset);
+            for (int32_t i = 0; i < size; i++) {
+                gc.visit<K>(newOffset + Map::entryByte() * i);
+                gc.visit<V>(newOffset + Map::entryByte() * i + Map::keyByte());
+            }
+        }
+    };
+
+    template <typename... Ts>
+    struct GcTrace<MsgCombine<Ts...>> {
+        static void trace(MessageCollector &gc, int32_t offset) {
+            const uint8_t index = loadValue<uint8_t>(gc.to(), offset);
+            uint8_t current = 0;
+            (traceCandidate<Ts>(gc, offset, index, ++current), ...);
+        }
+
+    private:
+        template <typename V>
+        static void traceCandidate(MessageCollector &gc, int32_t offset, uint8_t index, uint8_t candidate) {
+            if (index != candidate) {
+                return;
+            }
+            if constexpr (byteLengthOf<V>() <= 4) {
+                gc.visit<V>(offset + 4);
+            } else {
+                const int32_t addr = loadValue<int32_t>(gc.to(), offset + 4);
+                if (addr) {
+                    const int32_t newOffset = gc.copy(addr, byteLengthOf<V>(), itemAlignment<V>());
+                    storeValue<int32_t>(gc.to(), offset + 4, newOffset);
+                    gc.visit<V>(newOffset);
+                }
+            }
+        }
+    };
+
+    /**
+     * 把`from`(另一个消息或者builder自己)中`fromOffset`处的T(struct、数组、map、combine、字符串)深拷贝到builder的`toOffset`处，
+     * 比如把收到的消息的一部分转发到新消息中。子空间按schema整块拷贝到builder末尾并改写地址，
+     * 与gc一样去掉trash和多余的capacity，被多处引用的struct只拷贝一次。
+     * `toOffset`处原来的值引用的子空间不再可达，不计入trash。builder可能扩容，之后需要重新获取view。
+     */
+    template <typename T>
+    T copyValue(MessageBuilder &to, int32_t toOffset, const void *from, int32_t fromOffset) {
+        MessageCollector gc;
+        gc.template beginCopy<T>(static_cast<const uint8_t*>(from), fromOffset, to, toOffset);
+        gc.step();
+        return to.template view<T>(toOffset);
+    }
+
+    /// 一次性压缩builder中的消息，完成后之前取得的view都需要重新获取
+    template <typename Root>
+    void collect(MessageBuilder &builder) {
+        assert(builder.nextAvailableOffset() >= RootOffset + Root::byteLength);
+        MessageBuilder target = builder.pool() ? MessageBuilder(*builder.pool(), builder.capacity()) : MessageBuilder(builder.capacity());
+        MessageCollector gc;
+        gc.template begin<Root>(builder.data(), target);
+        gc.step();
+        builder = std::move(target);
+    }
+
+    /**
+     * 分步压缩builder中的消息，适合在UI线程的空闲时间里调用`step`。
+     * 两次`step`之间如果builder分配了新空间(header发生变化)，会从头开始。
+     * 原地的修改(setter、`setItem`、`mutableSpan`、不超过capacity的`setString`等)不改变header，
+     * 可能写在已经拷贝过的数据上而丢失，修改后需要调用`restart`。debug版本在`restart`时记下消息的hash，
+     * 完成时断言消息没有被这样修改，中间的`step`不再逐字节计算，需要更早发现时调用`verifyUnchanged`。
+     */
+    template <typename Root>
+    class IncrementalCollector {
+    public:
+        explicit IncrementalCollector(MessageBuilder &builder): _builder(builder), _target(emptyLike(builder)) {
+            restart();
+        }
+
+        /// @return true 压缩完成，builder已经替换为压缩后的buffer
+        bool step(int64_t budget) {
+            if (_builder.nextAvailableOffset() != _nextAvailable || _builder.trashLength() != _trash || _builder.data() != _gc.from()) {
+                restart();
+            }
+            if (!_gc.step(budget)) {
+                return false;
+            }
+            assert(verifyUnchanged() && "The message was modified in place during collection, call restart().");
+            _builder = std::move(_target);
+            return true;
+        }
+
+        /// 消息被原地修改后从头开始
+        void restart() {
+            if (_target.capacity() < _builder.capacity()) {
+                _target = emptyLike(_builder);
+            }
+            _nextAvailable = _builder.nextAvailableOffset();
+            _trash = _builder.trashLength();
+            _checksum = checksum();
+            _gc.template begin<Root>(_builder.data(), _target);
+        }
+
+        /// debug版本中检查自`restart`以来消息没有被原地修改，耗时与消息长度成线性；release版本始终为true
+        bool verifyUnchanged() const {
+            return checksum() == _checksum;
+        }
+
+    private:
+        /// 整个消息的FNV-1a，只在debug版本中计算
+        uint64_t checksum() const {
+#ifdef NDEBUG
+            return 0;
+#else
+            uint64_t hash = 14695981039346656037ull;
+            for (int32_t i = 0; i < _builder.nextAvailableOffset(); i++) {
+                hash = (hash ^ _builder.data()[i]) * 1099511628211ull;
+            }
+            return hash;
+#endif
+        }
+
+        static MessageBuilder emptyLike(const MessageBuilder &builder) {
+            return builder.pool() ? MessageBuilder(*builder.pool(), builder.capacity()) : MessageBuilder(builder.capacity());
+        }
+
+        MessageBuilder &_builder;
+        MessageBuilder _target;
+        MessageCollector _gc;
+        int32_t _nextAvailable;
+        int32_t _trash;
+        uint64_t _checksum;
+    };
+}
@@ -0,0 +1,802 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "base.hpp"
+
+namespace SMessage
+{
+    struct MessageLogOptions {
+        /// 单个segment文件的大小，创建时预分配(稀疏文件)，一条消息不能超过它
+        uint64_t segmentSize = 256ull << 20;
+        /// 每追加这么多条消息sync一次，0为不按条数
+        uint32_t syncEveryRecords = 4096;
+        /**
+         * 距上次sync超过这个时间的追加会sync，0为不按时间。
+         * 只在`append`和`syncIfDue`中检查，突发写入之后空闲时需要定时调用`syncIfDue`，否则尾部要等到下一次追加或close才会sync
+         */
+        std::chrono::milliseconds syncInterval{100};
+        /// 稀疏索引的间隔(字节)，seek时最多向后扫描这么多
+        uint32_t indexInterval = 64u << 10;
+    };
+
+    /// 日志中的一条消息，data指向reader的只读映射，在reader关闭之前有效
+    struct LogRecord {
+        uint64_t sequence;
+        int64_t timestamp;
+        int32_t typeId;
+        std::span<const uint8_t> data;
+
+        /// 完整的消息buffer，可以交给`visitMessage`分发。映射是只读的，不能通过它修改
+        inline void* buffer() const {
+            return const_cast<uint8_t*>(data.data());
+        }
+
+        /// 直接指向映射的root，不反序列化也不拷贝
+        template <typename T>
+        inline T root() const {
+            return T(buffer(), RootOffset);
+        }
+    };
+
+    namespace Detail {
+        struct LogSegmentHeader {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t firstSequence;
+            uint8_t reserved[48];
+        };
+
+        /// 每条消息前的header，消息从8对齐的位置开始。length最后写入，为0表示这里还没有消息
+        struct LogRecordHeader {
+            uint32_t length;
+            int32_t typeId;
+            uint64_t sequence;
+            int64_t timestamp;
+        };
+
+        /// `.smidx`中的稀疏索引项，offset为消息header在segment中的位置
+        struct LogIndexEntry {
+            uint64_t sequence;
+            int64_t timestamp;
+            uint64_t offset;
+        };
+
+        static_assert(sizeof(LogSegmentHeader) == 64 && sizeof(LogRecordHeader) == 24 && sizeof(LogIndexEntry) == 24, "message log layout changed.");
+
+        constexpr uint32_t logMagic = 0x474F4C53; // 'SLOG'
+        constexpr uint32_t logVersion = 1;
+        /// segment到此结束，后面的消息在下一个segment中
+        constexpr uint32_t logSealed = UINT32_MAX;
+
+        inline uint64_t logRecordStride(uint64_t length) {
+            return (sizeof(LogRecordHeader) + length + 7) & ~uint64_t(7);
+        }
+
+        inline uint32_t loadLogLength(const LogRecordHeader *header) {
+            return std::atomic_ref<uint32_t>(const_cast<uint32_t&>(header->length)).load(std::memory_order_acquire);
+        }
+
+        [[noreturn]] inline void throwLogErrno(const char *what) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+
+        [[noreturn]] inline void throwLogInvalid(const char *what) {
+            throw std::system_error(EINVAL, std::generic_category(), what);
+        }
+
+        /// segment以第一条消息的sequence命名: `00000000000000000042.smlog`，索引为同名的`.smidx`
+        inline std::string logSegmentPath(const std::string &dir, uint64_t firstSequence, const char *extension) {
+            char name[40];
+            std::snprintf(name, sizeof(name), "/%020" PRIu64 "%s", firstSequence, extension);
+            return dir + name;
+        }
+
+        /// 目录中的segment，按firstSequence排序
+        inline std::vector<uint64_t> listLogSegments(const std::string &dir) {
+            DIR *d = opendir(dir.c_str());
+            if (!d) {
+                throwLogErrno("opendir");
+            }
+            std::vector<uint64_t> segments;
+            while (const dirent *entry = readdir(d)) {
+                const size_t length = std::strlen(entry->d_name);
+                if (length != 26 || std::strcmp(entry->d_name + 20, ".smlog") != 0 || !std::all_of(entry->d_name, entry->d_name + 20, [](char c) { return c >= '0' && c <= '9'; })) {
+                    continue;
+                }
+                segments.push_back(std::strtoull(entry->d_name, nullptr, 10));
+            }
+            closedir(d);
+            std::sort(segments.begin(), segments.end());
+            return segments;
+        }
+
+        /// 读取整个索引文件，末尾不完整的项被忽略
+        inline std::vector<LogIndexEntry> readLogIndex(const std::string &path) {
+            std::vector<LogIndexEntry> entries;
+            const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return entries;
+            }
+            struct stat st;
+            if (fstat(fd, &st) == 0) {
+                entries.resize(static_cast<size_t>(st.st_size) / sizeof(LogIndexEntry));
+                const ssize_t bytes = pread(fd, entries.data(), entries.size() * sizeof(LogIndexEntry), 0);
+                entries.resize(bytes > 0 ? static_cast<size_t>(bytes) / sizeof(LogIndexEntry) : 0);
+            }
+            ::close(fd);
+            return entries;
+        }
+
+        /// 整个映射的segment文件
+        class LogFile {
+        public:
+            LogFile(): fd(-1), data(nullptr), length(0) {}
+
+            ~LogFile() {
+                close();
+            }
+
+            LogFile(const LogFile&) = delete;
+            LogFile& operator=(const LogFile&) = delete;
+
+            LogFile(LogFile &&other) noexcept: fd(other.fd), data(other.data), length(other.length) {
+                other.fd = -1;
+                other.data = nullptr;
+                other.length = 0;
+            }
+
+            LogFile& operator=(LogFile &&other) noexcept {
+                if (this != &other) {
+                    close();
+                    std::swap(fd, other.fd);
+                    std::swap(data, other.data);
+                    std::swap(length, other.length);
+                }
+                return *this;
+            }
+
+            void open(const std::string &path, bool writable) {
+                close();
+                fd = ::open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+                if (fd < 0) {
+                    throwLogErrno("open");
+                }
+                struct stat st;
+                if (fstat(fd, &st) != 0) {
+                    throwLogErrno("fstat");
+                }
+                map(static_cast<size_t>(st.st_size), writable);
+            }
+
+            void map(size_t size, bool writable) {
+                if (size < sizeof(LogSegmentHeader) + sizeof(LogRecordHeader)) {
+                    throwLogInvalid("MessageLog: not a segment");
+                }
+                void *mem = mmap(nullptr, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+                if (mem == MAP_FAILED) {
+                    throwLogErrno("mmap");
+                }
+                data = static_cast<uint8_t*>(mem);
+                length = size;
+            }
+
+            inline const LogSegmentHeader* header() const {
+                return reinterpret_cast<const LogSegmentHeader*>(data);
+            }
+
+            inline LogRecordHeader* recordAt(uint64_t offset) const {
+                return reinterpret_cast<LogRecordHeader*>(data + offset);
+            }
+
+            void close() {
+                if (data) {
+                    munmap(data, length);
+                    data = nullptr;
+                    length = 0;
+                }
+                if (fd >= 0) {
+                    ::close(fd);
+                    fd = -1;
+                }
+            }
+
+            int fd;
+            uint8_t *data;
+            size_t length;
+        };
+    }
+
+    /**
+     * 追加写入的消息日志，用于录制线上的消息流供离线调试和回放。
+     *
+     * 目录中是按第一条消息的sequence命名的segment文件，每个预分配`segmentSize`字节并以MAP_SHARED映射，
+     * 每条消息是`| length | typeId | sequence | timestamp |`之后的完整SMessage buffer(header + 12处的root + 所有子空间)。
+     * length最后写入，同一台机器上的`MessageLogReader`可以在写入的同时读取。
+     * 写满时在末尾写入结束标记并切换到新的segment(先以临时文件创建再rename，reader不会看到未初始化的文件)。
+     *
+     * 数据按`syncEveryRecords`/`syncInterval`批量msync，随后写入这段时间积累的稀疏索引(`.smidx`)，索引不会指向未落盘的数据。
+     * 进程崩溃不会丢失已经追加的消息，掉电只保证最后一次sync之前的。
+     * 重新打开时扫描最后一个segment，截掉不完整的尾部并重建它的索引，之后继续追加。
+     *
+     * 只能有一个writer，不是线程安全的。出错时抛出`std::system_error`，析构时的错误被忽略，需要知道结果时先调用`close`。
+     */
+    class MessageLogWriter {
+    public:
+        MessageLogWriter(): _indexFd(-1), _end(0), _syncedEnd(0), _nextSequence(0), _indexLength(0), _lastIndexed(0), _lastTimestamp(0), _unsynced(0) {}
+
+        ~MessageLogWriter() {
+            closeNoThrow();
+        }
+
+        MessageLogWriter(const MessageLogWriter&) = delete;
+        MessageLogWriter& operator=(const MessageLogWriter&) = delete;
+
+        MessageLogWriter(MessageLogWriter &&other) noexcept: MessageLogWriter() {
+            swap(other);
+        }
+
+        MessageLogWriter& operator=(MessageLogWriter &&other) noexcept {
+            if (this != &other) {
+                closeNoThrow();
+                swap(other);
+            }
+            return *this;
+        }
+
+        /// 打开目录中的日志，不存在时创建目录，已有的日志从末尾继续追加
+        static MessageLogWriter open(const std::string &dir, const MessageLogOptions &options = {}) {
+            if (options.segmentSize < sizeof(Detail::LogSegmentHeader) + 2 * sizeof(Detail::LogRecordHeader) + RootOffset) {
+                Detail::throwLogInvalid("MessageLog: segment too small");
+            }
+            if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+                Detail::throwLogErrno("mkdir");
+            }
+            MessageLogWriter writer;
+            writer._dir = dir;
+            writer._options = options;
+            writer._lastSync = std::chrono::steady_clock::now();
+            const std::vector<uint64_t> segments = Detail::listLogSegments(dir);
+            if (segments.empty()) {
+                writer.createSegment(0);
+            } else {
+                writer.recover(segments.back());
+            }
+            return writer;
+        }
+
+        /// 当前时间，默认的timestamp(Unix纪元以来的纳秒)
+        static int64_t now() {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        }
+
+        /**
+         * 追加一个完整的消息buffer，比如`std::span(builder.data(), builder.size())`
+         * @param timestamp 比上一条小时使用上一条的，保证按时间seek
+         * @return 消息的sequence
+         */
+        uint64_t append(std::span<const uint8_t> message, int64_t timestamp) {
+            if (message.size() < static_cast<size_t>(RootOffset)) {
+                Detail::throwLogInvalid("MessageLog: not a message");
+            }
+            const uint64_t stride = Detail::logRecordStride(message.size());
+            if (message.size() >= Detail::logSealed || stride + sizeof(Detail::LogRecordHeader) > _options.segmentSize - sizeof(Detail::LogSegmentHeader)) {
+                throw std::system_error(EMSGSIZE, std::generic_category(), "MessageLog: message larger than segment");
+            }
+            // 始终为结束标记留出一个header
+            if (_end + stride + sizeof(Detail::LogRecordHeader) > _file.length) {
+                roll();
+            }
+            timestamp = std::max(timestamp, _lastTimestamp);
+            Detail::LogRecordHeader *header = _file.recordAt(_end);
+            header->typeId = loadValue<int32_t>(message.data(), MainTypeIdOffset);
+            header->sequence = _nextSequence;
+            header->timestamp = timestamp;
+            std::memcpy(header + 1, message.data(), message.size());
+            std::atomic_ref<uint32_t>(header->length).store(static_cast<uint32_t>(message.size()), std::memory_order_release);
+            if (_lastIndexed == 0 || _end - _lastIndexed >= _options.indexInterval) {
+                _pendingIndex.push_back(Detail::LogIndexEntry{_nextSequence, timestamp, _end});
+                _lastIndexed = _end;
+            }
+            _end += stride;
+            _lastTimestamp = timestamp;
+            _unsynced++;
+            syncIfDue();
+            return _nextSequence++;
+        }
+
+        inline uint64_t append(std::span<const uint8_t> message) {
+            return append(message, now());
+        }
+
+        /// 把已追加的消息和索引写入磁盘
+        void sync() {
+            if (!_file.data) {
+                return;
+            }
+            if (_end > _syncedEnd) {
+                const uint64_t page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+                const uint64_t start = _syncedEnd & ~(page - 1);
+                if (msync(_file.data + start, _end - start, MS_SYNC) != 0) {
+                    Detail::throwLogErrno("msync");
+                }
+                _syncedEnd = _end;
+            }
+            if (!_pendingIndex.empty()) {
+                const size_t bytes = _pendingIndex.size() * sizeof(Detail::LogIndexEntry);
+                if (pwrite(_indexFd, _pendingIndex.data(), bytes, static_cast<off_t>(_indexLength)) != static_cast<ssize_t>(bytes)) {
+                    Detail::throwLogErrno("pwrite");
+                }
+                _indexLength += bytes;
+                _pendingIndex.clear();
+                if (fdatasync(_indexFd) != 0) {
+                    Detail::throwLogErrno("fdatasync");
+                }
+            }
+            _unsynced = 0;
+            _lastSync = std::chrono::steady_clock::now();
+        }
+
+        /**
+         * 未sync的消息达到`syncEveryRecords`条或距上次sync超过`syncInterval`时sync。
+         * 写入停止后由调用者定时调用(比如在事件循环的timer中)，使最后一批消息也按syncInterval落盘
+         * @return 是否进行了sync
+         */
+        bool syncIfDue() {
+            if (!_unsynced) {
+                return false;
+            }
+            if ((_options.syncEveryRecords && _unsynced >= _options.syncEveryRecords) ||
+                (_options.syncInterval.count() && std::chrono::steady_clock::now() - _lastSync >= _options.syncInterval)) {
+                sync();
+                return true;
+            }
+            return false;
+        }
+
+        /// 下一条消息的sequence，也是已追加的消息数量
+        inline uint64_t nextSequence() const {
+            return _nextSequence;
+        }
+
+        /// sync之后关闭，sync失败时仍然关闭文件，然后抛出异常
+        void close() {
+            if (_file.data) {
+                try {
+                    sync();
+                } catch (...) {
+                    release();
+                    throw;
+                }
+            }
+            release();
+        }
+
+    private:
+        void release() {
+            _file.close();
+            if (_indexFd >= 0) {
+                ::close(_indexFd);
+                _indexFd = -1;
+            }
+        }
+
+        /// 析构和移动赋值不能抛出异常，sync失败时只关闭文件
+        void closeNoThrow() noexcept {
+            try {
+                close();
+            } catch (...) {
+                release();
+            }
+        }
+
+        void swap(MessageLogWriter &other) noexcept {
+            std::swap(_dir, other._dir);
+            std::swap(_options, other._options);
+            std::swap(_file, other._file);
+            std::swap(_indexFd, other._indexFd);
+            std::swap(_end, other._end);
+            std::swap(_syncedEnd, other._syncedEnd);
+            std::swap(_nextSequence, other._nextSequence);
+            std::swap(_indexLength, other._indexLength);
+            std::swap(_lastIndexed, other._lastIndexed);
+            std::swap(_lastTimestamp, other._lastTimestamp);
+            std::swap(_unsynced, other._unsynced);
+            std::swap(_lastSync, other._lastSync);
+            std::swap(_pendingIndex, other._pendingIndex);
+        }
+
+        void createSegment(uint64_t firstSequence) {
+            const std::string path = Detail::logSegmentPath(_dir, firstSequence, ".smlog");
+            const std::string temp = path + ".tmp";
+            _file.close();
+            _file.fd = ::open(temp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            if (_file.fd < 0) {
+                Detail::throwLogErrno("open");
+            }
+            if (ftruncate(_file.fd, static_cast<off_t>(_options.segmentSize)) != 0) {
+                Detail::throwLogErrno("ftruncate");
+            }
+            _file.map(static_cast<size_t>(_options.segmentSize), true);
+            Detail::LogSegmentHeader *header = reinterpret_cast<Detail::LogSegmentHeader*>(_file.data);
+            header->magic = Detail::logMagic;
+            header->version = Detail::logVersion;
+            header->firstSequence = firstSequence;
+            openIndex(firstSequence, 0);
+            if (rename(temp.c_str(), path.c_str()) != 0) {
+                Detail::throwLogErrno("rename");
+            }
+            syncDirectory();
+            resetSegment(firstSequence, sizeof(Detail::LogSegmentHeader));
+        }
+
+        /// 扫描最后一个segment: 截掉不完整的尾部，重建索引
+        void recover(uint64_t firstSequence) {
+            _file.open(Detail::logSegmentPath(_dir, firstSequence, ".smlog"), true);
+            const Detail::LogSegmentHeader *segment = _file.header();
+            if (segment->magic != Detail::logMagic || segment->version != Detail::logVersion || segment->firstSequence != firstSequence) {
+                Detail::throwLogInvalid("MessageLog: not a segment");
+            }
+            uint64_t offset = sizeof(Detail::LogSegmentHeader);
+            uint64_t sequence = firstSequence;
+            uint64_t lastIndexed = 0;
+            int64_t lastTimestamp = 0;
+            bool sealed = false;
+            bool torn = false;
+            std::vector<Detail::LogIndexEntry> index;
+            while (offset + sizeof(Detail::LogRecordHeader) <= _file.length) {
+                const Detail::LogRecordHeader *header = _file.recordAt(offset);
+                const uint32_t length = header->length;
+                if (length == 0 || length == Detail::logSealed) {
+                    sealed = length == Detail::logSealed;
+                    break;
+                }
+                if (length < static_cast<uint32_t>(RootOffset) || Detail::logRecordStride(length) + sizeof(Detail::LogRecordHeader) > _file.length - offset ||
+                    header->sequence != sequence || header->timestamp < lastTimestamp) {
+                    torn = true;
+                    break;
+                }
+                if (lastIndexed == 0 || offset - lastIndexed >= _options.indexInterval) {
+                    index.push_back(Detail::LogIndexEntry{sequence, header->timestamp, offset});
+                    lastIndexed = offset;
+                }
+                lastTimestamp = header->timestamp;
+                offset += Detail::logRecordStride(length);
+                sequence++;
+            }
+            if (torn) {
+                // 截断再扩展，尾部重新变为0，之后的追加不会与残留的字节连在一起
+                const off_t length = static_cast<off_t>(_file.length);
+                if (ftruncate(_file.fd, static_cast<off_t>(offset)) != 0 || ftruncate(_file.fd, length) != 0) {
+                    Detail::throwLogErrno("ftruncate");
+                }
+            }
+            _lastTimestamp = lastTimestamp;
+            if (sealed) {
+                createSegment(sequence);
+                return;
+            }
+            openIndex(firstSequence, 0);
+            const size_t bytes = index.size() * sizeof(Detail::LogIndexEntry);
+            if (pwrite(_indexFd, index.data(), bytes, 0) != static_cast<ssize_t>(bytes) || fdatasync(_indexFd) != 0) {
+                Detail::throwLogErrno("pwrite");
+            }
+            resetSegment(firstSequence, offset);
+            _nextSequence = sequence;
+            _indexLength = bytes;
+            _lastIndexed = lastIndexed;
+        }
+
+        /// 写入结束标记，切换到下一个segment
+        void roll() {
+            std::atomic_ref<uint32_t>(_file.recordAt(_end)->length).store(Detail::logSealed, std::memory_order_release);
+            _end += sizeof(Detail::LogRecordHeader);
+            sync();
+            createSegment(_nextSequence);
+        }
+
+        void openIndex(uint64_t firstSequence, off_t length) {
+            if (_indexFd >= 0) {
+                ::close(_indexFd);
+            }
+            _indexFd = ::open(Detail::logSegmentPath(_dir, firstSequence, ".smidx").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (_indexFd < 0) {
+                Detail::throwLogErrno("open");
+            }
+            if (ftruncate(_indexFd, length) != 0) {
+                Detail::throwLogErrno("ftruncate");
+            }
+        }
+
+        void resetSegment(uint64_t firstSequence, uint64_t end) {
+            _nextSequence = firstSequence;
+            _end = end;
+            _syncedEnd = 0;
+            _indexLength = 0;
+            _lastIndexed = 0;
+            _pendingIndex.clear();
+        }
+
+        void syncDirectory() {
+            const int fd = ::open(_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd >= 0) {
+                fsync(fd);
+                ::close(fd);
+            }
+        }
+
+        std::string _dir;
+        MessageLogOptions _options;
+        Detail::LogFile _file;
+        int _indexFd;
+        uint64_t _end;
+        uint64_t _syncedEnd;
+        uint64_t _nextSequence;
+        uint64_t _indexLength;
+        /// 最后一个索引项的位置，0为当前segment还没有索引项
+        uint64_t _lastIndexed;
+        int64_t _lastTimestamp;
+        uint32_t _unsynced;
+        std::chrono::steady_clock::time_point _lastSync;
+        std::vector<Detail::LogIndexEntry> _pendingIndex;
+    };
+
+    /**
+     * 读取`MessageLogWriter`写入的日志: segment以只读的MAP_SHARED映射，`LogRecord`直接指向映射中的消息，
+     * 回放时不反序列化也不拷贝，可以用`record.root<T>()`或者`visitMessage`处理。
+     *
+     * 可以在writer写入的同时读取: 读到末尾时`next`返回false，writer追加之后再调用可以继续读取。
+     * `seekSequence`/`seekTime`先按segment的文件名和第一条消息，再按稀疏索引定位，最后向后扫描不超过`indexInterval`字节。
+     * 记录的长度、sequence和timestamp都会检查，遇到损坏的记录时停止(`corrupted()`为true)。
+     * 消息本身来自磁盘，不可信时先用`verifyMessage`校验。
+     */
+    class MessageLogReader {
+    public:
+        MessageLogReader(): _current(0), _offset(0), _sequence(0), _corrupted(false) {}
+
+        MessageLogReader(const MessageLogReader&) = delete;
+        MessageLogReader& operator=(const MessageLogReader&) = delete;
+        MessageLogReader(MessageLogReader&&) noexcept = default;
+        MessageLogReader& operator=(MessageLogReader&&) noexcept = default;
+
+        /// 打开目录中的日志，位于第一条消息之前
+        static MessageLogReader open(const std::string &dir) {
+            MessageLogReader reader;
+            reader._dir = dir;
+            reader.refresh();
+            reader.rewind();
+            return reader;
+        }
+
+        /// 回到第一条消息之前
+        void rewind() {
+            _current = 0;
+            _offset = sizeof(Detail::LogSegmentHeader);
+            _sequence = _segments.empty() ? 0 : _segments[0].firstSequence;
+            _corrupted = false;
+        }
+
+        /// 读取下一条消息，读到末尾或者遇到损坏的记录时返回false
+        bool next(LogRecord &record) {
+            if (!peek(record)) {
+                return false;
+            }
+            _offset += Detail::logRecordStride(record.data.size());
+            _sequence++;
+            return true;
+        }
+
+        /**
+         * 依次把消息交给handler(参数为`const LogRecord&`)，直到末尾
+         * @return 处理的消息数
+         */
+        template <typename Handler>
+        size_t replay(Handler &&handler, size_t maxCount = std::numeric_limits<size_t>::max()) {
+            size_t count = 0;
+            LogRecord record;
+            while (count < maxCount && next(record)) {
+                handler(static_cast<const LogRecord&>(record));
+                count++;
+            }
+            return count;
+        }
+
+        /**
+         * 定位到sequence，之后`next`从它开始读取
+         * @return false 日志中没有这条消息(已删除的位于第一条之前，还没写入的位于末尾)
+         */
+        bool seekSequence(uint64_t sequence) {
+            refresh();
+            if (_segments.empty()) {
+                return false;
+            }
+            const auto it = std::upper_bound(_segments.begin(), _segments.end(), sequence, [](uint64_t value, const Segment &segment) { return value < segment.firstSequence; });
+            if (it == _segments.begin()) {
+                rewind();
+                return false;
+            }
+            const size_t segment = static_cast<size_t>(it - _segments.begin()) - 1;
+            const std::vector<Detail::LogIndexEntry> index = Detail::readLogIndex(Detail::logSegmentPath(_dir, _segments[segment].firstSequence, ".smidx"));
+            const auto entry = std::upper_bound(index.begin(), index.end(), sequence, [](uint64_t value, const Detail::LogIndexEntry &e) { return value < e.sequence; });
+            position(segment, entry == index.begin() ? nullptr : &*(entry - 1));
+            LogRecord record;
+            while (_sequence < sequence) {
+                if (!next(record)) {
+                    return false;
+                }
+            }
+            return peek(record);
+        }
+
+        /**
+         * 定位到第一条timestamp不小于timestamp的消息
+         * @return false 没有这样的消息，位于末尾
+         */
+        bool seekTime(int64_t timestamp) {
+            refresh();
+            if (_segments.empty()) {
+                return false;
+            }
+            // 第一条消息早于timestamp的最后一个segment，空的segment只可能是最后一个
+            size_t lo = 0;
+            size_t hi = _segments.size();
+            while (lo < hi) {
+                const size_t mid = (lo + hi) / 2;
+                const Detail::LogRecordHeader *first = mapped(mid).recordAt(sizeof(Detail::LogSegmentHeader));
+                const uint32_t length = Detail::loadLogLength(first);
+                if (length != 0 && length != Detail::logSealed && first->timestamp < timestamp) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            const size_t segment = lo ? lo - 1 : 0;
+            const std::vector<Detail::LogIndexEntry> index = Detail::readLogIndex(Detail::logSegmentPath(_dir, _segments[segment].firstSequence, ".smidx"));
+            const auto entry = std::partition_point(index.begin(), index.end(), [timestamp](const Detail::LogIndexEntry &e) { return e.timestamp < timestamp; });
+            position(segment, entry == index.begin() ? nullptr : &*(entry - 1));
+            LogRecord record;
+            while (peek(record)) {
+                if (record.timestamp >= timestamp) {
+                    return true;
+                }
+                next(record);
+            }
+            return false;
+        }
+
+        /// 下一条要读取的消息的sequence
+        inline uint64_t sequence() const {
+            return _sequence;
+        }
+
+        inline bool corrupted() const {
+            return _corrupted;
+        }
+
+        void close() {
+            _segments.clear();
+            rewind();
+        }
+
+    private:
+        struct Segment {
+            uint64_t firstSequence;
+            Detail::LogFile file;
+        };
+
+        /// 重新列出目录，加入writer新建的segment
+        bool refresh() {
+            const std::vector<uint64_t> segments = Detail::listLogSegments(_dir);
+            const size_t count = _segments.size();
+            for (uint64_t first : segments) {
+                if (_segments.empty() || first > _segments.back().firstSequence) {
+                    _segments.push_back(Segment{first, Detail::LogFile()});
+                }
+            }
+            if (count == 0 && !_segments.empty()) {
+                _sequence = _segments[0].firstSequence;
+            }
+            return _segments.size() > count;
+        }
+
+        /// 按需映射segment，之前的LogRecord在reader关闭之前一直有效
+        Detail::LogFile& mapped(size_t segment) {
+            Detail::LogFile &file = _segments[segment].file;
+            if (!file.data) {
+                file.open(Detail::logSegmentPath(_dir, _segments[segment].firstSequence, ".smlog"), false);
+                const Detail::LogSegmentHeader *header = file.header();
+                if (header->magic != Detail::logMagic || header->version != Detail::logVersion || header->firstSequence != _segments[segment].firstSequence) {
+                    file.close();
+                    Detail::throwLogInvalid("MessageLog: not a segment");
+                }
+                madvise(file.data, file.length, MADV_SEQUENTIAL);
+            }
+            return file;
+        }
+
+        /// 定位到索引项(与segment中的记录一致时)或者segment的开头
+        void position(size_t segment, const Detail::LogIndexEntry *entry) {
+            const Detail::LogFile &file = mapped(segment);
+            _current = segment;
+            _offset = sizeof(Detail::LogSegmentHeader);
+            _sequence = _segments[segment].firstSequence;
+            _corrupted = false;
+            if (entry && entry->offset % 8 == 0 && entry->offset >= _offset && entry->offset <= file.length - sizeof(Detail::LogRecordHeader)) {
+                const Detail::LogRecordHeader *header = file.recordAt(entry->offset);
+                const uint32_t length = Detail::loadLogLength(header);
+                if (length != 0 && length != Detail::logSealed && header->sequence == entry->sequence) {
+                    _offset = entry->offset;
+                    _sequence = entry->sequence;
+                }
+            }
+        }
+
+        /// 读取下一条消息但不前进，经过结束标记时切换到下一个segment
+        bool peek(LogRecord &record) {
+            if (_corrupted || (_segments.empty() && !refresh())) {
+                return false;
+            }
+            for (;;) {
+                const Detail::LogFile &file = mapped(_current);
+                if (_offset > file.length - sizeof(Detail::LogRecordHeader)) {
+                    _corrupted = true;
+                    return false;
+                }
+                const Detail::LogRecordHeader *header = file.recordAt(_offset);
+                const uint32_t length = Detail::loadLogLength(header);
+                if (length == 0) {
+                    return false;
+                }
+                if (length == Detail::logSealed) {
+                    if (_current + 1 >= _segments.size() && !refresh()) {
+                        return false;
+                    }
+                    if (_segments[_current + 1].firstSequence != _sequence) {
+                        _corrupted = true;
+                        return false;
+                    }
+                    _current++;
+                    _offset = sizeof(Detail::LogSegmentHeader);
+                    continue;
+                }
+                if (length < static_cast<uint32_t>(RootOffset) || length > file.length - _offset - sizeof(Detail::LogRecordHeader) || header->sequence != _sequence) {
+                    _corrupted = true;
+                    return false;
+                }
+                record = LogRecord{header->sequence, header->timestamp, header->typeId, std::span<const uint8_t>(reinterpret_cast<const uint8_t*>(header + 1), length)};
+                return true;
+            }
+        }
+
+        std::string _dir;
+        std::vector<Segment> _segments;
+        size_t _current;
+        uint64_t _offset;
+        uint64_t _sequence;
+        bool _corrupted;
+    };
+}
+
+#endif
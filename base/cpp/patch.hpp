@@ -0,0 +1,688 @@
+#pragma once
+
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "builder.hpp"
+#include "verifier.hpp"
+
+namespace SMessage
+{
+    /// patch消息的mainTypeId，位于batch(58)之前
+    constexpr int32_t PatchTypeId = 57;
+
+    /**
+     * 把接收端的base消息更新为target的patch，本身也是一个消息:
+     * `| baseTypeId | baseLength | length | trashLength | ranges | data | baseHash |`
+     *
+     * ranges为`(offset, length)`对，data依次存放每段的字节。base之后新增的子空间作为最后一段，
+     * 应用时只需要按段拷贝，不需要schema。与TS的`MessagePatch`布局相同。
+     */
+    class MessagePatch : public BaseMessage<MessagePatch> {
+    public:
+        static constexpr int32_t typeId = PatchTypeId;
+        static constexpr int32_t byteLength = 44;
+
+        static constexpr int32_t offsetBaseTypeId = 0;
+        static constexpr int32_t offsetBaseLength = 4;
+        static constexpr int32_t offsetLength = 8;
+        static constexpr int32_t offsetTrashLength = 12;
+        static constexpr int32_t offsetRanges = 16;
+        static constexpr int32_t offsetData = 28;
+        static constexpr int32_t offsetBaseHash = 40;
+
+        using BaseMessage::BaseMessage;
+
+        template <typename Tracer>
+        static void traceMembers(Tracer &tracer, int32_t offset) {
+            tracer.template visit<MsgVector<int32_t>>(offset + offsetRanges);
+            tracer.template visit<MsgVector<uint8_t>>(offset + offsetData);
+        }
+
+        /// 被patch的消息类型
+        inline int32_t getBaseTypeId() const {
+            return loadMember<int32_t>(offsetBaseTypeId);
+        }
+
+        /// 被patch的消息在diff时的nextAvailableOffset，接收端的消息必须与之相同
+        inline int32_t getBaseLength() const {
+            return loadMember<int32_t>(offsetBaseLength);
+        }
+
+        /// 应用后的nextAvailableOffset
+        inline int32_t getLength() const {
+            return loadMember<int32_t>(offsetLength);
+        }
+
+        /// base在diff时header之后的字节的hash(`patchBaseHash`)，接收端的消息必须与之相同
+        inline uint32_t getBaseHash() const {
+            return loadMember<uint32_t>(offsetBaseHash);
+        }
+
+        inline int32_t getTrashLength() const {
+            return loadMember<int32_t>(offsetTrashLength);
+        }
+
+        inline MsgVector<int32_t> getRanges() const {
+            return inlineMember<MsgVector<int32_t>>(offsetRanges);
+        }
+
+        inline MsgVector<uint8_t> getData() const {
+            return inlineMember<MsgVector<uint8_t>>(offsetData);
+        }
+
+        inline int32_t rangeCount() const {
+            return getRanges().getSize() / 2;
+        }
+
+    private:
+        friend class MessageDiffer;
+
+        inline void set(int32_t baseTypeId, int32_t baseLength, uint32_t baseHash, int32_t length, int32_t trashLength) {
+            storeMember<int32_t>(offsetBaseTypeId, baseTypeId);
+            storeMember<int32_t>(offsetBaseLength, baseLength);
+            storeMember<int32_t>(offsetLength, length);
+            storeMember<int32_t>(offsetTrashLength, trashLength);
+            storeMember<uint32_t>(offsetBaseHash, baseHash);
+        }
+    };
+
+    /**
+     * base消息`[RootOffset, length)`的FNV-1a，与TS的`patchBaseHash`相同。
+     * header中的trash不参与，typeId和length单独比较。
+     */
+    inline uint32_t patchBaseHash(const uint8_t *message, int32_t length) {
+        uint32_t hash = 2166136261u;
+        for (int32_t i = RootOffset; i < length; i++) {
+            hash = (hash ^ message[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    class MessageDiffer;
+
+    /**
+     * 比较working buffer中`offset`处的值与target中`targetOffset`处的值，把差异写入working buffer。
+     * 生成的struct通过`traceMembers`提供非native成员，其余字节按native比较；辅助结构在下面特化。
+     */
+    template <typename T, typename Enable = void>
+    struct DiffTrace {
+        static void diff(MessageDiffer &differ, int32_t offset, int32_t targetOffset);
+    };
+
+    /**
+     * 按schema比较两个同类型的消息，生成把base更新为target的`MessagePatch`。
+     *
+     * 在base的副本(working buffer)上进行: native字段只写入变化的字节，字符串和数组在原有capacity足够时原地更新，
+     * 否则在末尾分配新的子空间(旧的计入trash)，引用的struct按(typeId, 地址)对应后递归比较，
+     * 没有对应的struct时拷贝target的。从全0的值开始比较就是深拷贝，所以新增的值也使用同一套规则。
+     * 最后把写入过的base范围和新增的子空间一起写入patch，接收端应用后与target的值相同(布局可以不同)。
+     *
+     * 使用显式的任务栈，RecuTest这样很深的引用链不会栈溢出。
+     */
+    class MessageDiffer {
+    public:
+        using DiffFn = void (*)(MessageDiffer&, int32_t, int32_t);
+
+        /**
+         * @param patch 清空后写入`MessagePatch`
+         * @return false base或target不是Root消息
+         */
+        template <typename Root>
+        bool diff(const void *base, const void *target, MessageBuilder &patch) {
+            const uint8_t *from = static_cast<const uint8_t*>(base);
+            _target = static_cast<const uint8_t*>(target);
+            if (loadValue<int32_t>(from, MainTypeIdOffset) != Root::typeId || loadValue<int32_t>(_target, MainTypeIdOffset) != Root::typeId) {
+                return false;
+            }
+            _baseLength = loadValue<int32_t>(from, NextAvailableOffset);
+            _trash = loadValue<int32_t>(from, TrashLengthOffset);
+            _baseHash = patchBaseHash(from, _baseLength);
+            _working.assign(from, from + _baseLength);
+            _dirty.clear();
+            _tasks.clear();
+            _forward.clear();
+            _matched.clear();
+            _matched.insert(matchKey(Root::typeId, RootOffset));
+            _forward.emplace(RootOffset, RootOffset);
+            visit<Root>(RootOffset, RootOffset);
+            while (!_tasks.empty()) {
+                const Task task = _tasks.back();
+                _tasks.pop_back();
+                task.diff(*this, task.offset, task.targetOffset);
+            }
+            writePatch(Root::typeId, patch);
+            return true;
+        }
+
+        /// 比较`offset`处的T，native直接比较字节，其余稍后处理
+        template <typename T>
+        void visit(int32_t offset, int32_t targetOffset) {
+            if constexpr (IsNativeType<T>::value) {
+                diffBytes(offset, targetOffset, byteLengthOf<T>());
+            } else {
+                _tasks.push_back(Task{&DiffTrace<T>::diff, offset, targetOffset});
+            }
+        }
+
+        /// 引用类型成员，`addrOffset`/`targetAddrOffset`为存放地址的位置
+        template <typename T>
+        static void reference(MessageDiffer &differ, int32_t addrOffset, int32_t targetAddrOffset) {
+            const int32_t targetAddr = differ.loadTarget<int32_t>(targetAddrOffset);
+            const int32_t addr = differ.load<int32_t>(addrOffset);
+            if (!targetAddr) {
+                if (addr) {
+                    differ.store<int32_t>(addrOffset, 0);
+                }
+                return;
+            }
+            // target中被多处引用的struct只对应一次，保持共享
+            const auto found = differ._forward.find(targetAddr);
+            if (found != differ._forward.end()) {
+                if (addr != found->second) {
+                    differ.store<int32_t>(addrOffset, found->second);
+                }
+                return;
+            }
+            if (addr && differ._matched.insert(matchKey(T::typeId, addr)).second) {
+                differ._forward.emplace(targetAddr, addr);
+                differ.visit<T>(addr, targetAddr);
+                return;
+            }
+            // base中这个struct已经对应了target中的另一个struct，拷贝一份
+            const int32_t copy = differ.allocate(T::byteLength, itemAlignment<T>());
+            differ._forward.emplace(targetAddr, copy);
+            differ.store<int32_t>(addrOffset, copy);
+            differ.visit<T>(copy, targetAddr);
+        }
+
+        /// 把不同的字节写入working buffer，相隔很近的差异合并为一段
+        void diffBytes(int32_t offset, int32_t targetOffset, int32_t length) {
+            const uint8_t *target = _target + targetOffset;
+            int32_t i = 0;
+            while (i < length) {
+                if (_working[static_cast<size_t>(offset + i)] == target[i]) {
+                    i++;
+                    continue;
+                }
+                const int32_t start = i;
+                int32_t end = i + 1;
+                for (i = end; i < length && i - end < rangeMergeGap; i++) {
+                    if (_working[static_cast<size_t>(offset + i)] != target[i]) {
+                        end = i + 1;
+                    }
+                }
+                write(offset + start, target + start, end - start);
+                i = end;
+            }
+        }
+
+        void write(int32_t offset, const void *src, int32_t length) {
+            std::memcpy(_working.data() + offset, src, static_cast<size_t>(length));
+            markDirty(offset, length);
+        }
+
+        template <typename V>
+        inline void store(int32_t offset, V value) {
+            storeValue<V>(_working.data(), offset, value);
+            markDirty(offset, static_cast<int32_t>(sizeof(V)));
+        }
+
+        template <typename V>
+        inline V load(int32_t offset) const {
+            return loadValue<V>(_working.data(), offset);
+        }
+
+        template <typename V>
+        inline V loadTarget(int32_t offset) const {
+            return loadValue<V>(_target, offset);
+        }
+
+        /// 清零一段已有的空间，接收端同样需要清零
+        void clear(int32_t offset, int32_t length) {
+            std::memset(_working.data() + offset, 0, static_cast<size_t>(length));
+            markDirty(offset, length);
+        }
+
+        /// 在末尾分配清零的子空间，之后working buffer的地址可能变化
+        int32_t allocate(int32_t length, int32_t alignment = 1) {
+            const int32_t next = static_cast<int32_t>(_working.size());
+            const int32_t offset = next + (alignment - next % alignment) % alignment;
+            _working.resize(static_cast<size_t>(offset + length), 0);
+            return offset;
+        }
+
+        /// 在working buffer内移动数据到新分配的子空间
+        inline void move(int32_t to, int32_t from, int32_t length) {
+            std::memmove(_working.data() + to, _working.data() + from, static_cast<size_t>(length));
+        }
+
+        /// 直接修改data()后调用。只记录base范围内的写入，之后新增的部分整体写入patch
+        void markDirty(int32_t offset, int32_t length) {
+            const int32_t end = std::min(offset + length, _baseLength);
+            if (offset < end) {
+                _dirty.emplace_back(offset, end - offset);
+            }
+        }
+
+        inline void addTrash(int32_t length) {
+            _trash += length;
+        }
+
+        inline uint8_t* data() {
+            return _working.data();
+        }
+
+        inline const uint8_t* target() const {
+            return _target;
+        }
+
+    private:
+        /// 两段差异之间相同的字节少于一个range项(8字节)时合并
+        static constexpr int32_t rangeMergeGap = 8;
+
+        struct Task {
+            DiffFn diff;
+            int32_t offset;
+            int32_t targetOffset;
+        };
+
+        static inline uint64_t matchKey(int32_t typeId, int32_t addr) {
+            return (static_cast<uint64_t>(static_cast<uint32_t>(typeId)) << 32) | static_cast<uint32_t>(addr);
+        }
+
+
+        void writePatch(int32_t baseTypeId, MessageBuilder &patch) {
+            std::sort(_dirty.begin(), _dirty.end());
+            std::vector<int32_t> ranges;
+            int32_t dataLength = 0;
+            for (const auto &[offset, length] : _dirty) {
+                const size_t size = ranges.size();
+                if (size && offset - (ranges[size - 2] + ranges[size - 1]) < rangeMergeGap) {
+                    const int32_t end = std::max(ranges[size - 2] + ranges[size - 1], offset + length);
+                    dataLength += end - (ranges[size - 2] + ranges[size - 1]);
+                    ranges[size - 1] = end - ranges[size - 2];
+                } else {
+                    ranges.push_back(offset);
+                    ranges.push_back(length);
+                    dataLength += length;
+                }
+            }
+            const int32_t length = static_cast<int32_t>(_working.size());
+            if (length > _baseLength) {
+                ranges.push_back(_baseLength);
+                ranges.push_back(length - _baseLength);
+                dataLength += length - _baseLength;
+            }
+
+            patch.createRoot<MessagePatch>().set(baseTypeId, _baseLength, _baseHash, length, _trash);
+            if (ranges.empty()) {
+                return;
+            }
+            patch.reserve(patch.root<MessagePatch>().getRanges(), static_cast<int32_t>(ranges.size()));
+            patch.append(patch.root<MessagePatch>().getRanges(), ranges.data(), ranges.data() + ranges.size());
+            patch.reserve(patch.root<MessagePatch>().getData(), dataLength);
+            for (size_t i = 0; i < ranges.size(); i += 2) {
+                const uint8_t *first = _working.data() + ranges[i];
+                patch.append(patch.root<MessagePatch>().getData(), first, first + ranges[i + 1]);
+            }
+        }
+
+        std::vector<uint8_t> _working;
+        const uint8_t *_target = nullptr;
+        int32_t _baseLength = 0;
+        uint32_t _baseHash = 0;
+        int32_t _trash = 0;
+        std::vector<std::pair<int32_t, int32_t>> _dirty;
+        std::vector<Task> _tasks;
+        /// target中的struct地址 -> working buffer中对应的地址
+        std::unordered_map<int32_t, int32_t> _forward;
+        /// 已经对应了target中某个struct的(typeId, 地址)
+        std::unordered_set<uint64_t> _matched;
+    };
+
+    /// 记录struct中非native成员的位置和比较函数
+    class DiffMemberRecorder {
+    public:
+        struct Member {
+            int32_t offset;
+            int32_t length;
+            MessageDiffer::DiffFn diff;
+
+            inline bool operator<(const Member &other) const {
+                return offset < other.offset;
+            }
+        };
+
+        template <typename T>
+        void visit(int32_t offset) {
+            members.push_back(Member{offset, byteLengthOf<T>(), &DiffTrace<T>::diff});
+        }
+
+        template <typename T>
+        void visitReference(int32_t offset) {
+            members.push_back(Member{offset, 4, &MessageDiffer::reference<T>});
+        }
+
+        std::vector<Member> members;
+    };
+
+    template <typename T, typename Enable>
+    void DiffTrace<T, Enable>::diff(MessageDiffer &differ, int32_t offset, int32_t targetOffset) {
+        static const std::vector<DiffMemberRecorder::Member> members = [] {
+            DiffMemberRecorder recorder;
+            T::traceMembers(recorder, 0);
+            std::sort(recorder.members.begin(), recorder.members.end());
+            return std::move(recorder.members);
+        }();
+        int32_t cursor = 0;
+        for (const auto &member : members) {
+            if (member.offset > cursor) {
+                differ.diffBytes(offset + cursor, targetOffset + cursor, member.offset - cursor);
+            }
+            member.diff(differ, offset + member.offset, targetOffset + member.offset);
+            cursor = member.offset + member.length;
+        }
+        if (T::byteLength > cursor) {
+            differ.diffBytes(offset + cursor, targetOffset + cursor, T::byteLength - cursor);
+        }
+    }
+
+    template <>
+    struct DiffTrace<MsgString> {
+        static void diff(MessageDiffer &differ, int32_t offset, int32_t targetOffset) {
+            const MsgString target(const_cast<uint8_t*>(differ.target()), targetOffset);
+            const MsgString str(differ.data(), offset);
+            if (str.getStringView() == target.getStringView()) {
+                return;
+            }
+            if (target.isInline()) {
+                if (!str.isInline()) {
+                    differ.addTrash(str.capacity());
+                }
+                differ.write(offset, differ.target() + targetOffset, MsgString::byteLength);
+                return;
+            }
+            const int32_t len = target.length();
+            if (!str.isInline() && str.capacity() >= len) {
+                differ.diffBytes(str.getDataOffset(), target.getDataOffset(), len);
+                if (str.length() != len) {
+                    differ.store<int32_t>(offset + 4, len);
+                }
+                return;
+            }
+            if (!str.isInline()) {
+                differ.addTrash(str.capacity());
+            }
+            const int32_t dataOffset = differ.allocate(len);
+            differ.write(dataOffset, differ.target() + target.getDataOffset(), len);
+            MsgString(differ.data(), offset).setOutOfLine(dataOffset, len, len);
+            differ.markDirty(offset, MsgString::byteLength);
+        }
+    };
+
+    /// 元素逐个比较，capacity不够时移动到末尾的新空间，已有的元素仍然逐个比较以复用它们的子空间
+    template <typename T>
+    struct DiffTrace<MsgVector<T>> {
+        static void diff(MessageDiffer &differ, int32_t offset, int32_t targetOffset) {
+            constexpr int32_t itemBytes = byteLengthOf<T>();
+            const int32_t dataOffset = differ.load<int32_t>(offset);
+            const int32_t size = differ.load<int32_t>(offset + 4);
+            const int32_t capacity = differ.load<int32_t>(offset + 8);
+            const int32_t targetData = differ.loadTarget<int32_t>(targetOffset);
+            const int32_t targetSize = differ.loadTarget<int32_t>(targetOffset + 4);
+            if (targetSize == 0) {
+                if (size != 0) {
+                    differ.store<int32_t>(offset + 4, 0);
+                }
+                return;
+            }
+            const int32_t kept = std::min(size, targetSize);
+            int32_t data = dataOffset;
+            if (dataOffset == 0 || capacity < targetSize) {
+                data = differ.allocate(targetSize * itemBytes, itemAlignment<T>());
+                if (dataOffset != 0) {
+                    differ.move(data, dataOffset, kept * itemBytes);
+                    differ.addTrash(capacity * itemBytes);
+                }
+                differ.store<int32_t>(offset, data);
+                differ.store<int32_t>(offset + 8, targetSize);
+            }
+            if (size != targetSize) {
+                differ.store<int32_t>(offset + 4, targetSize);
+            }
+            if constexpr (IsNativeType<T>::value) {
+                // size之后的旧字节接收端同样持有，直接比较即可
+                differ.diffBytes(data, targetData, targetSize * itemBytes);
+            } else {
+                for (int32_t i = 0; i < targetSize; i++) {
+                    // 原地复用size之后的空间时先清零，旧的引用可能指向仍在使用的数据
+                    if (i >= kept && data == dataOffset) {
+                        differ.clear(data + itemBytes * i, itemBytes);
+                    }
+                    differ.visit<T>(data + itemBytes * i, targetData + itemBytes * i);
+                }
+            }
+        }
+    };
+
+    /// `@soa`数组逐列比较，capacity不够时各列搬到末尾的新数据区
+    template <typename T>
+    struct DiffTrace<MsgSoaVector<T>> {
+        static void diff(MessageDiffer &differ, int32_t offset, int32_t targetOffset) {
+            const int32_t dataOffset = differ.load<int32_t>(offset);
+            const int32_t size = differ.load<int32_t>(offset + 4);
+            const int32_t capacity = differ.load<int32_t>(offset + 8);
+            const int32_t targetData = differ.loadTarget<int32_t>(targetOffset);
+            const int32_t targetSize = differ.loadTarget<int32_t>(targetOffset + 4);
+            const int32_t targetCapacity = differ.loadTarget<int32_t>(targetOffset + 8);
+            if (targetSize == 0) {
+                if (size != 0) {
+                    differ.store<int32_t>(offset + 4, 0);
+                }
+                return;
+            }
+            const int32_t kept = std::min(size, targetSize);
+            int32_t data = dataOffset;
+            int32_t dataCapacity = capacity;
+            if (dataOffset == 0 || capacity < targetSize) {
+                dataCapacity = MsgSoaVectorBase::capacityFor(targetSize);
+                data = differ.allocate(dataCapacity * T::byteLength, MsgSoaVectorBase::dataAlignment);
+                if (dataOffset != 0) {
+                    for (const MsgSoaColumn &column : MsgSoaVector<T>::columns) {
+                        differ.move(data + dataCapacity * column.offset, dataOffset + capacity * column.offset, kept * column.bytes);
+                    }
+                    differ.addTrash(capacity * T::byteLength);
+                }
+                differ.store<int32_t>(offset, data);
+                differ.store<int32_t>(offset + 8, dataCapacity);
+            }
+            if (size != targetSize) {
+                differ.store<int32_t>(offset + 4, targetSize);
+            }
+            // size之后的旧字节接收端同样持有，直接比较即可
+            for (const MsgSoaColumn &column : MsgSoaVector<T>::columns) {
+                differ.diffBytes(data + dataCapacity * column.offset, targetData + targetCapacity * column.offset, targetSize * column.bytes);
+            }
+        }
+    };
+
+    /// key完全相同时逐个比较value，否则整体替换
+    template <typename K, typename V>
+    struct DiffTrace<MsgMap<K, V>> {
+        using Map = MsgMap<K, V>;
+
+        static void diff(MessageDiffer &differ, int32_t offset, int32_t targetOffset) {
+            const int32_t size = differ.load<int32_t>(offset);
+            const int32_t dataOffset = differ.load<int32_t>(offset + 8);
+            const int32_t targetSize = differ.loadTarget<int32_t>(targetOffset);
+            const int32_t targetData = differ.loadTarget<int32_t>(targetOffset + 8);
+            if (targetSize == 0) {
+                if (size != 0) {
+                    differ.store<int32_t>(offset, 0);
+                }
+                return;
+            }
+            if (size == targetSize && dataOffset != 0 && sameKeys(differ, dataOffset, targetData, size)) {
+                for (int32_t i = 0; i < size; i++) {
+                    differ.visit<V>(dataOffset + Map::entryByte() * i + Map::keyByte(), targetData + Map::entryByte() * i + Map::keyByte());
+                }
+                return;
+            }
+            if (dataOffset != 0) {
+                differ.addTrash(differ.load<int32_t>(offset + 4) * Map::entryByte());
+            }
+            const int32_t data = differ.allocate(targetSize * Map::entryByte());
+            differ.store<int32_t>(offset, targetSize);
+            differ.store<int32_t>(offset + 4, targetSize);
+            differ.store<int32_t>(offset + 8, data);
+            for (int32_t i = 0; i < targetSize; i++) {
+                differ.visit<K>(data + Map::entryByte() * i, targetData + Map::entryByte() * i);
+                differ.visit<V>(data + Map::entryByte() * i + Map::keyByte(), targetData + Map::entryByte() * i + Map::keyByte());
+            }
+        }
+
+    private:
+        static bool sameKeys(MessageDiffer &differ, int32_t data, int32_t targetData, int32_t size) {
+            for (int32_t i = 0; i < size; i++) {
+                const int32_t entry = data + Map::entryByte() * i;
+                const int32_t targetEntry = targetData + Map::entryByte() * i;
+                if constexpr (IsNativeType<K>::value) {
+                    if (differ.load<K>(entry) != differ.loadTarget<K>(targetEntry)) {
+                        return false;
+                    }
+                } else if (MsgString(differ.data(), entry).getStringView() != MsgString(const_cast<uint8_t*>(differ.target()), targetEntry).getStringView()) {
+                    return false;
+                }
+            }
+            return true;
+        }
+    };
+
+    /// 类型相同时比较值，否则重新设置
+    template <typename... Ts>
+    struct DiffTrace<MsgCombine<Ts...>> {
+        static void diff(MessageDiffer &differ, int32_t offset, int32_t targetOffset) {
+            const uint8_t index = differ.load<uint8_t>(offset);
+            const uint8_t targetIndex = differ.loadTarget<uint8_t>(targetOffset);
+            if (targetIndex == 0) {
+                if (index != 0) {
+                    dropValue(differ, offset, index);
+                    differ.store<uint8_t>(offset, 0);
+                }
+                return;
+            }
+            uint8_t current = 0;
+            (diffCandidate<Ts>(differ, offset, targetOffset, index, targetIndex, ++current), ...);
+        }
+
+    private:
+        template <typename V>
+        static void diffCandidate(MessageDiffer &differ, int32_t offset, int32_t targetOffset, uint8_t index, uint8_t targetIndex, uint8_t candidate) {
+            if (targetIndex != candidate) {
+                return;
+            }
+            if (index != targetIndex) {
+                dropValue(differ, offset, index);
+                differ.store<uint8_t>(offset, targetIndex);
+                differ.clear(offset + 4, 4);
+            }
+            if constexpr (byteLengthOf<V>() <= 4) {
+                differ.visit<V>(offset + 4, targetOffset + 4);
+            } else {
+                const int32_t targetAddr = differ.loadTarget<int32_t>(targetOffset + 4);
+                int32_t addr = differ.load<int32_t>(offset + 4);
+                if (!targetAddr) {
+                    if (addr) {
+                        differ.store<int32_t>(offset + 4, 0);
+                    }
+                    return;
+                }
+                if (!addr) {
+                    addr = differ.allocate(byteLengthOf<V>(), itemAlignment<V>());
+                    differ.store<int32_t>(offset + 4, addr);
+                }
+                differ.visit<V>(addr, targetAddr);
+            }
+        }
+
+        /// 原来的值在子空间中时计入trash
+        static void dropValue(MessageDiffer &differ, int32_t offset, uint8_t index) {
+            uint8_t current = 0;
+            ((++current == index && byteLengthOf<Ts>() > 4 && differ.load<int32_t>(offset + 4) ? differ.addTrash(byteLengthOf<Ts>()) : void()), ...);
+        }
+    };
+
+    /// 生成把base更新为target的patch
+    template <typename Root>
+    inline bool diffMessage(const void *base, const void *target, MessageBuilder &patch) {
+        MessageDiffer differ;
+        return differ.template diff<Root>(base, target, patch);
+    }
+
+    namespace Detail {
+        /// patch中的数组在patch消息的nextAvailableOffset之内
+        inline bool patchVectorInBounds(const MsgVectorBase &vec, int32_t itemBytes, int32_t end) {
+            const int64_t start = vec.getStartOffset();
+            const int64_t size = vec.getSize();
+            return size >= 0 && (size == 0 || (start >= RootOffset && start + size * itemBytes <= end));
+        }
+    }
+
+    /**
+     * 在接收端原地应用patch，消息的类型、nextAvailableOffset和内容(`getBaseHash`)必须与diff时的base相同。
+     * 先检查所有范围(包括ranges和data在patch消息之内)再写入，失败时消息不变。
+     * patch消息的nextAvailableOffset不能超过它的buffer，来自不可信来源时使用下面带长度的版本。
+     * @return false patch不适用于这个消息或者已损坏
+     */
+    inline bool applyPatch(MessageBuilder &message, const MessagePatch &patch) {
+        const int32_t baseLength = patch.getBaseLength();
+        const int32_t length = patch.getLength();
+        if (message.nextAvailableOffset() < RootOffset || loadValue<int32_t>(message.data(), MainTypeIdOffset) != patch.getBaseTypeId() || message.nextAvailableOffset() != baseLength ||
+            length < baseLength) {
+            return false;
+        }
+        const MsgVector<int32_t> ranges = patch.getRanges();
+        const MsgVector<uint8_t> data = patch.getData();
+        const int32_t patchEnd = patch.nextAvailableOffset();
+        if (ranges.getSize() % 2 != 0 || !Detail::patchVectorInBounds(ranges, 4, patchEnd) || !Detail::patchVectorInBounds(data, 1, patchEnd)) {
+            return false;
+        }
+        const int32_t count = ranges.getSize() / 2;
+        int64_t dataLength = 0;
+        for (int32_t i = 0; i < count; i++) {
+            const int32_t offset = ranges.getItem(i * 2);
+            const int32_t rangeLength = ranges.getItem(i * 2 + 1);
+            if (offset < RootOffset || rangeLength < 0 || offset > length - rangeLength) {
+                return false;
+            }
+            dataLength += rangeLength;
+        }
+        if (dataLength != data.getSize() || patchBaseHash(message.data(), baseLength) != patch.getBaseHash()) {
+            return false;
+        }
+        if (length > baseLength) {
+            message.createSubBuffer(length - baseLength);
+        }
+        const uint8_t *bytes = data.getSpan().data();
+        for (int32_t i = 0; i < count; i++) {
+            const int32_t offset = ranges.getItem(i * 2);
+            const int32_t rangeLength = ranges.getItem(i * 2 + 1);
+            std::memcpy(message.data() + offset, bytes, static_cast<size_t>(rangeLength));
+            bytes += rangeLength;
+        }
+        storeValue<int32_t>(message.data(), TrashLengthOffset, patch.getTrashLength());
+        return true;
+    }
+
+    /// 应用收到的length字节的patch消息，先按schema校验patch本身
+    inline bool applyPatch(MessageBuilder &message, const void *patch, size_t length) {
+        if (!verifyMessage<MessagePatch>(patch, length)) {
+            return false;
+        }
+        return applyPatch(message, MessagePatch(const_cast<void*>(patch)));
+    }
+}
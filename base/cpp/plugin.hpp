@@ -1,21 +1,73 @@
+#pragma once
 
-namespace Plugin {
+#include <array>
+
+#include "dispatch.hpp"
+
+namespace Plugin
+{
+    /**
+     * 按消息类型注册处理函数的插件，Types为生成的`SMessage::Dispatch::MessageTypes`。
+     * 处理函数按`typeId - MINUserDefTypeId`保存在定长数组中，收到消息时读取mainTypeId，
+     * 一次下标访问找到对应的项并调用，没有虚函数、hash表和分配。
+     */
+    template <typename Types>
     class SinglePlugin
     {
-    private:
-        /// @brief 插件名
-        static constexpr char* name = "SWitch Plugin";
     public:
-        SinglePlugin(/* args */);
-        ~SinglePlugin();
+        /// @brief 插件名
+        static constexpr const char* name = "SWitch Plugin";
+
+        template <typename T>
+        using Handler = void (*)(T message, void *context);
+
+        /// 注册T的处理函数，同一类型只保留最后一次注册的
+        template <typename T>
+        void on(Handler<T> handler, void *context = nullptr) {
+            _slots[indexOf<T>()] = Slot{&invoke<T>, reinterpret_cast<void (*)()>(handler), context};
+        }
+
+        template <typename T>
+        void off() {
+            _slots[indexOf<T>()] = Slot{};
+        }
+
+        template <typename T>
+        bool handles() const {
+            return _slots[indexOf<T>()].invoke != nullptr;
+        }
+
+        /**
+         * 把消息交给它的类型注册的处理函数
+         * @return false 类型未知或者没有注册处理函数
+         */
+        bool dispatch(void *buffer) const {
+            const uint32_t index = SMessage::messageIndexOf<Types>(buffer);
+            if (index == _slots.size() || !_slots[index].invoke) {
+                return false;
+            }
+            const Slot &slot = _slots[index];
+            slot.invoke(slot, static_cast<uint8_t*>(buffer));
+            return true;
+        }
+
+    private:
+        struct Slot {
+            void (*invoke)(const Slot&, uint8_t*) = nullptr;
+            void (*handler)() = nullptr;
+            void *context = nullptr;
+        };
+
+        template <typename T>
+        static constexpr size_t indexOf() {
+            return SMessage::typeIndexOf<Types, T>();
+        }
+
+        template <typename T>
+        static void invoke(const Slot &slot, uint8_t *buffer) {
+            reinterpret_cast<Handler<T>>(slot.handler)(T(buffer, SMessage::RootOffset), slot.context);
+        }
+
+        std::array<Slot, static_cast<size_t>(Types::size)> _slots{};
     };
-    
-    SinglePlugin::SinglePlugin(/* args */)
-    {
-    }
-    
-    SinglePlugin::~SinglePlugin()
-    {
-    }
-    
-}
\ No newline at end of file
+}
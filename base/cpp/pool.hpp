@@ -0,0 +1,488 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include "base.hpp"
+
+namespace SMessage
+{
+    class MessagePool;
+
+    namespace Detail {
+        /// 放在每个buffer之前的块头，buffer从块头之后开始
+        struct alignas(32) PoolBlock {
+            MessagePool *pool;
+            PoolBlock *next;
+            std::atomic<int32_t> refs;
+            /// size class序号，等于`MessagePool::classCount`时为直接分配的大块
+            uint32_t sizeClass;
+            size_t byteLength;
+
+            inline uint8_t* data() {
+                return reinterpret_cast<uint8_t*>(this + 1);
+            }
+        };
+    }
+
+    /**
+     * 引用计数的池buffer句柄，最后一个句柄释放时buffer回到所属的pool。
+     * 计数是原子的，句柄可以在线程之间传递和拷贝，但buffer的内容本身不做同步。
+     */
+    class PoolBuffer {
+    public:
+        PoolBuffer(): _block(nullptr) {}
+
+        ~PoolBuffer() {
+            reset();
+        }
+
+        PoolBuffer(const PoolBuffer &other): _block(other._block) {
+            if (_block) {
+                _block->refs.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        PoolBuffer(PoolBuffer &&other) noexcept: _block(other._block) {
+            other._block = nullptr;
+        }
+
+        PoolBuffer& operator=(const PoolBuffer &other) {
+            PoolBuffer(other).swap(*this);
+            return *this;
+        }
+
+        PoolBuffer& operator=(PoolBuffer &&other) noexcept {
+            PoolBuffer(std::move(other)).swap(*this);
+            return *this;
+        }
+
+        inline void swap(PoolBuffer &other) noexcept {
+            std::swap(_block, other._block);
+        }
+
+        inline void reset();
+
+        inline uint8_t* data() const {
+            return _block ? _block->data() : nullptr;
+        }
+
+        /// 可用字节数，等于size class的块大小减去块头
+        inline size_t capacity() const {
+            return _block ? _block->byteLength : 0;
+        }
+
+        inline int32_t useCount() const {
+            return _block ? _block->refs.load(std::memory_order_acquire) : 0;
+        }
+
+        /// 是否是唯一的句柄，此时没有其他线程能访问buffer，可以直接修改
+        inline bool unique() const {
+            return useCount() == 1;
+        }
+
+        /// buffer所属的pool
+        inline MessagePool* pool() const {
+            return _block ? _block->pool : nullptr;
+        }
+
+        inline explicit operator bool() const {
+            return _block != nullptr;
+        }
+
+    private:
+        friend class MessagePool;
+
+        explicit PoolBuffer(Detail::PoolBlock *block): _block(block) {}
+
+        Detail::PoolBlock *_block;
+    };
+
+    /**
+     * 消息buffer的内存池。块大小为2的幂(64B ~ 16MB)，更大的请求直接分配，释放时归还系统。
+     *
+     * 每个线程为一个pool保留一组本地空闲链表，分配和释放通常不需要任何原子操作。
+     * 本地链表超过上限时把一半放回全局空闲链表；全局链表是无锁的，只有整条push和整条取走两种操作，
+     * 因此不存在ABA问题。线程退出时本地缓存全部归还全局链表。
+     * pool记录所有缓存了它的线程，析构时释放这些线程缓存中的块并解除关联，之后这些线程可以缓存其他pool。
+     *
+     * pool分配出去的buffer必须在pool析构前全部释放，析构时其他线程不能正在使用这个pool。
+     * `MessagePool::shared()`永远不会析构。
+     */
+    class MessagePool {
+    public:
+        static constexpr uint32_t minClassShift = 6;
+        static constexpr uint32_t maxClassShift = 24;
+        static constexpr uint32_t classCount = maxClassShift - minClassShift + 1;
+        static constexpr size_t headerLength = sizeof(Detail::PoolBlock);
+        static constexpr std::align_val_t blockAlignment{alignof(Detail::PoolBlock)};
+        /// 每个线程每个size class最多缓存的字节数(至少缓存minCachedBlocks块)
+        static constexpr size_t threadCacheBytes = 256 * 1024;
+        static constexpr uint32_t minCachedBlocks = 4;
+
+        MessagePool() {
+            for (auto &head : _global) {
+                head.store(nullptr, std::memory_order_relaxed);
+            }
+        }
+
+        ~MessagePool() {
+            {
+                std::lock_guard<std::mutex> lock(registryMutex());
+                for (ThreadCache *cache : _caches) {
+                    cache->drain();
+                }
+                _caches.clear();
+            }
+            trim();
+        }
+
+        MessagePool(const MessagePool&) = delete;
+        MessagePool& operator=(const MessagePool&) = delete;
+
+        /// 进程级别的默认pool
+        static MessagePool& shared() {
+            static MessagePool *pool = new MessagePool();
+            return *pool;
+        }
+
+        /// 分配至少byteLength字节，内容未初始化
+        PoolBuffer acquire(size_t byteLength) {
+            const uint32_t sizeClass = classOf(byteLength);
+            if (sizeClass == classCount) {
+                return PoolBuffer(newBlock(sizeClass, byteLength + headerLength));
+            }
+            Detail::PoolBlock *block = nullptr;
+            ThreadCache *cache = threadCache();
+            if (cache && !cache->owner.load(std::memory_order_relaxed)) {
+                adopt(cache);
+            }
+            if (cache && cache->owner.load(std::memory_order_relaxed) == this) {
+                ThreadCache::List &list = cache->lists[sizeClass];
+                if (!list.head) {
+                    refill(list, sizeClass);
+                }
+                block = list.head;
+                if (block) {
+                    list.head = block->next;
+                    list.count--;
+                }
+            } else {
+                // 当前线程缓存的是另一个pool(或线程正在退出)，直接使用全局链表
+                ThreadCache::List list;
+                refill(list, sizeClass);
+                block = list.head;
+                if (block && block->next) {
+                    pushGlobal(sizeClass, block->next, list.tail);
+                }
+            }
+            if (!block) {
+                return PoolBuffer(newBlock(sizeClass, blockLength(sizeClass)));
+            }
+            block->refs.store(1, std::memory_order_relaxed);
+            block->next = nullptr;
+            return PoolBuffer(block);
+        }
+
+        /// 分配并拷贝一段数据，比如从IPC收到的消息
+        PoolBuffer acquireCopy(const void *bytes, size_t byteLength) {
+            PoolBuffer buffer = acquire(byteLength);
+            std::memcpy(buffer.data(), bytes, byteLength);
+            return buffer;
+        }
+
+        /// 把全局空闲链表中的块归还系统，线程本地缓存不受影响
+        void trim() {
+            for (uint32_t i = 0; i < classCount; i++) {
+                Detail::PoolBlock *block = _global[i].exchange(nullptr, std::memory_order_acquire);
+                while (block) {
+                    Detail::PoolBlock *next = block->next;
+                    deleteBlock(block);
+                    block = next;
+                }
+            }
+        }
+
+        /// 向系统申请的次数，用于观察命中率
+        inline uint64_t systemAllocations() const {
+            return _systemAllocations.load(std::memory_order_relaxed);
+        }
+
+        static constexpr uint32_t classOf(size_t byteLength) {
+            const size_t total = byteLength + headerLength;
+            if (total > (size_t(1) << maxClassShift)) {
+                return classCount;
+            }
+            const uint32_t shift = static_cast<uint32_t>(std::bit_width(total - 1));
+            return shift <= minClassShift ? 0 : shift - minClassShift;
+        }
+
+        static constexpr size_t blockLength(uint32_t sizeClass) {
+            return size_t(1) << (sizeClass + minClassShift);
+        }
+
+    private:
+        friend class PoolBuffer;
+
+        struct ThreadCache {
+            struct List {
+                Detail::PoolBlock *head = nullptr;
+                Detail::PoolBlock *tail = nullptr;
+                uint32_t count = 0;
+            };
+
+            /// 只有所属线程设置，以及pool析构时在registryMutex下清空
+            std::atomic<MessagePool*> owner{nullptr};
+            List lists[classCount];
+
+            ~ThreadCache() {
+                flush();
+                destroyed() = true;
+            }
+
+            /// 线程退出: 缓存的块归还所属pool的全局链表
+            void flush() {
+                std::lock_guard<std::mutex> lock(registryMutex());
+                MessagePool *pool = owner.load(std::memory_order_relaxed);
+                if (!pool) {
+                    return;
+                }
+                for (uint32_t i = 0; i < classCount; i++) {
+                    if (lists[i].head) {
+                        pool->pushGlobal(i, lists[i].head, lists[i].tail);
+                    }
+                    lists[i] = List();
+                }
+                std::erase(pool->_caches, this);
+                owner.store(nullptr, std::memory_order_relaxed);
+            }
+
+            /// pool析构: 缓存的块直接归还系统，调用者持有registryMutex
+            void drain() {
+                for (List &list : lists) {
+                    Detail::PoolBlock *block = list.head;
+                    while (block) {
+                        Detail::PoolBlock *next = block->next;
+                        deleteBlock(block);
+                        block = next;
+                    }
+                    list = List();
+                }
+                owner.store(nullptr, std::memory_order_relaxed);
+            }
+        };
+
+        /// 保护各个pool的`_caches`和线程缓存的关联，只在线程第一次使用pool、线程退出和pool析构时加锁
+        static std::mutex& registryMutex() {
+            // 与shared()一样不析构，其他线程在静态对象析构之后退出时仍然可用
+            static std::mutex *mutex = new std::mutex();
+            return *mutex;
+        }
+
+        /// 当前线程开始缓存这个pool
+        void adopt(ThreadCache *cache) {
+            std::lock_guard<std::mutex> lock(registryMutex());
+            cache->owner.store(this, std::memory_order_relaxed);
+            _caches.push_back(cache);
+        }
+
+        /// 线程退出时本地缓存先于静态对象析构，此后的分配和释放只使用全局链表
+        static bool& destroyed() {
+            static thread_local bool value = false;
+            return value;
+        }
+
+        static ThreadCache* threadCache() {
+            if (destroyed()) {
+                return nullptr;
+            }
+            static thread_local ThreadCache cache;
+            return &cache;
+        }
+
+        static constexpr uint32_t cacheLimit(uint32_t sizeClass) {
+            const size_t count = threadCacheBytes / blockLength(sizeClass);
+            return count < minCachedBlocks ? minCachedBlocks : static_cast<uint32_t>(count);
+        }
+
+        void release(Detail::PoolBlock *block) {
+            const uint32_t sizeClass = block->sizeClass;
+            if (sizeClass == classCount) {
+                deleteBlock(block);
+                return;
+            }
+            ThreadCache *cache = threadCache();
+            if (!cache || cache->owner.load(std::memory_order_relaxed) != this) {
+                pushGlobal(sizeClass, block, block);
+                return;
+            }
+            ThreadCache::List &list = cache->lists[sizeClass];
+            block->next = list.head;
+            if (!list.head) {
+                list.tail = block;
+            }
+            list.head = block;
+            if (++list.count <= cacheLimit(sizeClass)) {
+                return;
+            }
+            // 保留前一半(最近释放的)，其余整条放回全局链表
+            Detail::PoolBlock *last = list.head;
+            for (uint32_t i = 1; i < list.count / 2; i++) {
+                last = last->next;
+            }
+            pushGlobal(sizeClass, last->next, list.tail);
+            last->next = nullptr;
+            list.tail = last;
+            list.count /= 2;
+        }
+
+        /// 把first..last整条链放到全局链表头部
+        void pushGlobal(uint32_t sizeClass, Detail::PoolBlock *first, Detail::PoolBlock *last) {
+            std::atomic<Detail::PoolBlock*> &head = _global[sizeClass];
+            Detail::PoolBlock *expected = head.load(std::memory_order_relaxed);
+            do {
+                last->next = expected;
+            } while (!head.compare_exchange_weak(expected, first, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        /// 一次取走全局链表中的全部块
+        void refill(ThreadCache::List &list, uint32_t sizeClass) {
+            Detail::PoolBlock *block = _global[sizeClass].exchange(nullptr, std::memory_order_acquire);
+            list.head = block;
+            list.count = 0;
+            while (block) {
+                list.tail = block;
+                list.count++;
+                block = block->next;
+            }
+        }
+
+        Detail::PoolBlock* newBlock(uint32_t sizeClass, size_t length) {
+            void *mem = ::operator new(length, blockAlignment);
+            _systemAllocations.fetch_add(1, std::memory_order_relaxed);
+            Detail::PoolBlock *block = new (mem) Detail::PoolBlock();
+            block->pool = this;
+            block->next = nullptr;
+            block->refs.store(1, std::memory_order_relaxed);
+            block->sizeClass = sizeClass;
+            block->byteLength = length - headerLength;
+            return block;
+        }
+
+        static void deleteBlock(Detail::PoolBlock *block) {
+            block->~PoolBlock();
+            ::operator delete(static_cast<void*>(block), blockAlignment);
+        }
+
+        std::atomic<Detail::PoolBlock*> _global[classCount];
+        std::atomic<uint64_t> _systemAllocations{0};
+        /// 缓存了这个pool的线程，由registryMutex保护
+        std::vector<ThreadCache*> _caches;
+    };
+
+    inline void PoolBuffer::reset() {
+        if (_block && _block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            _block->pool->release(_block);
+        }
+        _block = nullptr;
+    }
+
+    /**
+     * 持有池buffer的消息: 同时是T的view，buffer在最后一个持有者释放后回到pool。
+     * T为生成的struct类。
+     */
+    template <typename T>
+    class SharedMessage;
+
+    template <typename T>
+    class PooledMessage : public T {
+    public:
+        PooledMessage() = default;
+        explicit PooledMessage(PoolBuffer buffer, int32_t offset = RootOffset): T(buffer.data(), offset), _holder(std::move(buffer)) {}
+
+        inline const PoolBuffer& holder() const {
+            return _holder;
+        }
+
+        /// 转为只读共享的句柄，之后不能再通过这个消息修改buffer
+        inline SharedMessage<T> share() && {
+            const int32_t offset = this->offset();
+            return SharedMessage<T>(std::move(_holder), offset);
+        }
+
+    private:
+        PoolBuffer _holder;
+    };
+
+    /**
+     * 只读共享的消息句柄，用于把一个消息不拷贝地分发给多个线程的订阅者。
+     * 计数保存在buffer之前的块头(`PoolBlock`)中，拷贝句柄只做一次原子加，最后一个句柄释放后buffer回到pool。
+     *
+     * 只提供const的T，所有持有者都只能读取(通过getter取得的数组、map等view也不应写入)。
+     * 需要修改时调用`detach`写时拷贝，再交给`MessageBuilder(PoolBuffer)`。
+     */
+    template <typename T>
+    class SharedMessage {
+    public:
+        SharedMessage() = default;
+        explicit SharedMessage(PoolBuffer buffer, int32_t offset = RootOffset): _view(buffer.data(), offset), _holder(std::move(buffer)) {}
+
+        inline const T& operator*() const {
+            return _view;
+        }
+
+        inline const T* operator->() const {
+            return &_view;
+        }
+
+        inline const T& get() const {
+            return _view;
+        }
+
+        /// 整个消息(nextAvailableOffset之前)的字节，比如用于转发
+        inline std::span<const uint8_t> bytes() const {
+            if (!_holder) {
+                return {};
+            }
+            return std::span<const uint8_t>(_holder.data(), static_cast<size_t>(loadValue<int32_t>(_holder.data(), NextAvailableOffset)));
+        }
+
+        inline int32_t useCount() const {
+            return _holder.useCount();
+        }
+
+        inline const PoolBuffer& holder() const {
+            return _holder;
+        }
+
+        inline explicit operator bool() const {
+            return static_cast<bool>(_holder);
+        }
+
+        /**
+         * 写时拷贝: 唯一的句柄直接交出buffer，否则从同一个pool拷贝一份消息(只拷贝nextAvailableOffset之前的数据)。
+         * 之后这个句柄为空，其他句柄看到的消息不变。
+         */
+        PoolBuffer detach() && {
+            PoolBuffer buffer = std::move(_holder);
+            _view = T();
+            if (!buffer || buffer.unique()) {
+                return buffer;
+            }
+            const int32_t length = loadValue<int32_t>(buffer.data(), NextAvailableOffset);
+            return buffer.pool()->acquireCopy(buffer.data(), static_cast<size_t>(length));
+        }
+
+    private:
+        T _view;
+        PoolBuffer _holder;
+    };
+}
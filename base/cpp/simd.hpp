@@ -0,0 +1,337 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <span>
+#include <string_view>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define SMESSAGE_SIMD_SSE2 1
+#include <emmintrin.h>
+#endif
+
+/**
+ * 对MsgVector::getSpan()返回的连续数据做归约。
+ * x86上使用SSE2，先用标量处理到16字节对齐，然后使用对齐的load；其他平台使用多个累加器的标量循环，由编译器自动向量化。
+ */
+namespace SMessage::Simd
+{
+    template <typename T>
+    struct BBox2D {
+        T minX = std::numeric_limits<T>::infinity();
+        T minY = std::numeric_limits<T>::infinity();
+        T maxX = -std::numeric_limits<T>::infinity();
+        T maxY = -std::numeric_limits<T>::infinity();
+    };
+
+    namespace detail
+    {
+        template <typename T>
+        inline size_t unalignedHead(const T *data, size_t size) {
+            const size_t mis = reinterpret_cast<uintptr_t>(data) % 16;
+            if (mis == 0) {
+                return 0;
+            }
+            return std::min(size, (16 - mis) / sizeof(T));
+        }
+
+#ifdef SMESSAGE_SIMD_SSE2
+        inline float horizontalSum(__m128 v) {
+            __m128 shuf = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+            __m128 sums = _mm_add_ps(v, shuf);
+            shuf = _mm_movehl_ps(shuf, sums);
+            return _mm_cvtss_f32(_mm_add_ss(sums, shuf));
+        }
+
+        inline double horizontalSum(__m128d v) {
+            return _mm_cvtsd_f64(_mm_add_sd(v, _mm_unpackhi_pd(v, v)));
+        }
+
+        inline float horizontalMin(__m128 v) {
+            v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+            v = _mm_min_ps(v, _mm_movehl_ps(v, v));
+            return _mm_cvtss_f32(v);
+        }
+
+        inline double horizontalMin(__m128d v) {
+            return _mm_cvtsd_f64(_mm_min_sd(v, _mm_unpackhi_pd(v, v)));
+        }
+
+        inline float horizontalMax(__m128 v) {
+            v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+            v = _mm_max_ps(v, _mm_movehl_ps(v, v));
+            return _mm_cvtss_f32(v);
+        }
+
+        inline double horizontalMax(__m128d v) {
+            return _mm_cvtsd_f64(_mm_max_sd(v, _mm_unpackhi_pd(v, v)));
+        }
+#endif
+    } // namespace detail
+
+    inline float sum(std::span<const float> data) {
+        const float *p = data.data();
+        const size_t n = data.size();
+        size_t i = detail::unalignedHead(p, n);
+        float total = 0;
+        for (size_t h = 0; h < i; h++) {
+            total += p[h];
+        }
+#ifdef SMESSAGE_SIMD_SSE2
+        __m128 acc0 = _mm_setzero_ps();
+        __m128 acc1 = _mm_setzero_ps();
+        for (; i + 8 <= n; i += 8) {
+            acc0 = _mm_add_ps(acc0, _mm_load_ps(p + i));
+            acc1 = _mm_add_ps(acc1, _mm_load_ps(p + i + 4));
+        }
+        total += detail::horizontalSum(_mm_add_ps(acc0, acc1));
+#else
+        float acc[4] = { 0, 0, 0, 0 };
+        for (; i + 4 <= n; i += 4) {
+            acc[0] += p[i];
+            acc[1] += p[i + 1];
+            acc[2] += p[i + 2];
+            acc[3] += p[i + 3];
+        }
+        total += (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+        for (; i < n; i++) {
+            total += p[i];
+        }
+        return total;
+    }
+
+    inline double sum(std::span<const double> data) {
+        const double *p = data.data();
+        const size_t n = data.size();
+        size_t i = detail::unalignedHead(p, n);
+        double total = 0;
+        for (size_t h = 0; h < i; h++) {
+            total += p[h];
+        }
+#ifdef SMESSAGE_SIMD_SSE2
+        __m128d acc0 = _mm_setzero_pd();
+        __m128d acc1 = _mm_setzero_pd();
+        for (; i + 4 <= n; i += 4) {
+            acc0 = _mm_add_pd(acc0, _mm_load_pd(p + i));
+            acc1 = _mm_add_pd(acc1, _mm_load_pd(p + i + 2));
+        }
+        total += detail::horizontalSum(_mm_add_pd(acc0, acc1));
+#else
+        double acc[4] = { 0, 0, 0, 0 };
+        for (; i + 4 <= n; i += 4) {
+            acc[0] += p[i];
+            acc[1] += p[i + 1];
+            acc[2] += p[i + 2];
+            acc[3] += p[i + 3];
+        }
+        total += (acc[0] + acc[1]) + (acc[2] + acc[3]);
+#endif
+        for (; i < n; i++) {
+            total += p[i];
+        }
+        return total;
+    }
+
+    /// 空数组返回+inf
+    inline float min(std::span<const float> data) {
+        const float *p = data.data();
+        const size_t n = data.size();
+        size_t i = detail::unalignedHead(p, n);
+        float rst = std::numeric_limits<float>::infinity();
+        for (size_t h = 0; h < i; h++) {
+            rst = std::min(rst, p[h]);
+        }
+#ifdef SMESSAGE_SIMD_SSE2
+        __m128 acc = _mm_set1_ps(rst);
+        for (; i + 4 <= n; i += 4) {
+            acc = _mm_min_ps(acc, _mm_load_ps(p + i));
+        }
+        rst = detail::horizontalMin(acc);
+#endif
+        for (; i < n; i++) {
+            rst = std::min(rst, p[i]);
+        }
+        return rst;
+    }
+
+    inline double min(std::span<const double> data) {
+        const double *p = data.data();
+        const size_t n = data.size();
+        size_t i = detail::unalignedHead(p, n);
+        double rst = std::numeric_limits<double>::infinity();
+        for (size_t h = 0; h < i; h++) {
+            rst = std::min(rst, p[h]);
+        }
+#ifdef SMESSAGE_SIMD_SSE2
+        __m128d acc = _mm_set1_pd(rst);
+        for (; i + 2 <= n; i += 2) {
+            acc = _mm_min_pd(acc, _mm_load_pd(p + i));
+        }
+        rst = detail::horizontalMin(acc);
+#endif
+        for (; i < n; i++) {
+            rst = std::min(rst, p[i]);
+        }
+        return rst;
+    }
+
+    /// 空数组返回-inf
+    inline float max(std::span<const float> data) {
+        const float *p = data.data();
+        const size_t n = data.size();
+        size_t i = detail::unalignedHead(p, n);
+        float rst = -std::numeric_limits<float>::infinity();
+        for (size_t h = 0; h < i; h++) {
+            rst = std::max(rst, p[h]);
+        }
+#ifdef SMESSAGE_SIMD_SSE2
+        __m128 acc = _mm_set1_ps(rst);
+        for (; i + 4 <= n; i += 4) {
+            acc = _mm_max_ps(acc, _mm_load_ps(p + i));
+        }
+        rst = detail::horizontalMax(acc);
+#endif
+        for (; i < n; i++) {
+            rst = std::max(rst, p[i]);
+        }
+        return rst;
+    }
+
+    inline double max(std::span<const double> data) {
+        const double *p = data.data();
+        const size_t n = data.size();
+        size_t i = detail::unalignedHead(p, n);
+        double rst = -std::numeric_limits<double>::infinity();
+        for (size_t h = 0; h < i; h++) {
+            rst = std::max(rst, p[h]);
+        }
+#ifdef SMESSAGE_SIMD_SSE2
+        __m128d acc = _mm_set1_pd(rst);
+        for (; i + 2 <= n; i += 2) {
+            acc = _mm_max_pd(acc, _mm_load_pd(p + i));
+        }
+        rst = detail::horizontalMax(acc);
+#endif
+        for (; i < n; i++) {
+            rst = std::max(rst, p[i]);
+        }
+        return rst;
+    }
+
+    /**
+     * x,y交替存储的点(如`Point2D[]`的数据区)的包围盒，点的数据只保证8字节对齐，所以这里使用非对齐的load
+     * @param xy 长度为点数的2倍
+     */
+    inline BBox2D<double> bbox2D(std::span<const double> xy) {
+        BBox2D<double> box;
+        const double *p = xy.data();
+        const size_t n = xy.size() & ~static_cast<size_t>(1);
+        size_t i = 0;
+#ifdef SMESSAGE_SIMD_SSE2
+        {
+            __m128d lo = _mm_set1_pd(std::numeric_limits<double>::infinity());
+            __m128d hi = _mm_set1_pd(-std::numeric_limits<double>::infinity());
+            for (; i + 2 <= n; i += 2) {
+                const __m128d pt = _mm_loadu_pd(p + i);
+                lo = _mm_min_pd(lo, pt);
+                hi = _mm_max_pd(hi, pt);
+            }
+            box.minX = _mm_cvtsd_f64(lo);
+            box.minY = _mm_cvtsd_f64(_mm_unpackhi_pd(lo, lo));
+            box.maxX = _mm_cvtsd_f64(hi);
+            box.maxY = _mm_cvtsd_f64(_mm_unpackhi_pd(hi, hi));
+        }
+#endif
+        for (; i + 2 <= n; i += 2) {
+            box.minX = std::min(box.minX, p[i]);
+            box.maxX = std::max(box.maxX, p[i]);
+            box.minY = std::min(box.minY, p[i + 1]);
+            box.maxY = std::max(box.maxY, p[i + 1]);
+        }
+        return box;
+    }
+
+    inline BBox2D<float> bbox2D(std::span<const float> xy) {
+        BBox2D<float> box;
+        const float *p = xy.data();
+        const size_t n = xy.size() & ~static_cast<size_t>(1);
+        size_t i = 0;
+#ifdef SMESSAGE_SIMD_SSE2
+        {
+            __m128 lo = _mm_set1_ps(std::numeric_limits<float>::infinity());
+            __m128 hi = _mm_set1_ps(-std::numeric_limits<float>::infinity());
+            for (; i + 4 <= n; i += 4) {
+                const __m128 pts = _mm_loadu_ps(p + i);
+                lo = _mm_min_ps(lo, pts);
+                hi = _mm_max_ps(hi, pts);
+            }
+            // lanes: x0 y0 x1 y1
+            lo = _mm_min_ps(lo, _mm_movehl_ps(lo, lo));
+            hi = _mm_max_ps(hi, _mm_movehl_ps(hi, hi));
+            box.minX = _mm_cvtss_f32(lo);
+            box.minY = _mm_cvtss_f32(_mm_shuffle_ps(lo, lo, _MM_SHUFFLE(1, 1, 1, 1)));
+            box.maxX = _mm_cvtss_f32(hi);
+            box.maxY = _mm_cvtss_f32(_mm_shuffle_ps(hi, hi, _MM_SHUFFLE(1, 1, 1, 1)));
+        }
+#endif
+        for (; i + 2 <= n; i += 2) {
+            box.minX = std::min(box.minX, p[i]);
+            box.maxX = std::max(box.maxX, p[i]);
+            box.minY = std::min(box.minY, p[i + 1]);
+            box.maxY = std::max(box.maxY, p[i + 1]);
+        }
+        return box;
+    }
+
+    /**
+     * 按字节比较前n个字节，返回值同memcmp。以16字节为单位比较，只在找到不同的块后定位第一个不同的字节。
+     */
+    inline int compareBytes(const uint8_t *left, const uint8_t *right, size_t n) {
+        size_t i = 0;
+#ifdef SMESSAGE_SIMD_SSE2
+        for (; i + 16 <= n; i += 16) {
+            const __m128i l = _mm_loadu_si128(reinterpret_cast<const __m128i*>(left + i));
+            const __m128i r = _mm_loadu_si128(reinterpret_cast<const __m128i*>(right + i));
+            const unsigned neq = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(l, r))) ^ 0xFFFFu;
+            if (neq) {
+                const size_t pos = i + static_cast<size_t>(std::countr_zero(neq));
+                return static_cast<int>(left[pos]) - static_cast<int>(right[pos]);
+            }
+        }
+#endif
+        for (; i + 8 <= n; i += 8) {
+            uint64_t l;
+            uint64_t r;
+            std::memcpy(&l, left + i, 8);
+            std::memcpy(&r, right + i, 8);
+            if (l != r) {
+                const size_t pos = i + static_cast<size_t>(std::countr_zero(l ^ r)) / 8;
+                return static_cast<int>(left[pos]) - static_cast<int>(right[pos]);
+            }
+        }
+        for (; i < n; i++) {
+            if (left[i] != right[i]) {
+                return static_cast<int>(left[i]) - static_cast<int>(right[i]);
+            }
+        }
+        return 0;
+    }
+
+    /// 与TS中StructMap.compareString相同的顺序: 先按字节比较公共前缀，再按长度
+    inline int compareString(std::string_view left, std::string_view right) {
+        const size_t len = std::min(left.size(), right.size());
+        const int rst = compareBytes(reinterpret_cast<const uint8_t*>(left.data()), reinterpret_cast<const uint8_t*>(right.data()), len);
+        if (rst != 0) {
+            return rst;
+        }
+        if (left.size() == right.size()) {
+            return 0;
+        }
+        return left.size() < right.size() ? -1 : 1;
+    }
+
+} // namespace SMessage::Simd
@@ -0,0 +1,380 @@
+#pragma once
+
+#include <span>
+#include <type_traits>
+#include <unordered_set>
+#include <vector>
+
+#include "builder.hpp"
+
+namespace SMessage
+{
+    class MessageRelocator;
+
+    /**
+     * 改写一个值引用的子空间的地址，生成的struct通过`traceMembers`提供成员信息，辅助结构在下面特化。
+     * `hasOffsets`为false的类型(只有native成员的struct)不需要遍历，数组的元素因此可以整块跳过。
+     */
+    template <typename T, typename Enable = void>
+    struct RelocateTrace {
+        static void trace(MessageRelocator &relocator, int32_t offset) {
+            T::traceMembers(relocator, offset);
+        }
+
+        static bool hasOffsets() {
+            static const bool value = probe();
+            return value;
+        }
+
+    private:
+        struct Probe {
+            bool traced = false;
+
+            template <typename V>
+            void visit(int32_t) {
+                traced = traced || !IsNativeType<V>::value;
+            }
+
+            template <typename V>
+            void visitReference(int32_t) {
+                traced = true;
+            }
+        };
+
+        static bool probe() {
+            Probe probe;
+            T::traceMembers(probe, 0);
+            return probe.traced;
+        }
+    };
+
+    /**
+     * 把一段子空间整体移动`delta`之后，从一个值开始按schema遍历，给其中所有的地址加上`delta`。
+     * 0地址和inline字符串保持不变，被多处引用的struct只改写一次。与gc一样使用显式的任务栈。
+     *
+     * 移动的子空间从`from`开始，值本身不在其中(由调用者拷贝到`root`处)，
+     * 子空间中指向原位置(`from`之前)的引用改为指向`root`。
+     */
+    class MessageRelocator {
+    public:
+        MessageRelocator(uint8_t *buffer, int32_t delta, int32_t from, int32_t root): _buffer(buffer), _delta(delta), _from(from), _root(root) {}
+
+        /// 改写`offset`处的T及它引用的所有子空间
+        template <typename T>
+        void run(int32_t offset) {
+            visit<T>(offset);
+            while (!_tasks.empty()) {
+                const Task task = _tasks.back();
+                _tasks.pop_back();
+                task.trace(*this, task.offset);
+            }
+        }
+
+        template <typename T>
+        void visit(int32_t offset) {
+            if constexpr (!IsNativeType<T>::value) {
+                _tasks.push_back(Task{&RelocateTrace<T>::trace, offset});
+            }
+        }
+
+        template <typename T>
+        void visitReference(int32_t addrOffset) {
+            const int32_t addr = loadValue<int32_t>(_buffer, addrOffset);
+            if (!addr) {
+                return;
+            }
+            if (addr < _from) {
+                storeValue<int32_t>(_buffer, addrOffset, _root + addr - RootOffset);
+                return;
+            }
+            storeValue<int32_t>(_buffer, addrOffset, addr + _delta);
+            if (_visited.insert(visitKey(T::typeId, addr)).second) {
+                visit<T>(addr + _delta);
+            }
+        }
+
+        /// 改写`addrOffset`处的地址
+        /// @return 新地址，原来为0时返回0
+        inline int32_t shift(int32_t addrOffset) {
+            const int32_t addr = loadValue<int32_t>(_buffer, addrOffset);
+            if (!addr) {
+                return 0;
+            }
+            storeValue<int32_t>(_buffer, addrOffset, addr + _delta);
+            return addr + _delta;
+        }
+
+        inline uint8_t* data() const {
+            return _buffer;
+        }
+
+        inline int32_t delta() const {
+            return _delta;
+        }
+
+    private:
+        static inline uint64_t visitKey(int32_t typeId, int32_t addr) {
+            return (static_cast<uint64_t>(static_cast<uint32_t>(typeId)) << 32) | static_cast<uint32_t>(addr);
+        }
+
+        struct Task {
+            void (*trace)(MessageRelocator&, int32_t);
+            int32_t offset;
+        };
+
+        uint8_t *_buffer;
+        int32_t _delta;
+        int32_t _from;
+        int32_t _root;
+        std::vector<Task> _tasks;
+        std::unordered_set<uint64_t> _visited;
+    };
+
+    template <>
+    struct RelocateTrace<MsgString> {
+        static void trace(MessageRelocator &relocator, int32_t offset) {
+            MsgString str(relocator.data(), offset);
+            if (!str.isInline()) {
+                str.setOutOfLine(str.getDataOffset() + relocator.delta(), str.length(), str.capacity());
+            }
+        }
+
+        static constexpr bool hasOffsets() {
+            return true;
+        }
+    };
+
+    template <typename T>
+    struct RelocateTrace<MsgVector<T>> {
+        static void trace(MessageRelocator &relocator, int32_t offset) {
+            const int32_t dataOffset = relocator.shift(offset);
+            if constexpr (!IsNativeType<T>::value) {
+                if (dataOffset == 0 || !RelocateTrace<T>::hasOffsets()) {
+                    return;
+                }
+                const int32_t size = loadValue<int32_t>(relocator.data(), offset + 4);
+                for (int32_t i = 0; i < size; i++) {
+                    relocator.visit<T>(dataOffset + byteLengthOf<T>() * i);
+                }
+            }
+        }
+
+        static constexpr bool hasOffsets() {
+            return true;
+        }
+    };
+
+    /// `@soa`数组的元素只有native成员，只需要改写数据区的地址
+    template <typename T>
+    struct RelocateTrace<MsgSoaVector<T>> {
+        static void trace(MessageRelocator &relocator, int32_t offset) {
+            relocator.shift(offset);
+        }
+
+        static constexpr bool hasOffsets() {
+            return true;
+        }
+    };
+
+    template <typename K, typename V>
+    struct RelocateTrace<MsgMap<K, V>> {
+        static void trace(MessageRelocator &relocator, int32_t offset) {
+            using Map = MsgMap<K, V>;
+            const int32_t dataOffset = relocator.shift(offset + 8);
+            if (dataOffset == 0) {
+                return;
+            }
+            const int32_t size = loadValue<int32_t>(relocator.data(), offset);
+            for (int32_t i = 0; i < size; i++) {
+                relocator.visit<K>(dataOffset + Map::entryByte() * i);
+                relocator.visit<V>(dataOffset + Map::entryByte() * i + Map::keyByte());
+            }
+        }
+
+        static constexpr bool hasOffsets() {
+            return true;
+        }
+    };
+
+    template <typename... Ts>
+    struct RelocateTrace<MsgCombine<Ts...>> {
+        static void trace(MessageRelocator &relocator, int32_t offset) {
+            const uint8_t index = loadValue<uint8_t>(relocator.data(), offset);
+            uint8_t current = 0;
+            (traceCandidate<Ts>(relocator, offset, index, ++current), ...);
+        }
+
+        static constexpr bool hasOffsets() {
+            return true;
+        }
+
+    private:
+        template <typename V>
+        static void traceCandidate(MessageRelocator &relocator, int32_t offset, uint8_t index, uint8_t candidate) {
+            if (index != candidate) {
+                return;
+            }
+            if constexpr (byteLengthOf<V>() <= 4) {
+                relocator.visit<V>(offset + 4);
+            } else {
+                const int32_t addr = relocator.shift(offset + 4);
+                if (addr) {
+                    relocator.visit<V>(addr);
+                }
+            }
+        }
+    };
+
+    /**
+     * 线程私有的构建区: 在独立的`MessageBuilder`中构建一个T(数组、字符串、struct等)及它引用的子空间，
+     * 之后用`splice`/`spliceAppend`整体拷贝到父消息中，地址在拷贝时统一改写。
+     *
+     * T保存在root(12)处，通过`value()`取得，`builder()`用来分配子空间。多个线程可以各自构建一个arena，
+     * 拼接只做一次拷贝和一次地址改写，不需要重新构建。
+     */
+    template <typename T>
+    class MessageArena {
+    public:
+        explicit MessageArena(int32_t initialCapacity = MessageBuilder::defaultCapacity): _builder(initialCapacity) {
+            _builder.createSubBuffer(byteLengthOf<T>());
+        }
+
+        MessageArena(MessagePool &pool, int32_t initialCapacity = MessageBuilder::defaultCapacity): _builder(pool, initialCapacity) {
+            _builder.createSubBuffer(byteLengthOf<T>());
+        }
+
+        inline T value() const {
+            return _builder.template view<T>(RootOffset);
+        }
+
+        inline MessageBuilder& builder() {
+            return _builder;
+        }
+
+        inline const MessageBuilder& builder() const {
+            return _builder;
+        }
+
+        /// 子空间在arena中的起始位置
+        static constexpr int32_t dataOffset() {
+            return RootOffset + byteLengthOf<T>();
+        }
+
+        /// 子空间的长度(含trash)
+        inline int32_t dataLength() const {
+            return _builder.size() - dataOffset();
+        }
+
+    private:
+        MessageBuilder _builder;
+    };
+
+    namespace Detail
+    {
+        /// 消息内对齐要求最高为8(int64/float64数组和`@soa`数据区)，子空间移动8的整数倍后对齐不变
+        constexpr int32_t spliceAlignment = 8;
+
+        /// 从`at`开始放置一段在原buffer中从`from`开始的子空间需要的padding
+        inline int32_t splicePadding(int32_t at, int32_t from) {
+            return ((from - at) % spliceAlignment + spliceAlignment) % spliceAlignment;
+        }
+
+        /// 把arena的子空间拷贝到parent的`at`处(已经分配)，返回移动的距离
+        template <typename T>
+        int32_t copyArena(MessageBuilder &parent, int32_t at, const MessageArena<T> &arena) {
+            const int32_t base = at + splicePadding(at, arena.dataOffset());
+            std::memcpy(parent.data() + base, arena.builder().data() + arena.dataOffset(), static_cast<size_t>(arena.dataLength()));
+            return base - arena.dataOffset();
+        }
+    }
+
+    /**
+     * 把arena中构建的值写入parent的`offset`处(一个T大小的成员、元素或root)，它引用的子空间整块拷贝到parent末尾并改写地址。
+     * offset处原来的值引用的子空间不再可达，与直接覆盖成员一样不计入trash；arena中的trash计入parent。
+     * parent可能扩容，之后需要重新获取view。
+     */
+    template <typename T>
+    T splice(MessageBuilder &parent, int32_t offset, const MessageArena<T> &arena) {
+        const int32_t length = arena.dataLength();
+        int32_t delta = 0;
+        if (length > 0) {
+            const int32_t at = parent.nextAvailableOffset();
+            parent.createSubBuffer(Detail::splicePadding(at, arena.dataOffset()) + length);
+            delta = Detail::copyArena(parent, at, arena);
+        }
+        std::memcpy(parent.data() + offset, arena.builder().data() + RootOffset, static_cast<size_t>(byteLengthOf<T>()));
+        if (length > 0) {
+            MessageRelocator(parent.data(), delta, arena.dataOffset(), offset).template run<T>(offset);
+        }
+        parent.addTrash(arena.builder().trashLength());
+        return parent.template view<T>(offset);
+    }
+
+    /**
+     * 把各arena中构建的数组依次追加到parent的`vec`末尾，用于在多个线程中分块构建一个大数组(比如二维数组的行)。
+     * 数组一次扩容，所有arena的子空间一次分配，然后逐个拷贝并改写地址；元素拷贝到`vec`的数据区后，arena中的原数组计入trash。
+     * parent可能扩容，之后需要重新获取view。
+     */
+    template <typename T>
+    void spliceAppend(MessageBuilder &parent, const MsgVector<T> &vec, std::type_identity_t<std::span<const MessageArena<MsgVector<T>>>> arenas) {
+        const int32_t offset = vec.offset();
+        int32_t count = MsgVectorBase(parent.data(), offset).getSize();
+        int64_t total = count;
+        for (const auto &arena : arenas) {
+            total += arena.value().getSize();
+        }
+        if (total > std::numeric_limits<int32_t>::max() / byteLengthOf<T>()) {
+            throw std::bad_alloc();
+        }
+        if (total > count) {
+            parent.reserve(MsgVector<T>(parent.data(), offset), static_cast<int32_t>(total));
+        }
+
+        const int32_t start = parent.nextAvailableOffset();
+        int64_t end = start;
+        for (const auto &arena : arenas) {
+            if (arena.dataLength() == 0) {
+                continue;
+            }
+            end += Detail::splicePadding(static_cast<int32_t>(end % Detail::spliceAlignment), arena.dataOffset()) + arena.dataLength();
+        }
+        if (end > std::numeric_limits<int32_t>::max()) {
+            throw std::bad_alloc();
+        }
+        if (end > start) {
+            parent.createSubBuffer(static_cast<int32_t>(end - start));
+        }
+
+        int32_t at = start;
+        for (const auto &arena : arenas) {
+            if (arena.dataLength() == 0) {
+                continue;
+            }
+            const MsgVectorBase items(arena.builder().data(), RootOffset);
+            const int32_t size = items.getSize();
+            const int32_t delta = Detail::copyArena(parent, at, arena);
+            at += Detail::splicePadding(at, arena.dataOffset()) + arena.dataLength();
+            parent.addTrash(arena.builder().trashLength());
+            if (items.getStartOffset() == 0) {
+                continue;
+            }
+            parent.addTrash(items.getCapacity() * byteLengthOf<T>());
+            if (size == 0) {
+                continue;
+            }
+            const int32_t dataOffset = loadValue<int32_t>(parent.data(), offset) + byteLengthOf<T>() * count;
+            std::memcpy(parent.data() + dataOffset, parent.data() + items.getStartOffset() + delta, static_cast<size_t>(size * byteLengthOf<T>()));
+            if constexpr (!IsNativeType<T>::value) {
+                if (RelocateTrace<T>::hasOffsets()) {
+                    MessageRelocator relocator(parent.data(), delta, arena.dataOffset(), 0);
+                    for (int32_t i = 0; i < size; i++) {
+                        relocator.template run<T>(dataOffset + byteLengthOf<T>() * i);
+                    }
+                }
+            }
+            count += size;
+        }
+        storeValue<int32_t>(parent.data(), offset + 4, count);
+    }
+
+}
@@ -0,0 +1,527 @@
+#pragma once
+
+#ifdef __linux__
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <new>
+#include <span>
+#include <string>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "base.hpp"
+
+namespace SMessage
+{
+    /// SPSC时发布不需要CAS，MPSC时多个生产者通过CAS抢占位置，消费者始终只有一个
+    enum class RingMode : uint32_t {
+        SPSC = 1,
+        MPSC = 2,
+    };
+
+    /// 已预留的slot，可以直接在data中构建消息(比如用`MessageBuilder(std::span<uint8_t>)`)，然后`commit`
+    struct RingSlot {
+        uint8_t *data;
+        uint32_t capacity;
+        uint64_t position;
+    };
+
+    namespace Detail {
+        struct alignas(64) RingHeader {
+            uint32_t magic;
+            uint32_t version;
+            RingMode mode;
+            uint32_t slotCount;
+            uint32_t slotSize;
+            uint32_t slotStride;
+            alignas(64) std::atomic<uint64_t> head;
+            alignas(64) std::atomic<uint64_t> tail;
+            /// futex: 消费者等待数据
+            alignas(64) std::atomic<uint32_t> dataSignal;
+            std::atomic<uint32_t> dataWaiters;
+            /// futex: 生产者等待空间
+            alignas(64) std::atomic<uint32_t> spaceSignal;
+            std::atomic<uint32_t> spaceWaiters;
+        };
+
+        struct RingSlotHeader {
+            /// 位置p的slot: sequence == p 可写，p + 1 可读，读完后设为 p + slotCount
+            std::atomic<uint64_t> sequence;
+            uint32_t length;
+            uint32_t reserved;
+        };
+
+        static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free, "shared memory ring needs lock-free atomics.");
+        static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t), "futex word must be 32 bits.");
+
+        /// 共享映射上的futex，不能使用FUTEX_PRIVATE_FLAG
+        inline void futexWait(std::atomic<uint32_t> &word, uint32_t expected, const timespec *timeout) {
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAIT, expected, timeout, nullptr, 0);
+        }
+
+        inline void futexWake(std::atomic<uint32_t> &word) {
+            syscall(SYS_futex, reinterpret_cast<uint32_t*>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+    }
+
+    /**
+     * 进程间共享内存中的消息ring，每个slot保存一个完整的SMessage buffer(header + 12处的root)。
+     *
+     * 内存来自`memfd_create`(fd通过fork继承或SCM_RIGHTS传给另一个进程)或者命名的POSIX共享内存。
+     * 每个slot带一个sequence(Vyukov有界队列)，生产者之间只竞争head，消费者按顺序读取并释放slot。
+     * 消费者拿到的是指向共享内存的span，可以直接构造`BaseMessage<T>`读取，不需要拷贝。
+     * 空/满时通过映射中的futex等待，只有存在等待者时才会进入内核唤醒。
+     *
+     * 另一个进程可以随意修改映射的内容，ring的几何参数(slot数量、大小、间隔和模式)在创建或attach时复制到本地，
+     * 之后只使用本地的值；slot中记录的长度超过slotSize时视为损坏。
+     *
+     * 出错时抛出`std::system_error`。
+     */
+    class ShmRing {
+    public:
+        static constexpr uint32_t magic = 0x474E5253; // 'SRNG'
+        static constexpr uint32_t version = 1;
+
+        ShmRing(): _fd(-1), _header(nullptr), _slots(nullptr), _mappedLength(0), _slotCount(0), _slotSize(0), _slotStride(0), _mode(RingMode::SPSC) {}
+
+        ~ShmRing() {
+            close();
+        }
+
+        ShmRing(const ShmRing&) = delete;
+        ShmRing& operator=(const ShmRing&) = delete;
+
+        ShmRing(ShmRing &&other) noexcept: _fd(other._fd), _header(other._header), _slots(other._slots), _mappedLength(other._mappedLength),
+            _slotCount(other._slotCount), _slotSize(other._slotSize), _slotStride(other._slotStride), _mode(other._mode), _tail(other._tail) {
+            other._fd = -1;
+            other._header = nullptr;
+            other._slots = nullptr;
+            other._mappedLength = 0;
+        }
+
+        ShmRing& operator=(ShmRing &&other) noexcept {
+            if (this != &other) {
+                close();
+                std::swap(_fd, other._fd);
+                std::swap(_header, other._header);
+                std::swap(_slots, other._slots);
+                std::swap(_mappedLength, other._mappedLength);
+                std::swap(_slotCount, other._slotCount);
+                std::swap(_slotSize, other._slotSize);
+                std::swap(_slotStride, other._slotStride);
+                std::swap(_mode, other._mode);
+                std::swap(_tail, other._tail);
+            }
+            return *this;
+        }
+
+        /**
+         * 创建匿名(memfd)的ring
+         * @param slotCount 向上取整为2的幂
+         * @param slotSize 单个消息的最大长度
+         */
+        static ShmRing create(uint32_t slotCount, uint32_t slotSize, RingMode mode = RingMode::SPSC) {
+            const int fd = static_cast<int>(syscall(SYS_memfd_create, "smessage-ring", MFD_CLOEXEC));
+            if (fd < 0) {
+                throwErrno("memfd_create");
+            }
+            return initialize(fd, slotCount, slotSize, mode);
+        }
+
+        /// 创建命名的POSIX共享内存ring，`name`形如"/smessage-xxx"，已存在时失败
+        static ShmRing createNamed(const std::string &name, uint32_t slotCount, uint32_t slotSize, RingMode mode = RingMode::SPSC) {
+            const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+            if (fd < 0) {
+                throwErrno("shm_open");
+            }
+            return initialize(fd, slotCount, slotSize, mode);
+        }
+
+        static ShmRing openNamed(const std::string &name) {
+            const int fd = shm_open(name.c_str(), O_RDWR | O_CLOEXEC, 0600);
+            if (fd < 0) {
+                throwErrno("shm_open");
+            }
+            return attach(fd);
+        }
+
+        static void unlinkNamed(const std::string &name) {
+            shm_unlink(name.c_str());
+        }
+
+        /// 映射另一个进程创建的ring，接管fd
+        static ShmRing attach(int fd) {
+            ShmRing ring;
+            ring._fd = fd;
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                throwErrno("fstat");
+            }
+            if (static_cast<size_t>(st.st_size) < sizeof(Detail::RingHeader)) {
+                throw std::system_error(EINVAL, std::generic_category(), "ShmRing: not a ring");
+            }
+            ring.map(static_cast<size_t>(st.st_size));
+            // 只读取一次共享的header，检查的值与之后使用的值相同
+            const Detail::RingHeader *header = ring._header;
+            const uint32_t slotCount = header->slotCount;
+            const uint32_t slotSize = header->slotSize;
+            const uint32_t slotStride = header->slotStride;
+            const RingMode mode = header->mode;
+            if (header->magic != magic || header->version != version || !std::has_single_bit(slotCount) ||
+                mappingLength(slotCount, slotStride) != ring._mappedLength || slotStride < sizeof(Detail::RingSlotHeader) + static_cast<size_t>(slotSize) ||
+                slotStride % alignof(Detail::RingSlotHeader) != 0 || (mode != RingMode::SPSC && mode != RingMode::MPSC)) {
+                throw std::system_error(EINVAL, std::generic_category(), "ShmRing: not a ring");
+            }
+            ring.setGeometry(slotCount, slotSize, slotStride, mode);
+            return ring;
+        }
+
+        inline int fd() const {
+            return _fd;
+        }
+
+        inline uint32_t slotCount() const {
+            return _slotCount;
+        }
+
+        inline uint32_t slotSize() const {
+            return _slotSize;
+        }
+
+        inline RingMode mode() const {
+            return _mode;
+        }
+
+        /// 可读的消息数量(近似值)
+        inline uint64_t size() const {
+            return _header->head.load(std::memory_order_acquire) - _header->tail.load(std::memory_order_acquire);
+        }
+
+        /// 一次预留slots.size()个连续的slot，全部可用时才成功
+        bool tryReserve(std::span<RingSlot> slots) {
+            uint64_t pos;
+            if (!reserveRange(static_cast<uint32_t>(std::min<size_t>(slots.size(), UINT32_MAX)), pos)) {
+                return slots.empty();
+            }
+            for (size_t i = 0; i < slots.size(); i++) {
+                slots[i] = RingSlot{slotData(pos + i), _slotSize, pos + i};
+            }
+            return true;
+        }
+
+        inline bool tryReserve(RingSlot &slot) {
+            return tryReserve(std::span<RingSlot>(&slot, 1));
+        }
+
+        /// 发布已预留的slot，length为消息的实际长度
+        void commit(const RingSlot &slot, uint32_t length) {
+            Detail::RingSlotHeader *header = slotAt(slot.position);
+            header->length = length;
+            header->sequence.store(slot.position + 1, std::memory_order_release);
+            notify(_header->dataSignal, _header->dataWaiters);
+        }
+
+        /// 批量发布，只唤醒一次
+        void commit(std::span<const RingSlot> slots, std::span<const uint32_t> lengths) {
+            for (size_t i = 0; i < slots.size(); i++) {
+                Detail::RingSlotHeader *header = slotAt(slots[i].position);
+                header->length = lengths[i];
+                header->sequence.store(slots[i].position + 1, std::memory_order_release);
+            }
+            notify(_header->dataSignal, _header->dataWaiters);
+        }
+
+        /// 拷贝一个已经构建好的消息，ring已满时返回false
+        bool tryPublish(std::span<const uint8_t> message) {
+            checkLength(message.size());
+            RingSlot slot;
+            if (!tryReserve(slot)) {
+                return false;
+            }
+            std::memcpy(slot.data, message.data(), message.size());
+            commit(slot, static_cast<uint32_t>(message.size()));
+            return true;
+        }
+
+        /// 与tryPublish相同，已满时等待消费者释放空间，超时返回false
+        bool publish(std::span<const uint8_t> message, std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()) {
+            checkLength(message.size());
+            RingSlot slot;
+            if (!waitFor([&] { return tryReserve(slot); }, _header->spaceSignal, _header->spaceWaiters, timeout)) {
+                return false;
+            }
+            std::memcpy(slot.data, message.data(), message.size());
+            commit(slot, static_cast<uint32_t>(message.size()));
+            return true;
+        }
+
+        /// 批量发布，全部放入或全部不放入
+        bool tryPublishBatch(std::span<const std::span<const uint8_t>> messages) {
+            constexpr size_t chunk = 64;
+            for (const auto &message : messages) {
+                checkLength(message.size());
+            }
+            uint64_t pos;
+            if (messages.size() > _slotCount || !reserveRange(static_cast<uint32_t>(messages.size()), pos)) {
+                return messages.empty();
+            }
+            // 分段拷贝和发布，消费者可以更早开始处理
+            RingSlot slots[chunk];
+            uint32_t lengths[chunk];
+            for (size_t begin = 0; begin < messages.size(); begin += chunk) {
+                const size_t count = std::min(chunk, messages.size() - begin);
+                for (size_t i = 0; i < count; i++) {
+                    const std::span<const uint8_t> &message = messages[begin + i];
+                    slots[i] = RingSlot{slotData(pos + begin + i), _slotSize, pos + begin + i};
+                    std::memcpy(slots[i].data, message.data(), message.size());
+                    lengths[i] = static_cast<uint32_t>(message.size());
+                }
+                commit(std::span<const RingSlot>(slots, count), std::span<const uint32_t>(lengths, count));
+            }
+            return true;
+        }
+
+        /**
+         * 读取最多maxCount个已发布的消息，handler的参数是共享内存中的消息，只在调用期间有效。
+         * 全部处理完后一起释放slot并唤醒等待的生产者。
+         * 遇到长度超过slotSize的slot时释放之前处理过的slot，然后抛出EBADMSG，损坏的slot不会交给handler。
+         * @return 处理的消息数
+         */
+        template <typename Handler>
+        size_t consume(Handler &&handler, size_t maxCount = std::numeric_limits<size_t>::max()) {
+            const uint64_t start = _tail;
+            uint64_t pos = start;
+            bool corrupt = false;
+            while (pos - start < maxCount) {
+                Detail::RingSlotHeader *header = slotAt(pos);
+                if (header->sequence.load(std::memory_order_acquire) != pos + 1) {
+                    break;
+                }
+                const uint32_t length = header->length;
+                if (length > _slotSize) {
+                    corrupt = true;
+                    break;
+                }
+                handler(std::span<const uint8_t>(slotData(pos), length));
+                pos++;
+            }
+            if (pos != start) {
+                for (uint64_t p = start; p < pos; p++) {
+                    slotAt(p)->sequence.store(p + _slotCount, std::memory_order_release);
+                }
+                _tail = pos;
+                _header->tail.store(pos, std::memory_order_release);
+                notify(_header->spaceSignal, _header->spaceWaiters);
+            }
+            if (corrupt) {
+                throw std::system_error(EBADMSG, std::generic_category(), "ShmRing: corrupt slot length");
+            }
+            return static_cast<size_t>(pos - start);
+        }
+
+        /// 等待直到有可读的消息，超时返回false
+        bool wait(std::chrono::nanoseconds timeout = std::chrono::nanoseconds::max()) {
+            return waitFor([this] { return readable(); }, _header->dataSignal, _header->dataWaiters, timeout);
+        }
+
+        inline bool readable() const {
+            return slotAt(_tail)->sequence.load(std::memory_order_acquire) == _tail + 1;
+        }
+
+        void close() {
+            if (_header) {
+                munmap(_header, _mappedLength);
+                _header = nullptr;
+                _slots = nullptr;
+                _mappedLength = 0;
+            }
+            if (_fd >= 0) {
+                ::close(_fd);
+                _fd = -1;
+            }
+        }
+
+    private:
+        static constexpr uint32_t cacheLine = 64;
+
+        [[noreturn]] static void throwErrno(const char *what) {
+            throw std::system_error(errno, std::generic_category(), what);
+        }
+
+        static size_t mappingLength(uint32_t slotCount, uint32_t slotStride) {
+            return sizeof(Detail::RingHeader) + static_cast<size_t>(slotCount) * slotStride;
+        }
+
+        static ShmRing initialize(int fd, uint32_t slotCount, uint32_t slotSize, RingMode mode) {
+            ShmRing ring;
+            ring._fd = fd;
+            if (slotCount == 0 || slotCount > (1u << 30) || slotSize < static_cast<uint32_t>(RootOffset) || slotSize > (1u << 30)) {
+                throw std::system_error(EINVAL, std::generic_category(), "ShmRing: invalid size");
+            }
+            slotCount = std::bit_ceil(slotCount);
+            const uint32_t stride = (static_cast<uint32_t>(sizeof(Detail::RingSlotHeader)) + slotSize + cacheLine - 1) & ~(cacheLine - 1);
+            const size_t length = mappingLength(slotCount, stride);
+            if (ftruncate(fd, static_cast<off_t>(length)) != 0) {
+                throwErrno("ftruncate");
+            }
+            ring.map(length);
+            ring.setGeometry(slotCount, slotSize, stride, mode);
+            Detail::RingHeader *header = new (ring._header) Detail::RingHeader();
+            header->magic = magic;
+            header->version = version;
+            header->mode = mode;
+            header->slotCount = slotCount;
+            header->slotSize = slotSize;
+            header->slotStride = stride;
+            header->head.store(0, std::memory_order_relaxed);
+            header->tail.store(0, std::memory_order_relaxed);
+            header->dataSignal.store(0, std::memory_order_relaxed);
+            header->dataWaiters.store(0, std::memory_order_relaxed);
+            header->spaceSignal.store(0, std::memory_order_relaxed);
+            header->spaceWaiters.store(0, std::memory_order_relaxed);
+            for (uint32_t i = 0; i < slotCount; i++) {
+                Detail::RingSlotHeader *slot = new (ring._slots + static_cast<size_t>(i) * stride) Detail::RingSlotHeader();
+                slot->sequence.store(i, std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            return ring;
+        }
+
+        void map(size_t length) {
+            void *mem = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+            if (mem == MAP_FAILED) {
+                throwErrno("mmap");
+            }
+            _header = static_cast<Detail::RingHeader*>(mem);
+            _slots = static_cast<uint8_t*>(mem) + sizeof(Detail::RingHeader);
+            _mappedLength = length;
+        }
+
+        void setGeometry(uint32_t slotCount, uint32_t slotSize, uint32_t slotStride, RingMode mode) {
+            _slotCount = slotCount;
+            _slotSize = slotSize;
+            _slotStride = slotStride;
+            _mode = mode;
+            _tail = _header->tail.load(std::memory_order_acquire);
+        }
+
+        inline Detail::RingSlotHeader* slotAt(uint64_t position) const {
+            const size_t index = static_cast<size_t>(position & (_slotCount - 1));
+            return reinterpret_cast<Detail::RingSlotHeader*>(_slots + index * _slotStride);
+        }
+
+        inline uint8_t* slotData(uint64_t position) const {
+            return reinterpret_cast<uint8_t*>(slotAt(position) + 1);
+        }
+
+        inline void checkLength(size_t length) const {
+            if (length > _slotSize) {
+                throw std::system_error(EMSGSIZE, std::generic_category(), "ShmRing: message larger than slot");
+            }
+        }
+
+        /**
+         * 一次预留count个连续的位置，全部可用时才成功。
+         * 消费者按顺序释放slot，因此最后一个可写时前面的都可写。
+         */
+        bool reserveRange(uint32_t count, uint64_t &pos) {
+            if (count == 0 || count > _slotCount) {
+                return false;
+            }
+            pos = _header->head.load(std::memory_order_relaxed);
+            for (;;) {
+                const uint64_t last = pos + count - 1;
+                const uint64_t seq = slotAt(last)->sequence.load(std::memory_order_acquire);
+                const int64_t diff = static_cast<int64_t>(seq - last);
+                if (diff < 0) {
+                    return false; // 已满
+                }
+                if (diff > 0) {
+                    // 其他生产者已经占用了这个位置
+                    pos = _header->head.load(std::memory_order_relaxed);
+                    continue;
+                }
+                if (_mode == RingMode::SPSC) {
+                    _header->head.store(pos + count, std::memory_order_relaxed);
+                    return true;
+                }
+                if (_header->head.compare_exchange_weak(pos, pos + count, std::memory_order_relaxed)) {
+                    return true;
+                }
+            }
+        }
+
+        /// 只有存在等待者时才修改futex并进入内核
+        static void notify(std::atomic<uint32_t> &signal, std::atomic<uint32_t> &waiters) {
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (waiters.load(std::memory_order_relaxed)) {
+                signal.fetch_add(1, std::memory_order_release);
+                Detail::futexWake(signal);
+            }
+        }
+
+        template <typename Ready>
+        static bool waitFor(Ready &&ready, std::atomic<uint32_t> &signal, std::atomic<uint32_t> &waiters, std::chrono::nanoseconds timeout) {
+            if (ready()) {
+                return true;
+            }
+            const bool infinite = timeout == std::chrono::nanoseconds::max();
+            const auto deadline = infinite ? std::chrono::steady_clock::time_point::max() : std::chrono::steady_clock::now() + timeout;
+            for (;;) {
+                const uint32_t observed = signal.load(std::memory_order_acquire);
+                waiters.fetch_add(1, std::memory_order_seq_cst);
+                std::atomic_thread_fence(std::memory_order_seq_cst);
+                if (ready()) {
+                    waiters.fetch_sub(1, std::memory_order_relaxed);
+                    return true;
+                }
+                if (infinite) {
+                    Detail::futexWait(signal, observed, nullptr);
+                } else {
+                    const auto left = deadline - std::chrono::steady_clock::now();
+                    if (left <= std::chrono::nanoseconds::zero()) {
+                        waiters.fetch_sub(1, std::memory_order_relaxed);
+                        return ready();
+                    }
+                    const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(left).count();
+                    const timespec ts{static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000)};
+                    Detail::futexWait(signal, observed, &ts);
+                }
+                waiters.fetch_sub(1, std::memory_order_relaxed);
+                if (ready()) {
+                    return true;
+                }
+            }
+        }
+
+        int _fd;
+        Detail::RingHeader *_header;
+        uint8_t *_slots;
+        size_t _mappedLength;
+        /// 从共享的header复制的几何参数
+        uint32_t _slotCount;
+        uint32_t _slotSize;
+        uint32_t _slotStride;
+        RingMode _mode;
+        /// 消费者的读取位置，只由唯一的消费者修改，共享的tail只用于生产者判断和size()
+        uint64_t _tail = 0;
+    };
+}
+
+#endif
@@ -0,0 +1,281 @@
+#pragma once
+
+#include <limits>
+#include <unordered_set>
+#include <vector>
+
+#include "base.hpp"
+
+namespace SMessage
+{
+    class MessageVerifier;
+
+    /// 校验一个值引用的子空间，生成的struct通过`traceMembers`提供成员信息，辅助结构在下面特化
+    template <typename T, typename Enable = void>
+    struct VerifyTrace {
+        static void trace(MessageVerifier &verifier, int32_t offset) {
+            T::traceMembers(verifier, offset);
+        }
+    };
+
+    enum class VerifyError : uint8_t {
+        None,
+        /// 长度不足或mainTypeId/nextAvailableOffset不正确
+        Header,
+        /// 引用的struct超出buffer
+        Reference,
+        String,
+        Vector,
+        Map,
+        /// combine的index超出候选类型，或者值的地址不正确
+        Combine,
+        /// 嵌套超过maxDepth
+        Depth,
+        /// 子空间的总长度超过buffer，说明有重叠的数据(构造出来的buffer)
+        Budget,
+    };
+
+    struct VerifyResult {
+        VerifyError error;
+        /// 出错的值在buffer中的位置
+        int32_t offset;
+
+        inline explicit operator bool() const {
+            return error == VerifyError::None;
+        }
+    };
+
+    /**
+     * 按schema一次遍历校验来自不可信来源的buffer，通过后所有accessor都可以不做任何检查直接读取，builder也可以直接修改。
+     * 检查每个引用、字符串和数组的整个capacity、map以及combine的index都在buffer之内，native数组按元素大小对齐。
+     *
+     * 被多处引用的struct只校验一次，引用形成的环也因此终止；子空间的总长度不能超过buffer，
+     * 所以校验的耗时与buffer长度成线性。`maxDepth`限制嵌套层数(比如RecuTest的引用链)。
+     * 与gc一样使用显式的任务栈，不会因为嵌套过深而栈溢出。
+     */
+    class MessageVerifier {
+    public:
+        static constexpr int32_t defaultMaxDepth = 64;
+
+        explicit MessageVerifier(int32_t maxDepth = defaultMaxDepth): _maxDepth(maxDepth) {}
+
+        template <typename Root>
+        VerifyResult verify(const void *buf, size_t length) {
+            _buffer = static_cast<const uint8_t*>(buf);
+            _tasks.clear();
+            _visited.clear();
+            _result = VerifyResult{VerifyError::None, 0};
+            _depth = 0;
+            if (length < static_cast<size_t>(RootOffset + Root::byteLength) || loadValue<int32_t>(_buffer, MainTypeIdOffset) != Root::typeId) {
+                return VerifyResult{VerifyError::Header, 0};
+            }
+            _end = loadValue<int32_t>(_buffer, NextAvailableOffset);
+            if (_end < RootOffset + Root::byteLength || static_cast<size_t>(_end) > length) {
+                return VerifyResult{VerifyError::Header, NextAvailableOffset};
+            }
+            _budget = _end;
+            _visited.insert(visitKey(Root::typeId, RootOffset));
+            visit<Root>(RootOffset);
+            while (!_tasks.empty() && ok()) {
+                const Task task = _tasks.back();
+                _tasks.pop_back();
+                _depth = task.depth;
+                task.trace(*this, task.offset);
+            }
+            return _result;
+        }
+
+        /// `offset`处的T已经在合法范围内，稍后检查它引用的子空间
+        template <typename T>
+        void visit(int32_t offset) {
+            if constexpr (!IsNativeType<T>::value) {
+                if (_depth >= _maxDepth) {
+                    fail(VerifyError::Depth, offset);
+                    return;
+                }
+                _tasks.push_back(Task{&VerifyTrace<T>::trace, offset, _depth + 1});
+            }
+        }
+
+        /// 引用类型成员: 地址为0或者指向buffer内的一个T
+        template <typename T>
+        void visitReference(int32_t addrOffset) {
+            const int32_t addr = loadValue<int32_t>(_buffer, addrOffset);
+            if (!addr || !_visited.insert(visitKey(T::typeId, addr)).second) {
+                return;
+            }
+            if (claim(addr, T::byteLength, VerifyError::Reference)) {
+                visit<T>(addr);
+            }
+        }
+
+        /**
+         * 检查[offset, offset + length)在root之后、nextAvailableOffset之前，并计入子空间总长度
+         * @return false 已经记录了错误
+         */
+        bool claim(int32_t offset, int64_t length, VerifyError error) {
+            if (offset < RootOffset || length < 0 || length > static_cast<int64_t>(_end) - offset) {
+                fail(error, offset);
+                return false;
+            }
+            _budget -= length;
+            if (_budget < 0) {
+                fail(VerifyError::Budget, offset);
+                return false;
+            }
+            return true;
+        }
+
+        inline void fail(VerifyError error, int32_t offset) {
+            if (ok()) {
+                _result = VerifyResult{error, offset};
+            }
+        }
+
+        inline bool ok() const {
+            return _result.error == VerifyError::None;
+        }
+
+        inline const uint8_t* data() const {
+            return _buffer;
+        }
+
+    private:
+        /// 同一地址可能被解释为不同的类型，按(typeId, addr)去重
+        static inline uint64_t visitKey(int32_t typeId, int32_t addr) {
+            return (static_cast<uint64_t>(static_cast<uint32_t>(typeId)) << 32) | static_cast<uint32_t>(addr);
+        }
+
+        struct Task {
+            void (*trace)(MessageVerifier&, int32_t);
+            int32_t offset;
+            int32_t depth;
+        };
+
+        const uint8_t *_buffer = nullptr;
+        int32_t _end = 0;
+        int64_t _budget = 0;
+        int32_t _maxDepth;
+        int32_t _depth = 0;
+        VerifyResult _result{VerifyError::None, 0};
+        std::vector<Task> _tasks;
+        std::unordered_set<uint64_t> _visited;
+    };
+
+    template <>
+    struct VerifyTrace<MsgString> {
+        static void trace(MessageVerifier &verifier, int32_t offset) {
+            const MsgString str(const_cast<uint8_t*>(verifier.data()), offset);
+            if (str.isInline()) {
+                if (str.length() > MsgString::maxInlineLength) {
+                    verifier.fail(VerifyError::String, offset);
+                }
+                return;
+            }
+            // 原地写入较长的字符串时使用整个capacity
+            const int32_t len = str.length();
+            const int32_t capacity = str.capacity();
+            if (len < 0 || capacity < len) {
+                verifier.fail(VerifyError::String, offset);
+                return;
+            }
+            verifier.claim(str.getDataOffset(), capacity, VerifyError::String);
+        }
+    };
+
+    /// builder在capacity之内原地追加，所以检查整个capacity；native数组的span要求数据区按元素对齐
+    template <typename T>
+    struct VerifyTrace<MsgVector<T>> {
+        static void trace(MessageVerifier &verifier, int32_t offset) {
+            const int32_t dataOffset = loadValue<int32_t>(verifier.data(), offset);
+            const int32_t size = loadValue<int32_t>(verifier.data(), offset + 4);
+            const int32_t capacity = loadValue<int32_t>(verifier.data(), offset + 8);
+            if (size == 0 && capacity == 0) {
+                return;
+            }
+            if (size < 0 || capacity < size || (IsNativeType<T>::value && dataOffset % itemAlignment<T>() != 0)
+                || !verifier.claim(dataOffset, static_cast<int64_t>(capacity) * byteLengthOf<T>(), VerifyError::Vector)) {
+                verifier.fail(VerifyError::Vector, offset);
+                return;
+            }
+            if constexpr (!IsNativeType<T>::value) {
+                for (int32_t i = 0; i < size; i++) {
+                    verifier.visit<T>(dataOffset + byteLengthOf<T>() * i);
+                }
+            }
+        }
+    };
+
+    /// `@soa`数组: 数据区是整个capacity，capacity为不小于size的偶数且数据区按8对齐，各列的span才是对齐的
+    template <typename T>
+    struct VerifyTrace<MsgSoaVector<T>> {
+        static void trace(MessageVerifier &verifier, int32_t offset) {
+            const int32_t dataOffset = loadValue<int32_t>(verifier.data(), offset);
+            const int32_t size = loadValue<int32_t>(verifier.data(), offset + 4);
+            const int32_t capacity = loadValue<int32_t>(verifier.data(), offset + 8);
+            if (size == 0 && capacity == 0) {
+                return;
+            }
+            if (size < 0 || capacity < size || capacity % 2 != 0 || dataOffset % MsgSoaVectorBase::dataAlignment != 0
+                || !verifier.claim(dataOffset, static_cast<int64_t>(capacity) * T::byteLength, VerifyError::Vector)) {
+                verifier.fail(VerifyError::Vector, offset);
+            }
+        }
+    };
+
+    template <typename K, typename V>
+    struct VerifyTrace<MsgMap<K, V>> {
+        static void trace(MessageVerifier &verifier, int32_t offset) {
+            using Map = MsgMap<K, V>;
+            const int32_t size = loadValue<int32_t>(verifier.data(), offset);
+            const int32_t dataOffset = loadValue<int32_t>(verifier.data(), offset + 8);
+            if (size == 0) {
+                return;
+            }
+            if (size < 0 || !verifier.claim(dataOffset, static_cast<int64_t>(size) * Map::entryByte(), VerifyError::Map)) {
+                verifier.fail(VerifyError::Map, offset);
+                return;
+            }
+            for (int32_t i = 0; i < size; i++) {
+                verifier.visit<K>(dataOffset + Map::entryByte() * i);
+                verifier.visit<V>(dataOffset + Map::entryByte() * i + Map::keyByte());
+            }
+        }
+    };
+
+    template <typename... Ts>
+    struct VerifyTrace<MsgCombine<Ts...>> {
+        static void trace(MessageVerifier &verifier, int32_t offset) {
+            const uint8_t index = loadValue<uint8_t>(verifier.data(), offset);
+            if (index > sizeof...(Ts)) {
+                verifier.fail(VerifyError::Combine, offset);
+                return;
+            }
+            uint8_t current = 0;
+            (traceCandidate<Ts>(verifier, offset, index, ++current), ...);
+        }
+
+    private:
+        template <typename V>
+        static void traceCandidate(MessageVerifier &verifier, int32_t offset, uint8_t index, uint8_t candidate) {
+            if (index != candidate) {
+                return;
+            }
+            if constexpr (byteLengthOf<V>() <= 4) {
+                verifier.visit<V>(offset + 4);
+            } else {
+                const int32_t addr = loadValue<int32_t>(verifier.data(), offset + 4);
+                if (verifier.claim(addr, byteLengthOf<V>(), VerifyError::Combine)) {
+                    verifier.visit<V>(addr);
+                }
+            }
+        }
+    };
+
+    /// 校验buffer是否是一个合法的Root消息
+    template <typename Root>
+    inline VerifyResult verifyMessage(const void *buf, size_t length, int32_t maxDepth = MessageVerifier::defaultMaxDepth) {
+        MessageVerifier verifier(maxDepth);
+        return verifier.template verify<Root>(buf, length);
+    }
+}
@@ -0,0 +1,759 @@
+#pragma once
+
+#include <algorithm>
+#include <limits>
+#include <span>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "builder.hpp"
+
+namespace SMessage
+{
+    class WireEncoder;
+    class WireDecoder;
+
+    /**
+     * 一个值在紧凑格式中的编码，生成的struct通过`wireMembers`按声明顺序列出所有成员，辅助结构在下面特化。
+     * struct: 成员存在位图(每字节7位，最高位表示后面还有)，之后依次是不为默认值的成员。
+     */
+    template <typename T, typename Enable = void>
+    struct WireTrace {
+        static void encode(WireEncoder &encoder, int32_t offset);
+        static void decode(WireDecoder &decoder, int32_t offset);
+        /// 所有成员都是默认值
+        static bool isDefault(const uint8_t *buf, int32_t offset);
+    };
+
+    /// native类型在紧凑格式中按这个类型编码: enum使用底层类型，bool按字节原样保存
+    template <typename T, typename Enable = void>
+    struct WireNativeType {
+        using type = T;
+    };
+
+    template <typename T>
+    struct WireNativeType<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+        using type = typename std::underlying_type<T>::type;
+    };
+
+    template <>
+    struct WireNativeType<bool> {
+        using type = uint8_t;
+    };
+
+    /// 1字节的整数和浮点数按小端原样保存，其余整数使用varint(有符号的先zigzag)
+    template <typename T>
+    constexpr bool isWireRaw() {
+        using V = typename WireNativeType<T>::type;
+        return std::is_floating_point<V>::value || sizeof(V) == 1;
+    }
+
+    /**
+     * 默认值: native的字节全为0，字符串、数组和map为空，combine为undefined，引用为null，struct的成员都是默认值。
+     * 默认值解码后的字节全为0，所以重新编码得到相同的字节。
+     */
+    template <typename T>
+    inline bool isWireDefault(const uint8_t *buf, int32_t offset) {
+        if constexpr (IsNativeType<T>::value) {
+            return std::all_of(buf + offset, buf + offset + sizeof(T), [](uint8_t byte) { return byte == 0; });
+        } else if constexpr (std::is_same<T, MsgString>::value) {
+            return MsgString(const_cast<uint8_t*>(buf), offset).length() == 0;
+        } else {
+            return WireTrace<T>::isDefault(buf, offset);
+        }
+    }
+
+    /**
+     * 把消息编码为跨进程传输和持久化使用的紧凑格式: `| varint mainTypeId | root |`。
+     * 整数使用varint/zigzag，省略默认值的成员，不保存数组和字符串多余的capacity以及trash，
+     * 与内存布局(对齐、offset)无关，只取决于值和成员的声明顺序。
+     *
+     * 被多处引用的struct只编码一次，之后的引用编码为它的序号，共享和环在解码后保持不变。
+     * 与TS的`StructWireEncoder`产生相同的字节。使用显式的任务栈，编码和解码按相同的顺序处理子值:
+     * 一个值的子值按声明顺序深度优先处理，与gc相同，所以解码时`@flat`二维数组的各行按行顺序连续分配。
+     */
+    class WireEncoder {
+    public:
+        using EncodeFn = void (*)(WireEncoder&, int32_t);
+
+        /**
+         * 编码后追加到`out`，可以在同一个buffer中连续写入多个消息
+         * @return false buffer不是Root消息
+         */
+        template <typename Root>
+        bool encode(const void *buf, std::vector<uint8_t> &out) {
+            _buffer = static_cast<const uint8_t*>(buf);
+            if (loadValue<int32_t>(_buffer, MainTypeIdOffset) != Root::typeId) {
+                return false;
+            }
+            _out = &out;
+            _tasks.clear();
+            _ordinals.clear();
+            _ordinals.emplace(refKey(Root::typeId, RootOffset), 0);
+            writeVarint(static_cast<uint32_t>(Root::typeId));
+            _tasks.push_back(Task{&WireTrace<Root>::encode, RootOffset});
+            while (!_tasks.empty()) {
+                const Task task = _tasks.back();
+                _tasks.pop_back();
+                const size_t pushed = _tasks.size();
+                task.encode(*this, task.offset);
+                std::reverse(_tasks.begin() + static_cast<std::ptrdiff_t>(pushed), _tasks.end());
+            }
+            _out = nullptr;
+            return true;
+        }
+
+        /// 编码`offset`处的T: native和字符串立即写入，其余稍后处理
+        template <typename T>
+        static void value(WireEncoder &encoder, int32_t offset) {
+            if constexpr (IsNativeType<T>::value) {
+                encoder.native<T>(loadValue<typename WireNativeType<T>::type>(encoder._buffer, offset));
+            } else if constexpr (std::is_same<T, MsgString>::value) {
+                const std::string_view str = MsgString(const_cast<uint8_t*>(encoder._buffer), offset).getStringView();
+                encoder.writeVarint(str.size());
+                encoder.write(str.data(), str.size());
+            } else {
+                encoder._tasks.push_back(Task{&WireTrace<T>::encode, offset});
+            }
+        }
+
+        /// 引用类型成员(地址不为0): 第一次出现时为0，之后为1 + 序号
+        template <typename T>
+        static void reference(WireEncoder &encoder, int32_t addrOffset) {
+            const int32_t addr = loadValue<int32_t>(encoder._buffer, addrOffset);
+            const auto [found, inserted] = encoder._ordinals.emplace(refKey(T::typeId, addr), encoder._ordinals.size());
+            if (!inserted) {
+                encoder.writeVarint(found->second + 1);
+                return;
+            }
+            encoder.writeVarint(0);
+            encoder._tasks.push_back(Task{&WireTrace<T>::encode, addr});
+        }
+
+        template <typename T>
+        void native(typename WireNativeType<T>::type value) {
+            using V = typename WireNativeType<T>::type;
+            if constexpr (isWireRaw<T>()) {
+                write(&value, sizeof(V));
+            } else if constexpr (std::is_signed<V>::value) {
+                using U = typename std::make_unsigned<V>::type;
+                writeVarint(static_cast<uint64_t>(static_cast<U>((static_cast<U>(value) << 1) ^ static_cast<U>(value >> (sizeof(V) * 8 - 1)))));
+            } else {
+                writeVarint(static_cast<uint64_t>(value));
+            }
+        }
+
+        inline void writeVarint(uint64_t value) {
+            while (value >= 0x80) {
+                _out->push_back(static_cast<uint8_t>(value | 0x80));
+                value >>= 7;
+            }
+            _out->push_back(static_cast<uint8_t>(value));
+        }
+
+        inline void writeByte(uint8_t byte) {
+            _out->push_back(byte);
+        }
+
+        inline void write(const void *src, size_t length) {
+            const uint8_t *bytes = static_cast<const uint8_t*>(src);
+            _out->insert(_out->end(), bytes, bytes + length);
+        }
+
+        inline const uint8_t* data() const {
+            return _buffer;
+        }
+
+        inline std::vector<uint8_t>& out() {
+            return *_out;
+        }
+
+    private:
+        struct Task {
+            EncodeFn encode;
+            int32_t offset;
+        };
+
+        static inline uint64_t refKey(int32_t typeId, int32_t addr) {
+            return (static_cast<uint64_t>(static_cast<uint32_t>(typeId)) << 32) | static_cast<uint32_t>(addr);
+        }
+
+        const uint8_t *_buffer = nullptr;
+        std::vector<uint8_t> *_out = nullptr;
+        std::vector<Task> _tasks;
+        /// 已经编码的被引用struct`(typeId, 地址)` -> 序号，root为0
+        std::unordered_map<uint64_t, size_t> _ordinals;
+    };
+
+    /**
+     * 把紧凑格式解码为内存布局，在一次顺序读取中直接构建到`MessageBuilder`。
+     * 输入来自不可信来源时同样安全: 所有读取都检查长度，数量不能超过剩余的字节，
+     * 引用序号、combine的index和varint的范围都会检查，输入必须恰好用完。
+     * 默认值的struct只占1字节却要分配完整的空间，所以解码后的消息不能超过`maxDecodedBytes`。
+     */
+    class WireDecoder {
+    public:
+        using DecodeFn = void (*)(WireDecoder&, int32_t);
+
+        static constexpr int32_t defaultMaxDecodedBytes = 64 << 20;
+
+        explicit WireDecoder(int32_t maxDecodedBytes = defaultMaxDecodedBytes): _maxDecodedBytes(maxDecodedBytes) {}
+
+        /**
+         * @param builder 清空后写入解码的消息，没有trash，数组和字符串的capacity等于长度
+         * @return false 输入不是Root消息、已损坏或者解码后超过maxDecodedBytes
+         */
+        template <typename Root>
+        bool decode(std::span<const uint8_t> wire, MessageBuilder &builder) {
+            _input = wire.data();
+            _pos = 0;
+            _size = wire.size();
+            _builder = &builder;
+            _ok = true;
+            _tasks.clear();
+            _refs.clear();
+            if (readVarint() != static_cast<uint32_t>(Root::typeId) || !_ok) {
+                return false;
+            }
+            builder.createRoot<Root>();
+            if (builder.nextAvailableOffset() > _maxDecodedBytes) {
+                return false;
+            }
+            _refs.emplace_back(Root::typeId, RootOffset);
+            _tasks.push_back(Task{&WireTrace<Root>::decode, RootOffset});
+            while (!_tasks.empty() && _ok) {
+                const Task task = _tasks.back();
+                _tasks.pop_back();
+                const size_t pushed = _tasks.size();
+                task.decode(*this, task.offset);
+                std::reverse(_tasks.begin() + static_cast<std::ptrdiff_t>(pushed), _tasks.end());
+            }
+            return _ok && _pos == _size;
+        }
+
+        /// 解码到`offset`处的T，与`WireEncoder::value`的顺序相同
+        template <typename T>
+        static void value(WireDecoder &decoder, int32_t offset) {
+            if constexpr (IsNativeType<T>::value) {
+                using V = typename WireNativeType<T>::type;
+                const V native = decoder.native<T>();
+                storeValue<V>(decoder.data(), offset, native);
+            } else if constexpr (std::is_same<T, MsgString>::value) {
+                const uint64_t length = decoder.readVarint();
+                const uint8_t *bytes = decoder.read(length);
+                if (bytes && length > static_cast<uint64_t>(MsgString::maxInlineLength) && !decoder.fits(static_cast<int64_t>(length), 1)) {
+                    return;
+                }
+                if (bytes) {
+                    decoder._builder->setString(MsgString(decoder.data(), offset), std::string_view(reinterpret_cast<const char*>(bytes), static_cast<size_t>(length)));
+                }
+            } else {
+                decoder._tasks.push_back(Task{&WireTrace<T>::decode, offset});
+            }
+        }
+
+        template <typename T>
+        static void reference(WireDecoder &decoder, int32_t addrOffset) {
+            const uint64_t tag = decoder.readVarint();
+            if (!decoder._ok) {
+                return;
+            }
+            if (tag == 0) {
+                const int32_t addr = decoder.allocate(1, T::byteLength, itemAlignment<T>());
+                if (!decoder._ok) {
+                    return;
+                }
+                storeValue<int32_t>(decoder.data(), addrOffset, addr);
+                decoder._refs.emplace_back(T::typeId, addr);
+                decoder._tasks.push_back(Task{&WireTrace<T>::decode, addr});
+                return;
+            }
+            if (tag > decoder._refs.size() || decoder._refs[static_cast<size_t>(tag - 1)].first != T::typeId) {
+                decoder.fail();
+                return;
+            }
+            storeValue<int32_t>(decoder.data(), addrOffset, decoder._refs[static_cast<size_t>(tag - 1)].second);
+        }
+
+        template <typename T>
+        typename WireNativeType<T>::type native() {
+            using V = typename WireNativeType<T>::type;
+            if constexpr (isWireRaw<T>()) {
+                const uint8_t *bytes = read(sizeof(V));
+                return bytes ? loadValue<V>(bytes, 0) : V();
+            } else {
+                using U = typename std::make_unsigned<V>::type;
+                const uint64_t raw = readVarint();
+                if (raw > std::numeric_limits<U>::max()) {
+                    fail();
+                    return V();
+                }
+                const U value = static_cast<U>(raw);
+                if constexpr (std::is_signed<V>::value) {
+                    return static_cast<V>(static_cast<U>(value >> 1) ^ static_cast<U>(0 - (value & 1)));
+                } else {
+                    return value;
+                }
+            }
+        }
+
+        uint64_t readVarint() {
+            uint64_t value = 0;
+            for (int32_t shift = 0; shift < 64; shift += 7) {
+                if (_pos >= _size) {
+                    break;
+                }
+                const uint8_t byte = _input[_pos++];
+                // 第10个字节只能提供最高的1位
+                if (shift == 63 && byte > 1) {
+                    break;
+                }
+                value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+                if (!(byte & 0x80)) {
+                    return value;
+                }
+            }
+            fail();
+            return 0;
+        }
+
+        /// 读取一个数量，每个元素至少占1字节，所以不能超过剩余的输入
+        int32_t readCount() {
+            const uint64_t count = readVarint();
+            if (count > _size - _pos) {
+                fail();
+                return 0;
+            }
+            return static_cast<int32_t>(count);
+        }
+
+        inline uint8_t readByte() {
+            const uint8_t *byte = read(1);
+            return byte ? *byte : 0;
+        }
+
+        /// @return 输入中length字节的起始位置，不足时为nullptr
+        const uint8_t* read(uint64_t length) {
+            if (length > _size - _pos) {
+                fail();
+                return nullptr;
+            }
+            const uint8_t *bytes = _input + _pos;
+            _pos += static_cast<size_t>(length);
+            return bytes;
+        }
+
+        /**
+         * 分配count个itemBytes大小的清零空间
+         * @return 0 超出maxDecodedBytes
+         */
+        int32_t allocate(int32_t count, int32_t itemBytes, int32_t alignment = 1) {
+            const int64_t length = static_cast<int64_t>(count) * itemBytes;
+            if (!fits(length, alignment)) {
+                return 0;
+            }
+            return _builder->createSubBuffer(static_cast<int32_t>(length), alignment);
+        }
+
+        /// 按alignment对齐再分配length字节后不超过maxDecodedBytes，否则解码失败
+        bool fits(int64_t length, int32_t alignment) {
+            const int64_t end = _builder->nextAvailableOffset();
+            if (end + (alignment - end % alignment) % alignment + length > _maxDecodedBytes) {
+                fail();
+                return false;
+            }
+            return true;
+        }
+
+        inline void fail() {
+            _ok = false;
+        }
+
+        inline bool ok() const {
+            return _ok;
+        }
+
+        /// builder分配之后地址会变化，每次写入前重新获取
+        inline uint8_t* data() const {
+            return _builder->data();
+        }
+
+    private:
+        struct Task {
+            DecodeFn decode;
+            int32_t offset;
+        };
+
+        const uint8_t *_input = nullptr;
+        size_t _pos = 0;
+        size_t _size = 0;
+        MessageBuilder *_builder = nullptr;
+        int32_t _maxDecodedBytes;
+        bool _ok = true;
+        std::vector<Task> _tasks;
+        /// 按序号排列的被引用struct`(typeId, 地址)`，root为0
+        std::vector<std::pair<int32_t, int32_t>> _refs;
+    };
+
+    /// 记录struct的成员，按声明顺序排列
+    class WireMemberRecorder {
+    public:
+        struct Member {
+            int32_t offset;
+            bool (*isDefault)(const uint8_t*, int32_t);
+            WireEncoder::EncodeFn encode;
+            WireDecoder::DecodeFn decode;
+        };
+
+        template <typename T>
+        void member(int32_t offset) {
+            members.push_back(Member{offset, &isWireDefault<T>, &WireEncoder::value<T>, &WireDecoder::value<T>});
+        }
+
+        template <typename T>
+        void reference(int32_t offset) {
+            members.push_back(Member{offset, &isWireDefault<int32_t>, &WireEncoder::reference<T>, &WireDecoder::reference<T>});
+        }
+
+        std::vector<Member> members;
+    };
+
+    template <typename T>
+    inline const std::vector<WireMemberRecorder::Member>& wireMembersOf() {
+        static const std::vector<WireMemberRecorder::Member> members = [] {
+            WireMemberRecorder recorder;
+            T::wireMembers(recorder);
+            return std::move(recorder.members);
+        }();
+        return members;
+    }
+
+    /// struct的位图和不为默认值的成员，第i个成员位于`address(i)`
+    template <typename Address>
+    void encodeWireStruct(WireEncoder &encoder, const std::vector<WireMemberRecorder::Member> &members, Address address) {
+        std::vector<uint8_t> &out = encoder.out();
+        const size_t start = out.size();
+        const size_t groups = std::max<size_t>((members.size() + 6) / 7, 1);
+        out.resize(start + groups, 0);
+        for (size_t i = 0; i < members.size(); i++) {
+            if (!members[i].isDefault(encoder.data(), address(i))) {
+                out[start + i / 7] |= static_cast<uint8_t>(1 << (i % 7));
+            }
+        }
+        size_t used = groups;
+        while (used > 1 && out[start + used - 1] == 0) {
+            used--;
+        }
+        out.resize(start + used);
+        for (size_t i = 0; i + 1 < used; i++) {
+            out[start + i] |= 0x80;
+        }
+        for (size_t i = 0; i < members.size(); i++) {
+            if (out[start + i / 7] & (1 << (i % 7))) {
+                members[i].encode(encoder, address(i));
+            }
+        }
+    }
+
+    template <typename Address>
+    void decodeWireStruct(WireDecoder &decoder, const std::vector<WireMemberRecorder::Member> &members, Address address) {
+        const size_t groups = std::max<size_t>((members.size() + 6) / 7, 1);
+        uint8_t local[16];
+        std::vector<uint8_t> large;
+        uint8_t *bits = local;
+        if (groups > sizeof(local)) {
+            large.resize(groups);
+            bits = large.data();
+        }
+        size_t used = 0;
+        uint8_t byte = 0x80;
+        while (byte & 0x80) {
+            if (used == groups) {
+                decoder.fail();
+                return;
+            }
+            byte = decoder.readByte();
+            bits[used++] = byte & 0x7F;
+        }
+        // 最后一组中超出成员数量的位必须为0
+        const size_t valid = std::min<size_t>(members.size() - 7 * (used - 1), 7);
+        if (!decoder.ok() || bits[used - 1] >> valid) {
+            decoder.fail();
+            return;
+        }
+        for (size_t i = 0; i < members.size() && i / 7 < used && decoder.ok(); i++) {
+            if (bits[i / 7] & (1 << (i % 7))) {
+                members[i].decode(decoder, address(i));
+            }
+        }
+    }
+
+    template <typename T, typename Enable>
+    void WireTrace<T, Enable>::encode(WireEncoder &encoder, int32_t offset) {
+        const auto &members = wireMembersOf<T>();
+        encodeWireStruct(encoder, members, [&](size_t i) { return offset + members[i].offset; });
+    }
+
+    template <typename T, typename Enable>
+    bool WireTrace<T, Enable>::isDefault(const uint8_t *buf, int32_t offset) {
+        const auto &members = wireMembersOf<T>();
+        return std::all_of(members.begin(), members.end(), [&](const WireMemberRecorder::Member &member) { return member.isDefault(buf, offset + member.offset); });
+    }
+
+    template <typename T, typename Enable>
+    void WireTrace<T, Enable>::decode(WireDecoder &decoder, int32_t offset) {
+        const auto &members = wireMembersOf<T>();
+        decodeWireStruct(decoder, members, [&](size_t i) { return offset + members[i].offset; });
+    }
+
+    /// `| varint size | 元素 |`，native元素连续写入
+    template <typename T>
+    struct WireTrace<MsgVector<T>> {
+        static bool isDefault(const uint8_t *buf, int32_t offset) {
+            return loadValue<int32_t>(buf, offset + 4) == 0;
+        }
+
+        static void encode(WireEncoder &encoder, int32_t offset) {
+            constexpr int32_t itemBytes = byteLengthOf<T>();
+            const int32_t data = loadValue<int32_t>(encoder.data(), offset);
+            const int32_t size = loadValue<int32_t>(encoder.data(), offset + 4);
+            encoder.writeVarint(static_cast<uint64_t>(size));
+            if constexpr (IsNativeType<T>::value && isWireRaw<T>()) {
+                encoder.write(encoder.data() + data, static_cast<size_t>(size) * itemBytes);
+            } else {
+                for (int32_t i = 0; i < size; i++) {
+                    WireEncoder::value<T>(encoder, data + itemBytes * i);
+                }
+            }
+        }
+
+        static void decode(WireDecoder &decoder, int32_t offset) {
+            constexpr int32_t itemBytes = byteLengthOf<T>();
+            const int32_t size = decoder.readCount();
+            if (size == 0) {
+                return;
+            }
+            const int32_t data = decoder.allocate(size, itemBytes, itemAlignment<T>());
+            if (!decoder.ok()) {
+                return;
+            }
+            storeValue<int32_t>(decoder.data(), offset, data);
+            storeValue<int32_t>(decoder.data(), offset + 4, size);
+            storeValue<int32_t>(decoder.data(), offset + 8, size);
+            if constexpr (IsNativeType<T>::value && isWireRaw<T>()) {
+                const uint8_t *bytes = decoder.read(static_cast<uint64_t>(size) * itemBytes);
+                if (bytes) {
+                    std::memcpy(decoder.data() + data, bytes, static_cast<size_t>(size) * itemBytes);
+                }
+            } else {
+                for (int32_t i = 0; i < size && decoder.ok(); i++) {
+                    WireDecoder::value<T>(decoder, data + itemBytes * i);
+                }
+            }
+        }
+    };
+
+    /**
+     * `@soa`数组与同元素的普通数组编码相同: `| varint size | 元素 |`，元素的成员从各列读取。
+     * 元素按顺序写入，与普通数组的元素在任务栈中的处理顺序相同，两种布局可以互相解码。
+     */
+    template <typename T>
+    struct WireTrace<MsgSoaVector<T>> {
+        static bool isDefault(const uint8_t *buf, int32_t offset) {
+            return loadValue<int32_t>(buf, offset + 4) == 0;
+        }
+
+        static void encode(WireEncoder &encoder, int32_t offset) {
+            const auto &members = wireMembersOf<T>();
+            const int32_t data = loadValue<int32_t>(encoder.data(), offset);
+            const int32_t size = loadValue<int32_t>(encoder.data(), offset + 4);
+            const int32_t capacity = loadValue<int32_t>(encoder.data(), offset + 8);
+            encoder.writeVarint(static_cast<uint64_t>(size));
+            for (int32_t index = 0; index < size; index++) {
+                encodeWireStruct(encoder, members, [&](size_t i) { return columnOffset(data, capacity, index, i); });
+            }
+        }
+
+        static void decode(WireDecoder &decoder, int32_t offset) {
+            const auto &members = wireMembersOf<T>();
+            const int32_t size = decoder.readCount();
+            if (size == 0) {
+                return;
+            }
+            const int32_t capacity = MsgSoaVectorBase::capacityFor(size);
+            const int32_t data = decoder.allocate(capacity, T::byteLength, MsgSoaVectorBase::dataAlignment);
+            if (!decoder.ok()) {
+                return;
+            }
+            storeValue<int32_t>(decoder.data(), offset, data);
+            storeValue<int32_t>(decoder.data(), offset + 4, size);
+            storeValue<int32_t>(decoder.data(), offset + 8, capacity);
+            for (int32_t index = 0; index < size && decoder.ok(); index++) {
+                decodeWireStruct(decoder, members, [&](size_t i) { return columnOffset(data, capacity, index, i); });
+            }
+        }
+
+    private:
+        /// wireMembers与columns都按声明顺序排列
+        static inline int32_t columnOffset(int32_t data, int32_t capacity, int32_t index, size_t member) {
+            const MsgSoaColumn &column = MsgSoaVector<T>::columns[member];
+            return data + capacity * column.offset + column.bytes * index;
+        }
+    };
+
+    /// `| varint size | key value ... |`，按原来的顺序(key升序)写入，解码时拒绝不递增的key
+    template <typename K, typename V>
+    struct WireTrace<MsgMap<K, V>> {
+        using Map = MsgMap<K, V>;
+
+        static bool isDefault(const uint8_t *buf, int32_t offset) {
+            return loadValue<int32_t>(buf, offset) == 0;
+        }
+
+        static void encode(WireEncoder &encoder, int32_t offset) {
+            const int32_t size = loadValue<int32_t>(encoder.data(), offset);
+            const int32_t data = loadValue<int32_t>(encoder.data(), offset + 8);
+            encoder.writeVarint(static_cast<uint64_t>(size));
+            for (int32_t i = 0; i < size; i++) {
+                WireEncoder::value<K>(encoder, data + Map::entryByte() * i);
+                WireEncoder::value<V>(encoder, data + Map::entryByte() * i + Map::keyByte());
+            }
+        }
+
+        static void decode(WireDecoder &decoder, int32_t offset) {
+            const int32_t size = decoder.readCount();
+            if (size == 0) {
+                return;
+            }
+            const int32_t data = decoder.allocate(size, Map::entryByte());
+            if (!decoder.ok()) {
+                return;
+            }
+            storeValue<int32_t>(decoder.data(), offset, size);
+            storeValue<int32_t>(decoder.data(), offset + 4, size);
+            storeValue<int32_t>(decoder.data(), offset + 8, data);
+            for (int32_t i = 0; i < size && decoder.ok(); i++) {
+                const int32_t entry = data + Map::entryByte() * i;
+                WireDecoder::value<K>(decoder, entry);
+                if (i > 0 && decoder.ok() && !keyAfter(decoder.data(), entry - Map::entryByte(), entry)) {
+                    decoder.fail();
+                    return;
+                }
+                WireDecoder::value<V>(decoder, entry + Map::keyByte());
+            }
+        }
+
+    private:
+        /// key必须严格递增，否则MsgMap的二分查找会出错
+        static bool keyAfter(uint8_t *buf, int32_t prev, int32_t entry) {
+            if constexpr (std::is_same<K, MsgString>::value) {
+                return Simd::compareString(MsgString(buf, prev).getStringView(), MsgString(buf, entry).getStringView()) < 0;
+            } else {
+                return loadValue<K>(buf, prev) < loadValue<K>(buf, entry);
+            }
+        }
+    };
+
+    /// `| index |`之后是值，子空间中的值地址为0时index的最高位为1且没有值
+    template <typename... Ts>
+    struct WireTrace<MsgCombine<Ts...>> {
+        static bool isDefault(const uint8_t *buf, int32_t offset) {
+            return loadValue<uint8_t>(buf, offset) == 0;
+        }
+
+        static void encode(WireEncoder &encoder, int32_t offset) {
+            const uint8_t index = loadValue<uint8_t>(encoder.data(), offset);
+            if (index == 0 || index > sizeof...(Ts)) {
+                encoder.writeByte(0);
+                return;
+            }
+            uint8_t current = 0;
+            (encodeCandidate<Ts>(encoder, offset, index, ++current), ...);
+        }
+
+        static void decode(WireDecoder &decoder, int32_t offset) {
+            const uint8_t tag = decoder.readByte();
+            const uint8_t index = tag & 0x7F;
+            if (tag == 0) {
+                return;
+            }
+            if (index == 0 || index > sizeof...(Ts)) {
+                decoder.fail();
+                return;
+            }
+            storeValue<uint8_t>(decoder.data(), offset, index);
+            uint8_t current = 0;
+            (decodeCandidate<Ts>(decoder, offset, tag, ++current), ...);
+        }
+
+    private:
+        template <typename V>
+        static void encodeCandidate(WireEncoder &encoder, int32_t offset, uint8_t index, uint8_t candidate) {
+            if (index != candidate) {
+                return;
+            }
+            if constexpr (byteLengthOf<V>() <= 4) {
+                encoder.writeByte(index);
+                WireEncoder::value<V>(encoder, offset + 4);
+            } else {
+                const int32_t addr = loadValue<int32_t>(encoder.data(), offset + 4);
+                encoder.writeByte(addr ? index : static_cast<uint8_t>(index | 0x80));
+                if (addr) {
+                    WireEncoder::value<V>(encoder, addr);
+                }
+            }
+        }
+
+        template <typename V>
+        static void decodeCandidate(WireDecoder &decoder, int32_t offset, uint8_t tag, uint8_t candidate) {
+            if ((tag & 0x7F) != candidate) {
+                return;
+            }
+            if constexpr (byteLengthOf<V>() <= 4) {
+                if (tag & 0x80) {
+                    decoder.fail();
+                    return;
+                }
+                WireDecoder::value<V>(decoder, offset + 4);
+            } else {
+                if (tag & 0x80) {
+                    return;
+                }
+                const int32_t addr = decoder.allocate(1, byteLengthOf<V>(), itemAlignment<V>());
+                if (!decoder.ok()) {
+                    return;
+                }
+                storeValue<int32_t>(decoder.data(), offset + 4, addr);
+                WireDecoder::value<V>(decoder, addr);
+            }
+        }
+    };
+
+    /// 把消息编码为紧凑格式追加到`out`
+    template <typename Root>
+    inline bool encodeWire(const void *buf, std::vector<uint8_t> &out) {
+        WireEncoder encoder;
+        return encoder.template encode<Root>(buf, out);
+    }
+
+    template <typename Root>
+    inline bool decodeWire(std::span<const uint8_t> wire, MessageBuilder &builder, int32_t maxDecodedBytes = WireDecoder::defaultMaxDecodedBytes) {
+        WireDecoder decoder(maxDecodedBytes);
+        return decoder.template decode<Root>(wire, builder);
+    }
+
+    /// 紧凑格式中的mainTypeId，用于在解码前分发到对应的类型，格式不正确时为0
+    inline int32_t wireTypeIdOf(std::span<const uint8_t> wire) {
+        uint32_t value = 0;
+        for (size_t i = 0; i < wire.size() && i < 5; i++) {
+            value |= static_cast<uint32_t>(wire[i] & 0x7F) << (7 * i);
+            if (!(wire[i] & 0x80)) {
+                return static_cast<int32_t>(value);
+            }
+        }
+        return 0;
+    }
+}
@@ -1,8 +1,33 @@
+import path from 'path';
 import { GenerateService } from './generateservice';
+import { EnumDescription, StringTypeId, StructDescription, NativeSupportTypes, TypeDescType, IAccessoryDesc, EMemberRefType, MINUserDefTypeId } from './msgschema';
+
+const literalToCppTypeName: { [key: string]: string } = {
+    bool: 'bool',
+    int8: 'int8_t',
+    uint8: 'uint8_t',
+    int16: 'int16_t',
+    uint16: 'uint16_t',
+    int32: 'int32_t',
+    uint32: 'uint32_t',
+    float32: 'float',
+    float64: 'double',
+    int64: 'int64_t',
+    uint64: 'uint64_t',
+};
+
+/** 需要拷贝到输出目录的C++运行时头文件 */
+const cppRuntimeFiles = ['base.hpp', 'simd.hpp', 'pool.hpp', 'builder.hpp', 'gc.hpp', 'verifier.hpp', 'batch.hpp', 'transport.hpp', 'compat.hpp', 'dispatch.hpp', 'plugin.hpp', 'patch.hpp', 'coalesce.hpp', 'wire.hpp', 'msglog.hpp', 'splice.hpp'];
+
+const accessoryHeader = 'accessorystructs';
+const accessoryNamespace = 'SMessage::Accessory';
 
 interface ScopeCtx {
     scope: string;
+    relys: Set<number>;
+    /** 类型定义，成员函数中不依赖其他类型的部分 */
     header: string;
+    /** 所有类型定义完后才能实例化的inline成员函数 */
     cpp: string;
 }
 
@@ -13,8 +38,537 @@ export class CppGenerator {
         this._outDir = outputDir;
     }
 
-    public generateToDir(dir: string) {
-        this._genServ.writeScopeString(this._outDir, 'ctx', dir, 'h');
+    public generate() {
+        cppRuntimeFiles.forEach((fname) => {
+            this._genServ.copyFile(this._outDir, `../base/cpp/${fname}`, fname);
+        });
+
+        const scopeMap: Map<string, ScopeCtx> = new Map();
+        const getScope = (scope: string) => {
+            let sctx = scopeMap.get(scope);
+            if (!sctx) {
+                sctx = { scope, relys: new Set(), header: '', cpp: '' };
+                scopeMap.set(scope, sctx);
+                this._scopeCtx.push(sctx);
+            }
+            return sctx;
+        };
+
+        this._genServ.schema.enumDefs.forEach((edesc) => {
+            getScope(edesc.scope).header += this._generateEnumDef(edesc);
+        });
+
+        this._genServ.schema.structDefs.forEach((sdesc) => {
+            this._generateStructDef(sdesc, getScope(sdesc.scope));
+        });
+
+        this._genServ.schema.structDefs.forEach((sdesc) => {
+            this._generateCompatDef(sdesc, getScope(sdesc.scope));
+        });
+
+        this._scopeCtx.forEach((sctx) => {
+            this._genServ.writeScopeString(this._outDir, this._generateScopeFile(sctx), sctx.scope, 'h');
+        });
+
+        this._genServ.writeScopeString(this._outDir, this._generateAccessoryFile(), accessoryHeader, 'h');
+
+        let indexCtx = `#pragma once\n\n`;
+        this._scopeCtx.forEach((sctx) => {
+            indexCtx += `#include "${sctx.scope.split('.').join('/')}.h"\n`;
+        });
+        this._genServ.writeScopeString(this._outDir, indexCtx, 'index', 'h');
+
+        if (this._genServ.schema.structDefs.length > 0) {
+            this._genServ.writeScopeString(this._outDir, this._generateDispatchFile(), 'dispatch', 'h');
+        }
+    }
+
+    /**
+     * 按typeId排列的消息类型表，dispatch.hpp据此在编译期生成跳转表
+     */
+    private _generateDispatchFile() {
+        const maxTypeId = Math.max(...this._genServ.schema.structDefs.map((sdesc) => sdesc.typeId));
+        const types: string[] = [];
+        for (let id = MINUserDefTypeId; id <= maxTypeId; id++) {
+            const desc = this._genServ.idToDesc.get(id);
+            types.push(desc && desc.type === 'struct' ? `    ${this._getCppTypeName(id)}, // ${id}` : `    void, // ${id}`);
+        }
+        return `#pragma once
+
+#include <utility>
+
+#include "index.h"
+#include "dispatch.hpp"
+
+namespace SMessage::Dispatch {
+
+/// 按typeId - MINUserDefTypeId排列的消息类型，enum和辅助结构的位置为void
+using MessageTypes = ::SMessage::MessageTypeList<
+${types.join('\n').replace(/, \/\/ (\d+)$/, ' // $1')}
+>;
+
+/// 按buffer的mainTypeId调用handler中对应类型的重载，没有对应的重载时返回false
+template <typename Handler>
+inline bool visit(void *buffer, Handler &&handler) {
+    return ::SMessage::visitMessage<MessageTypes>(buffer, std::forward<Handler>(handler));
+}
+
+} // namespace SMessage::Dispatch
+`;
+    }
+
+    private _generateScopeFile(sctx: ScopeCtx) {
+        const namespace = sctx.scope.split('.').join('::');
+        const relyScopes: Set<string> = new Set();
+        sctx.relys.forEach((tid) => {
+            const desc = this._genServ.idToDesc.get(tid);
+            if (desc && (desc.type === 'struct' || desc.type === 'enum') && desc.scope !== sctx.scope) {
+                relyScopes.add(desc.scope);
+            }
+        });
+
+        // 依赖的scope在本scope的类型定义之后include，这样互相依赖的scope也能正确展开
+        return `#pragma once
+
+#include "${this._relativeInclude(sctx.scope, 'base.hpp')}"
+#include "${this._relativeInclude(sctx.scope, `${accessoryHeader}.h`)}"
+
+namespace ${namespace} {
+${sctx.header}
+} // namespace ${namespace}
+${[...relyScopes].map((rscope) => `\n#include "${this._relativeInclude(sctx.scope, `${rscope.split('.').join('/')}.h`)}"`).join('')}
+
+namespace ${namespace} {
+${sctx.cpp}
+} // namespace ${namespace}
+`;
+    }
+
+    private _generateEnumDef(edesc: EnumDescription) {
+        return `
+enum class ${edesc.typeName} : ${literalToCppTypeName[edesc.dataType.literal]} {
+${edesc.valueTypes
+    .map((vt) => {
+        return `    ${vt.name} = ${vt.value},`;
+    })
+    .join('\n')}
+};
+`;
+    }
+
+    private _generateStructDef(sdesc: StructDescription, sctx: ScopeCtx) {
+        let offsetStr = '';
+        let memsStr = '';
+        let implStr = '';
+        let traceStr = '';
+        let wireStr = '';
+        sdesc.members.forEach((memdec) => {
+            const upperName = memdec.name.charAt(0).toUpperCase() + memdec.name.slice(1);
+            const offsetName = `offset${upperName}`;
+            offsetStr += `
+    static constexpr int32_t ${offsetName} = ${memdec.offset};`;
+            switch (memdec.type.descType) {
+            case TypeDescType.NativeSupportType:
+            {
+                if (memdec.type.typeId === StringTypeId) {
+                    traceStr += `
+        tracer.template visit<::SMessage::MsgString>(offset + ${offsetName});`;
+                    wireStr += `
+        recorder.template member<::SMessage::MsgString>(${offsetName});`;
+                    memsStr += `
+    inline ::SMessage::MsgString get${upperName}() const {
+        return inlineMember<::SMessage::MsgString>(${offsetName});
+    }
+`;
+                } else {
+                    const cppType = literalToCppTypeName[memdec.type.literal];
+                    wireStr += `
+        recorder.template member<${cppType}>(${offsetName});`;
+                    memsStr += `
+    inline ${cppType} get${upperName}() const {
+        return loadMember<${cppType}>(${offsetName});
+    }
+
+    inline void set${upperName}(${cppType} value) {
+        storeMember<${cppType}>(${offsetName}, value);
+    }
+`;
+                }
+                break;
+            }
+            case TypeDescType.ArrayType:
+            case TypeDescType.MapType:
+            case TypeDescType.CombineType:
+            {
+                const accessoryType = memdec.type.accessory;
+                if (!accessoryType) {
+                    throw new Error('Must have accessory type!!!');
+                }
+                const cppType = this._getCppTypeName(accessoryType.typeId);
+                traceStr += `
+        tracer.template visit<${cppType}>(offset + ${offsetName});`;
+                wireStr += `
+        recorder.template member<${cppType}>(${offsetName});`;
+                memsStr += `
+    inline ${cppType} get${upperName}() const;
+`;
+                implStr += `
+inline ${cppType} ${sdesc.typeName}::get${upperName}() const {
+    return inlineMember<${cppType}>(${offsetName});
+}
+`;
+                if (memdec.flat) {
+                    memsStr += `
+    /// 各行的数据连续存放，可以按行或整块取得span
+    inline ::SMessage::MsgFlatRows<${cppType}> get${upperName}Rows() const;
+`;
+                    implStr += `
+inline ::SMessage::MsgFlatRows<${cppType}> ${sdesc.typeName}::get${upperName}Rows() const {
+    return inlineMember<::SMessage::MsgFlatRows<${cppType}>>(${offsetName});
+}
+`;
+                }
+                sctx.relys.add(accessoryType.typeId);
+                break;
+            }
+            case TypeDescType.UserDefType:
+            {
+                const memType = this._genServ.idToDesc.get(memdec.type.typeId);
+                if (memType && memType.type === 'enum') {
+                    const cppType = this._getCppTypeName(memType.typeId);
+                    const storeType = literalToCppTypeName[memType.dataType.literal];
+                    wireStr += `
+        recorder.template member<${cppType}>(${offsetName});`;
+                    memsStr += `
+    inline ${cppType} get${upperName}() const {
+        return static_cast<${cppType}>(loadMember<${storeType}>(${offsetName}));
+    }
+
+    inline void set${upperName}(${cppType} value) {
+        storeMember<${storeType}>(${offsetName}, static_cast<${storeType}>(value));
+    }
+`;
+                } else if (memType && memType.type === 'struct') {
+                    const cppType = this._getCppTypeName(memType.typeId);
+                    const getter = memdec.refType === EMemberRefType.reference ? 'referenceMember' : 'inlineMember';
+                    traceStr += `
+        tracer.template ${memdec.refType === EMemberRefType.reference ? 'visitReference' : 'visit'}<${cppType}>(offset + ${offsetName});`;
+                    wireStr += `
+        recorder.template ${memdec.refType === EMemberRefType.reference ? 'reference' : 'member'}<${cppType}>(${offsetName});`;
+                    memsStr += `
+    inline ${cppType} get${upperName}() const;
+`;
+                    implStr += `
+inline ${cppType} ${sdesc.typeName}::get${upperName}() const {
+    return ${getter}<${cppType}>(${offsetName});
+}
+`;
+                }
+                sctx.relys.add(memdec.type.typeId);
+                break;
+            }
+            }
+        });
+
+        sctx.header += `
+class ${sdesc.typeName} : public ::SMessage::BaseMessage<${sdesc.typeName}> {
+public:
+    static constexpr int32_t typeId = ${sdesc.typeId};
+    static constexpr int32_t byteLength = ${sdesc.byteLength};
+${offsetStr}${this._coalesceStr(sdesc)}
+
+    using BaseMessage::BaseMessage;
+
+    /// 遍历引用了其他空间的成员，gc.hpp压缩buffer和verifier.hpp校验buffer时使用
+    template <typename Tracer>
+    static void traceMembers(Tracer &tracer, int32_t offset) {${traceStr ? traceStr : `
+        (void)tracer;
+        (void)offset;`}
+    }
+
+    /// 按声明顺序列出所有成员，wire.hpp的紧凑编码使用
+    template <typename Recorder>
+    static void wireMembers(Recorder &recorder) {${wireStr ? wireStr : `
+        (void)recorder;`}
+    }
+${this._soaStr(sdesc)}${memsStr}};
+`;
+        sctx.cpp += implStr;
+    }
+
+    /**
+     * 作为`@soa`数组元素的struct生成`MsgSoaVector`使用的`SoaItem`(与struct相同的get/set)和`SoaColumns`(各列的span)
+     */
+    private _soaStr(sdesc: StructDescription) {
+        if (!this._genServ.schema.accessories.some((acc) => acc.type === 'soaArray' && acc.relyTypes[0] === sdesc.typeId)) {
+            return '';
+        }
+        let itemStr = '';
+        let columnStr = '';
+        const columns = sdesc.members.map((memdec) => {
+            const upperName = memdec.name.charAt(0).toUpperCase() + memdec.name.slice(1);
+            const offsetName = `offset${upperName}`;
+            const memType = this._genServ.idToDesc.get(memdec.type.typeId);
+            const cppType = this._getCppTypeName(memdec.type.typeId);
+            const storeType = memType?.type === 'enum' ? literalToCppTypeName[memType.dataType.literal] : cppType;
+            const load = `loadColumn<${storeType}>(${offsetName})`;
+            itemStr += `
+        inline ${cppType} get${upperName}() const {
+            return ${storeType === cppType ? load : `static_cast<${cppType}>(${load})`};
+        }
+
+        inline void set${upperName}(${cppType} value) {
+            storeColumn<${storeType}>(${offsetName}, ${storeType === cppType ? 'value' : `static_cast<${storeType}>(value)`});
+        }
+`;
+            columnStr += `
+        inline std::span<const ${cppType}> ${memdec.name}s() const {
+            return column<${cppType}>(${offsetName});
+        }
+
+        inline std::span<${cppType}> mutable${upperName}s() {
+            return mutableColumn<${cppType}>(${offsetName});
+        }
+`;
+            return `{${offsetName}, ${this._genServ.getTypeSizeFromTypeId(memdec.type.typeId)}}`;
+        });
+        return `
+    /// \`@soa\`数组的元素，成员分散在各列
+    class SoaItem : public ::SMessage::MsgSoaItemBase {
+    public:
+        using MsgSoaItemBase::MsgSoaItemBase;
+${itemStr}    };
+
+    /// \`@soa\`数组的各列，按声明顺序
+    class SoaColumns : public ::SMessage::MsgSoaVectorBase {
+    public:
+        static constexpr ::SMessage::MsgSoaColumn columns[] = {${columns.join(', ')}};
+
+        using MsgSoaVectorBase::MsgSoaVectorBase;
+${columnStr}    };
+`;
+    }
+
+    /**
+     * `@coalesce`的struct在coalesce.hpp的`CoalescingQueue`中合并，key为-1/0时按类型合并
+     */
+    private _coalesceStr(sdesc: StructDescription) {
+        if (!sdesc.coalesce) {
+            return '';
+        }
+        const key = sdesc.members.find((mem) => mem.name === sdesc.coalesce?.key);
+        if (!key) {
+            return `
+
+    static constexpr int32_t coalesceKeyOffset = -1;
+    static constexpr int32_t coalesceKeyBytes = 0;`;
+        }
+        const upperName = key.name.charAt(0).toUpperCase() + key.name.slice(1);
+        return `
+
+    static constexpr int32_t coalesceKeyOffset = offset${upperName};
+    static constexpr int32_t coalesceKeyBytes = ${this._genServ.getTypeSizeFromTypeId(key.type.typeId)};`;
+    }
+
+    /**
+     * 布局在历史版本中变化过的struct，生成按版本布局只读访问的`XxxCompat`类
+     */
+    private _generateCompatDef(sdesc: StructDescription, sctx: ScopeCtx) {
+        const layouts = this._genServ.getCompatLayouts(sdesc.typeId);
+        if (!layouts) {
+            return;
+        }
+        const className = `${sdesc.typeName}Compat`;
+        const versions = [...this._genServ.compatVersions, this._genServ.schema.version];
+        let memsStr = '';
+        let implStr = '';
+        sdesc.members.forEach((memdec, index) => {
+            const upperName = memdec.name.charAt(0).toUpperCase() + memdec.name.slice(1);
+            // 当前版本的view包装在CompatView中，不能通过兼容类修改buffer或共享的全0空间
+            const addImpl = (cppType: string, body: string) => {
+                memsStr += `
+    inline ${cppType} get${upperName}() const;
+`;
+                implStr += `
+inline ${cppType} ${className}::get${upperName}() const {
+    return ${body};
+}
+`;
+            };
+            if (memdec.type.descType === TypeDescType.NativeSupportType) {
+                if (memdec.type.typeId === StringTypeId) {
+                    memsStr += `
+    inline ::SMessage::CompatView<::SMessage::MsgString> get${upperName}() const {
+        return inlineCompat<::SMessage::MsgString>(${index});
+    }
+`;
+                } else {
+                    const cppType = literalToCppTypeName[memdec.type.literal];
+                    memsStr += `
+    inline ${cppType} get${upperName}() const {
+        return loadCompat<${cppType}>(${index});
+    }
+`;
+                }
+                return;
+            }
+            const memType = memdec.type.descType === TypeDescType.UserDefType ? this._genServ.idToDesc.get(memdec.type.typeId) : undefined;
+            if (memType && memType.type === 'enum') {
+                const cppType = this._getCppTypeName(memType.typeId);
+                memsStr += `
+    inline ${cppType} get${upperName}() const {
+        return static_cast<${cppType}>(loadCompat<${literalToCppTypeName[memType.dataType.literal]}>(${index}));
+    }
+`;
+                return;
+            }
+            if (memdec.type.descType === TypeDescType.UserDefType && memType?.type !== 'struct') {
+                return;
+            }
+            const reference = memdec.refType === EMemberRefType.reference;
+            if (!this._genServ.isCompatChanged(memdec.typeId)) {
+                const cppType = this._getCppTypeName(memdec.typeId);
+                addImpl(`::SMessage::CompatView<${cppType}>`, `${reference ? 'referenceCompat' : 'inlineCompat'}<${cppType}>(${index})`);
+            } else {
+                const compatType = this._getCppCompatTypeName(memdec.typeId);
+                if (compatType) {
+                    addImpl(compatType, `${reference ? 'referenceVersioned' : 'inlineVersioned'}<${compatType}>(${index})`);
+                } else {
+                    memsStr += `
+    // ${memdec.name}: map/combine中struct的布局已变化，不支持兼容读取
+`;
+                }
+            }
+        });
+
+        sctx.header += `
+/// 按历史版本的布局只读访问${sdesc.typeName}，version为compatVersionOf()得到的序号
+class ${className} : public ::SMessage::CompatMessage<${className}> {
+public:
+    static constexpr int32_t typeId = ${sdesc.typeId};
+    static constexpr ::SMessage::CompatLayout<${sdesc.members.length}> layouts[] = {
+${layouts.map((layout, vi) => `        {${layout.byteLength}, {${layout.offsets.join(', ')}}}, // ${versions[vi]}`).join('\n')}
+    };
+
+    using CompatMessage::CompatMessage;
+${memsStr}};
+`;
+        sctx.cpp += implStr;
+    }
+
+    /**
+     * 布局变化的struct及其数组对应的兼容类型，map和combine不支持时返回undefined
+     */
+    private _getCppCompatTypeName(id: number): string | undefined {
+        const desc = this._genServ.getDescByTypeId(id);
+        if (desc.type === 'struct') {
+            return `::${desc.scope.split('.').join('::')}::${desc.typeName}Compat`;
+        }
+        if (desc.type === 'mapArray') {
+            const baseTypeId = desc.relyTypes.length === 1 ? desc.relyTypes[0] : parseInt(desc.typeName.split('_')[2], 10);
+            const itemType = this._getCppCompatTypeName(baseTypeId);
+            return itemType ? `::SMessage::MsgCompatVector<${itemType}>` : undefined;
+        }
+        return undefined;
+    }
+
+    private _generateAccessoryDef(desc: IAccessoryDesc) {
+        const nameparts = desc.typeName.split('_');
+        if (desc.type === 'mapArray') {
+            if (nameparts.length !== 3) {
+                throw new Error('Array must have 3 parts.');
+            }
+            const baseTypeId = desc.relyTypes.length === 1 ? desc.relyTypes[0] : parseInt(nameparts[2], 10);
+            return `using ${desc.typeName} = ::SMessage::MsgVector<${this._getCppTypeName(baseTypeId)}>;\n`;
+        } else if (desc.type === 'mapStruct') {
+            if (nameparts.length !== 3) {
+                throw new Error('Map must have 3 parts.');
+            }
+            const keyTypeId = parseInt(nameparts[1]);
+            const valueTypeId = parseInt(nameparts[2]);
+            return `using ${desc.typeName} = ::SMessage::MsgMap<${this._getCppTypeName(keyTypeId)}, ${this._getCppTypeName(valueTypeId)}>;\n`;
+        } else if (desc.type === 'combineType') {
+            const candidateTypes = nameparts.slice(1).map((tpStr) => this._getCppTypeName(parseInt(tpStr)));
+            return `using ${desc.typeName} = ::SMessage::MsgCombine<${candidateTypes.join(', ')}>;\n`;
+        } else if (desc.type === 'soaArray') {
+            return `using ${desc.typeName} = ::SMessage::MsgSoaVector<${this._getCppTypeName(desc.relyTypes[0])}>;\n`;
+        }
+        throw new Error('Unsupport accessory type.');
+    }
+
+    /**
+     * 辅助结构都是模板的别名，只需要前置声明用户类型即可。
+     * 辅助结构的typeId按照依赖顺序生成，按照typeId输出即可保证被依赖的别名先定义。
+     */
+    private _generateAccessoryFile() {
+        let declStr = '';
+        const scopeDecls: Map<string, string[]> = new Map();
+        const addDecl = (scope: string, decl: string) => {
+            const decls = scopeDecls.get(scope);
+            if (decls) {
+                decls.push(decl);
+            } else {
+                scopeDecls.set(scope, [decl]);
+            }
+        };
+        this._genServ.schema.enumDefs.forEach((edesc) => {
+            addDecl(edesc.scope, `enum class ${edesc.typeName} : ${literalToCppTypeName[edesc.dataType.literal]};`);
+        });
+        this._genServ.schema.structDefs.forEach((sdesc) => {
+            addDecl(sdesc.scope, `class ${sdesc.typeName};`);
+            if (this._genServ.getCompatLayouts(sdesc.typeId)) {
+                addDecl(sdesc.scope, `class ${sdesc.typeName}Compat;`);
+            }
+        });
+        scopeDecls.forEach((decls, scope) => {
+            declStr += `namespace ${scope.split('.').join('::')} {\n${decls.map((d) => `    ${d}`).join('\n')}\n}\n\n`;
+        });
+
+        const accessories = [...this._genServ.schema.accessories].sort((a, b) => a.typeId - b.typeId);
+        const compatVersions = this._genServ.compatVersions;
+        const compatStr = compatVersions.length === 0 ? '' : `
+/// 兼容类(XxxCompat)可以读取的版本，layouts按此顺序排列，最后一个为当前版本
+inline constexpr std::string_view compatVersions[] = {${[...compatVersions, this._genServ.schema.version].map((v) => `"${v}"`).join(', ')}};
+
+inline constexpr int32_t compatVersionOf(std::string_view version) {
+    return ::SMessage::findCompatVersion(compatVersions, version);
+}
+`;
+        return `#pragma once
+
+#include "base.hpp"
+${compatVersions.length === 0 ? '' : '#include "compat.hpp"\n'}
+${declStr}namespace ${accessoryNamespace} {
+
+${accessories.map((acc) => this._generateAccessoryDef(acc)).join('')}${compatStr}
+} // namespace ${accessoryNamespace}
+`;
+    }
+
+    private _relativeInclude(fromScope: string, target: string) {
+        const currDir = fromScope.split('.');
+        currDir.pop();
+        return path.relative(currDir.join('/'), target).replace(/\\/g, '/');
+    }
+
+    /**
+     * 将类型ID转换为C++中的类型名
+     * @param id 类型的ID
+     * @returns 带完整namespace的C++类型
+     */
+    private _getCppTypeName(id: number): string {
+        if (id === StringTypeId) {
+            return '::SMessage::MsgString';
+        }
+        const nativeST = NativeSupportTypes.find((tp) => tp.typeId === id);
+        if (nativeST) {
+            return literalToCppTypeName[nativeST.literal];
+        }
+        const desc = this._genServ.getDescByTypeId(id);
+        if (desc.type !== 'struct' && desc.type !== 'enum') {
+            return `::${accessoryNamespace}::${desc.typeName}`;
+        }
+        return `::${desc.scope.split('.').join('::')}::${desc.typeName}`;
     }
 
     private _scopeCtx: ScopeCtx[];
@@ -1,6 +1,6 @@
 import fs from 'fs';
 import path from 'path';
-import { SMessageSchemas, NativeSupportTypes, PredefinedTypes, StructDescription, EnumDescription, IAccessoryDesc, TypeDescType, MINUserDefTypeId } from './msgschema';
+import { SMessageSchemas, NativeSupportTypes, PredefinedTypes, StructDescription, EnumDescription, IAccessoryDesc, TypeDescType, MINUserDefTypeId, StructLayoutDesc } from './msgschema';
 
 export enum OutPutType {
     Enum = 1,
@@ -70,6 +70,33 @@ export class GenerateService {
         });
 
         // this._analyseAllDepth();
+        this._analyseCompatLayouts();
+    }
+
+    /**
+     * 需要兼容读取的历史版本(至少有一个struct的布局与当前不同)，从旧到新。
+     * 兼容类的layouts按此顺序排列，最后再加上当前版本。
+     */
+    public get compatVersions() {
+        return this._compatVersions;
+    }
+
+    /**
+     * struct在各兼容版本中的布局: 成员顺序与当前schema相同，不存在或类型不同的成员offset为-1，
+     * 版本中不存在该struct时byteLength为0。布局在所有版本中都与当前相同(包括嵌套的struct)时返回undefined。
+     */
+    public getCompatLayouts(typeId: number) {
+        return this._compatLayouts.get(typeId);
+    }
+
+    /**
+     * 类型(struct或辅助结构)在某个兼容版本中的读取方式与当前不同
+     */
+    public isCompatChanged(typeId: number) {
+        if (this._compatLayouts.has(typeId)) {
+            return true;
+        }
+        return this._structsReachedBy(typeId).some((id) => this._compatLayouts.has(id));
     }
 
     public writeHistory() {
@@ -126,6 +153,70 @@ export class GenerateService {
         throw new Error('Cannot find the type.');
     }
 
+    private _analyseCompatLayouts() {
+        const history = this.schema.layoutHistory || [];
+        const changedByVersion = history.map((h) => {
+            const oldLayouts: Map<number, StructLayoutDesc> = new Map();
+            h.structs.forEach((sl) => oldLayouts.set(sl.typeId, sl));
+            const changed: Set<number> = new Set();
+            this.schema.structDefs.forEach((sds) => {
+                const old = oldLayouts.get(sds.typeId);
+                const same = old && old.byteLength === sds.byteLength && sds.members.every((mem) => {
+                    const om = old.members.find((m) => m.name === mem.name);
+                    return om && om.offset === mem.offset && om.typeId === mem.typeId && om.refType === mem.refType;
+                });
+                if (!same) {
+                    changed.add(sds.typeId);
+                }
+            });
+            // 成员(包括数组、map、combine中)的struct布局变化时，读取方式也随之变化
+            let grown = true;
+            while (grown) {
+                grown = false;
+                this.schema.structDefs.forEach((sds) => {
+                    if (!changed.has(sds.typeId) && sds.members.some((mem) => this._structsReachedBy(mem.typeId).some((id) => changed.has(id)))) {
+                        changed.add(sds.typeId);
+                        grown = true;
+                    }
+                });
+            }
+            return { old: oldLayouts, changed, version: h.version };
+        }).filter((vh) => vh.changed.size > 0);
+
+        this._compatVersions = changedByVersion.map((vh) => vh.version);
+        this.schema.structDefs.forEach((sds) => {
+            if (!changedByVersion.some((vh) => vh.changed.has(sds.typeId))) {
+                return;
+            }
+            const layouts = changedByVersion.map((vh) => {
+                const old = vh.old.get(sds.typeId);
+                return {
+                    byteLength: old ? old.byteLength : 0,
+                    offsets: sds.members.map((mem) => {
+                        const om = old?.members.find((m) => m.name === mem.name);
+                        return om && om.typeId === mem.typeId && om.refType === mem.refType ? om.offset : -1;
+                    }),
+                };
+            });
+            layouts.push({ byteLength: sds.byteLength, offsets: sds.members.map((mem) => mem.offset) });
+            this._compatLayouts.set(sds.typeId, layouts);
+        });
+    }
+
+    /**
+     * 类型本身或者通过辅助结构引用到的struct
+     */
+    private _structsReachedBy(typeId: number): number[] {
+        const desc = this.idToDesc.get(typeId);
+        if (!desc || desc.type === 'enum') {
+            return [];
+        }
+        if (desc.type === 'struct') {
+            return [typeId];
+        }
+        return desc.relyTypes.flatMap((id) => this._structsReachedBy(id));
+    }
+
     private _analyseAllDepth() {
         this.idToDesc.forEach((_desc, id) => {
             if (this.idToDepth.has(id)) {
@@ -177,6 +268,8 @@ export class GenerateService {
     public idToDepth: Map<number, number> = new Map();
 
     private _historyJson: string;
+    private _compatVersions: string[] = [];
+    private _compatLayouts: Map<number, { byteLength: number; offsets: number[] }[]> = new Map();
     private _idToBytesize: Map<number, number> = new Map();
     private _idToClassName: Map<number, string> = new Map();
 }
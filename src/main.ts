@@ -1,4 +1,5 @@
 import path from 'path';
+import { CppGenerator } from './cppgenerator';
 import { DirWalker } from './dirwalker';
 import { GenerateService } from './generateservice';
 import { SMessageCompiler } from './messagecompiler';
@@ -9,10 +10,12 @@ const option: {
     rootDir: string;
     outputDir: string;
     outputVersion: string;
+    languages: string[];
 } = {
     rootDir: '',
     outputDir: '',
     outputVersion: '',
+    languages: ['ts'],
 };
 
 for (let i = 0; i < process.argv.length; i++) {
@@ -34,6 +37,12 @@ for (let i = 0; i < process.argv.length; i++) {
             i++;
         }
     }
+    if (process.argv[i] === '-l') {
+        if (i + 1 < process.argv.length) {
+            option.languages = process.argv[i + 1].split(',');
+            i++;
+        }
+    }
 }
 
 const inputValid = option.rootDir.length > 0 && !option.rootDir.startsWith('-');
@@ -41,7 +50,7 @@ const outputValid = option.outputDir.length > 0 && !option.outputDir.startsWith(
 const versionValid = versionStrToNums(option.outputVersion).length === 3;
 
 if (!inputValid || !outputValid || !versionValid) {
-    console.log(`Usage: ${process.argv[0]} ${process.argv[1]} -i inputDir -o outputDir -v currVersion`);
+    console.log(`Usage: ${process.argv[0]} ${process.argv[1]} -i inputDir -o outputDir -v currVersion [-l ts,cpp]`);
 }
 
 const dirWalker = new DirWalker(option.rootDir, option.outputDir);
@@ -62,5 +71,14 @@ if (!compiler.currentSchema) {
 
 const genSer = new GenerateService(compiler.currentSchema, dirWalker.historyFileName);
 
-const gen = new TypescriptCodeGen(genSer, option.outputDir);
-gen.generate();
+if (option.languages.includes('cpp')) {
+    const cppGen = new CppGenerator(genSer, option.outputDir);
+    cppGen.generate();
+}
+
+if (option.languages.includes('ts')) {
+    const gen = new TypescriptCodeGen(genSer, option.outputDir);
+    gen.generate();
+} else {
+    genSer.writeHistory();
+}
@@ -15,6 +15,8 @@ import {
     PredefinedTypes,
     IAccessoryDesc,
     EMemberRefType,
+    SchemaLayoutHistory,
+    StringTypeId,
 } from './msgschema';
 import { ICombineType as IParserCombineType } from './parser';
 import { isGraterOrEqualThan } from './version';
@@ -165,6 +167,7 @@ export class SMessageCompiler {
             enumDefs: [],
             structDefs: [],
             accessories: [],
+            layoutHistory: this._collectLayoutHistory(),
         };
         objectDefs.forEach((typedef) => {
             if (typedef.type === 'enum') {
@@ -186,7 +189,7 @@ export class SMessageCompiler {
     }
 
     /**
-     * 以4字节对齐的方式，分析Struct的Bytes和member的type
+     * 以4字节对齐的方式(`@packed`的struct按自然对齐重排)，分析Struct的Bytes和member的type
      *
      * @private
      * @param {SMessageSchemas} msgs
@@ -204,6 +207,91 @@ export class SMessageCompiler {
         msgs.structDefs.forEach((sd) => {
             this._analyseStructDesc(sd, id2Types);
         });
+
+        msgs.structDefs.forEach((sd) => {
+            this._checkCoalesceKey(sd, id2Types);
+            this._checkFlatMembers(sd, id2Types);
+            this._checkSoaMembers(sd, id2Types);
+        });
+    }
+
+    /**
+     * `@flat`只能用于元素为native或plain struct的二维数组，gc按行顺序拷贝时各行才能保持连续
+     */
+    private _checkFlatMembers(sDesc: StructDescription, id2Types: Map<number, StructDescription | EnumDescription>) {
+        sDesc.members.forEach((member) => {
+            if (!member.flat) {
+                return;
+            }
+            const mtype = member.type;
+            if (mtype.descType !== TypeDescType.ArrayType || mtype.arrayDims !== 2) {
+                throw new Error(`@flat member ${sDesc.typeName}.${member.name} must be a two-dimensional array.`);
+            }
+            if (!this._isPlainType(mtype.baseType, id2Types)) {
+                throw new Error(`The items of @flat member ${sDesc.typeName}.${member.name} must be native types, enums or plain structs.`);
+            }
+        });
+    }
+
+    /**
+     * `@soa`只能用于元素struct的成员都是native(不含string)或enum的一维数组，每个成员对应一列
+     */
+    private _checkSoaMembers(sDesc: StructDescription, id2Types: Map<number, StructDescription | EnumDescription>) {
+        sDesc.members.forEach((member) => {
+            const mtype = member.type;
+            if (mtype.descType !== TypeDescType.ArrayType || !mtype.soa) {
+                return;
+            }
+            const item = mtype.baseType.descType === TypeDescType.UserDefType ? id2Types.get(mtype.baseType.typeId) : undefined;
+            const columnar = item?.type === 'struct' && item.members.every((mem) => {
+                if (mem.type.descType === TypeDescType.NativeSupportType) {
+                    return mem.type.typeId !== StringTypeId;
+                }
+                return mem.type.descType === TypeDescType.UserDefType && id2Types.get(mem.type.typeId)?.type === 'enum';
+            });
+            if (!columnar) {
+                throw new Error(`The items of @soa member ${sDesc.typeName}.${member.name} must be structs whose members are all native types or enums.`);
+            }
+        });
+    }
+
+    /**
+     * native(不含string)、enum，或成员都是这些类型的inline struct，不引用其他空间
+     */
+    private _isPlainType(type: AllTypeDesc, id2Types: Map<number, StructDescription | EnumDescription>): boolean {
+        if (type.descType === TypeDescType.NativeSupportType) {
+            return type.typeId !== StringTypeId;
+        }
+        if (type.descType !== TypeDescType.UserDefType) {
+            return false;
+        }
+        const desc = id2Types.get(type.typeId);
+        if (!desc || desc.type === 'enum') {
+            return !!desc;
+        }
+        return desc.members.every((member) => member.refType === EMemberRefType.inline && this._isPlainType(member.type, id2Types));
+    }
+
+    /**
+     * 合并key必须是整数、bool或enum成员，生成的代码按字节比较key
+     */
+    private _checkCoalesceKey(sDesc: StructDescription, id2Types: Map<number, StructDescription | EnumDescription>) {
+        const key = sDesc.coalesce?.key;
+        if (key === undefined) {
+            return;
+        }
+        const member = sDesc.members.find((mem) => mem.name === key);
+        if (!member) {
+            throw new Error(`The coalesce key ${key} is not a member of ${sDesc.scope}.${sDesc.typeName}.`);
+        }
+        const mtype = member.type;
+        if (mtype.descType === TypeDescType.NativeSupportType) {
+            if (mtype.typeId === StringTypeId || mtype.literal.startsWith('float')) {
+                throw new Error(`The coalesce key ${sDesc.typeName}.${key} must be an integer, bool or enum.`);
+            }
+        } else if (mtype.descType !== TypeDescType.UserDefType || id2Types.get(mtype.typeId)?.type !== 'enum') {
+            throw new Error(`The coalesce key ${sDesc.typeName}.${key} must be an integer, bool or enum.`);
+        }
     }
 
     private _analyseStructDesc(sDesc: StructDescription, id2Types: Map<number, StructDescription | EnumDescription>): StructDescription {
@@ -216,71 +304,49 @@ export class SMessageCompiler {
         }
         this._structAnalyzed.add(sDesc.typeId);
         const byteAlign = 4;
-        let byteSize = 0;
+        // 每个成员占用的字节数，以及其自然对齐
+        const memBytes: number[] = [];
+        const memAligns: number[] = [];
         for (let i = 0; i < sDesc.members.length; i++) {
             const member = sDesc.members[i];
             const mtDesc = member.type;
             if (mtDesc.descType === TypeDescType.NativeSupportType) {
-                const descByte = mtDesc.byteSize;
-                byteSize = this._increaseByteWithAlign(byteSize, descByte, Math.min(byteAlign, descByte));
                 member.refType = EMemberRefType.inline;
-                member.offset = byteSize - descByte;
                 member.typeId = mtDesc.typeId;
-            } else if (mtDesc.descType === TypeDescType.MapType) {
+                memBytes.push(mtDesc.byteSize);
+                memAligns.push(this._naturalAlign(mtDesc.byteSize));
+            } else if (mtDesc.descType === TypeDescType.MapType || mtDesc.descType === TypeDescType.ArrayType || mtDesc.descType === TypeDescType.CombineType) {
                 const desc = PredefinedTypes.find(t => t.typeId === mtDesc.typeId);
                 if (!desc) {
                     throw new Error('The mtDesc should be preDefined.');
                 }
                 const psByte = desc.preDefinedClass.prototype.byteLength;
-                byteSize = this._increaseByteWithAlign(byteSize, psByte, Math.min(byteAlign, psByte));
                 const insId = this._generateAccessoryType(mtDesc, sDesc.scope);
                 mtDesc.accessory = this._id2Accessory.get(insId);
                 member.refType = EMemberRefType.inline;
-                member.offset = byteSize - psByte;
-                member.typeId = insId;
-            } else if (mtDesc.descType === TypeDescType.ArrayType) {
-                const desc = PredefinedTypes.find(t => t.typeId === mtDesc.typeId);
-                if (!desc) {
-                    throw new Error('The mtDesc should be preDefined.');
-                }
-                const psByte = desc.preDefinedClass.prototype.byteLength;
-                byteSize = this._increaseByteWithAlign(byteSize, psByte, Math.min(byteAlign, psByte));
-                const insId = this._generateAccessoryType(mtDesc, sDesc.scope);
-                mtDesc.accessory = this._id2Accessory.get(insId);
-                member.refType = EMemberRefType.inline;
-                member.offset = byteSize - psByte;
-                member.typeId = insId;
-            } else if (mtDesc.descType === TypeDescType.CombineType) {
-                const desc = PredefinedTypes.find(t => t.typeId === mtDesc.typeId);
-                if (!desc) {
-                    throw new Error('The mtDesc should be preDefined.');
-                }
-                const psByte = desc.preDefinedClass.prototype.byteLength;
-                byteSize = this._increaseByteWithAlign(byteSize, psByte, Math.min(byteAlign, psByte));
-                const insId = this._generateAccessoryType(mtDesc, sDesc.scope);
-                mtDesc.accessory = this._id2Accessory.get(insId);
-                member.refType = EMemberRefType.inline;
-                member.offset = byteSize - psByte;
                 member.typeId = insId;
+                memBytes.push(psByte);
+                memAligns.push(Math.min(byteAlign, psByte));
             } else if (mtDesc.descType === TypeDescType.UserDefType) {
                 const dTDesc = id2Types.get(mtDesc.typeId);
                 if (dTDesc && 'byteLength' in dTDesc) {
                     const arst = this._analyseStructDesc(dTDesc, id2Types);
-                    let memByte = arst.byteLength;
                     if (this._isTypeDirectDependenceBy(sDesc, arst)) {
                         member.refType = EMemberRefType.reference;
-                        memByte = 4;
+                        memBytes.push(4);
+                        memAligns.push(4);
                     } else {
                         member.refType = EMemberRefType.inline;
+                        memBytes.push(arst.byteLength);
+                        // 只有@packed的struct按内嵌struct自身的对齐排列，普通struct与以前一样按4字节对齐
+                        memAligns.push(sDesc.packed ? this._structAlign.get(arst.typeId) || byteAlign : byteAlign);
                     }
-                    byteSize = this._increaseByteWithAlign(byteSize, memByte, Math.min(byteAlign, 4));
-                    member.offset = byteSize - memByte;
                     member.typeId = arst.typeId;
                 } else if (dTDesc && 'dataType' in dTDesc) {
                     member.refType = EMemberRefType.inline;
-                    byteSize = this._increaseByteWithAlign(byteSize, dTDesc.dataType.byteSize, Math.min(byteAlign, dTDesc.dataType.byteSize));
-                    member.offset = byteSize - dTDesc.dataType.byteSize;
                     member.typeId = dTDesc.dataType.typeId;
+                    memBytes.push(dTDesc.dataType.byteSize);
+                    memAligns.push(this._naturalAlign(dTDesc.dataType.byteSize));
                 } else {
                     throw new Error(`Unsupport type id: ${mtDesc.typeId}`);
                 }
@@ -288,6 +354,17 @@ export class SMessageCompiler {
                 throw new Error(`Error while deal the type: ${JSON.stringify(mtDesc)}`);
             }
         }
+        let byteSize = 0;
+        if (sDesc.packed) {
+            byteSize = this._packMembers(sDesc, memBytes, memAligns);
+            this._structAlign.set(sDesc.typeId, Math.max(1, ...memAligns));
+        } else {
+            // 按声明顺序，最多4字节对齐
+            sDesc.members.forEach((member, i) => {
+                byteSize = this._increaseByteWithAlign(byteSize, memBytes[i], Math.min(byteAlign, memAligns[i]));
+                member.offset = byteSize - memBytes[i];
+            });
+        }
         if (byteSize === 0) {
             throw new Error(`Deal with type: ${sDesc.scope}:${sDesc.typeName} error.`);
         }
@@ -295,6 +372,83 @@ export class SMessageCompiler {
         return sDesc;
     }
 
+    /**
+     * `@packed`的布局：按对齐从大到小、同对齐时从大到小排列成员，8字节的native按8字节对齐，
+     * 小的成员填进前面留下的空隙。上一版本已是`@packed`时，类型未变的成员保持原offset，
+     * 删除的成员占用的空间也不再使用，新成员只能放进空隙或追加在末尾，旧buffer因此仍能按新布局读取。
+     *
+     * @private
+     * @return {number} struct的byteLength，按最大的成员对齐取整
+     */
+    private _packMembers(sDesc: StructDescription, memBytes: number[], memAligns: number[]): number {
+        const prev = this._prevSchema?.structDefs.find((sd) => sd.typeId === sDesc.typeId && sd.packed);
+        const used: [number, number][] = [];
+        let byteSize = prev ? prev.byteLength : 0;
+        const pending: number[] = [];
+        sDesc.members.forEach((member, i) => {
+            const pm = prev?.members.find((mem) => mem.name === member.name);
+            if (pm && pm.typeId === member.typeId && pm.refType === member.refType && this._prevMemberByte(pm) === memBytes[i]) {
+                member.offset = pm.offset;
+                used.push([pm.offset, pm.offset + memBytes[i]]);
+            } else {
+                pending.push(i);
+            }
+        });
+        prev?.members.forEach((pm) => {
+            if (!sDesc.members.some((mem) => mem.name === pm.name && mem.offset === pm.offset)) {
+                used.push([pm.offset, pm.offset + this._prevMemberByte(pm)]);
+            }
+        });
+        pending.sort((a, b) => memAligns[b] - memAligns[a] || memBytes[b] - memBytes[a] || a - b);
+        pending.forEach((i) => {
+            // 从0开始找第一个放得下的对齐位置
+            const overlap = (offset: number) => used.find(([s, e]) => offset < e && s < offset + memBytes[i]);
+            let offset = 0;
+            for (let hit = overlap(offset); hit; hit = overlap(offset)) {
+                offset = this._alignUp(hit[1], memAligns[i]);
+            }
+            sDesc.members[i].offset = offset;
+            used.push([offset, offset + memBytes[i]]);
+        });
+        used.forEach(([, e]) => {
+            byteSize = Math.max(byteSize, e);
+        });
+        return this._alignUp(byteSize, Math.max(1, ...memAligns));
+    }
+
+    /**
+     * 上一版本中成员占用的字节数
+     */
+    private _prevMemberByte(member: StructDescription['members'][number]): number {
+        if (member.refType === EMemberRefType.reference) {
+            return 4;
+        }
+        const native = NativeSupportTypes.find((t) => t.typeId === member.typeId);
+        if (native) {
+            return native.byteSize;
+        }
+        const accessory = this._prevSchema?.accessories.find((ad) => ad.typeId === member.typeId);
+        if (accessory) {
+            return accessory.byteLength;
+        }
+        const sd = this._prevSchema?.structDefs.find((sd) => sd.typeId === member.typeId);
+        if (sd) {
+            return sd.byteLength;
+        }
+        throw new Error(`Unknown type id ${member.typeId} in the history schema.`);
+    }
+
+    /**
+     * 1、2、4、8字节的native按自身大小对齐，其余(如string)按4字节
+     */
+    private _naturalAlign(byteSize: number): number {
+        return byteSize <= 8 && (byteSize & (byteSize - 1)) === 0 ? byteSize : 4;
+    }
+
+    private _alignUp(btSize: number, alignSize: number) {
+        return Math.ceil(btSize / alignSize) * alignSize;
+    }
+
     private _increaseByteWithAlign(btSize: number, increase: number, alignSize: number) {
         const remainder = btSize % alignSize;
         if (remainder > 0) {
@@ -321,15 +475,47 @@ export class SMessageCompiler {
             members: [],
             dependences: [],
         };
+        structDef.cst.children.annotation?.forEach((annotation) => {
+            const name = annotation.children.Literal[0].image;
+            const args = (annotation.children.annotationArg || []).map((arg) => (arg.children.Literal || arg.children.NumberLiteral || [])[0].image);
+            if (name === 'coalesce') {
+                if (args.length > 1) {
+                    throw new Error(`@coalesce of ${structDef.scope}.${structDef.name} takes at most one key member.`);
+                }
+                ret.coalesce = args.length ? { key: args[0] } : {};
+            } else if (name === 'packed') {
+                if (args.length > 0) {
+                    throw new Error(`@packed of ${structDef.scope}.${structDef.name} takes no argument.`);
+                }
+                ret.packed = true;
+            } else {
+                throw new Error(`Unknown annotation @${name} on ${structDef.scope}.${structDef.name}.`);
+            }
+        });
         structDef.cst.children.memberDefine.forEach((memberDef) => {
             const memberName = memberDef.children.Literal[0].image;
             const memberType = this._cstTypeToTypeDesc(structDef.scope, memberDef.children.combineType[0]);
+            let flat = false;
+            memberDef.children.annotation?.forEach((annotation) => {
+                const name = annotation.children.Literal[0].image;
+                if (name === 'flat' && !annotation.children.annotationArg?.length) {
+                    flat = true;
+                } else if (name === 'soa' && !annotation.children.annotationArg?.length) {
+                    if (memberType.descType !== TypeDescType.ArrayType || memberType.arrayDims !== 1) {
+                        throw new Error(`@soa member ${structDef.scope}.${structDef.name}.${memberName} must be a one-dimensional array.`);
+                    }
+                    memberType.soa = true;
+                } else {
+                    throw new Error(`Unknown annotation @${name} on ${structDef.scope}.${structDef.name}.${memberName}.`);
+                }
+            });
             ret.members.push({
                 name: memberName,
                 type: memberType,
                 refType: EMemberRefType.unknow,
                 offset: -1,
                 typeId: -1,
+                ...(flat ? { flat } : {}),
             });
             if (memberType.descType === TypeDescType.UserDefType) {
                 ret.dependences.push(memberType.typeId);
@@ -572,7 +758,9 @@ export class SMessageCompiler {
 
     private _generateAccessoryType(type: IArrayTypeDesc | IMapTypeDesc | ICombineTypeDesc, currScope: string) {
         let ret: IAccessoryDesc;
-        if (type.descType === TypeDescType.ArrayType) {
+        if (type.descType === TypeDescType.ArrayType && type.soa) {
+            return this._generateSoaAccessoryType(type, currScope);
+        } else if (type.descType === TypeDescType.ArrayType) {
             const dim = type.arrayDims;
             const btype = this._getInstancedTypeId(type.baseType, currScope);
             let typeId = -1;
@@ -665,6 +853,36 @@ export class SMessageCompiler {
         throw new Error('Unsupport accessory type.');
     }
 
+    /**
+     * `@soa`的一维数组使用单独的辅助结构`MS_1_元素typeId`，与同元素的普通数组并存
+     */
+    private _generateSoaAccessoryType(type: IArrayTypeDesc, currScope: string) {
+        const btype = this._getInstancedTypeId(type.baseType, currScope);
+        const typeName = `MS_1_${btype}`;
+        const astruct = this._name2Accessory.get(typeName);
+        if (astruct) {
+            if (astruct.scope !== currScope) {
+                astruct.scope = '';
+            }
+            return astruct.typeId;
+        }
+        const noAccName = `@soa ${this.getNoAccessoryName(type, true)}`;
+        const typeId = this._getAdditionalAccessoryTypeId(noAccName);
+        const sacc: IAccessoryDesc = {
+            type: 'soaArray',
+            typeId,
+            typeName,
+            byteLength: StructArray.prototype.byteLength,
+            relyTypes: [btype],
+            scope: currScope,
+            noAccessoryName: noAccName,
+            humanReadName: `@soa ${this.getNoAccessoryName(type, false)}`,
+        };
+        this._id2Accessory.set(typeId, sacc);
+        this._name2Accessory.set(typeName, sacc);
+        return typeId;
+    }
+
     private _getInstancedTypeId(type: AllTypeDesc, currScope: string) {
         if (type.descType === TypeDescType.NativeSupportType || type.descType === TypeDescType.UserDefType) {
             return type.typeId;
@@ -685,6 +903,8 @@ export class SMessageCompiler {
     private _id2Accessory: Map<number, IAccessoryDesc> = new Map();
 
     private _structAnalyzed: Set<number> = new Set();
+    /** `@packed` struct作为inline成员时的对齐 */
+    private _structAlign: Map<number, number> = new Map();
 
     private _idlFiles: string[];
     private _fileNameToCst: Map<string, ISMSGParserResult> = new Map();
@@ -741,6 +961,32 @@ export class SMessageCompiler {
         return typeId;
     }
 
+    /**
+     * 之前各版本的struct布局，加上上一次生成的布局，生成器据此为布局变化的struct生成兼容读取
+     *
+     * @private
+     * @return {SchemaLayoutHistory[]} 从旧到新
+     * @memberof SMessageCompiler
+     */
+    private _collectLayoutHistory(): SchemaLayoutHistory[] {
+        if (!this._prevSchema) {
+            return [];
+        }
+        const prevVersion = this._prevSchema.version;
+        const history = (this._prevSchema.layoutHistory || []).filter((h) => h.version !== this._version);
+        if (this._prevSchema.structDefs.length > 0 && prevVersion !== this._version && !history.some((h) => h.version === prevVersion)) {
+            history.push({
+                version: prevVersion,
+                structs: this._prevSchema.structDefs.map((sd) => ({
+                    typeId: sd.typeId,
+                    byteLength: sd.byteLength,
+                    members: sd.members.map((mem) => ({ name: mem.name, refType: mem.refType, offset: mem.offset, typeId: mem.typeId })),
+                })),
+            });
+        }
+        return history;
+    }
+
     /**
      * 读取历史的version，历史的生成方式将会对本次的造成影响，因为需要考虑做migration
      *
@@ -26,7 +26,7 @@ export interface NativeSupportType extends ITypeDesc {
 }
 
 export interface IAccessoryDesc {
-    type: 'mapArray' | 'mapStruct' | 'combineType';
+    type: 'mapArray' | 'mapStruct' | 'combineType' | 'soaArray';
     typeId: number;
     byteLength: number;
     relyTypes: number[];
@@ -54,6 +54,10 @@ export interface IArrayTypeDesc extends ITypeDesc {
     typeId: typeof ArrayTypeId;
     baseType: AllTypeDesc;
     arrayDims: number;
+    /**
+     * `@soa`: 一维struct数组按列存放，每个成员一段连续的数据
+     */
+    soa?: boolean;
     accessory?: IAccessoryDesc;
 }
 
@@ -131,7 +135,40 @@ export interface StructDescription extends BaseDescription {
         offset: number;
         type: AllTypeDesc;
         typeId: number;
+        /**
+         * `@flat`: 二维数组各行的数据按行顺序连续存放在一个块中，生成按行或整块访问的span
+         */
+        flat?: boolean;
     }[];
+    /**
+     * `@coalesce`或`@coalesce(key)`: 发送队列中同类型(且key成员相同)的新消息替换还未发送的旧消息
+     */
+    coalesce?: {
+        key?: string;
+    };
+    /**
+     * `@packed`: 成员按对齐从大到小重排以减少padding，8字节的native按8字节对齐
+     */
+    packed?: boolean;
+}
+
+/**
+ * 某个历史版本中struct的布局，用于生成读取旧版本buffer的兼容类
+ */
+export interface StructLayoutDesc {
+    typeId: number;
+    byteLength: number;
+    members: {
+        name: string;
+        refType: EMemberRefType;
+        offset: number;
+        typeId: number;
+    }[];
+}
+
+export interface SchemaLayoutHistory {
+    version: string;
+    structs: StructLayoutDesc[];
 }
 
 export interface SMessageSchemas {
@@ -139,4 +176,6 @@ export interface SMessageSchemas {
     structDefs: StructDescription[];
     enumDefs: EnumDescription[];
     accessories: IAccessoryDesc[];
+    /** 之前生成过的各版本的struct布局，从旧到新 */
+    layoutHistory?: SchemaLayoutHistory[];
 }
@@ -24,6 +24,7 @@ const Struct = createToken({ name: 'Struct', pattern: /struct/ });
 const Equals = createToken({ name: 'Equals', pattern: /=/ });
 const Dot = createToken({ name: 'Dot', pattern: /\./ });
 const OROP = createToken({ name: 'OROP', pattern: /\|/ });
+const At = createToken({ name: 'At', pattern: /@/ });
 
 const StringLiteral = createToken({
     name: 'StringLiteral',
@@ -82,6 +83,7 @@ const allTokens = [
     Equals,
     Dot,
     OROP,
+    At,
     Literal,
 ];
 
@@ -157,6 +159,9 @@ class SMSGParser extends CstParser {
         });
 
         $.RULE('memberDefine', () => {
+            $.MANY(() => {
+                $.SUBRULE($['annotation']);
+            });
             $.CONSUME(Literal);
             $.OPTION(() => {
                 $.CONSUME(Colon);
@@ -164,7 +169,31 @@ class SMSGParser extends CstParser {
             });
         });
 
+        $.RULE('annotationArg', () => {
+            $.OR([{ ALT: () => $.CONSUME(Literal) }, { ALT: () => $.CONSUME(NumberLiteral) }]);
+        });
+
+        // @name 或 @name(arg, ...)，写在struct或成员之前
+        $.RULE('annotation', () => {
+            $.CONSUME(At);
+            $.CONSUME(Literal);
+            $.OPTION(() => {
+                $.CONSUME(LBracket);
+                $.OPTION1(() => {
+                    $.SUBRULE($['annotationArg']);
+                    $.MANY(() => {
+                        $.CONSUME(Comma);
+                        $.SUBRULE1($['annotationArg']);
+                    });
+                });
+                $.CONSUME(RBracket);
+            });
+        });
+
         $.RULE('struct', () => {
+            $.MANY1(() => {
+                $.SUBRULE($['annotation']);
+            });
             $.CONSUME(Struct);
             $.CONSUME(Literal);
             $.CONSUME(LCurly);
@@ -363,14 +392,31 @@ export interface ICombineType {
     };
 }
 
+export interface IAnnotationDef {
+    name: 'annotation';
+    children: {
+        At: [TokenDef<'@'>];
+        Literal: [TokenDef<string>];
+        annotationArg?: {
+            name: 'annotationArg';
+            children: {
+                Literal?: [TokenDef<string>];
+                NumberLiteral?: [TokenDef<string>];
+            };
+        }[];
+    };
+}
+
 export interface IStructDef {
     name: 'struct';
     children: {
+        annotation?: IAnnotationDef[];
         Struct: [TokenDef<'struct'>];
         Literal: [TokenDef<string>];
         memberDefine: {
             name: 'memberDefine';
             children: {
+                annotation?: IAnnotationDef[];
                 Literal: [TokenDef<string>];
                 Colon: [TokenDef<':'>];
                 combineType: [ICombineType];
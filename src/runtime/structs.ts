@@ -1,14 +1,17 @@
 
 function copyArrayBuffer(src: ArrayBuffer, soffset: number, target: ArrayBuffer, toffset: number, length: number) {
-    const srcDV = new DataView(src);
-    const tgtDV = new DataView(target);
-    for (let i = 0; i < length; i++) {
-        tgtDV.setUint8(i + toffset, srcDV.getUint8(i + soffset));
-    }
+    new Uint8Array(target, toffset, length).set(new Uint8Array(src, soffset, length));
 }
 
 const trashToGCRatio = 0.5;
 
+/**
+ * 数组数据区的对齐: 整除元素大小的最大2的幂(不超过8)，与C++的`itemAlignment`相同，native数组即为元素大小
+ */
+function itemAlignment(dataBytes: number) {
+    return Math.min(dataBytes & -dataBytes, 8) || 1;
+}
+
 export class StructBuffer {
     constructor(buf: ArrayBuffer) {
         this._buffer = buf;
@@ -98,7 +101,85 @@ export abstract class StructBase {
 
     public abstract get byteLength(): number;
 
-    public abstract $_gcStruct(): void;
+    /**
+     * 压缩buffer时调用，此时this指向新buffer中已经拷贝好的位置，
+     * 需要通过gc把自己引用的子空间拷贝过去并改写offset
+     */
+    public abstract $_gcStruct(gc: StructCollector): void;
+
+    /**
+     * 校验buffer时调用，检查自己引用的子空间都在buffer之内，见`StructVerifier`
+     */
+    public abstract $_verifyStruct(v: StructVerifier): void;
+
+    /**
+     * 生成patch时调用，此时this指向working buffer，把与target中对应值的差异写入，见`StructDiffer`
+     */
+    public abstract $_diffStruct(d: StructDiffer): void;
+
+    /**
+     * 紧凑编码和解码时调用，向w描述自己的结构，见`StructWireEncoder`
+     */
+    public abstract $_wireStruct(w: IStructWire): void;
+
+    /**
+     * 在原地应用`StructDiffer`生成的patch，消息的类型、nextAvailableOffset和内容(base的hash)必须与diff时的base相同。
+     * 先检查所有范围再写入，失败时消息不变。之前取得的view仍然有效。
+     *
+     * @returns patch不适用于这个消息或者已损坏时返回false
+     */
+    public applyPatch(patch: ArrayBuffer) {
+        const pView = new DataView(patch);
+        if (patch.byteLength < 12 + patchByteLength || pView.getInt32(0, true) !== PatchTypeId) {
+            return false;
+        }
+        const baseLength = pView.getInt32(16, true);
+        const length = pView.getInt32(20, true);
+        if (this.mainTypeId !== pView.getInt32(12, true) || this.$_nextAvailableOffset !== baseLength || length < baseLength) {
+            return false;
+        }
+        const rangesOffset = pView.getInt32(28, true);
+        const count = pView.getInt32(32, true);
+        const dataOffset = pView.getInt32(40, true);
+        const dataLength = pView.getInt32(44, true);
+        if (count < 0 || count % 2 || dataLength < 0 || (count && rangesOffset < 12) || rangesOffset + count * 4 > patch.byteLength || (dataLength && dataOffset < 12) || dataOffset + dataLength > patch.byteLength) {
+            return false;
+        }
+        let total = 0;
+        for (let i = 0; i < count; i += 2) {
+            const offset = pView.getInt32(rangesOffset + i * 4, true);
+            const rangeLength = pView.getInt32(rangesOffset + i * 4 + 4, true);
+            if (offset < 12 || rangeLength < 0 || offset > length - rangeLength) {
+                return false;
+            }
+            total += rangeLength;
+        }
+        if (total !== dataLength || patchBaseHash(this._buffer, baseLength) !== pView.getUint32(52, true)) {
+            return false;
+        }
+        if (length > baseLength) {
+            this.$_createSubBuffer(length - baseLength);
+        }
+        let src = dataOffset;
+        for (let i = 0; i < count; i += 2) {
+            const offset = pView.getInt32(rangesOffset + i * 4, true);
+            const rangeLength = pView.getInt32(rangesOffset + i * 4 + 4, true);
+            copyArrayBuffer(patch, src, this._buffer, offset, rangeLength);
+            src += rangeLength;
+        }
+        this.$_trashLength = pView.getInt32(24, true);
+        return true;
+    }
+
+    /**
+     * trash超过trashToGCRatio时应该在合适的时机调用`StructGC`压缩buffer
+     *
+     * @readonly
+     * @memberof StructBase
+     */
+    public get $_needGC() {
+        return this.$_trashLength / this.$_nextAvailableOffset > trashToGCRatio;
+    }
 
     protected get _dataView() {
         return this._sBuffer._dataView;
@@ -107,19 +188,15 @@ export abstract class StructBase {
         return this._sBuffer._buffer;
     }
 
+    /**
+     * 同一个buffer上的view共享StructBuffer，扩容后都能看到新的buffer。
+     * 扩容时不会gc，否则调用者手中的offset会失效，gc需要在外部通过`StructGC`进行。
+     */
     protected $_updateCapacity(minAddCapacity: number) {
-        if (this._offset !== 12) {
-            throw new Error('Cannot update capacity in a non-root struct.');
-        }
-
-        if (this.$_trashLength / this.$_nextAvailableOffset > trashToGCRatio) {
-            throw new Error('GC shold be impled.');
-        } else {
-            const nxtSize = Math.max(this._buffer.byteLength * 2, this._buffer.byteLength + Math.floor(this._buffer.byteLength * 0.5) + minAddCapacity);
-            const newBuffer = new ArrayBuffer(nxtSize);
-            copyArrayBuffer(this._buffer, 0, newBuffer, 0, this.$_nextAvailableOffset);
-            this._sBuffer.reset(newBuffer);
-        }
+        const nxtSize = Math.max(this._buffer.byteLength * 2, this._buffer.byteLength + Math.floor(this._buffer.byteLength * 0.5) + minAddCapacity);
+        const newBuffer = new ArrayBuffer(nxtSize);
+        copyArrayBuffer(this._buffer, 0, newBuffer, 0, this.$_nextAvailableOffset);
+        this._sBuffer.reset(newBuffer);
     }
 
     protected $_extendSubBuffer(offset: number, originLength: number, toLength: number) {
@@ -131,27 +208,27 @@ export abstract class StructBase {
             nxtavail += toLength - originLength;
             if (nxtavail > this._sBuffer._buffer.byteLength) {
                 this.$_updateCapacity(nxtavail - this._sBuffer._buffer.byteLength);
-                this.$_nextAvailableOffset = nxtavail;
             }
+            this.$_nextAvailableOffset = nxtavail;
             return offset;
         } else {
             const ret = nxtavail;
             nxtavail += toLength;
             if (nxtavail > this._sBuffer._buffer.byteLength) {
                 this.$_updateCapacity(nxtavail - this._sBuffer._buffer.byteLength);
-                this.$_nextAvailableOffset = nxtavail;
             }
+            this.$_nextAvailableOffset = nxtavail;
             return ret;
         }
     }
 
-    public $_createSubBuffer(byteLength: number) {
-        const curOffset = this.$_nextAvailableOffset;
+    public $_createSubBuffer(byteLength: number, alignment = 1) {
+        const curOffset = this.$_nextAvailableOffset + (alignment - (this.$_nextAvailableOffset % alignment)) % alignment;
         const nxtavail = curOffset + byteLength;
         if (nxtavail > this._sBuffer._buffer.byteLength) {
             this.$_updateCapacity(nxtavail - this._sBuffer._buffer.byteLength);
-            this.$_nextAvailableOffset = nxtavail;
         }
+        this.$_nextAvailableOffset = nxtavail;
         return curOffset;
     }
 
@@ -160,18 +237,19 @@ export abstract class StructBase {
     }
 
     public copyArrayBuffer(src: ArrayBuffer, soffset: number, target: ArrayBuffer, toffset: number, length: number) {
-        const srcDV = new DataView(src);
-        const tgtDV = new DataView(target);
-        for (let i = 0; i < length; i++) {
-            tgtDV.setUint8(i + toffset, srcDV.getUint8(i + soffset));
-        }
+        copyArrayBuffer(src, soffset, target, toffset, length);
     }
 
-    public copyToBuffer(sBuf: StructBuffer, offset: number) {
+    /**
+     * 同一个buffer中只拷贝值本身，子空间与原值共享；不同buffer时通过`StructCopier`深拷贝
+     */
+    public copyToBuffer(sBuf: StructBuffer, offset: number, creator?: IStructCreator) {
         if (sBuf === this._sBuffer) {
             copyArrayBuffer(this._sBuffer._buffer, this._offset, sBuf._buffer, offset, this.byteLength);
+        } else if (creator) {
+            new StructCopier(creator).copyValue(this, sBuf, offset);
         } else {
-            throw new Error('Should implement');
+            throw new Error('Copying to another buffer needs a creator');
         }
     }
 
@@ -179,6 +257,16 @@ export abstract class StructBase {
         return this._sBuffer;
     }
 
+    /**
+     * 在buffer中的位置
+     *
+     * @readonly
+     * @memberof StructBase
+     */
+    public get $_address() {
+        return this._offset;
+    }
+
     protected _sBuffer: StructBuffer;
     protected _offset: number;
 }
@@ -186,68 +274,100 @@ export abstract class StructBase {
 const utf8Encoder = new TextEncoder();
 const utf8Decoder = new TextDecoder('utf-8');
 
+function bytesEqual(left: Uint8Array, right: Uint8Array) {
+    if (left.length !== right.length) {
+        return false;
+    }
+    for (let i = 0; i < left.length; i++) {
+        if (left[i] !== right[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * 先按字节比较公共前缀，再按长度，返回值同memcmp
+ */
+function compareBytes(left: Uint8Array, right: Uint8Array) {
+    const length = Math.min(left.length, right.length);
+    for (let i = 0; i < length; i++) {
+        if (left[i] !== right[i]) {
+            return left[i] - right[i];
+        }
+    }
+    return left.length - right.length;
+}
+
 export class StructString extends StructBase {
+    /**
+     * data offset 以big-endian存储，第一个字节就不会与短字符串的0x80标志冲突
+     *
+     * @readonly
+     * @memberof StructString
+     */
+    public get dataOffset() {
+        return this._dataView.getInt32(this._offset);
+    }
+
+    public get isInline() {
+        return this.dataOffset <= 0;
+    }
+
     public get length() {
-        if (this._dataView.getInt32(this._offset, true) > 0) {
+        if (this.dataOffset > 0) {
             return this._dataView.getInt32(this._offset + 4, true);
         }
-        return this._dataView.getInt8(this._offset) & 0x7F;
+        return this._dataView.getUint8(this._offset) & 0x7F;
     }
 
     public getString() {
-        const dataOffset = this._dataView.getInt32(this._offset, true);
-        if (dataOffset > 0) {
-            const len = this._dataView.getInt32(this._offset + 4, true);
-            const u8ary = new Uint8Array(this._buffer, dataOffset, len);
-            return utf8Decoder.decode(u8ary);
-        } else {
-            const len = this._dataView.getInt8(this._offset) & 0x7F;
-            const u8ary = new Uint8Array(this._buffer, this._offset + 1, len);
-            return utf8Decoder.decode(u8ary);
-        }
+        return utf8Decoder.decode(this.getStringBuffer());
     }
 
     public getStringBuffer() {
-        const dataOffset = this._dataView.getInt32(this._offset, true);
+        const dataOffset = this.dataOffset;
         if (dataOffset > 0) {
             const len = this._dataView.getInt32(this._offset + 4, true);
             return new Uint8Array(this._buffer, dataOffset, len);
         } else {
-            const len = this._dataView.getInt8(this._offset) & 0x7F;
+            const len = this._dataView.getUint8(this._offset) & 0x7F;
             return new Uint8Array(this._buffer, this._offset + 1, len);
         }
     }
 
     public setString(str: string) {
         const buffer = utf8Encoder.encode(str);
-        const dataOffset = this._dataView.getInt32(this._offset, true);
+        const dataOffset = this.dataOffset;
         if (buffer.length < 12) {
-            if (dataOffset < 0) {
-                this._dataView.setInt8(this._offset, buffer.length | 0x80);
-                copyArrayBuffer(buffer, 0, this._buffer, this._offset + 1, buffer.length);
-            } else {
-                this._dataView.setInt32(this._offset + 4, buffer.length, true);
-                copyArrayBuffer(buffer, 0, this._buffer, dataOffset, buffer.length);
+            if (dataOffset > 0) {
+                this.$_trashLength += this._dataView.getInt32(this._offset + 8, true);
             }
+            const inlineBuf = new Uint8Array(this._buffer, this._offset, 12);
+            inlineBuf.fill(0);
+            inlineBuf[0] = buffer.length | 0x80;
+            inlineBuf.set(buffer, 1);
         } else {
-            if (dataOffset < 0) {
+            if (dataOffset <= 0) {
                 const ndoffset = this.$_createSubBuffer(buffer.length);
-                this._dataView.setInt32(this._offset, ndoffset, true);
+                this._dataView.setInt32(this._offset, ndoffset);
                 this._dataView.setInt32(this._offset + 4, buffer.length, true);
                 this._dataView.setInt32(this._offset + 8, buffer.length, true);
-                copyArrayBuffer(buffer, 0, this._buffer, ndoffset, buffer.length);
+                new Uint8Array(this._buffer, ndoffset, buffer.length).set(buffer);
             } else {
                 const cap = this._dataView.getInt32(this._offset + 8, true);
                 if (cap >= buffer.length) {
                     this._dataView.setInt32(this._offset + 4, buffer.length, true);
-                    copyArrayBuffer(buffer, 0, this._buffer, dataOffset, this.length);
+                    new Uint8Array(this._buffer, dataOffset, buffer.length).set(buffer);
                 } else {
                     const ndoffset = this.$_extendSubBuffer(dataOffset, cap, buffer.length);
-                    this._dataView.setInt32(this._offset, ndoffset, true);
+                    this._dataView.setInt32(this._offset, ndoffset);
                     this._dataView.setInt32(this._offset + 4, buffer.length, true);
                     this._dataView.setInt32(this._offset + 8, buffer.length, true);
-                    copyArrayBuffer(buffer, 0, this._buffer, ndoffset, buffer.length);
-                    this.$_trashLength += cap;
+                    new Uint8Array(this._buffer, ndoffset, buffer.length).set(buffer);
+                    if (ndoffset !== dataOffset) {
+                        this.$_trashLength += cap;
+                    }
                 }
             }
         }
@@ -259,7 +379,7 @@ export class StructString extends StructBase {
 
     /**
      * Memory structure:  
-     * `| data offset | str length | str capacity |`  
+     * `| data offset(big-endian) | str length | str capacity |`  
      * or  
      * `| 0b1 str len -- 1 byte | str Data -- 11 byte |`
      *
@@ -271,8 +391,67 @@ export class StructString extends StructBase {
         return 12;
     }
 
-    public $_gcStruct(): void {
-        void (0);
+    public $_gcStruct(gc: StructCollector): void {
+        const dataOffset = this.dataOffset;
+        if (dataOffset > 0) {
+            const len = this._dataView.getInt32(this._offset + 4, true);
+            // 拷贝到另一个消息时copy可能扩容，之后再取dataView
+            const newOffset = gc.copy(dataOffset, len);
+            this._dataView.setInt32(this._offset, newOffset);
+            this._dataView.setInt32(this._offset + 8, len, true);
+        }
+    }
+
+    public $_verifyStruct(v: StructVerifier): void {
+        const dataOffset = this.dataOffset;
+        if (dataOffset > 0) {
+            // 原地写入较长的字符串时使用整个capacity
+            const len = this._dataView.getInt32(this._offset + 4, true);
+            const capacity = this._dataView.getInt32(this._offset + 8, true);
+            if (len < 0 || capacity < len) {
+                v.fail('String', this._offset);
+                return;
+            }
+            v.claim(dataOffset, capacity, 'String', this._offset);
+        } else if ((this._dataView.getUint8(this._offset) & 0x7F) > 11) {
+            v.fail('String', this._offset);
+        }
+    }
+
+    public $_wireStruct(w: IStructWire): void {
+        w.string(this._offset);
+    }
+
+    /**
+     * 值相同时不修改，短字符串直接拷贝，长字符串在capacity足够时原地更新，否则分配新的空间
+     */
+    public $_diffStruct(d: StructDiffer): void {
+        const target = new StructString(d.targetBuffer, d.targetOf(this._offset));
+        const bytes = target.getStringBuffer();
+        if (bytesEqual(this.getStringBuffer(), bytes)) {
+            return;
+        }
+        const dataOffset = this.dataOffset;
+        const cap = dataOffset > 0 ? this._dataView.getInt32(this._offset + 8, true) : 0;
+        if (target.isInline) {
+            d.addTrash(cap);
+            d.write(this._offset, d.targetBuffer._buffer, target.$_address, 12);
+            return;
+        }
+        if (dataOffset > 0 && cap >= bytes.length) {
+            d.diffRange(dataOffset, target.dataOffset, bytes.length);
+            if (this.length !== bytes.length) {
+                d.storeInt32(this._offset + 4, bytes.length);
+            }
+            return;
+        }
+        d.addTrash(cap);
+        const ndoffset = d.allocate(bytes.length);
+        d.write(ndoffset, d.targetBuffer._buffer, target.dataOffset, bytes.length);
+        this._dataView.setInt32(this._offset, ndoffset);
+        this._dataView.setInt32(this._offset + 4, bytes.length, true);
+        this._dataView.setInt32(this._offset + 8, bytes.length, true);
+        d.markDirty(this._offset, 12);
     }
 }
 
@@ -307,7 +486,7 @@ export abstract class StructArray extends StructBase {
             originByte = this.capacity * this.dataBytes;
             this.$_trashLength += originByte;
         }
-        const newBuf = this.$_createSubBuffer(count * this.dataBytes);
+        const newBuf = this.$_createSubBuffer(count * this.dataBytes, itemAlignment(this.dataBytes));
         this._dataView.setInt32(this._offset, newBuf, true);
         this._dataView.setInt32(this._offset + 8, count, true);
         this._dataView.setInt32(this._offset + 4, this.size, true);
@@ -324,7 +503,7 @@ export abstract class StructArray extends StructBase {
      */
     public pushElement(src?: number) {
         if (this.capacity - this.size < 1) {
-            this.reserve(Math.min(this.capacity * 2, this.capacity + 20));
+            this.reserve(Math.min(Math.max(this.capacity * 2, 1), this.capacity + 20));
         }
         const existSize = this.size;
         this._dataView.setInt32(this._offset + 4, existSize + 1, true);
@@ -345,97 +524,2630 @@ export abstract class StructArray extends StructBase {
         return 12;
     }
 
-    public $_gcStruct(): void {
-        void(0);
+    public abstract $_gcStruct(gc: StructCollector): void;
+
+    public abstract $_verifyStruct(v: StructVerifier): void;
+
+    public abstract $_diffStruct(d: StructDiffer): void;
+
+    /**
+     * 只保留size个元素，capacity收缩为size。
+     * 元素按倒序入栈、顺序处理，二维数组各行的数据因此按行顺序紧密排列(`StructFlatRows`)
+     *
+     * @param itemTypeId 元素的类型, native类型为0
+     */
+    protected $_gcItems(gc: StructCollector, itemTypeId: number) {
+        const dataOffset = this.dataOffset;
+        const size = this.size;
+        if (dataOffset === 0 || size === 0) {
+            this._dataView.setInt32(this._offset, 0, true);
+            this._dataView.setInt32(this._offset + 8, 0, true);
+            return;
+        }
+        const dataBytes = this.dataBytes;
+        const newOffset = gc.copy(dataOffset, size * dataBytes, itemAlignment(dataBytes));
+        this._dataView.setInt32(this._offset, newOffset, true);
+        this._dataView.setInt32(this._offset + 8, size, true);
+        if (itemTypeId) {
+            for (let i = size - 1; i >= 0; i--) {
+                gc.visit(itemTypeId, newOffset + dataBytes * i);
+            }
+        }
     }
-}
 
-export abstract class StructMap extends StructBase {
-    public get size() {
-        return this._dataView.getInt32(this._offset, true);
+    /**
+     * 整个数据区(capacity × 元素大小)在buffer之内，native数组按元素大小对齐，再检查每个元素
+     *
+     * @param itemTypeId 元素的类型, native类型为0
+     */
+    protected $_verifyItems(v: StructVerifier, itemTypeId: number) {
+        const size = this.size;
+        const capacity = this.capacity;
+        if (size === 0 && capacity === 0) {
+            return;
+        }
+        const dataOffset = this.dataOffset;
+        const dataBytes = this.dataBytes;
+        if (size < 0 || capacity < size || (!itemTypeId && dataOffset % itemAlignment(dataBytes) !== 0) || !v.claim(dataOffset, capacity * dataBytes, 'Vector', this._offset)) {
+            v.fail('Vector', this._offset);
+            return;
+        }
+        if (itemTypeId && dataBytes) {
+            for (let i = 0; i < size; i++) {
+                v.visit(itemTypeId, dataOffset + dataBytes * i);
+            }
+        }
     }
 
-    public get capacity() {
-        return this._dataView.getInt32(this._offset + 4, true);
+    /**
+     * capacity不够时移动到末尾的新空间，已有的元素仍然逐个比较以复用它们的子空间
+     *
+     * @param itemTypeId 元素的类型, native类型为0
+     */
+    protected $_diffItems(d: StructDiffer, itemTypeId: number) {
+        const targetOffset = d.targetOf(this._offset);
+        const tView = d.targetBuffer._dataView;
+        const targetData = tView.getInt32(targetOffset, true);
+        const targetSize = tView.getInt32(targetOffset + 4, true);
+        const size = this.size;
+        if (targetSize === 0) {
+            if (size !== 0) {
+                d.storeInt32(this._offset + 4, 0);
+            }
+            return;
+        }
+        const dataOffset = this.dataOffset;
+        const dataBytes = this.dataBytes;
+        const kept = Math.min(size, targetSize);
+        let data = dataOffset;
+        if (dataOffset === 0 || this.capacity < targetSize) {
+            data = d.allocate(targetSize * dataBytes, itemAlignment(dataBytes));
+            if (dataOffset !== 0) {
+                copyArrayBuffer(this._buffer, dataOffset, this._buffer, data, kept * dataBytes);
+                d.addTrash(this.capacity * dataBytes);
+            }
+            d.storeInt32(this._offset, data);
+            d.storeInt32(this._offset + 8, targetSize);
+        }
+        if (size !== targetSize) {
+            d.storeInt32(this._offset + 4, targetSize);
+        }
+        if (!itemTypeId) {
+            // size之后的旧字节接收端同样持有，直接比较即可
+            d.diffRange(data, targetData, targetSize * dataBytes);
+            return;
+        }
+        for (let i = 0; i < targetSize; i++) {
+            // 原地复用size之后的空间时先清零，旧的引用可能指向仍在使用的数据
+            if (i >= kept && data === dataOffset) {
+                d.clear(data + dataBytes * i, dataBytes);
+            }
+            d.visitAt(itemTypeId, data + dataBytes * i, targetData + dataBytes * i);
+        }
     }
+}
 
-    public get dataOffset() {
-        return this._dataView.getInt32(this._offset + 8, true);
+/**
+ * `Float64Array`等，用于按整块或按行读取`StructFlatRows`
+ */
+export interface TypedArrayConstructor<T> {
+    new (buffer: ArrayBuffer, byteOffset: number, length: number): T;
+    readonly BYTES_PER_ELEMENT: number;
+}
+
+/**
+ * `@flat`二维数组的行视图: 各行的数据按行顺序连续存放在一个块中，外层数组的元素`| data offset | size | capacity |`就是行表。
+ * `setRows`/`flatten`和gc产生这样的布局，某一行扩容搬走后`isFlat`为false，可以用`flatten`恢复。
+ */
+export class StructFlatRows {
+    /**
+     * @param rows 外层数组
+     * @param itemBytes 元素的字节数
+     */
+    constructor(rows: StructArray, itemBytes: number) {
+        this._rows = rows;
+        this._itemBytes = itemBytes;
     }
 
-    public abstract get typeId(): number;
+    public get rowCount() {
+        return this._rows.size;
+    }
 
-    public abstract get keyByte(): number;
+    public rowSize(row: number) {
+        return this._view.getInt32(this._rows.dataOffset + 12 * row + 4, true);
+    }
 
-    public abstract get valueByte(): number;
+    /**
+     * 所有行的元素个数
+     */
+    public get itemCount() {
+        let count = 0;
+        for (let i = 0; i < this.rowCount; i++) {
+            count += this.rowSize(i);
+        }
+        return count;
+    }
 
     /**
-     * 4 byte: data offset, 4 byte: capacity, 4 byte: length
-     *
-     * @readonly
-     * @memberof StructArray
+     * 非空的行依次紧接着上一行，没有元素时也为true
      */
-    public get byteLength() {
-        return 12;
+    public get isFlat() {
+        let expected = 0;
+        for (let i = 0; i < this.rowCount; i++) {
+            const size = this.rowSize(i);
+            if (size === 0) {
+                continue;
+            }
+            const data = this._rowData(i);
+            if (expected !== 0 && data !== expected) {
+                return false;
+            }
+            expected = data + size * this._itemBytes;
+        }
+        return true;
     }
 
-    public $_gcStruct(): void {
-        void(0);
+    /**
+     * 整个块，例如`Point2D`的行用`block(Float64Array)`得到x,y交替的数组
+     */
+    public block<T>(ctor: TypedArrayConstructor<T>) {
+        if (!this.isFlat) {
+            throw new Error('The rows are not flat, call flatten first.');
+        }
+        let data = 0;
+        for (let i = 0; i < this.rowCount && !data; i++) {
+            data = this.rowSize(i) ? this._rowData(i) : 0;
+        }
+        return this._typed(ctor, data, this.itemCount);
     }
 
-    public compareString(left: string | StructString, right: string | StructString) {
-        const bufLeft = typeof left === 'string' ? utf8Encoder.encode(left) : left.getStringBuffer();
-        const bufRight = typeof right === 'string' ? utf8Encoder.encode(right) : right.getStringBuffer();
-        const compareLen = Math.min(bufLeft.length, bufRight.length);
-        for (let i = 0; i < compareLen; i++) {
-            if (bufLeft[i] < bufRight[i]) {
-                return 1;
-            } else if (bufLeft[i] > bufRight[i]) {
-                return -1;
+    public row<T>(ctor: TypedArrayConstructor<T>, row: number) {
+        return this._typed(ctor, this._rowData(row), this.rowSize(row));
+    }
+
+    /**
+     * 设为`sizes.length`行，第i行有`sizes[i]`个清零的元素，所有行的数据在一个连续块中。原有的行表和各行的数据计入trash
+     */
+    public setRows(sizes: number[]) {
+        const rows = this._rows;
+        let total = 0;
+        sizes.forEach((size) => {
+            total += size;
+        });
+        let trash = this._rowsDataLength();
+        if (rows.dataOffset !== 0) {
+            trash += rows.capacity * 12;
+        }
+        const table = sizes.length ? rows.$_createSubBuffer(sizes.length * 12, 4) : 0;
+        const block = total ? rows.$_createSubBuffer(total * this._itemBytes, itemAlignment(this._itemBytes)) : 0;
+        new Uint8Array(rows.$_structBuf()._buffer, table, sizes.length * 12).fill(0);
+        new Uint8Array(rows.$_structBuf()._buffer, block, total * this._itemBytes).fill(0);
+        const view = this._view;
+        view.setInt32(rows.$_address, table, true);
+        view.setInt32(rows.$_address + 4, sizes.length, true);
+        view.setInt32(rows.$_address + 8, sizes.length, true);
+        let data = block;
+        sizes.forEach((size, i) => {
+            if (size) {
+                view.setInt32(table + 12 * i, data, true);
+                view.setInt32(table + 12 * i + 4, size, true);
+                view.setInt32(table + 12 * i + 8, size, true);
+                data += size * this._itemBytes;
             }
+        });
+        rows.$_trashLength += trash;
+    }
+
+    /**
+     * 把各行的数据拷贝到一个新的连续块中，行表不变，原数据计入trash。已经连续时不做任何事
+     */
+    public flatten() {
+        if (this.isFlat) {
+            return;
         }
-        if (bufLeft.length < bufRight.length) {
-            return 1;
-        } else if (bufLeft.length > bufRight.length) {
-            return -1;
+        const trash = this._rowsDataLength();
+        let data = this._rows.$_createSubBuffer(this.itemCount * this._itemBytes, itemAlignment(this._itemBytes));
+        const buffer = this._rows.$_structBuf()._buffer;
+        const view = this._view;
+        for (let i = 0; i < this.rowCount; i++) {
+            const size = this.rowSize(i);
+            const header = this._rows.dataOffset + 12 * i;
+            if (size === 0) {
+                view.setInt32(header, 0, true);
+                view.setInt32(header + 8, 0, true);
+                continue;
+            }
+            copyArrayBuffer(buffer, this._rowData(i), buffer, data, size * this._itemBytes);
+            view.setInt32(header, data, true);
+            view.setInt32(header + 8, size, true);
+            data += size * this._itemBytes;
         }
-        return 0;
+        this._rows.$_trashLength += trash;
     }
 
-    protected toUint8Array(str: string) {
-        return utf8Encoder.encode(str);
+    private get _view() {
+        return this._rows.$_structBuf()._dataView;
     }
-}
 
-export abstract class StructCombine extends StructBase {
+    private _rowData(row: number) {
+        return this._view.getInt32(this._rows.dataOffset + 12 * row, true);
+    }
 
     /**
-     * Only one offset(Ptr) store in the array.
-     *
-     * @readonly
-     * @memberof StructCombine
+     * 各行已分配的数据长度(capacity)
      */
-    public get dataOffset() {
+    private _rowsDataLength() {
+        let length = 0;
+        for (let i = 0; i < this.rowCount; i++) {
+            if (this._rowData(i)) {
+                length += this._view.getInt32(this._rows.dataOffset + 12 * i + 8, true) * this._itemBytes;
+            }
+        }
+        return length;
+    }
+
+    private _typed<T>(ctor: TypedArrayConstructor<T>, data: number, count: number) {
+        if (this._itemBytes % ctor.BYTES_PER_ELEMENT !== 0) {
+            throw new Error('The item must be made of the typed array elements.');
+        }
+        return new ctor(this._rows.$_structBuf()._buffer, count ? data : 0, count * (this._itemBytes / ctor.BYTES_PER_ELEMENT));
+    }
+
+    private _rows: StructArray;
+    private _itemBytes: number;
+}
+
+/**
+ * `@soa`数组数据区的对齐，capacity总是偶数，所以每一列都按8对齐，与C++的`MsgSoaVectorBase`相同
+ */
+const soaAlignment = 8;
+
+function soaCapacity(count: number) {
+    return count + (count & 1);
+}
+
+/**
+ * `@soa`的struct数组: 头部与`StructArray`相同，数据区(capacity × 元素大小)按列存放，
+ * 偏移为o、大小为s的成员，第i个元素的值在`data + capacity × o + s × i`，每一列都可以作为typed array直接读取。
+ * 元素的成员只能是除string外的native类型或enum，所以gc、校验和patch都是逐列的字节操作。
+ */
+export abstract class StructSoaArray extends StructBase {
+
+    public get size() {
         return this._dataView.getInt32(this._offset + 4, true);
     }
 
-    public get dataType() {
-        return this._dataView.getInt32(this.dataOffset, true);
+    public get capacity() {
+        return this._dataView.getInt32(this._offset + 8, true);
+    }
+
+    public get dataOffset() {
+        return this._dataView.getInt32(this._offset, true);
+    }
+
+    public get byteLength() {
+        return 12;
     }
 
+    /**
+     * 元素struct的大小
+     */
+    public abstract get dataBytes(): number;
+
+    /**
+     * 元素struct的`wireMembers`，各成员的`typeId, offset`就是各列
+     */
+    public abstract get columns(): number[];
+
     public abstract get typeId(): number;
 
+    public reserve(count: number) {
+        const dataOffset = this.dataOffset;
+        const capacity = this.capacity;
+        if (dataOffset !== 0 && capacity >= count) {
+            return;
+        }
+        const size = this.size;
+        const newCapacity = soaCapacity(count);
+        const length = newCapacity * this.dataBytes;
+        const newOffset = this.$_createSubBuffer(length, soaAlignment);
+        new Uint8Array(this._buffer, newOffset, length).fill(0);
+        if (dataOffset !== 0) {
+            this._eachColumn((offset, bytes) => {
+                copyArrayBuffer(this._buffer, dataOffset + capacity * offset, this._buffer, newOffset + newCapacity * offset, size * bytes);
+            });
+            this.$_trashLength += capacity * this.dataBytes;
+        }
+        this._dataView.setInt32(this._offset, newOffset, true);
+        this._dataView.setInt32(this._offset + 8, newCapacity, true);
+    }
+
     /**
-     * CombineType 使用8字节，其中前4字节标示类型，后4字节如果类型长度<=4,那么标示为值，否则存储指针
-     * 当一个struct包含了combine类型的时候，它的byte一定是大于4的，所以不会发生循环包含的情况
-     *
-     * @memberof StructCombine
+     * 新增的元素清零
      */
-    public get byteLength() {
-        return 8;
+    public resize(count: number) {
+        const size = this.size;
+        const capacity = this.capacity;
+        if (this.dataOffset === 0 || capacity < count) {
+            this.reserve(Math.max(count, capacity * 2));
+        }
+        if (count > size) {
+            const dataOffset = this.dataOffset;
+            const newCapacity = this.capacity;
+            this._eachColumn((offset, bytes) => {
+                new Uint8Array(this._buffer, dataOffset + newCapacity * offset + size * bytes, (count - size) * bytes).fill(0);
+            });
+        }
+        this._dataView.setInt32(this._offset + 4, count, true);
+    }
+
+    /**
+     * 偏移为memberOffset的成员的一列，长度为size。扩容后原来的列不再有效
+     */
+    public column<T>(ctor: TypedArrayConstructor<T>, memberOffset: number) {
+        const dataOffset = this.dataOffset;
+        const size = dataOffset ? this.size : 0;
+        return new ctor(this._buffer, size ? dataOffset + this.capacity * memberOffset : 0, size);
     }
 
-    public $_gcStruct(): void {
-        void(0);
+    public abstract $_gcStruct(gc: StructCollector): void;
+
+    public abstract $_verifyStruct(v: StructVerifier): void;
+
+    public abstract $_diffStruct(d: StructDiffer): void;
+
+    /**
+     * capacity收缩为容纳size个元素的偶数，各列分别紧密拷贝
+     */
+    protected $_gcColumns(gc: StructCollector) {
+        const dataOffset = this.dataOffset;
+        const size = this.size;
+        const capacity = this.capacity;
+        if (dataOffset === 0 || size === 0) {
+            this._dataView.setInt32(this._offset, 0, true);
+            this._dataView.setInt32(this._offset + 8, 0, true);
+            return;
+        }
+        const newCapacity = soaCapacity(size);
+        const newOffset = gc.allocate(newCapacity * this.dataBytes, soaAlignment);
+        this._eachColumn((offset, bytes) => {
+            gc.copyTo(newOffset + newCapacity * offset, dataOffset + capacity * offset, size * bytes);
+        });
+        this._dataView.setInt32(this._offset, newOffset, true);
+        this._dataView.setInt32(this._offset + 8, newCapacity, true);
     }
+
+    /**
+     * 整个数据区(capacity × 元素大小)在buffer之内，capacity为偶数且数据区按8对齐
+     */
+    protected $_verifyColumns(v: StructVerifier) {
+        const size = this.size;
+        const capacity = this.capacity;
+        if (size === 0 && capacity === 0) {
+            return;
+        }
+        const dataOffset = this.dataOffset;
+        if (size < 0 || capacity < size || capacity % 2 !== 0 || dataOffset % soaAlignment !== 0 || !v.claim(dataOffset, capacity * this.dataBytes, 'Vector', this._offset)) {
+            v.fail('Vector', this._offset);
+        }
+    }
+
+    /**
+     * 逐列比较，capacity不够时各列搬到末尾的新数据区
+     */
+    protected $_diffColumns(d: StructDiffer) {
+        const targetOffset = d.targetOf(this._offset);
+        const tView = d.targetBuffer._dataView;
+        const targetData = tView.getInt32(targetOffset, true);
+        const targetSize = tView.getInt32(targetOffset + 4, true);
+        const targetCapacity = tView.getInt32(targetOffset + 8, true);
+        const size = this.size;
+        if (targetSize === 0) {
+            if (size !== 0) {
+                d.storeInt32(this._offset + 4, 0);
+            }
+            return;
+        }
+        const dataOffset = this.dataOffset;
+        const capacity = this.capacity;
+        const kept = Math.min(size, targetSize);
+        let data = dataOffset;
+        let dataCapacity = capacity;
+        if (dataOffset === 0 || capacity < targetSize) {
+            dataCapacity = soaCapacity(targetSize);
+            data = d.allocate(dataCapacity * this.dataBytes, soaAlignment);
+            if (dataOffset !== 0) {
+                this._eachColumn((offset, bytes) => {
+                    copyArrayBuffer(this._buffer, dataOffset + capacity * offset, this._buffer, data + dataCapacity * offset, kept * bytes);
+                });
+                d.addTrash(capacity * this.dataBytes);
+            }
+            d.storeInt32(this._offset, data);
+            d.storeInt32(this._offset + 8, dataCapacity);
+        }
+        if (size !== targetSize) {
+            d.storeInt32(this._offset + 4, targetSize);
+        }
+        // size之后的旧字节接收端同样持有，直接比较即可
+        this._eachColumn((offset, bytes) => {
+            d.diffRange(data + dataCapacity * offset, targetData + targetCapacity * offset, targetSize * bytes);
+        });
+    }
+
+    private _eachColumn(callback: (offset: number, bytes: number) => void) {
+        const columns = this.columns;
+        for (let i = 0; i < columns.length; i += 3) {
+            callback(columns[i + 1], nativeByteLengths[columns[i]]);
+        }
+    }
+}
+
+/**
+ * `StructSoaArray`中的一个元素，生成的子类按列读写各成员
+ */
+export class StructSoaItem {
+    constructor(array: StructSoaArray, index: number) {
+        this._array = array;
+        this._index = index;
+        this._sBuffer = array.$_structBuf();
+    }
+
+    public get index() {
+        return this._index;
+    }
+
+    /**
+     * 偏移为memberOffset、大小为byteLength的成员在buffer中的位置
+     */
+    protected _at(memberOffset: number, byteLength: number) {
+        return this._array.dataOffset + this._array.capacity * memberOffset + byteLength * this._index;
+    }
+
+    protected _sBuffer: StructBuffer;
+    private _array: StructSoaArray;
+    private _index: number;
+}
+
+export abstract class StructMap extends StructBase {
+    public get size() {
+        return this._dataView.getInt32(this._offset, true);
+    }
+
+    public get capacity() {
+        return this._dataView.getInt32(this._offset + 4, true);
+    }
+
+    public get dataOffset() {
+        return this._dataView.getInt32(this._offset + 8, true);
+    }
+
+    public abstract get typeId(): number;
+
+    public abstract get keyByte(): number;
+
+    public abstract get valueByte(): number;
+
+    /**
+     * 4 byte: data offset, 4 byte: capacity, 4 byte: length
+     *
+     * @readonly
+     * @memberof StructArray
+     */
+    public get byteLength() {
+        return 12;
+    }
+
+    public abstract $_gcStruct(gc: StructCollector): void;
+
+    public abstract $_verifyStruct(v: StructVerifier): void;
+
+    public abstract $_diffStruct(d: StructDiffer): void;
+
+    /**
+     * @param keyTypeId key的类型, native类型为0
+     * @param valueTypeId value的类型, native类型为0
+     */
+    protected $_gcEntries(gc: StructCollector, keyTypeId: number, valueTypeId: number) {
+        const dataOffset = this.dataOffset;
+        const size = this.size;
+        if (dataOffset === 0 || size === 0) {
+            this._dataView.setInt32(this._offset + 4, 0, true);
+            this._dataView.setInt32(this._offset + 8, 0, true);
+            return;
+        }
+        const entryByte = this.keyByte + this.valueByte;
+        const newOffset = gc.copy(dataOffset, size * entryByte);
+        this._dataView.setInt32(this._offset + 4, size, true);
+        this._dataView.setInt32(this._offset + 8, newOffset, true);
+        for (let i = 0; i < size; i++) {
+            if (keyTypeId) {
+                gc.visit(keyTypeId, newOffset + entryByte * i);
+            }
+            if (valueTypeId) {
+                gc.visit(valueTypeId, newOffset + entryByte * i + this.keyByte);
+            }
+        }
+    }
+
+    /**
+     * @param keyTypeId key的类型, native类型为0
+     * @param valueTypeId value的类型, native类型为0
+     */
+    protected $_verifyEntries(v: StructVerifier, keyTypeId: number, valueTypeId: number) {
+        const size = this.size;
+        if (size === 0) {
+            return;
+        }
+        const dataOffset = this.dataOffset;
+        const entryByte = this.keyByte + this.valueByte;
+        if (size < 0 || !v.claim(dataOffset, size * entryByte, 'Map', this._offset)) {
+            v.fail('Map', this._offset);
+            return;
+        }
+        for (let i = 0; i < size; i++) {
+            if (keyTypeId) {
+                v.visit(keyTypeId, dataOffset + entryByte * i);
+            }
+            if (valueTypeId) {
+                v.visit(valueTypeId, dataOffset + entryByte * i + this.keyByte);
+            }
+        }
+    }
+
+    /**
+     * key完全相同时逐个比较value，否则整体替换
+     *
+     * @param keyTypeId key的类型, native类型为0
+     * @param valueTypeId value的类型, native类型为0
+     */
+    protected $_diffEntries(d: StructDiffer, keyTypeId: number, valueTypeId: number) {
+        const targetOffset = d.targetOf(this._offset);
+        const tView = d.targetBuffer._dataView;
+        const targetSize = tView.getInt32(targetOffset, true);
+        const targetData = tView.getInt32(targetOffset + 8, true);
+        const size = this.size;
+        if (targetSize === 0) {
+            if (size !== 0) {
+                d.storeInt32(this._offset, 0);
+            }
+            return;
+        }
+        const keyByte = this.keyByte;
+        const entryByte = keyByte + this.valueByte;
+        const dataOffset = this.dataOffset;
+        if (size === targetSize && dataOffset !== 0 && this._sameKeys(d, keyTypeId, dataOffset, targetData)) {
+            for (let i = 0; i < size; i++) {
+                d.visitAt(valueTypeId, dataOffset + entryByte * i + keyByte, targetData + entryByte * i + keyByte, this.valueByte);
+            }
+            return;
+        }
+        if (dataOffset !== 0) {
+            d.addTrash(this.capacity * entryByte);
+        }
+        const data = d.allocate(targetSize * entryByte);
+        d.storeInt32(this._offset, targetSize);
+        d.storeInt32(this._offset + 4, targetSize);
+        d.storeInt32(this._offset + 8, data);
+        for (let i = 0; i < targetSize; i++) {
+            d.visitAt(keyTypeId, data + entryByte * i, targetData + entryByte * i, keyByte);
+            d.visitAt(valueTypeId, data + entryByte * i + keyByte, targetData + entryByte * i + keyByte, this.valueByte);
+        }
+    }
+
+    private _sameKeys(d: StructDiffer, keyTypeId: number, dataOffset: number, targetData: number) {
+        const entryByte = this.keyByte + this.valueByte;
+        for (let i = 0; i < this.size; i++) {
+            const entry = dataOffset + entryByte * i;
+            const targetEntry = targetData + entryByte * i;
+            const same = keyTypeId
+                ? bytesEqual(new StructString(this._sBuffer, entry).getStringBuffer(), new StructString(d.targetBuffer, targetEntry).getStringBuffer())
+                : bytesEqual(new Uint8Array(this._buffer, entry, this.keyByte), new Uint8Array(d.targetBuffer._buffer, targetEntry, this.keyByte));
+            if (!same) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    public compareString(left: string | StructString, right: string | StructString) {
+        const bufLeft = typeof left === 'string' ? utf8Encoder.encode(left) : left.getStringBuffer();
+        const bufRight = typeof right === 'string' ? utf8Encoder.encode(right) : right.getStringBuffer();
+        const compareLen = Math.min(bufLeft.length, bufRight.length);
+        for (let i = 0; i < compareLen; i++) {
+            if (bufLeft[i] < bufRight[i]) {
+                return 1;
+            } else if (bufLeft[i] > bufRight[i]) {
+                return -1;
+            }
+        }
+        if (bufLeft.length < bufRight.length) {
+            return 1;
+        } else if (bufLeft.length > bufRight.length) {
+            return -1;
+        }
+        return 0;
+    }
+
+    protected toUint8Array(str: string) {
+        return utf8Encoder.encode(str);
+    }
+}
+
+export abstract class StructCombine extends StructBase {
+
+    /**
+     * Only one offset(Ptr) store in the array.
+     *
+     * @readonly
+     * @memberof StructCombine
+     */
+    public get dataOffset() {
+        return this._dataView.getInt32(this._offset + 4, true);
+    }
+
+    public get dataType() {
+        return this._dataView.getInt32(this.dataOffset, true);
+    }
+
+    public abstract get typeId(): number;
+
+    /**
+     * CombineType 使用8字节，其中前4字节标示类型，后4字节如果类型长度<=4,那么标示为值，否则存储指针
+     * 当一个struct包含了combine类型的时候，它的byte一定是大于4的，所以不会发生循环包含的情况
+     *
+     * @memberof StructCombine
+     */
+    public get byteLength() {
+        return 8;
+    }
+
+    public abstract $_gcStruct(gc: StructCollector): void;
+
+    public abstract $_verifyStruct(v: StructVerifier): void;
+
+    public abstract $_diffStruct(d: StructDiffer): void;
+
+    /**
+     * 当前类型的值长度>4时存储在子空间中
+     *
+     * @param typeId 当前值的类型, native类型为0
+     */
+    protected $_gcValue(gc: StructCollector, typeId: number, byteLength: number) {
+        if (byteLength <= 4) {
+            if (typeId) {
+                gc.visit(typeId, this._offset + 4);
+            }
+            return;
+        }
+        const addr = this._dataView.getInt32(this._offset + 4, true);
+        if (addr) {
+            const newOffset = gc.copy(addr, byteLength, itemAlignment(byteLength));
+            this._dataView.setInt32(this._offset + 4, newOffset, true);
+            if (typeId) {
+                gc.visit(typeId, newOffset);
+            }
+        }
+    }
+
+    /**
+     * 已设置的值: 长度>4时地址必须指向buffer之内
+     *
+     * @param typeId 当前值的类型, native类型为0
+     */
+    protected $_verifyValue(v: StructVerifier, typeId: number, byteLength: number) {
+        if (byteLength <= 4) {
+            if (typeId) {
+                v.visit(typeId, this._offset + 4);
+            }
+            return;
+        }
+        const addr = this._dataView.getInt32(this._offset + 4, true);
+        if (v.claim(addr, byteLength, 'Combine', this._offset) && typeId) {
+            v.visit(typeId, addr);
+        }
+    }
+
+    /**
+     * 类型相同时比较值，否则重新设置，原来在子空间中的值计入trash
+     *
+     * @param typeIds 每个候选类型的typeId, native类型为0
+     * @param byteLengths 每个候选类型的长度
+     */
+    protected $_diffValue(d: StructDiffer, typeIds: number[], byteLengths: number[]) {
+        const targetOffset = d.targetOf(this._offset);
+        const tView = d.targetBuffer._dataView;
+        const index = this._dataView.getUint8(this._offset);
+        const targetIndex = tView.getUint8(targetOffset);
+        if (index !== targetIndex) {
+            if (index > 0 && byteLengths[index - 1] > 4 && this.dataOffset) {
+                d.addTrash(byteLengths[index - 1]);
+            }
+            this._dataView.setUint8(this._offset, targetIndex);
+            d.markDirty(this._offset, 1);
+            if (targetIndex === 0) {
+                return;
+            }
+            d.clear(this._offset + 4, 4);
+        } else if (targetIndex === 0) {
+            return;
+        }
+        const typeId = typeIds[targetIndex - 1];
+        const byteLength = byteLengths[targetIndex - 1];
+        if (byteLength <= 4) {
+            d.visitAt(typeId, this._offset + 4, targetOffset + 4, byteLength);
+            return;
+        }
+        const targetAddr = tView.getInt32(targetOffset + 4, true);
+        let addr = this.dataOffset;
+        if (!targetAddr) {
+            if (addr) {
+                d.storeInt32(this._offset + 4, 0);
+            }
+            return;
+        }
+        if (!addr) {
+            addr = d.allocate(byteLength, itemAlignment(byteLength));
+            d.storeInt32(this._offset + 4, addr);
+        }
+        d.visitAt(typeId, addr, targetAddr, byteLength);
+    }
+}
+
+/**
+ * 批量消息buffer的mainTypeId，位于内置类型(59~63)之前
+ */
+export const BatchTypeId = 58;
+
+export interface IBatchMessageClass<T extends StructBase> {
+    new (buf: StructBuffer, offset: number): T;
+    typeId(): number;
+    byteLength(): number;
+}
+
+/**
+ * 一个buffer中依次存放多个消息，root(12处)是索引数组`| dataOffset | size | cap |`，每项为`| typeId | offset | length |`。
+ * 所有消息共用batch的header，消息内的offset都是batch buffer中的绝对位置，读取时直接在batch buffer上创建view，不需要拷贝。
+ * 与C++的batch.hpp布局相同。
+ *
+ * 追加消息: `begin`分配消息的root(8字节对齐)，通过`messageFactory.createInStruct`等在同一个buffer中构建成员，然后`end`写入索引。
+ */
+export class MessageBatch extends StructBase {
+    static byteLength() {
+        return 12;
+    }
+
+    public static create(byteLength = 256) {
+        const batch = new MessageBatch(new ArrayBuffer(Math.max(byteLength, 24)), 12);
+        batch.mainTypeId = BatchTypeId;
+        batch.$_nextAvailableOffset = 24;
+        return batch;
+    }
+
+    public static from(buf: ArrayBuffer) {
+        const batch = new MessageBatch(buf, 12);
+        if (batch.mainTypeId !== BatchTypeId) {
+            throw new Error(`Not a message batch, mainTypeId: ${batch.mainTypeId}`);
+        }
+        return batch;
+    }
+
+    public get typeId() {
+        return BatchTypeId;
+    }
+
+    public get byteLength() {
+        return 12;
+    }
+
+    public $_gcStruct(gc: StructCollector): void {
+        throw new Error('MessageBatch is append only and cannot be collected.');
+    }
+
+    public $_diffStruct(d: StructDiffer): void {
+        throw new Error('MessageBatch is append only, diff the messages in it instead.');
+    }
+
+    public $_wireStruct(w: IStructWire): void {
+        throw new Error('MessageBatch is append only, encode the messages in it instead.');
+    }
+
+    /**
+     * 消息共用batch的buffer，只检查范围，消息内部的子空间由各自的类型校验
+     */
+    public $_verifyStruct(v: StructVerifier): void {
+        const size = this.count;
+        if (size === 0) {
+            return;
+        }
+        if (size < 0 || !v.claim(this._dataView.getInt32(this._offset, true), size * 12, 'Batch', this._offset)) {
+            v.fail('Batch', this._offset);
+            return;
+        }
+        for (let i = 0; i < size; i++) {
+            const offset = this.offsetAt(i);
+            if (!v.check(offset, this.lengthAt(i), 'Batch') || !v.check(offset, v.byteLengthOf(this.typeIdAt(i)), 'Batch')) {
+                return;
+            }
+            v.visit(this.typeIdAt(i), offset);
+        }
+    }
+
+    public get count() {
+        return this._dataView.getInt32(this._offset + 4, true);
+    }
+
+    public typeIdAt(index: number) {
+        return this._dataView.getInt32(this._entryOffset(index), true);
+    }
+
+    public offsetAt(index: number) {
+        return this._dataView.getInt32(this._entryOffset(index) + 4, true);
+    }
+
+    public lengthAt(index: number) {
+        return this._dataView.getInt32(this._entryOffset(index) + 8, true);
+    }
+
+    /**
+     * 第index个消息，creator一般为messageFactory
+     */
+    public get(index: number, creator: IStructCreator) {
+        return creator.create(this.typeIdAt(index), this._sBuffer, this.offsetAt(index));
+    }
+
+    public getAs<T extends StructBase>(index: number, cls: IBatchMessageClass<T>) {
+        const typeId = this.typeIdAt(index);
+        if (typeId !== cls.typeId()) {
+            throw new Error(`Batch message ${index} is ${typeId}, not ${cls.typeId()}`);
+        }
+        return new cls(this._sBuffer, this.offsetAt(index));
+    }
+
+    /**
+     * 消息的字节，是batch buffer的视图
+     */
+    public bytesAt(index: number) {
+        return new Uint8Array(this._buffer, this.offsetAt(index), this.lengthAt(index));
+    }
+
+    /**
+     * 预先分配索引，避免追加过程中索引被移动到末尾产生trash
+     */
+    public reserve(count: number) {
+        if (this._dataView.getInt32(this._offset, true) === 0 || this._dataView.getInt32(this._offset + 8, true) < count) {
+            this._reserveIndex(count);
+        }
+    }
+
+    /**
+     * 开始一个新消息，同一时间只能构建一个
+     */
+    public begin<T extends StructBase>(cls: IBatchMessageClass<T>) {
+        if (this._current) {
+            throw new Error('The previous batch message is not ended.');
+        }
+        const padding = (8 - (this.$_nextAvailableOffset % 8)) % 8;
+        this._current = this.$_createSubBuffer(padding + cls.byteLength()) + padding;
+        this._currentType = cls.typeId();
+        return new cls(this._sBuffer, this._current);
+    }
+
+    public end() {
+        if (!this._current) {
+            throw new Error('No batch message to end.');
+        }
+        const length = this.$_nextAvailableOffset - this._current;
+        const size = this.count;
+        const capacity = this._dataView.getInt32(this._offset + 8, true);
+        if (this._dataView.getInt32(this._offset, true) === 0 || capacity < size + 1) {
+            this._reserveIndex(Math.max(size + 1, capacity * 2));
+        }
+        this._dataView.setInt32(this._offset + 4, size + 1, true);
+        const entry = this._entryOffset(size);
+        this._dataView.setInt32(entry, this._currentType, true);
+        this._dataView.setInt32(entry + 4, this._current, true);
+        this._dataView.setInt32(entry + 8, length, true);
+        this._current = 0;
+    }
+
+    /**
+     * 与C++中MessageBuilder::reserve相同: 索引在末尾时原地扩展，否则移动到末尾
+     */
+    private _reserveIndex(count: number) {
+        const dataOffset = this._dataView.getInt32(this._offset, true);
+        const originByte = this._dataView.getInt32(this._offset + 8, true) * 12;
+        let newOffset: number;
+        if (dataOffset !== 0 && dataOffset + originByte === this.$_nextAvailableOffset) {
+            newOffset = this.$_extendSubBuffer(dataOffset, originByte, count * 12);
+        } else {
+            newOffset = this.$_createSubBuffer(count * 12, itemAlignment(12));
+            if (dataOffset !== 0) {
+                copyArrayBuffer(this._buffer, dataOffset, this._buffer, newOffset, originByte);
+                this.$_trashLength += originByte;
+            }
+        }
+        this._dataView.setInt32(this._offset, newOffset, true);
+        this._dataView.setInt32(this._offset + 8, count, true);
+    }
+
+    private _entryOffset(index: number) {
+        return this._dataView.getInt32(this._offset, true) + index * 12;
+    }
+
+    private _current = 0;
+    private _currentType = 0;
+}
+
+export interface IStructCreator {
+    create(typeId: number, buf: StructBuffer, offset: number): StructBase;
+}
+
+/**
+ * 按schema拷贝子空间的公共部分: `$_gcStruct`中this指向目标buffer中已经拷贝好的值，
+ * 通过这里把它引用的子空间拷贝到目标buffer末尾并改写offset。`StructGC`拷贝到新buffer，`StructCopier`拷贝到另一个消息。
+ */
+export abstract class StructCollector {
+    constructor(creator: IStructCreator, to: StructBuffer) {
+        this._creator = creator;
+        this._to = to;
+    }
+
+    /**
+     * 目标buffer中offset处的值已经拷贝，稍后处理它引用的子空间
+     */
+    public visit(typeId: number, offset: number) {
+        this._tasks.push(typeId, offset);
+    }
+
+    /**
+     * 引用类型成员: 被多处引用的struct只拷贝一次
+     */
+    public visitReference(typeId: number, byteLength: number, addrOffset: number) {
+        const addr = this._to._dataView.getInt32(addrOffset, true);
+        if (!addr) {
+            return;
+        }
+        const moved = this._forward.get(addr);
+        if (moved !== undefined) {
+            this._to._dataView.setInt32(addrOffset, moved, true);
+            return;
+        }
+        const newOffset = this.copy(addr, byteLength, itemAlignment(byteLength));
+        this._forward.set(addr, newOffset);
+        this._to._dataView.setInt32(addrOffset, newOffset, true);
+        this.visit(typeId, newOffset);
+    }
+
+    /**
+     * 在目标buffer末尾分配清零的子空间
+     */
+    public allocate(length: number, alignment = 1) {
+        return this._allocate(length, alignment);
+    }
+
+    /**
+     * 从原buffer拷贝到目标buffer中已经分配的位置
+     */
+    public copyTo(offset: number, fromOffset: number, length: number) {
+        copyArrayBuffer(this._source, fromOffset, this._to._buffer, offset, length);
+    }
+
+    /**
+     * 从原buffer拷贝一段子空间到目标buffer末尾
+     */
+    public copy(fromOffset: number, length: number, alignment = 1) {
+        const offset = this._allocate(length, alignment);
+        copyArrayBuffer(this._source, fromOffset, this._to._buffer, offset, length);
+        return offset;
+    }
+
+    /**
+     * 处理一个任务，调用方决定何时停止
+     */
+    protected _runTask() {
+        const offset = this._tasks.pop() as number;
+        const typeId = this._tasks.pop() as number;
+        this._creator.create(typeId, this._to, offset).$_gcStruct(this);
+    }
+
+    protected abstract _allocate(length: number, alignment: number): number;
+
+    protected abstract get _source(): ArrayBuffer;
+
+    protected _creator: IStructCreator;
+    protected _to: StructBuffer;
+    protected _tasks: number[] = [];
+    protected _forward: Map<number, number> = new Map();
+}
+
+/**
+ * 压缩消息buffer: 从root(12)开始按schema遍历，只把存活的子空间紧密拷贝到新buffer，
+ * 去掉trash以及数组、字符串多余的capacity，与C++的gc.hpp产生相同的布局。
+ *
+ * 可以通过`step`分多次完成，每次最多拷贝约budget字节，避免卡住UI线程。
+ * 分步进行时不能修改消息，如果期间发生了分配(header变化)会从头开始。
+ * 原地的修改(setter、`setItem`、typed array、不超过capacity的字符串等)不改变header，可能写在已经拷贝过的数据上而丢失，修改后需要调用`restart`。
+ * 完成后StructBuffer被替换为新buffer，除root外之前取得的view需要重新获取。
+ */
+export class StructGC extends StructCollector {
+    constructor(root: StructBase, creator: IStructCreator) {
+        const from = root.$_structBuf();
+        super(creator, new StructBuffer(new ArrayBuffer(from._buffer.byteLength)));
+        this._root = root;
+        this._from = from;
+        this._fromBuffer = from._buffer;
+        this._restart();
+    }
+
+    /**
+     * @param budget 本次最多拷贝的字节数
+     * @returns 是否已经完成
+     */
+    public step(budget = Infinity) {
+        if (this._done) {
+            return true;
+        }
+        if (this._from._buffer !== this._fromBuffer || this._root.$_nextAvailableOffset !== this._nextAvailable || this._root.$_trashLength !== this._trash) {
+            this._fromBuffer = this._from._buffer;
+            this._restart();
+        }
+        const start = this._next;
+        while (this._tasks.length && this._next - start < budget) {
+            this._runTask();
+        }
+        if (this._tasks.length) {
+            return false;
+        }
+        this._to._dataView.setInt32(8, this._next, true);
+        this._from.reset(this._to._buffer);
+        this._done = true;
+        return true;
+    }
+
+    public run() {
+        this.step();
+    }
+
+    /**
+     * 消息被原地修改后从头开始
+     */
+    public restart() {
+        this._fromBuffer = this._from._buffer;
+        this._done = false;
+        this._restart();
+    }
+
+    protected _allocate(length: number, alignment: number) {
+        this._next += (alignment - (this._next % alignment)) % alignment;
+        const offset = this._next;
+        this._next += length;
+        // 对齐的padding可能使结果比原buffer长
+        if (this._next > this._to._buffer.byteLength) {
+            const buf = new ArrayBuffer(Math.max(this._to._buffer.byteLength * 2, this._next));
+            copyArrayBuffer(this._to._buffer, 0, buf, 0, offset);
+            this._to.reset(buf);
+        }
+        return offset;
+    }
+
+    protected get _source() {
+        return this._fromBuffer;
+    }
+
+    private _restart() {
+        this._nextAvailable = this._root.$_nextAvailableOffset;
+        this._trash = this._root.$_trashLength;
+        if (this._to._buffer.byteLength < this._from._buffer.byteLength) {
+            this._to.reset(new ArrayBuffer(this._from._buffer.byteLength));
+        } else {
+            new Uint8Array(this._to._buffer).fill(0);
+        }
+        this._tasks = [];
+        this._forward.clear();
+        this._next = 12 + this._root.byteLength;
+        copyArrayBuffer(this._from._buffer, 0, this._to._buffer, 0, this._next);
+        this._to._dataView.setInt32(4, 0, true);
+        this.visit(this._root.typeId, 12);
+    }
+
+    private _root: StructBase;
+    private _from: StructBuffer;
+    private _fromBuffer: ArrayBuffer;
+    private _next = 0;
+    private _nextAvailable = 0;
+    private _trash = 0;
+    private _done = false;
+}
+
+/**
+ * 把一个值(struct、数组、map、combine、字符串)及它引用的子空间深拷贝到另一个消息中，比如把收到的消息的一部分转发到新消息。
+ * 子空间按schema整块拷贝到目标buffer末尾并改写地址，与gc一样去掉trash和多余的capacity，被多处引用的struct只拷贝一次。
+ * 与C++的`copyValue`产生相同的布局。源和目标可以是同一个buffer。
+ */
+export class StructCopier extends StructCollector {
+    constructor(creator: IStructCreator) {
+        super(creator, new StructBuffer(new ArrayBuffer(0)));
+        this._from = this._to;
+    }
+
+    /**
+     * 目标位置原来的值引用的子空间不再可达，不计入trash。目标buffer可能扩容，同一个StructBuffer上的view仍然有效。
+     *
+     * @param value 要拷贝的值
+     * @param to 目标消息的StructBuffer
+     * @param offset 目标位置(一个value.byteLength大小的成员或元素)，不能在value之内
+     * @returns 目标位置上的view
+     */
+    public copyValue<T extends StructBase>(value: T, to: StructBuffer, offset: number): T {
+        this._from = value.$_structBuf();
+        this._to = to;
+        this._target = this._creator.create(value.typeId, to, offset);
+        this._tasks = [];
+        this._forward.clear();
+        copyArrayBuffer(this._from._buffer, value.$_address, to._buffer, offset, value.byteLength);
+        this.visit(value.typeId, offset);
+        while (this._tasks.length) {
+            this._runTask();
+        }
+        return this._target as T;
+    }
+
+    protected _allocate(length: number, alignment: number) {
+        return (this._target as StructBase).$_createSubBuffer(length, alignment);
+    }
+
+    /**
+     * 源和目标是同一个buffer时，扩容后从新buffer读取
+     */
+    protected get _source() {
+        return this._from._buffer;
+    }
+
+    private _from: StructBuffer;
+    private _target?: StructBase;
+}
+
+/**
+ * 按schema一次遍历校验来自不可信来源的buffer，通过后可以直接使用生成的accessor读取。
+ * 检查每个引用、字符串、数组(size × 元素大小)、map以及combine的index都在buffer之内，与C++的verifier.hpp规则相同。
+ *
+ * 被多处引用的struct只校验一次，子空间的总长度不能超过buffer，因此耗时与buffer长度成线性。
+ * `maxDepth`限制嵌套层数(比如RecuTest的引用链)，使用显式的任务栈。
+ */
+export class StructVerifier {
+    constructor(creator: IStructCreator, maxDepth = 64) {
+        this._creator = creator;
+        this._maxDepth = maxDepth;
+    }
+
+    /**
+     * @returns 是否通过，失败原因见`error`
+     */
+    public verify(buf: ArrayBuffer, rootTypeId: number) {
+        this._sBuffer = new StructBuffer(buf);
+        this._tasks = [];
+        this._visited.clear();
+        this._error = '';
+        this._depth = 0;
+        const view = this._sBuffer._dataView;
+        if (buf.byteLength < 12 || view.getInt32(0, true) !== rootTypeId) {
+            this.fail('Header', 0);
+            return false;
+        }
+        const rootLength = this.byteLengthOf(rootTypeId);
+        this._end = view.getInt32(8, true);
+        if (buf.byteLength < 12 + rootLength || this._end < 12 + rootLength || this._end > buf.byteLength) {
+            this.fail('Header', 8);
+            return false;
+        }
+        this._budget = this._end;
+        this._visited.add(`${rootTypeId}:12`);
+        this.visit(rootTypeId, 12);
+        while (this._tasks.length && !this._error) {
+            this._depth = this._tasks.pop() as number;
+            const offset = this._tasks.pop() as number;
+            const typeId = this._tasks.pop() as number;
+            this._creator.create(typeId, this._sBuffer, offset).$_verifyStruct(this);
+        }
+        return !this._error;
+    }
+
+    public get error() {
+        return this._error;
+    }
+
+    public get dataView() {
+        return this._sBuffer._dataView;
+    }
+
+    /**
+     * offset处的值已经在合法范围内，稍后检查它引用的子空间
+     */
+    public visit(typeId: number, offset: number) {
+        if (this._depth >= this._maxDepth) {
+            this.fail('Depth', offset);
+            return;
+        }
+        this._tasks.push(typeId, offset, this._depth + 1);
+    }
+
+    /**
+     * 引用类型成员: 地址为0或者指向buffer内的一个struct
+     */
+    public visitReference(typeId: number, byteLength: number, addrOffset: number) {
+        const addr = this._sBuffer._dataView.getInt32(addrOffset, true);
+        const key = `${typeId}:${addr}`;
+        if (!addr || this._visited.has(key)) {
+            return;
+        }
+        this._visited.add(key);
+        if (this.claim(addr, byteLength, 'Reference', addrOffset)) {
+            this.visit(typeId, addr);
+        }
+    }
+
+    /**
+     * 检查范围并计入子空间总长度
+     */
+    public claim(offset: number, length: number, what: string, owner: number) {
+        if (!this.check(offset, length, what, owner)) {
+            return false;
+        }
+        this._budget -= length;
+        if (this._budget < 0) {
+            this.fail('Budget', owner);
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * [offset, offset + length)在root之后、nextAvailableOffset之前
+     */
+    public check(offset: number, length: number, what: string, owner = offset) {
+        if (!(offset >= 12 && length >= 0 && offset + length <= this._end)) {
+            this.fail(what, owner);
+            return false;
+        }
+        return true;
+    }
+
+    public fail(what: string, offset: number) {
+        if (!this._error) {
+            this._error = `${what} at ${offset}`;
+        }
+    }
+
+    public byteLengthOf(typeId: number) {
+        return this._creator.create(typeId, this._sBuffer, 0).byteLength;
+    }
+
+    private _creator: IStructCreator;
+    private _maxDepth: number;
+    private _sBuffer = new StructBuffer(new ArrayBuffer(0));
+    private _tasks: number[] = [];
+    private _visited: Set<string> = new Set();
+    private _error = '';
+    private _end = 0;
+    private _budget = 0;
+    private _depth = 0;
+}
+
+/**
+ * patch消息的mainTypeId，位于batch(58)之前
+ */
+export const PatchTypeId = 57;
+
+/**
+ * patch的root: `| baseTypeId | baseLength | length | trashLength | ranges | data | baseHash |`，与C++的patch.hpp布局相同
+ */
+const patchByteLength = 44;
+
+/**
+ * base消息`[12, length)`的FNV-1a，与C++的`patchBaseHash`相同，header中的trash不参与
+ */
+export function patchBaseHash(buffer: ArrayBuffer, length: number) {
+    const bytes = new Uint8Array(buffer, 0, length);
+    let hash = 2166136261;
+    for (let i = 12; i < length; i++) {
+        hash = Math.imul(hash ^ bytes[i], 16777619);
+    }
+    return hash >>> 0;
+}
+
+/**
+ * 两段差异之间相同的字节少于一个range项(8字节)时合并
+ */
+const rangeMergeGap = 8;
+
+/**
+ * 按schema比较两个同类型的消息，生成把base更新为target的patch，接收端通过`applyPatch`原地更新，与C++的patch.hpp规则相同。
+ *
+ * 在base的副本(working buffer)上进行: native字段只写入变化的字节，字符串和数组在原有capacity足够时原地更新，
+ * 否则在末尾分配新的子空间(旧的计入trash)，引用的struct按(typeId, 地址)对应后递归比较，没有对应的struct时拷贝target的。
+ * 最后把写入过的base范围和新增的子空间作为`(offset, length)`段写入patch，应用时不需要schema。
+ */
+export class StructDiffer {
+    constructor(creator: IStructCreator) {
+        this._creator = creator;
+    }
+
+    /**
+     * @param base 接收端持有的消息root
+     * @param target 要发送的消息root
+     * @returns patch消息的buffer
+     */
+    public diff(base: StructBase, target: StructBase) {
+        if (base.typeId !== target.typeId || base.mainTypeId !== base.typeId || target.mainTypeId !== target.typeId) {
+            throw new Error(`Cannot diff message ${base.mainTypeId} against ${target.mainTypeId}.`);
+        }
+        this._baseLength = base.$_nextAvailableOffset;
+        this._trash = base.$_trashLength;
+        this._baseHash = patchBaseHash(base.$_structBuf()._buffer, this._baseLength);
+        this._end = this._baseLength;
+        const working = new ArrayBuffer(Math.max(this._baseLength * 2, 64));
+        copyArrayBuffer(base.$_structBuf()._buffer, 0, working, 0, this._baseLength);
+        this._working = new StructBuffer(working);
+        this.targetBuffer = target.$_structBuf();
+        this._dirty = [];
+        this._tasks = [];
+        this._forward.clear();
+        this._matched.clear();
+        this._matched.add(`${base.typeId}:12`);
+        this._forward.set(12, 12);
+        this.visitAt(base.typeId, 12, 12);
+        while (this._tasks.length) {
+            const targetOffset = this._tasks.pop() as number;
+            const offset = this._tasks.pop() as number;
+            const typeId = this._tasks.pop() as number;
+            this._delta = targetOffset - offset;
+            this._creator.create(typeId, this._working, offset).$_diffStruct(this);
+        }
+        return this._writePatch(base.typeId);
+    }
+
+    /**
+     * 当前struct中offset处的成员在target中的位置
+     */
+    public targetOf(offset: number) {
+        return offset + this._delta;
+    }
+
+    /**
+     * 当前struct的成员，与C++的`DiffMemberRecorder`相同立即比较，多个成员分配新空间的顺序因此与C++相同
+     */
+    public visit(typeId: number, offset: number) {
+        this._creator.create(typeId, this._working, offset).$_diffStruct(this);
+    }
+
+    /**
+     * 比较offset处的值，native类型(typeId为0)直接比较字节
+     */
+    public visitAt(typeId: number, offset: number, targetOffset: number, byteLength = 0) {
+        if (typeId) {
+            this._tasks.push(typeId, offset, targetOffset);
+        } else {
+            this.diffRange(offset, targetOffset, byteLength);
+        }
+    }
+
+    /**
+     * 引用类型成员: target中被多处引用的struct只对应一次，保持共享
+     */
+    public visitReference(typeId: number, byteLength: number, addrOffset: number) {
+        const targetAddr = this.targetBuffer._dataView.getInt32(addrOffset + this._delta, true);
+        const addr = this._working._dataView.getInt32(addrOffset, true);
+        if (!targetAddr) {
+            if (addr) {
+                this.storeInt32(addrOffset, 0);
+            }
+            return;
+        }
+        const forward = this._forward.get(targetAddr);
+        if (forward !== undefined) {
+            if (addr !== forward) {
+                this.storeInt32(addrOffset, forward);
+            }
+            return;
+        }
+        const key = `${typeId}:${addr}`;
+        if (addr && !this._matched.has(key)) {
+            this._matched.add(key);
+            this._forward.set(targetAddr, addr);
+            this._tasks.push(typeId, addr, targetAddr);
+            return;
+        }
+        // base中这个struct已经对应了target中的另一个struct，拷贝一份
+        const copy = this.allocate(byteLength, itemAlignment(byteLength));
+        this._forward.set(targetAddr, copy);
+        this.storeInt32(addrOffset, copy);
+        this._tasks.push(typeId, copy, targetAddr);
+    }
+
+    /**
+     * 当前struct中的native成员
+     */
+    public diffBytes(offset: number, length: number) {
+        this.diffRange(offset, offset + this._delta, length);
+    }
+
+    /**
+     * 把不同的字节写入working buffer，相隔很近的差异合并为一段
+     */
+    public diffRange(offset: number, targetOffset: number, length: number) {
+        const from = new Uint8Array(this._working._buffer, offset, length);
+        const to = new Uint8Array(this.targetBuffer._buffer, targetOffset, length);
+        let i = 0;
+        while (i < length) {
+            if (from[i] === to[i]) {
+                i++;
+                continue;
+            }
+            const start = i;
+            let end = i + 1;
+            for (i = end; i < length && i - end < rangeMergeGap; i++) {
+                if (from[i] !== to[i]) {
+                    end = i + 1;
+                }
+            }
+            from.set(to.subarray(start, end), start);
+            this.markDirty(offset + start, end - start);
+            i = end;
+        }
+    }
+
+    public write(offset: number, src: ArrayBuffer, srcOffset: number, length: number) {
+        copyArrayBuffer(src, srcOffset, this._working._buffer, offset, length);
+        this.markDirty(offset, length);
+    }
+
+    public storeInt32(offset: number, value: number) {
+        this._working._dataView.setInt32(offset, value, true);
+        this.markDirty(offset, 4);
+    }
+
+    /**
+     * 清零一段已有的空间，接收端同样需要清零
+     */
+    public clear(offset: number, length: number) {
+        new Uint8Array(this._working._buffer, offset, length).fill(0);
+        this.markDirty(offset, length);
+    }
+
+    /**
+     * 在末尾分配清零的子空间，working buffer扩容后同一StructBuffer上的view仍然有效
+     */
+    public allocate(length: number, alignment = 1) {
+        const offset = this._end + ((alignment - (this._end % alignment)) % alignment);
+        this._end = offset + length;
+        if (this._end > this._working._buffer.byteLength) {
+            const buf = new ArrayBuffer(Math.max(this._working._buffer.byteLength * 2, this._end));
+            copyArrayBuffer(this._working._buffer, 0, buf, 0, offset);
+            this._working.reset(buf);
+        }
+        return offset;
+    }
+
+    public addTrash(length: number) {
+        this._trash += length;
+    }
+
+    /**
+     * 直接修改working buffer后调用。只记录base范围内的写入，之后新增的部分整体写入patch
+     */
+    public markDirty(offset: number, length: number) {
+        const end = Math.min(offset + length, this._baseLength);
+        if (offset < end) {
+            this._dirty.push(offset, end - offset);
+        }
+    }
+
+    private _writePatch(baseTypeId: number) {
+        const pairs: [number, number][] = [];
+        for (let i = 0; i < this._dirty.length; i += 2) {
+            pairs.push([this._dirty[i], this._dirty[i + 1]]);
+        }
+        pairs.sort((a, b) => a[0] - b[0] || a[1] - b[1]);
+        const ranges: number[] = [];
+        let dataLength = 0;
+        pairs.forEach(([offset, length]) => {
+            const size = ranges.length;
+            const last = size ? ranges[size - 2] + ranges[size - 1] : 0;
+            if (size && offset - last < rangeMergeGap) {
+                const end = Math.max(last, offset + length);
+                dataLength += end - last;
+                ranges[size - 1] = end - ranges[size - 2];
+            } else {
+                ranges.push(offset, length);
+                dataLength += length;
+            }
+        });
+        if (this._end > this._baseLength) {
+            ranges.push(this._baseLength, this._end - this._baseLength);
+            dataLength += this._end - this._baseLength;
+        }
+
+        // 与C++的MessageBuilder布局相同: root之后依次是ranges和data
+        const rangesOffset = 12 + patchByteLength;
+        const dataOffset = rangesOffset + ranges.length * 4;
+        const patch = new ArrayBuffer(dataOffset + dataLength);
+        const view = new DataView(patch);
+        view.setInt32(0, PatchTypeId, true);
+        view.setInt32(8, dataOffset + dataLength, true);
+        view.setInt32(12, baseTypeId, true);
+        view.setInt32(16, this._baseLength, true);
+        view.setInt32(20, this._end, true);
+        view.setInt32(24, this._trash, true);
+        view.setUint32(52, this._baseHash, true);
+        if (ranges.length) {
+            view.setInt32(28, rangesOffset, true);
+            view.setInt32(32, ranges.length, true);
+            view.setInt32(36, ranges.length, true);
+        }
+        if (dataLength) {
+            view.setInt32(40, dataOffset, true);
+            view.setInt32(44, dataLength, true);
+            view.setInt32(48, dataLength, true);
+        }
+        let to = dataOffset;
+        for (let i = 0; i < ranges.length; i += 2) {
+            view.setInt32(rangesOffset + i * 4, ranges[i], true);
+            view.setInt32(rangesOffset + i * 4 + 4, ranges[i + 1], true);
+            copyArrayBuffer(this._working._buffer, ranges[i], patch, to, ranges[i + 1]);
+            to += ranges[i + 1];
+        }
+        return patch;
+    }
+
+    /**
+     * 正在比较的target消息
+     */
+    public targetBuffer = new StructBuffer(new ArrayBuffer(0));
+
+    private _creator: IStructCreator;
+    private _working = new StructBuffer(new ArrayBuffer(0));
+    private _baseLength = 0;
+    private _baseHash = 0;
+    private _end = 0;
+    private _trash = 0;
+    private _delta = 0;
+    private _dirty: number[] = [];
+    private _tasks: number[] = [];
+    /**
+     * target中的struct地址 -> working buffer中对应的地址
+     */
+    private _forward: Map<number, number> = new Map();
+    /**
+     * 已经对应了target中某个struct的`typeId:地址`
+     */
+    private _matched: Set<string> = new Set();
+}
+
+/**
+ * 生成的`$_wireStruct`通过它描述值的结构，`StructWireEncoder`和`StructWireDecoder`分别实现。
+ * typeId: native为1~11(enum为底层类型)，字符串为60，其余为struct或辅助结构
+ */
+export interface IStructWire {
+    /**
+     * @param members 按声明顺序的`[typeId, offset, 引用的struct长度(不是引用时为0)]`
+     */
+    struct(offset: number, members: number[]): void;
+    string(offset: number): void;
+    items(offset: number, itemTypeId: number, itemByteLength: number): void;
+    entries(offset: number, keyTypeId: number, valueTypeId: number, keyByteLength: number, valueByteLength: number): void;
+    value(offset: number, typeIds: number[], byteLengths: number[]): void;
+    /**
+     * `@soa`数组，与元素相同的普通数组编码相同
+     *
+     * @param members 元素struct的`wireMembers`
+     */
+    columns(offset: number, members: number[], itemByteLength: number): void;
+}
+
+/**
+ * `@soa`数组中第index个元素的第member个成员的位置
+ */
+function soaMemberOffset(data: number, capacity: number, index: number, members: number[], member: number) {
+    return data + capacity * members[member * 3 + 1] + nativeByteLengths[members[member * 3]] * index;
+}
+
+/**
+ * native类型的字节数，下标为typeId
+ */
+const nativeByteLengths = [0, 1, 1, 1, 2, 2, 4, 4, 4, 8, 8, 8];
+const StringTypeIdOfWire = 60;
+
+/**
+ * 翻转一个值入栈的子值(每个为typeId, offset两项)，使它们按声明顺序出栈，与C++的wire.hpp和gc相同的深度优先顺序
+ */
+function reverseWireTasks(tasks: number[], start: number) {
+    for (let i = start, j = tasks.length - 2; i < j; i += 2, j -= 2) {
+        const typeId = tasks[i];
+        const offset = tasks[i + 1];
+        tasks[i] = tasks[j];
+        tasks[i + 1] = tasks[j + 1];
+        tasks[j] = typeId;
+        tasks[j + 1] = offset;
+    }
+}
+
+/**
+ * bool、1字节整数和浮点数按小端原样保存，其余整数使用varint(有符号的先zigzag)
+ */
+function isWireRaw(typeId: number) {
+    return typeId <= 3 || typeId === 8 || typeId === 11;
+}
+
+/**
+ * 紧凑格式中的mainTypeId，用于在解码前分发到对应的类型，格式不正确时为0
+ */
+export function wireTypeIdOf(wire: Uint8Array) {
+    let value = 0;
+    for (let i = 0; i < wire.length && i < 5; i++) {
+        value += (wire[i] & 0x7F) * 2 ** (7 * i);
+        if (!(wire[i] & 0x80)) {
+            return value | 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * 判断值是否为默认值: 字符串、数组和map为空，combine为undefined，struct的成员都是默认值
+ */
+class WireDefaultProbe implements IStructWire {
+    constructor(encoder: StructWireEncoder) {
+        this._encoder = encoder;
+    }
+
+    public struct(offset: number, members: number[]) {
+        let result = true;
+        for (let i = 0; i < members.length && result; i += 3) {
+            result = this._encoder.isDefault(members[i], offset + members[i + 1], members[i + 2]);
+        }
+        this.result = result;
+    }
+
+    public string(offset: number) {
+        this.result = new StructString(this._encoder.buffer, offset).length === 0;
+    }
+
+    public items(offset: number) {
+        this.result = this._encoder.buffer._dataView.getInt32(offset + 4, true) === 0;
+    }
+
+    public entries(offset: number) {
+        this.result = this._encoder.buffer._dataView.getInt32(offset, true) === 0;
+    }
+
+    public value(offset: number) {
+        this.result = this._encoder.buffer._dataView.getUint8(offset) === 0;
+    }
+
+    public columns(offset: number) {
+        this.result = this._encoder.buffer._dataView.getInt32(offset + 4, true) === 0;
+    }
+
+    public result = true;
+    private _encoder: StructWireEncoder;
+}
+
+/**
+ * 把消息编码为跨进程传输和持久化使用的紧凑格式: `| varint mainTypeId | root |`，与C++的wire.hpp产生相同的字节。
+ * 整数使用varint/zigzag，省略默认值的成员(struct前是每字节7位的成员存在位图)，不保存数组和字符串多余的capacity以及trash。
+ * 被多处引用的struct只编码一次，之后的引用编码为它的序号。
+ */
+export class StructWireEncoder implements IStructWire {
+    constructor(creator: IStructCreator) {
+        this._creator = creator;
+    }
+
+    public encode(root: StructBase) {
+        if (root.mainTypeId !== root.typeId) {
+            throw new Error(`Cannot encode message ${root.mainTypeId} as ${root.typeId}.`);
+        }
+        this.buffer = root.$_structBuf();
+        this._bytes = new Uint8Array(this.buffer._buffer);
+        this._length = 0;
+        this._tasks = [];
+        this._ordinals.clear();
+        this._ordinals.set(`${root.typeId}:12`, 0);
+        this._writeVarint(root.typeId);
+        this._tasks.push(root.typeId, 12);
+        while (this._tasks.length) {
+            const offset = this._tasks.pop() as number;
+            const typeId = this._tasks.pop() as number;
+            const pushed = this._tasks.length;
+            this._creator.create(typeId, this.buffer, offset).$_wireStruct(this);
+            reverseWireTasks(this._tasks, pushed);
+        }
+        return this._out.buffer.slice(0, this._length);
+    }
+
+    public struct(offset: number, members: number[]) {
+        this._struct(members, (i) => offset + members[i * 3 + 1]);
+    }
+
+    /**
+     * 元素按顺序写入，与普通数组的元素在任务栈中的处理顺序相同，两种布局可以互相解码
+     */
+    public columns(offset: number, members: number[]) {
+        const view = this.buffer._dataView;
+        const dataOffset = view.getInt32(offset, true);
+        const size = view.getInt32(offset + 4, true);
+        const capacity = view.getInt32(offset + 8, true);
+        this._writeVarint(size);
+        for (let index = 0; index < size; index++) {
+            this._struct(members, (i) => soaMemberOffset(dataOffset, capacity, index, members, i));
+        }
+    }
+
+    /**
+     * struct的位图和不为默认值的成员，第i个成员位于`address(i)`
+     */
+    private _struct(members: number[], address: (member: number) => number) {
+        const count = members.length / 3;
+        const groups = Math.max(Math.ceil(count / 7), 1);
+        this._reserve(groups);
+        const start = this._length;
+        this._out.fill(0, start, start + groups);
+        for (let i = 0; i < count; i++) {
+            if (!this.isDefault(members[i * 3], address(i), members[i * 3 + 2])) {
+                this._out[start + ((i / 7) | 0)] |= 1 << (i % 7);
+            }
+        }
+        let used = groups;
+        while (used > 1 && this._out[start + used - 1] === 0) {
+            used--;
+        }
+        for (let i = 0; i + 1 < used; i++) {
+            this._out[start + i] |= 0x80;
+        }
+        this._length += used;
+        for (let i = 0; i < count; i++) {
+            if (this._out[start + ((i / 7) | 0)] & (1 << (i % 7))) {
+                if (members[i * 3 + 2]) {
+                    this._reference(members[i * 3], address(i));
+                } else {
+                    this._visit(members[i * 3], address(i));
+                }
+            }
+        }
+    }
+
+    public string(offset: number) {
+        const bytes = new StructString(this.buffer, offset).getStringBuffer();
+        this._writeVarint(bytes.length);
+        this._write(bytes);
+    }
+
+    public items(offset: number, itemTypeId: number, itemByteLength: number) {
+        const view = this.buffer._dataView;
+        const dataOffset = view.getInt32(offset, true);
+        const size = view.getInt32(offset + 4, true);
+        this._writeVarint(size);
+        if (itemTypeId < StringTypeIdOfWire && isWireRaw(itemTypeId)) {
+            this._write(this._bytes.subarray(dataOffset, dataOffset + size * itemByteLength));
+            return;
+        }
+        for (let i = 0; i < size; i++) {
+            this._visit(itemTypeId, dataOffset + itemByteLength * i);
+        }
+    }
+
+    public entries(offset: number, keyTypeId: number, valueTypeId: number, keyByteLength: number, valueByteLength: number) {
+        const view = this.buffer._dataView;
+        const size = view.getInt32(offset, true);
+        const dataOffset = view.getInt32(offset + 8, true);
+        const entryByte = keyByteLength + valueByteLength;
+        this._writeVarint(size);
+        for (let i = 0; i < size; i++) {
+            this._visit(keyTypeId, dataOffset + entryByte * i);
+            this._visit(valueTypeId, dataOffset + entryByte * i + keyByteLength);
+        }
+    }
+
+    /**
+     * `| index |`之后是值，子空间中的值地址为0时index的最高位为1且没有值
+     */
+    public value(offset: number, typeIds: number[], byteLengths: number[]) {
+        const view = this.buffer._dataView;
+        const index = view.getUint8(offset);
+        if (index === 0 || index > typeIds.length) {
+            this._writeByte(0);
+            return;
+        }
+        if (byteLengths[index - 1] <= 4) {
+            this._writeByte(index);
+            this._visit(typeIds[index - 1], offset + 4);
+            return;
+        }
+        const addr = view.getInt32(offset + 4, true);
+        this._writeByte(addr ? index : index | 0x80);
+        if (addr) {
+            this._visit(typeIds[index - 1], addr);
+        }
+    }
+
+    /**
+     * 默认值解码后的字节全为0，所以重新编码得到相同的字节
+     */
+    public isDefault(typeId: number, offset: number, referenceLength = 0) {
+        if (referenceLength) {
+            return this.buffer._dataView.getInt32(offset, true) === 0;
+        }
+        if (typeId < StringTypeIdOfWire) {
+            return this._bytes.subarray(offset, offset + nativeByteLengths[typeId]).every((byte) => byte === 0);
+        }
+        this._creator.create(typeId, this.buffer, offset).$_wireStruct(this._probe);
+        return this._probe.result;
+    }
+
+    /**
+     * native和字符串立即写入，其余稍后处理
+     */
+    private _visit(typeId: number, offset: number) {
+        if (typeId === StringTypeIdOfWire) {
+            this.string(offset);
+        } else if (typeId < StringTypeIdOfWire) {
+            this._native(typeId, offset);
+        } else {
+            this._tasks.push(typeId, offset);
+        }
+    }
+
+    /**
+     * 引用类型成员(地址不为0): 第一次出现时为0，之后为1 + 序号
+     */
+    private _reference(typeId: number, addrOffset: number) {
+        const addr = this.buffer._dataView.getInt32(addrOffset, true);
+        const key = `${typeId}:${addr}`;
+        const ordinal = this._ordinals.get(key);
+        if (ordinal !== undefined) {
+            this._writeVarint(ordinal + 1);
+            return;
+        }
+        this._ordinals.set(key, this._ordinals.size);
+        this._writeVarint(0);
+        this._tasks.push(typeId, addr);
+    }
+
+    private _native(typeId: number, offset: number) {
+        const view = this.buffer._dataView;
+        if (isWireRaw(typeId)) {
+            this._write(this._bytes.subarray(offset, offset + nativeByteLengths[typeId]));
+            return;
+        }
+        switch (typeId) {
+        case 4:
+        case 6:
+        {
+            const value = typeId === 4 ? view.getInt16(offset, true) : view.getInt32(offset, true);
+            this._writeVarint(((value << 1) ^ (value >> 31)) >>> 0);
+            break;
+        }
+        case 5:
+            this._writeVarint(view.getUint16(offset, true));
+            break;
+        case 7:
+            this._writeVarint(view.getUint32(offset, true));
+            break;
+        case 9:
+        {
+            const value = view.getBigInt64(offset, true);
+            this._writeBigVarint(BigInt.asUintN(64, (value << 1n) ^ (value >> 63n)));
+            break;
+        }
+        case 10:
+            this._writeBigVarint(view.getBigUint64(offset, true));
+            break;
+        }
+    }
+
+    private _writeVarint(value: number) {
+        this._reserve(5);
+        while (value >= 0x80) {
+            this._out[this._length++] = (value & 0x7F) | 0x80;
+            value >>>= 7;
+        }
+        this._out[this._length++] = value;
+    }
+
+    private _writeBigVarint(value: bigint) {
+        this._reserve(10);
+        while (value >= 0x80n) {
+            this._out[this._length++] = Number(value & 0x7Fn) | 0x80;
+            value >>= 7n;
+        }
+        this._out[this._length++] = Number(value);
+    }
+
+    private _writeByte(byte: number) {
+        this._reserve(1);
+        this._out[this._length++] = byte;
+    }
+
+    private _write(bytes: Uint8Array) {
+        this._reserve(bytes.length);
+        this._out.set(bytes, this._length);
+        this._length += bytes.length;
+    }
+
+    private _reserve(length: number) {
+        if (this._length + length > this._out.length) {
+            const out = new Uint8Array(Math.max(this._out.length * 2, this._length + length));
+            out.set(this._out.subarray(0, this._length));
+            this._out = out;
+        }
+    }
+
+    /**
+     * 正在编码的消息
+     */
+    public buffer = new StructBuffer(new ArrayBuffer(0));
+
+    private _creator: IStructCreator;
+    private _probe = new WireDefaultProbe(this);
+    private _bytes = new Uint8Array(0);
+    private _out = new Uint8Array(256);
+    private _length = 0;
+    private _tasks: number[] = [];
+    /**
+     * 已经编码的被引用struct`typeId:地址` -> 序号，root为0
+     */
+    private _ordinals: Map<string, number> = new Map();
+}
+
+/**
+ * `StructWireDecoder`解码后的消息的默认上限
+ */
+export const defaultMaxDecodedBytes = 64 << 20;
+
+/**
+ * 把`StructWireEncoder`或C++ wire.hpp的紧凑格式解码为内存布局，没有trash，数组和字符串的capacity等于长度。
+ * 输入来自不可信来源时同样安全: 所有读取都检查长度，数量不能超过剩余的字节，
+ * 引用序号、combine的index和varint的范围都会检查，输入必须恰好用完。
+ * 默认值的struct只占1字节却要分配完整的空间，所以解码后的消息不能超过`maxDecodedBytes`，与C++的默认值相同。
+ */
+export class StructWireDecoder implements IStructWire {
+    constructor(creator: IStructCreator, maxDecodedBytes = defaultMaxDecodedBytes) {
+        this._creator = creator;
+        this._maxDecodedBytes = Math.min(maxDecodedBytes, 0x7FFFFFFF);
+    }
+
+    /**
+     * @returns 解码的消息buffer，输入不是rootTypeId的消息或者已损坏时返回undefined，原因见`error`
+     */
+    public decode(wire: Uint8Array, rootTypeId: number) {
+        this._in = wire;
+        this._pos = 0;
+        this._tasks = [];
+        this._refs = [];
+        this.error = '';
+        if (this._readVarint(0xFFFFFFFF) !== rootTypeId >>> 0 || this.error) {
+            this.error = this.error || 'Header';
+            return undefined;
+        }
+        const rootLength = this._creator.create(rootTypeId, this._sBuffer, 0).byteLength;
+        this._sBuffer.reset(new ArrayBuffer(Math.max(wire.length * 2, 12 + rootLength, 64)));
+        this._end = 12 + rootLength;
+        if (this._end > this._maxDecodedBytes) {
+            this.error = 'Length';
+            return undefined;
+        }
+        this._sBuffer._dataView.setInt32(0, rootTypeId, true);
+        this._refs.push(rootTypeId, 12);
+        this._tasks.push(rootTypeId, 12);
+        while (this._tasks.length && !this.error) {
+            const offset = this._tasks.pop() as number;
+            const typeId = this._tasks.pop() as number;
+            const pushed = this._tasks.length;
+            this._creator.create(typeId, this._sBuffer, offset).$_wireStruct(this);
+            reverseWireTasks(this._tasks, pushed);
+        }
+        if (!this.error && this._pos !== wire.length) {
+            this.fail('Trailing');
+        }
+        if (this.error) {
+            return undefined;
+        }
+        this._sBuffer._dataView.setInt32(8, this._end, true);
+        return this._sBuffer._buffer.slice(0, this._end);
+    }
+
+    public struct(offset: number, members: number[]) {
+        this._struct(members, (i) => offset + members[i * 3 + 1]);
+    }
+
+    public columns(offset: number, members: number[], itemByteLength: number) {
+        const size = this._readCount();
+        if (!size) {
+            return;
+        }
+        const capacity = soaCapacity(size);
+        const dataOffset = this._allocate(capacity * itemByteLength, soaAlignment);
+        if (this.error) {
+            return;
+        }
+        const view = this._sBuffer._dataView;
+        view.setInt32(offset, dataOffset, true);
+        view.setInt32(offset + 4, size, true);
+        view.setInt32(offset + 8, capacity, true);
+        for (let index = 0; index < size && !this.error; index++) {
+            this._struct(members, (i) => soaMemberOffset(dataOffset, capacity, index, members, i));
+        }
+    }
+
+    private _struct(members: number[], address: (member: number) => number) {
+        const count = members.length / 3;
+        const groups = Math.max(Math.ceil(count / 7), 1);
+        const bits: number[] = [];
+        let byte = 0x80;
+        while (byte & 0x80) {
+            if (bits.length === groups) {
+                this.fail('Struct');
+                return;
+            }
+            byte = this._readByte();
+            bits.push(byte & 0x7F);
+        }
+        // 最后一组中超出成员数量的位必须为0
+        if (this.error || bits[bits.length - 1] >> Math.min(count - 7 * (bits.length - 1), 7)) {
+            this.fail('Struct');
+            return;
+        }
+        for (let i = 0; i < count && i < bits.length * 7 && !this.error; i++) {
+            if (bits[(i / 7) | 0] & (1 << (i % 7))) {
+                if (members[i * 3 + 2]) {
+                    this._reference(members[i * 3], members[i * 3 + 2], address(i));
+                } else {
+                    this._visit(members[i * 3], address(i));
+                }
+            }
+        }
+    }
+
+    /**
+     * 与C++的`MessageBuilder::setString`相同: 短字符串inline保存，长字符串在末尾分配
+     */
+    public string(offset: number) {
+        const length = this._readVarint(this._in.length - this._pos);
+        const bytes = this._read(length);
+        if (!bytes) {
+            return;
+        }
+        if (length <= 11) {
+            this._sBuffer._dataView.setUint8(offset, 0x80 | length);
+            new Uint8Array(this._sBuffer._buffer).set(bytes, offset + 1);
+            return;
+        }
+        const dataOffset = this._allocate(length);
+        if (this.error) {
+            return;
+        }
+        new Uint8Array(this._sBuffer._buffer).set(bytes, dataOffset);
+        const view = this._sBuffer._dataView;
+        view.setInt32(offset, dataOffset, false);
+        view.setInt32(offset + 4, length, true);
+        view.setInt32(offset + 8, length, true);
+    }
+
+    public items(offset: number, itemTypeId: number, itemByteLength: number) {
+        const size = this._readCount();
+        if (!size) {
+            return;
+        }
+        const native = itemTypeId < StringTypeIdOfWire;
+        const dataOffset = this._allocate(size * itemByteLength, itemAlignment(itemByteLength));
+        const view = this._sBuffer._dataView;
+        view.setInt32(offset, dataOffset, true);
+        view.setInt32(offset + 4, size, true);
+        view.setInt32(offset + 8, size, true);
+        if (native && isWireRaw(itemTypeId)) {
+            const bytes = this._read(size * itemByteLength);
+            if (bytes) {
+                new Uint8Array(this._sBuffer._buffer).set(bytes, dataOffset);
+            }
+            return;
+        }
+        for (let i = 0; i < size && !this.error; i++) {
+            this._visit(itemTypeId, dataOffset + itemByteLength * i);
+        }
+    }
+
+    public entries(offset: number, keyTypeId: number, valueTypeId: number, keyByteLength: number, valueByteLength: number) {
+        const size = this._readCount();
+        if (!size) {
+            return;
+        }
+        const entryByte = keyByteLength + valueByteLength;
+        const dataOffset = this._allocate(size * entryByte);
+        const view = this._sBuffer._dataView;
+        view.setInt32(offset, size, true);
+        view.setInt32(offset + 4, size, true);
+        view.setInt32(offset + 8, dataOffset, true);
+        for (let i = 0; i < size && !this.error; i++) {
+            const entry = dataOffset + entryByte * i;
+            this._visit(keyTypeId, entry);
+            if (i > 0 && !this.error && !this._keyAfter(keyTypeId, entry - entryByte, entry)) {
+                this.fail('Map');
+                return;
+            }
+            this._visit(valueTypeId, entry + keyByteLength);
+        }
+    }
+
+    public value(offset: number, typeIds: number[], byteLengths: number[]) {
+        const tag = this._readByte();
+        const index = tag & 0x7F;
+        if (tag === 0) {
+            return;
+        }
+        if (index === 0 || index > typeIds.length) {
+            this.fail('Combine');
+            return;
+        }
+        this._sBuffer._dataView.setUint8(offset, index);
+        const typeId = typeIds[index - 1];
+        const byteLength = byteLengths[index - 1];
+        if (byteLength <= 4) {
+            if (tag & 0x80) {
+                this.fail('Combine');
+                return;
+            }
+            this._visit(typeId, offset + 4);
+            return;
+        }
+        if (tag & 0x80) {
+            return;
+        }
+        const addr = this._allocate(byteLength, itemAlignment(byteLength));
+        this._sBuffer._dataView.setInt32(offset + 4, addr, true);
+        this._visit(typeId, addr);
+    }
+
+    public fail(error: string) {
+        if (!this.error) {
+            this.error = error;
+        }
+    }
+
+    private _visit(typeId: number, offset: number) {
+        if (typeId === StringTypeIdOfWire) {
+            this.string(offset);
+        } else if (typeId < StringTypeIdOfWire) {
+            this._native(typeId, offset);
+        } else {
+            this._tasks.push(typeId, offset);
+        }
+    }
+
+    private _reference(typeId: number, byteLength: number, addrOffset: number) {
+        const tag = this._readVarint(Number.MAX_SAFE_INTEGER);
+        if (this.error) {
+            return;
+        }
+        const view = this._sBuffer._dataView;
+        if (tag === 0) {
+            const addr = this._allocate(byteLength, itemAlignment(byteLength));
+            view.setInt32(addrOffset, addr, true);
+            this._refs.push(typeId, addr);
+            this._tasks.push(typeId, addr);
+            return;
+        }
+        if (tag > this._refs.length / 2 || this._refs[(tag - 1) * 2] !== typeId) {
+            this.fail('Reference');
+            return;
+        }
+        view.setInt32(addrOffset, this._refs[(tag - 1) * 2 + 1], true);
+    }
+
+    /**
+     * key必须严格递增，否则map的二分查找会出错。string与C++的`Simd::compareString`顺序相同
+     */
+    private _keyAfter(typeId: number, prev: number, entry: number) {
+        const view = this._sBuffer._dataView;
+        switch (typeId) {
+        case StringTypeIdOfWire:
+            return compareBytes(new StructString(this._sBuffer, prev).getStringBuffer(), new StructString(this._sBuffer, entry).getStringBuffer()) < 0;
+        case 1:
+        case 3:
+            return view.getUint8(prev) < view.getUint8(entry);
+        case 2:
+            return view.getInt8(prev) < view.getInt8(entry);
+        case 4:
+            return view.getInt16(prev, true) < view.getInt16(entry, true);
+        case 5:
+            return view.getUint16(prev, true) < view.getUint16(entry, true);
+        case 6:
+            return view.getInt32(prev, true) < view.getInt32(entry, true);
+        case 7:
+            return view.getUint32(prev, true) < view.getUint32(entry, true);
+        case 8:
+            return view.getFloat32(prev, true) < view.getFloat32(entry, true);
+        case 9:
+            return view.getBigInt64(prev, true) < view.getBigInt64(entry, true);
+        case 10:
+            return view.getBigUint64(prev, true) < view.getBigUint64(entry, true);
+        default:
+            return view.getFloat64(prev, true) < view.getFloat64(entry, true);
+        }
+    }
+
+    private _native(typeId: number, offset: number) {
+        const view = this._sBuffer._dataView;
+        if (isWireRaw(typeId)) {
+            const bytes = this._read(nativeByteLengths[typeId]);
+            if (bytes) {
+                new Uint8Array(this._sBuffer._buffer).set(bytes, offset);
+            }
+            return;
+        }
+        switch (typeId) {
+        case 4:
+        case 6:
+        {
+            const value = this._readVarint(typeId === 4 ? 0xFFFF : 0xFFFFFFFF);
+            const decoded = (value >>> 1) ^ -(value & 1);
+            if (typeId === 4) {
+                view.setInt16(offset, decoded, true);
+            } else {
+                view.setInt32(offset, decoded, true);
+            }
+            break;
+        }
+        case 5:
+            view.setUint16(offset, this._readVarint(0xFFFF), true);
+            break;
+        case 7:
+            view.setUint32(offset, this._readVarint(0xFFFFFFFF), true);
+            break;
+        case 9:
+        {
+            const value = this._readBigVarint();
+            view.setBigInt64(offset, (value >> 1n) ^ -(value & 1n), true);
+            break;
+        }
+        case 10:
+            view.setBigUint64(offset, this._readBigVarint(), true);
+            break;
+        }
+    }
+
+    /**
+     * 与C++相同，最多10个字节，值超过max时失败
+     */
+    private _readVarint(max: number) {
+        let value = 0;
+        for (let shift = 0; shift < 64; shift += 7) {
+            if (this._pos >= this._in.length) {
+                break;
+            }
+            const byte = this._in[this._pos++];
+            if (shift === 63 && byte > 1) {
+                break;
+            }
+            value += (byte & 0x7F) * 2 ** shift;
+            if (!(byte & 0x80)) {
+                if (value > max) {
+                    break;
+                }
+                return value;
+            }
+        }
+        this.fail('Varint');
+        return 0;
+    }
+
+    private _readBigVarint() {
+        let value = 0n;
+        for (let shift = 0n; shift < 64n; shift += 7n) {
+            if (this._pos >= this._in.length) {
+                break;
+            }
+            const byte = this._in[this._pos++];
+            if (shift === 63n && byte > 1) {
+                break;
+            }
+            value |= BigInt(byte & 0x7F) << shift;
+            if (!(byte & 0x80)) {
+                return value;
+            }
+        }
+        this.fail('Varint');
+        return 0n;
+    }
+
+    /**
+     * 每个元素至少占1字节，所以数量不能超过剩余的输入
+     */
+    private _readCount() {
+        return this._readVarint(this._in.length - this._pos);
+    }
+
+    private _readByte() {
+        if (this._pos >= this._in.length) {
+            this.fail('Truncated');
+            return 0;
+        }
+        return this._in[this._pos++];
+    }
+
+    private _read(length: number) {
+        if (length > this._in.length - this._pos) {
+            this.fail('Truncated');
+            return undefined;
+        }
+        this._pos += length;
+        return this._in.subarray(this._pos - length, this._pos);
+    }
+
+    /**
+     * 在末尾分配清零的子空间，扩容后同一StructBuffer上的view仍然有效
+     */
+    private _allocate(length: number, alignment = 1) {
+        const end = this._end;
+        const offset = end + ((alignment - (end % alignment)) % alignment);
+        if (offset + length > this._maxDecodedBytes) {
+            this.fail('Length');
+            return 0;
+        }
+        this._end = offset + length;
+        if (this._end > this._sBuffer._buffer.byteLength) {
+            const buf = new ArrayBuffer(Math.max(this._sBuffer._buffer.byteLength * 2, this._end));
+            copyArrayBuffer(this._sBuffer._buffer, 0, buf, 0, end);
+            this._sBuffer.reset(buf);
+        }
+        return offset;
+    }
+
+    public error = '';
+
+    private _creator: IStructCreator;
+    private _maxDecodedBytes: number;
+    private _sBuffer = new StructBuffer(new ArrayBuffer(0));
+    private _in = new Uint8Array(0);
+    private _pos = 0;
+    private _end = 0;
+    private _tasks: number[] = [];
+    /**
+     * 按序号排列的被引用struct`typeId, 地址`，root为0
+     */
+    private _refs: number[] = [];
+}
+
+/**
+ * 按旧版本的布局只读访问buffer，不需要重新编码。生成的`XxxCompat`类继承它，`layouts`按版本序号排列，
+ * 每一行为`[byteLength, 成员offset...]`，不存在或类型不同的成员为-1。缺失的成员返回默认值，嵌套的兼容类沿用同一个版本。
+ */
+export abstract class StructCompat {
+    constructor(buf: StructBuffer, offset: number, version: number) {
+        this._sBuffer = buf;
+        this._offset = offset;
+        this._version = version;
+    }
+
+    public get $_address() {
+        return this._offset;
+    }
+
+    public get $_version() {
+        return this._version;
+    }
+
+    /**
+     * 缺失的字符串、数组等在全0的buffer上读取。返回的view可以写入，所以每次使用新的buffer，不会影响其他读取者
+     */
+    public static $_zeros(byteLength: number) {
+        return new StructBuffer(new ArrayBuffer(byteLength));
+    }
+
+    protected abstract get $_layout(): number[];
+
+    /**
+     * 成员在buffer中的位置，当前版本或者struct本身不存在时为-1
+     */
+    protected $_offsetOf(index: number) {
+        const offset = this.$_layout[index + 1];
+        return offset < 0 || this._offset < 0 ? -1 : this._offset + offset;
+    }
+
+    protected $_referenceOf(index: number) {
+        const offset = this.$_offsetOf(index);
+        return offset < 0 ? 0 : this._sBuffer._dataView.getInt32(offset, true);
+    }
+
+    protected _sBuffer: StructBuffer;
+    protected _offset: number;
+    protected _version: number;
+}
+
+export interface ICompatItemType<T> {
+    create(buf: StructBuffer, offset: number, version: number): T;
+    byteLengthOf(version: number): number;
+}
+
+/**
+ * 元素为兼容类的数组，元素的长度取决于版本
+ */
+export class StructCompatArray<T> {
+    constructor(buf: StructBuffer, offset: number, version: number, item: ICompatItemType<T>) {
+        this._sBuffer = buf;
+        this._offset = offset;
+        this._version = version;
+        this._item = item;
+    }
+
+    /**
+     * 多维数组: 元素本身是StructCompatArray
+     */
+    public static itemsOf<T>(item: ICompatItemType<T>): ICompatItemType<StructCompatArray<T>> {
+        return {
+            create: (buf, offset, version) => new StructCompatArray(buf, offset, version, item),
+            byteLengthOf: () => 12,
+        };
+    }
+
+    public get size() {
+        return this._offset < 0 ? 0 : this._sBuffer._dataView.getInt32(this._offset + 4, true);
+    }
+
+    public at(index: number) {
+        const dataOffset = this._sBuffer._dataView.getInt32(this._offset, true);
+        return this._item.create(this._sBuffer, dataOffset + this._item.byteLengthOf(this._version) * index, this._version);
+    }
+
+    private _sBuffer: StructBuffer;
+    private _offset: number;
+    private _version: number;
+    private _item: ICompatItemType<T>;
+}
+
+/**
+ * 消息类型在发送队列中的合并方式，由IDL中struct前的`@coalesce`或`@coalesce(key)`生成。
+ * keyOffset为key成员在struct中的offset，按类型合并时为-1
+ */
+export interface ICoalescePolicy {
+    keyOffset: number;
+    keyBytes: number;
+}
+
+export interface ICoalescePolicySource {
+    coalescePolicy(typeId: number): ICoalescePolicy | undefined;
+}
+
+export interface ICoalesceCounters {
+    queued: number;
+    merged: number;
+    dropped: number;
+}
+
+/**
+ * 合并过期消息的发送队列，与C++的coalesce.hpp规则相同。可合并类型的新消息替换队列中还未取走的同类型(同key)旧消息，位置不变，
+ * 因此输入风暴时队列长度受(类型, key)的数量限制。不可合并的消息按顺序追加，超过maxMessages条或maxBytes字节时丢弃新消息并计数，
+ * 替换后超过maxBytes时同样丢弃新消息，旧消息不变。
+ *
+ * policies一般为messageFactory。
+ */
+export class CoalescingQueue {
+    constructor(policies: ICoalescePolicySource, maxMessages: number, maxBytes = Infinity) {
+        this._policies = policies;
+        this._buffers = new Array(maxMessages);
+        this._keys = new Array(maxMessages);
+        this._maxBytes = maxBytes;
+    }
+
+    /**
+     * @returns 'queued'追加到队尾，'merged'替换了旧消息，'dropped'队列已满或超过maxBytes
+     */
+    public push(buf: ArrayBuffer): 'queued' | 'merged' | 'dropped' {
+        const view = new DataView(buf);
+        const typeId = view.getInt32(0, true);
+        const bytes = view.getInt32(8, true);
+        const counters = this.counters(typeId);
+        const policy = this._policy(typeId);
+        let key = '';
+        if (policy) {
+            key = `${typeId}:${this._loadKey(view, policy)}`;
+            const seq = this._index.get(key);
+            if (seq !== undefined) {
+                const slot = seq % this._buffers.length;
+                const grow = bytes - (this._buffers[slot] as ArrayBuffer).byteLength;
+                if (this._bytes + grow > this._maxBytes) {
+                    counters.dropped++;
+                    return 'dropped';
+                }
+                this._bytes += grow;
+                this._buffers[slot] = buf.byteLength === bytes ? buf : buf.slice(0, bytes);
+                counters.merged++;
+                return 'merged';
+            }
+        }
+        if (this._tail - this._head === this._buffers.length || this._bytes + bytes > this._maxBytes) {
+            counters.dropped++;
+            return 'dropped';
+        }
+        const slot = this._tail % this._buffers.length;
+        this._buffers[slot] = buf.byteLength === bytes ? buf : buf.slice(0, bytes);
+        this._keys[slot] = key;
+        if (policy) {
+            this._index.set(key, this._tail);
+        }
+        this._tail++;
+        this._bytes += bytes;
+        counters.queued++;
+        return 'queued';
+    }
+
+    /**
+     * 取出最早的消息，队列为空时返回undefined
+     */
+    public pop() {
+        if (this._head === this._tail) {
+            return undefined;
+        }
+        const slot = this._head % this._buffers.length;
+        const buf = this._buffers[slot] as ArrayBuffer;
+        if (this._keys[slot]) {
+            this._index.delete(this._keys[slot]);
+        }
+        this._buffers[slot] = undefined;
+        this._bytes -= buf.byteLength;
+        this._head++;
+        return buf;
+    }
+
+    public get size() {
+        return this._tail - this._head;
+    }
+
+    public get bytes() {
+        return this._bytes;
+    }
+
+    public counters(typeId: number) {
+        let counters = this._counters.get(typeId);
+        if (!counters) {
+            counters = { queued: 0, merged: 0, dropped: 0 };
+            this._counters.set(typeId, counters);
+        }
+        return counters;
+    }
+
+    private _policy(typeId: number) {
+        if (!this._policyCache.has(typeId)) {
+            this._policyCache.set(typeId, this._policies.coalescePolicy(typeId));
+        }
+        return this._policyCache.get(typeId);
+    }
+
+    /**
+     * key按字节比较，不区分有无符号
+     */
+    private _loadKey(view: DataView, policy: ICoalescePolicy) {
+        const offset = 12 + policy.keyOffset;
+        switch (policy.keyBytes) {
+        case 1:
+            return view.getUint8(offset);
+        case 2:
+            return view.getUint16(offset, true);
+        case 4:
+            return view.getUint32(offset, true);
+        case 8:
+            return view.getBigUint64(offset, true);
+        default:
+            return 0;
+        }
+    }
+
+    private _policies: ICoalescePolicySource;
+    private _policyCache: Map<number, ICoalescePolicy | undefined> = new Map();
+    private _buffers: (ArrayBuffer | undefined)[];
+    private _keys: string[];
+    private _index: Map<string, number> = new Map();
+    private _counters: Map<number, ICoalesceCounters> = new Map();
+    private _head = 0;
+    private _tail = 0;
+    private _bytes = 0;
+    private _maxBytes: number;
 }
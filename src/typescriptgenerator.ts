@@ -3,20 +3,20 @@ import { GenerateService } from './generateservice';
 import { EnumDescription, StringTypeId, StructDescription, NativeSupportTypes, TypeDescType, IAccessoryDesc, ArrayTypeId, MapTypeId, CombineTypeId, StructBaseId, EMemberRefType } from './msgschema';
 
 interface NativeTypeGenDesc {
-    [key: string]: { tsTypeName: string; bufViewGet: string; bufViewSet: string };
+    [key: string]: { tsTypeName: string; bufViewGet: string; bufViewSet: string; typedArray: string };
 }
 const literalToNativeTypeName: NativeTypeGenDesc = {
-    bool: { tsTypeName: 'boolean', bufViewGet: 'getUint8', bufViewSet: 'setUint8'},
-    int8: { tsTypeName: 'number', bufViewGet: 'getInt8', bufViewSet: 'setInt8'},
-    uint8: { tsTypeName: 'number', bufViewGet: 'getUint8', bufViewSet: 'setUint8'},
-    int16: { tsTypeName: 'number', bufViewGet: 'getInt16', bufViewSet: 'setInt16'},
-    uint16: { tsTypeName: 'number', bufViewGet: 'getUint16', bufViewSet: 'setUint16'},
-    int32: { tsTypeName: 'number', bufViewGet: 'getInt32', bufViewSet: 'setInt32'},
-    uint32: { tsTypeName: 'number', bufViewGet: 'getUint32', bufViewSet: 'setUint32'},
-    float32: { tsTypeName: 'number', bufViewGet: 'getFloat32', bufViewSet: 'setFloat32'},
-    float64: { tsTypeName: 'number', bufViewGet: 'getFloat64', bufViewSet: 'setFloat64'},
-    int64: { tsTypeName: 'bitint', bufViewGet: 'getBitInt64', bufViewSet: 'setBitInt64'},
-    uint64: { tsTypeName: 'bitint', bufViewGet: 'getBigUint64', bufViewSet: 'setBigUint64'},
+    bool: { tsTypeName: 'boolean', bufViewGet: 'getUint8', bufViewSet: 'setUint8', typedArray: 'Uint8Array'},
+    int8: { tsTypeName: 'number', bufViewGet: 'getInt8', bufViewSet: 'setInt8', typedArray: 'Int8Array'},
+    uint8: { tsTypeName: 'number', bufViewGet: 'getUint8', bufViewSet: 'setUint8', typedArray: 'Uint8Array'},
+    int16: { tsTypeName: 'number', bufViewGet: 'getInt16', bufViewSet: 'setInt16', typedArray: 'Int16Array'},
+    uint16: { tsTypeName: 'number', bufViewGet: 'getUint16', bufViewSet: 'setUint16', typedArray: 'Uint16Array'},
+    int32: { tsTypeName: 'number', bufViewGet: 'getInt32', bufViewSet: 'setInt32', typedArray: 'Int32Array'},
+    uint32: { tsTypeName: 'number', bufViewGet: 'getUint32', bufViewSet: 'setUint32', typedArray: 'Uint32Array'},
+    float32: { tsTypeName: 'number', bufViewGet: 'getFloat32', bufViewSet: 'setFloat32', typedArray: 'Float32Array'},
+    float64: { tsTypeName: 'number', bufViewGet: 'getFloat64', bufViewSet: 'setFloat64', typedArray: 'Float64Array'},
+    int64: { tsTypeName: 'bigint', bufViewGet: 'getBigInt64', bufViewSet: 'setBigInt64', typedArray: 'BigInt64Array'},
+    uint64: { tsTypeName: 'bigint', bufViewGet: 'getBigUint64', bufViewSet: 'setBigUint64', typedArray: 'BigUint64Array'},
 }
 
 interface IScopeContext {
@@ -26,6 +26,8 @@ interface IScopeContext {
     context: string;
     scope: string;
     typeName: string;
+    /** 用到的其他struct的兼容类(XxxCompat) */
+    compatRelys?: number[];
 }
 
 interface IScopeResult {
@@ -43,7 +45,7 @@ export class TypescriptCodeGen {
     public generate(): void {
         this._genService.copyFile(this._outDir, 'runtime/structs.ts', 'basestructs.ts'
             , `import { messageFactory } from './msgfactory';`
-            , `messageFactory.registerLoading(${StringTypeId}, StructString);`);
+            , `messageFactory.registerLoading(${StringTypeId}, StructString);\nmessageFactory.registerLoading(BatchTypeId, MessageBatch);`);
 
         this._idToScope.set(StructBaseId, 'basestructs');
         this._idToScope.set(StringTypeId, 'basestructs');
@@ -119,7 +121,34 @@ export class TypescriptCodeGen {
             });
             if (hasStruct) {
                 importFromScope['msgfactory'] = new Set(['messageFactory']);
+                if (importFromScope['basestructs']) {
+                    importFromScope['basestructs'].add('StructCollector').add('StructVerifier').add('StructDiffer').add('type IStructWire');
+                } else {
+                    importFromScope['basestructs'] = new Set(['StructCollector', 'StructVerifier', 'StructDiffer', 'type IStructWire']);
+                }
+                if (rst.contextLst.some((sctx) => sctx.context.includes('new StructFlatRows('))) {
+                    importFromScope['basestructs'].add('StructFlatRows');
+                }
+                if (rst.contextLst.some((sctx) => sctx.context.includes(' extends StructSoaArray '))) {
+                    importFromScope['basestructs'].add('StructSoaArray').add('StructSoaItem');
+                }
             }
+            rst.contextLst.forEach((sctx) => {
+                if (!sctx.compatRelys) {
+                    return;
+                }
+                importFromScope['basestructs'].add('StructBuffer').add('StructCompat');
+                if (sctx.context.includes('StructCompatArray.')) {
+                    importFromScope['basestructs'].add('StructCompatArray');
+                }
+                sctx.compatRelys.forEach((tid) => {
+                    const tscope = this._idToScope.get(tid);
+                    if (tscope && tscope !== scope) {
+                        const cname = `${this._genService.getSchemaTypeNameById(tid)}Compat`;
+                        importFromScope[tscope] = (importFromScope[tscope] || new Set()).add(cname);
+                    }
+                });
+            });
 
             Object.keys(importFromScope).forEach((tscope) => {
                 const currDir = scope.split('.');
@@ -139,6 +168,19 @@ export class TypescriptCodeGen {
             indexCtx += `import './${scope.split('.').join('/')}';\n`;
         });
 
+        const compatVersions = this._genService.compatVersions;
+        if (compatVersions.length > 0) {
+            indexCtx += `
+/**
+ * 兼容类(XxxCompat)可以读取的版本，layouts按此顺序排列，最后一个为当前版本
+ */
+export const compatVersions = [${[...compatVersions, this._genService.schema.version].map((v) => `'${v}'`).join(', ')}];
+
+export function compatVersionOf(version: string) {
+    return compatVersions.indexOf(version);
+}
+`;
+        }
         this._genService.writeScopeString(this._outDir, indexCtx, 'index', 'ts');
 
         this._generateFactory();
@@ -169,6 +211,13 @@ ${edesc.valueTypes
         const structBaseName = 'StructBase';
         const relys: Set<number> = new Set();
         let memsStr = '';
+        let gcStr = '';
+        /** gc遍历的成员，其余字节diff时按native比较 */
+        const traced: { offset: number; byteLength: number; line: string }[] = [];
+        const trace = (offset: number, byteLength: number, line: string) => {
+            gcStr += line;
+            traced.push({ offset, byteLength, line });
+        };
         sdesc.members.forEach(((memdec) => {
             switch (memdec.type.descType) {
             case TypeDescType.ArrayType:
@@ -182,12 +231,22 @@ ${edesc.valueTypes
 
     public get ${memdec.name}() {
         if (!this.#${memdec.name}) {
-            this.#${memdec.name} = messageFactory.create(${accessoryType.typeId}, this._buffer, this._offset + ${memdec.offset});
+            this.#${memdec.name} = messageFactory.create(${accessoryType.typeId}, this._sBuffer, this._offset + ${memdec.offset});
         }
         return this.#${memdec.name};
     }
 `;
+                if (memdec.flat) {
+                    memsStr += `
+    /** 各行的数据连续存放，可以按行或整块读取 */
+    public get ${memdec.name}Rows() {
+        return new StructFlatRows(this.${memdec.name}, ${this._genService.getTypeSizeFromTypeId(memdec.type.baseType.typeId)});
+    }
+`;
+                }
                 relys.add(accessoryType.typeId);
+                trace(memdec.offset, this._genService.getTypeSizeFromTypeId(accessoryType.typeId), `
+        gc.visit(${accessoryType.typeId}, this._offset + ${memdec.offset});`);
                 break;
             }
             case TypeDescType.MapType:
@@ -200,22 +259,28 @@ ${edesc.valueTypes
     #${memdec.name}: ${this._getMSGTSName(accessoryType.typeId)} | undefined;
     public get ${memdec.name}() {
         if (!this.#${memdec.name}) {
-            this.#${memdec.name} = messageFactory.create(${accessoryType.typeId}, this._buffer, this._offset + ${memdec.offset});
+            this.#${memdec.name} = messageFactory.create(${accessoryType.typeId}, this._sBuffer, this._offset + ${memdec.offset});
         }
         return this.#${memdec.name};
     }
 `;
                 relys.add(accessoryType.typeId);
+                trace(memdec.offset, this._genService.getTypeSizeFromTypeId(accessoryType.typeId), `
+        gc.visit(${accessoryType.typeId}, this._offset + ${memdec.offset});`);
                 break;
             }
             case TypeDescType.NativeSupportType:
+                if (memdec.type.typeId === StringTypeId) {
+                    trace(memdec.offset, 12, `
+        gc.visit(${StringTypeId}, this._offset + ${memdec.offset});`);
+                }
                 memsStr += `
     public get ${memdec.name}() {
-        return ${this._getValueFromId(memdec.type.typeId, `${memdec.offset}`)};
+        return ${this._getValueFromId(memdec.type.typeId, `this._offset + ${memdec.offset}`)};
     }
 
     public set ${memdec.name}(value: ${this._getGeneralTSName(memdec.type.typeId)}) {
-        ${this._setValueForId(memdec.type.typeId, `${memdec.offset}`, 'value')};
+        ${this._setValueForId(memdec.type.typeId, `this._offset + ${memdec.offset}`, 'value')};
     }
 `;
                 break;
@@ -229,43 +294,90 @@ ${edesc.valueTypes
     #${memdec.name}: ${this._getMSGTSName(accessoryType.typeId)} | undefined;
     public get ${memdec.name}() {
         if (!this.#${memdec.name}) {
-            this.#${memdec.name} = messageFactory.create(${accessoryType.typeId}, this._buffer, this._offset + ${memdec.offset});
+            this.#${memdec.name} = messageFactory.create(${accessoryType.typeId}, this._sBuffer, this._offset + ${memdec.offset});
         }
         return this.#${memdec.name};
     }
 `;
                 relys.add(accessoryType.typeId);
+                trace(memdec.offset, this._genService.getTypeSizeFromTypeId(accessoryType.typeId), `
+        gc.visit(${accessoryType.typeId}, this._offset + ${memdec.offset});`);
                 break;
             }
             case TypeDescType.UserDefType:
             {
                 const memType = this._genService.idToDesc.get(memdec.type.typeId);
                 if (memType && memType.type === 'struct') {
-                    let gstr = ``;
                     if (memdec.refType === EMemberRefType.reference) {
-                        gstr = `const addr = this._dataView.getInt32(this._offset + ${memdec.offset}, true);
-            if (!addr) {
-                return undefined;
-            }
-            this.#${memdec.name} = messageFactory.create(${memType.typeId}, this._buffer, addr);`;
-                    } else if (memdec.refType === EMemberRefType.inline) {
-                        gstr = `this.#${memdec.name} = messageFactory.create(${memType.typeId}, this._buffer, this._offset + ${memdec.offset});`;
-                    }
-                    memsStr += `
+                        // 引用的地址在重新分配或gc之后会变化，缓存需要校验地址
+                        memsStr += `
     #${memdec.name}: ${this._getMSGTSName(memType.typeId)} | undefined;
-    public get ${memdec.name}()${memdec.refType === EMemberRefType.reference ? `: ${this._getMSGTSName(memType.typeId)} | undefined` : `: ${this._getMSGTSName(memType.typeId)}`} {
+    public get ${memdec.name}(): ${this._getMSGTSName(memType.typeId)} | undefined {
+        const addr = this._dataView.getInt32(this._offset + ${memdec.offset}, true);
+        if (!addr) {
+            return undefined;
+        }
+        if (!this.#${memdec.name} || this.#${memdec.name}.$_address !== addr) {
+            this.#${memdec.name} = messageFactory.create(${memType.typeId}, this._sBuffer, addr);
+        }
+        return this.#${memdec.name};
+    }
+`;
+                        trace(memdec.offset, 4, `
+        gc.visitReference(${memType.typeId}, ${memType.byteLength}, this._offset + ${memdec.offset});`);
+                    } else {
+                        memsStr += `
+    #${memdec.name}: ${this._getMSGTSName(memType.typeId)} | undefined;
+    public get ${memdec.name}(): ${this._getMSGTSName(memType.typeId)} {
         if (!this.#${memdec.name}) {
-            ${gstr}
+            this.#${memdec.name} = messageFactory.create(${memType.typeId}, this._sBuffer, this._offset + ${memdec.offset});
         }
         return this.#${memdec.name};
     }
 `;
+                        trace(memdec.offset, memType.byteLength, `
+        gc.visit(${memType.typeId}, this._offset + ${memdec.offset});`);
+                    }
                 }
                 break;
             }
             }
         }));
 
+        // 紧凑编码按声明顺序处理所有成员，引用成员带上被引用struct的长度
+        const wireMembers = sdesc.members.map((memdec) => {
+            const typeId = memdec.type.accessory ? memdec.type.accessory.typeId : memdec.type.typeId;
+            const memType = this._genService.idToDesc.get(typeId);
+            const refLength = memdec.refType === EMemberRefType.reference && memType?.type === 'struct' ? memType.byteLength : 0;
+            return `${this._wireTypeId(typeId)}, ${memdec.offset}, ${refLength}`;
+        });
+
+        let coalesceStr = '';
+        if (sdesc.coalesce) {
+            const key = sdesc.members.find((mem) => mem.name === sdesc.coalesce?.key);
+            const policy = key ? `{ keyOffset: ${key.offset}, keyBytes: ${this._genService.getTypeSizeFromTypeId(key.type.typeId)} }` : '{ keyOffset: -1, keyBytes: 0 }';
+            coalesceStr = `
+    public static coalescePolicy() { return ${policy}; }
+`;
+        }
+
+        // 校验与gc遍历相同的成员，StructVerifier提供同名的visit/visitReference
+        const verifyStr = gcStr.replace(/gc\./g, 'v.');
+        // diff时gc遍历的成员之间的字节(native成员和enum)直接比较
+        let diffStr = '';
+        let cursor = 0;
+        traced.sort((a, b) => a.offset - b.offset).forEach((member) => {
+            if (member.offset > cursor) {
+                diffStr += `
+        d.diffBytes(this._offset + ${cursor}, ${member.offset - cursor});`;
+            }
+            diffStr += member.line.replace(/gc\./g, 'd.');
+            cursor = member.offset + member.byteLength;
+        });
+        if (sdesc.byteLength > cursor) {
+            diffStr += `
+        d.diffBytes(this._offset + ${cursor}, ${sdesc.byteLength - cursor});`;
+        }
         const structCtx = `
 export class ${sdesc.typeName} extends ${structBaseName} {
     public static typeId(): ${sdesc.typeId} {
@@ -274,6 +386,9 @@ export class ${sdesc.typeName} extends ${structBaseName} {
 
     public static byteLength() { return ${sdesc.byteLength}; }
 
+    /** 紧凑编码的成员，每3个一组: typeId, offset, 引用的struct长度 */
+    public static readonly wireMembers = [${wireMembers.join(', ')}];
+${coalesceStr}
     ${memsStr}
 
     public get typeId() {
@@ -284,7 +399,21 @@ export class ${sdesc.typeName} extends ${structBaseName} {
         return ${sdesc.byteLength};
     }
 
-    public $_gcStruct() {}
+    public $_gcStruct(gc: StructCollector) {${gcStr ? gcStr : `
+        void gc;`}
+    }
+
+    public $_verifyStruct(v: StructVerifier) {${verifyStr ? verifyStr : `
+        void v;`}
+    }
+
+    public $_diffStruct(d: StructDiffer) {${diffStr ? diffStr : `
+        void d;`}
+    }
+
+    public $_wireStruct(w: IStructWire) {
+        w.struct(this._offset, ${sdesc.typeName}.wireMembers);
+    }
 
     public buildSelf() {
     }
@@ -292,16 +421,202 @@ export class ${sdesc.typeName} extends ${structBaseName} {
 messageFactory.registerLoading(${sdesc.typeId}, ${sdesc.typeName});
 `;
 
+        const compatRelys: Set<number> = new Set();
+        const compatCtx = this._generateCompatDef(sdesc, compatRelys);
         return {
             type: 'struct',
             typeName: sdesc.typeName,
-            context: structCtx,
+            context: structCtx + compatCtx,
             scope: sdesc.scope,
             relys: [...relys, StructBaseId],
             typeId: sdesc.typeId,
+            compatRelys: compatCtx ? [...compatRelys] : undefined,
         };
     }
 
+    /**
+     * 布局在历史版本中变化过的struct，生成按版本布局只读访问的`XxxCompat`类
+     */
+    private _generateCompatDef(sdesc: StructDescription, compatRelys: Set<number>) {
+        const layouts = this._genService.getCompatLayouts(sdesc.typeId);
+        if (!layouts) {
+            return '';
+        }
+        const className = `${sdesc.typeName}Compat`;
+        const versions = [...this._genService.compatVersions, this._genService.schema.version];
+        let memsStr = '';
+        sdesc.members.forEach((memdec, index) => {
+            if (memdec.type.descType === TypeDescType.NativeSupportType && memdec.type.typeId !== StringTypeId) {
+                const literal = memdec.type.literal;
+                const defaultValue = literal === 'bool' ? 'false' : (literal === 'int64' || literal === 'uint64' ? '0n' : '0');
+                memsStr += `
+    public get ${memdec.name}() {
+        const offset = this.$_offsetOf(${index});
+        return offset < 0 ? ${defaultValue} : ${this._getValueFromId(memdec.type.typeId, 'offset')};
+    }
+`;
+                return;
+            }
+            const memType = memdec.type.descType === TypeDescType.UserDefType ? this._genService.idToDesc.get(memdec.type.typeId) : undefined;
+            if (memdec.type.descType === TypeDescType.UserDefType && memType?.type !== 'struct') {
+                return;
+            }
+            const reference = memdec.refType === EMemberRefType.reference;
+            if (!this._genService.isCompatChanged(memdec.typeId)) {
+                const tsType = this._getMSGTSName(memdec.typeId);
+                memsStr += reference ? `
+    public get ${memdec.name}(): ${tsType} | undefined {
+        const addr = this.$_referenceOf(${index});
+        return addr ? messageFactory.create(${memdec.typeId}, this._sBuffer, addr) : undefined;
+    }
+` : `
+    public get ${memdec.name}() {
+        const offset = this.$_offsetOf(${index});
+        return offset < 0 ? messageFactory.create(${memdec.typeId}, StructCompat.$_zeros(${this._genService.getTypeSizeFromTypeId(memdec.typeId)}), 0) : messageFactory.create(${memdec.typeId}, this._sBuffer, offset);
+    }
+`;
+                return;
+            }
+            const itemType = this._getCompatItemType(memdec.typeId, compatRelys);
+            if (!itemType) {
+                memsStr += `
+    // ${memdec.name}: map/combine中struct的布局已变化，不支持兼容读取
+`;
+            } else if (reference) {
+                memsStr += `
+    public get ${memdec.name}() {
+        const addr = this.$_referenceOf(${index});
+        return addr ? ${itemType}.create(this._sBuffer, addr, this._version) : undefined;
+    }
+`;
+            } else {
+                memsStr += `
+    public get ${memdec.name}() {
+        return ${itemType}.create(this._sBuffer, this.$_offsetOf(${index}), this._version);
+    }
+`;
+            }
+        });
+
+        return `
+/**
+ * 按历史版本的布局只读访问${sdesc.typeName}，version为compatVersionOf()得到的序号
+ */
+export class ${className} extends StructCompat {
+    public static readonly layouts = [
+${layouts.map((layout, vi) => `        [${[layout.byteLength, ...layout.offsets].join(', ')}], // ${versions[vi]}`).join('\n')}
+    ];
+
+    public static create(buf: StructBuffer, offset: number, version: number) {
+        return new ${className}(buf, offset, version);
+    }
+
+    public static byteLengthOf(version: number) {
+        return ${className}.layouts[version][0];
+    }
+
+    protected get $_layout() {
+        return ${className}.layouts[this._version];
+    }
+${memsStr}}
+`;
+    }
+
+    /**
+     * 布局变化的struct及其数组的兼容类型(StructCompatArray.itemsOf嵌套)，map和combine不支持时返回undefined
+     */
+    private _getCompatItemType(id: number, compatRelys: Set<number>): string | undefined {
+        const desc = this._genService.getDescByTypeId(id);
+        if (desc.type === 'struct') {
+            compatRelys.add(id);
+            return `${desc.typeName}Compat`;
+        }
+        if (desc.type === 'mapArray') {
+            const baseTypeId = desc.relyTypes.length === 1 ? desc.relyTypes[0] : parseInt(desc.typeName.split('_')[2], 10);
+            const itemType = this._getCompatItemType(baseTypeId, compatRelys);
+            return itemType ? `StructCompatArray.itemsOf(${itemType})` : undefined;
+        }
+        return undefined;
+    }
+
+    /**
+     * `@soa`数组及其元素类`XxxItem`，元素的成员只有native和enum(按dataType读写)，每一列可以作为typed array读取
+     */
+    private _generateSoaArray(desc: IAccessoryDesc) {
+        const sdesc = this._genService.getDescByTypeId(desc.relyTypes[0]) as StructDescription;
+        const itemName = `${desc.typeName}Item`;
+        let itemStr = '';
+        let columnStr = '';
+        sdesc.members.forEach((memdec) => {
+            const typeId = this._wireTypeId(memdec.type.typeId);
+            const byteLength = this._genService.getTypeSizeFromTypeId(typeId);
+            const literal = this._genService.getSchemaTypeNameById(typeId);
+            const offsetStr = `this._at(${memdec.offset}, ${byteLength})`;
+            itemStr += `
+    public get ${memdec.name}() {
+        return ${this._getValueFromId(typeId, offsetStr)};
+    }
+
+    public set ${memdec.name}(value: ${this._getGeneralTSName(typeId)}) {
+        ${this._setValueForId(typeId, offsetStr, 'value')};
+    }
+`;
+            columnStr += `
+    public get ${memdec.name}s() {
+        return this.column(${literalToNativeTypeName[literal].typedArray}, ${memdec.offset});
+    }
+`;
+        });
+        return `
+export class ${itemName} extends StructSoaItem {${itemStr}}
+
+export class ${desc.typeName} extends StructSoaArray {
+    public static humanReadableName(): '${desc.humanReadName}' {
+        return '${desc.humanReadName}';
+    }
+    public static byteLength() { return ${sdesc.byteLength}; }
+
+    public get dataBytes() { return ${sdesc.byteLength}; }
+
+    public get columns() { return ${sdesc.typeName}.wireMembers; }
+
+    public get typeId() { return ${desc.typeId}; }
+
+    public at(index: number) {
+        if (index < this.size) {
+            return new ${itemName}(this, index);
+        }
+        throw new Error('[Index Exceed], Get index in array error.')
+    }
+
+    /**
+     * 增加一个清零的元素
+     */
+    public pushElement() {
+        this.resize(this.size + 1);
+        return new ${itemName}(this, this.size - 1);
+    }
+${columnStr}
+    public $_gcStruct(gc: StructCollector) {
+        this.$_gcColumns(gc);
+    }
+
+    public $_verifyStruct(v: StructVerifier) {
+        this.$_verifyColumns(v);
+    }
+
+    public $_diffStruct(d: StructDiffer) {
+        this.$_diffColumns(d);
+    }
+
+    public $_wireStruct(w: IStructWire) {
+        w.columns(this._offset, ${sdesc.typeName}.wireMembers, ${sdesc.byteLength});
+    }
+}
+messageFactory.registerLoading(${desc.typeId}, ${desc.typeName});
+`;
+    }
+
     private _generateAccessoryDef(desc: IAccessoryDesc): IScopeContext {
         let ctxString = '';
         let scope = '';
@@ -328,6 +643,7 @@ export class ${desc.typeName} extends StructArray {
 
     public at(index: number): ${baseDesc} {
         if (index < this.size) {
+            this._checkCache();
             if (this._c[index]) {
                 return this._c[index];
             }
@@ -346,7 +662,7 @@ export class ${desc.typeName} extends StructArray {
      */
     public pushElement(src?: number) {
         if (this.capacity - this.size < 1) {
-            this.reserve(Math.min(this.capacity * 2, this.capacity + 20));
+            this.reserve(Math.min(Math.max(this.capacity * 2, 1), this.capacity + 20));
         }
         const existSize = this.size;
         this._dataView.setInt32(this._offset + 4, existSize + 1, true);
@@ -354,6 +670,7 @@ export class ${desc.typeName} extends StructArray {
         if (src) {
             this.copyArrayBuffer(this._sBuffer._buffer, src, this._sBuffer._buffer, this.dataOffset + this.dataBytes * existSize, this.dataBytes);
         }
+        this._checkCache();
         if (this._c[existSize]) {
             return this._c[existSize];
         }
@@ -363,12 +680,43 @@ export class ${desc.typeName} extends StructArray {
     }
 
     public get typeId() { return ${id}; }
+
+    public $_gcStruct(gc: StructCollector) {
+        this.$_gcItems(gc, ${this._gcTypeId(baseTypeId)});
+    }
+
+    public $_verifyStruct(v: StructVerifier) {
+        this.$_verifyItems(v, ${this._gcTypeId(baseTypeId)});
+    }
+
+    public $_diffStruct(d: StructDiffer) {
+        this.$_diffItems(d, ${this._gcTypeId(baseTypeId)});
+    }
+
+    public $_wireStruct(w: IStructWire) {
+        w.items(this._offset, ${this._wireTypeId(baseTypeId)}, ${structByte});
+    }
+
+    /**
+     * 数据在reserve或gc之后会移动，缓存的元素随之失效
+     */
+    private _checkCache() {
+        if (this._cOffset !== this.dataOffset) {
+            this._c = [];
+            this._cOffset = this.dataOffset;
+        }
+    }
+
     private _c: ${baseDesc}[] = [];
+    private _cOffset = 0;
 }
 messageFactory.registerLoading(${id}, ${desc.typeName});
 `;
                 scope = 'arraystructs';
             }
+        } else if (desc.type === 'soaArray') {
+            ctxString = this._generateSoaArray(desc);
+            scope = 'arraystructs';
         } else if (desc.type === 'mapStruct') {
             const id = desc.typeId;
             const nameparts = desc.typeName.split('_');
@@ -386,18 +734,18 @@ messageFactory.registerLoading(${id}, ${desc.typeName});
             if (keyTypeId === StringTypeId) {
                 getValueStr = `    public get(key: string): ${baseDesc} | undefined {
         const offset = this.binSearchLocation(key);
-        if (!offset) {
+        if (offset === undefined) {
             return undefined;
         }
-        return ${this._getValueFromId(valueTypeId, 'offset')};
+        return ${this._getValueFromId(valueTypeId, `offset + ${keyByte}`)};
     }`;
             } else {
                 getValueStr = `    public get(key: number): ${baseDesc} | undefined {
         const offset = this.binSearchLocation(key);
-        if (!offset) {
+        if (offset === undefined) {
             return undefined;
         }
-        return ${this._getValueFromId(valueTypeId, 'offset')};
+        return ${this._getValueFromId(valueTypeId, `offset + ${keyByte}`)};
     }`;
             }
 
@@ -433,6 +781,22 @@ ${searchMethod}
 
 ${getValueStr}
 
+    public $_gcStruct(gc: StructCollector) {
+        this.$_gcEntries(gc, ${this._gcTypeId(keyTypeId)}, ${this._gcTypeId(valueTypeId)});
+    }
+
+    public $_verifyStruct(v: StructVerifier) {
+        this.$_verifyEntries(v, ${this._gcTypeId(keyTypeId)}, ${this._gcTypeId(valueTypeId)});
+    }
+
+    public $_diffStruct(d: StructDiffer) {
+        this.$_diffEntries(d, ${this._gcTypeId(keyTypeId)}, ${this._gcTypeId(valueTypeId)});
+    }
+
+    public $_wireStruct(w: IStructWire) {
+        w.entries(this._offset, ${this._wireTypeId(keyTypeId)}, ${this._wireTypeId(valueTypeId)}, ${keyByte}, ${valueByte});
+    }
+
 }
 messageFactory.registerLoading(${id}, ${desc.typeName});
 
@@ -459,6 +823,41 @@ export class ${desc.typeName} extends StructCombine {
         return ${candidateTypes.length};
     }
 
+    public $_gcStruct(gc: StructCollector) {
+        switch(this._sBuffer._dataView.getUint8(this._offset)) {
+${candidateTypes.map((tyStr, index) => {
+    const typeId = parseInt(tyStr);
+    return `            case ${index + 1}:
+                this.$_gcValue(gc, ${this._gcTypeId(typeId)}, ${this._genService.getTypeSizeFromTypeId(typeId)});
+                break;`;
+}).join('\n')}
+        }
+    }
+
+    public $_verifyStruct(v: StructVerifier) {
+        const index = this._sBuffer._dataView.getUint8(this._offset);
+        switch(index) {
+${candidateTypes.map((tyStr, index) => {
+    const typeId = parseInt(tyStr);
+    return `            case ${index + 1}:
+                this.$_verifyValue(v, ${this._gcTypeId(typeId)}, ${this._genService.getTypeSizeFromTypeId(typeId)});
+                break;`;
+}).join('\n')}
+            default:
+                if (index > ${candidateTypes.length}) {
+                    v.fail('Combine', this._offset);
+                }
+        }
+    }
+
+    public $_diffStruct(d: StructDiffer) {
+        this.$_diffValue(d, [${candidateTypes.map((tyStr) => this._gcTypeId(parseInt(tyStr))).join(', ')}], [${candidateTypes.map((tyStr) => this._genService.getTypeSizeFromTypeId(parseInt(tyStr))).join(', ')}]);
+    }
+
+    public $_wireStruct(w: IStructWire) {
+        w.value(this._offset, [${candidateTypes.map((tyStr) => this._wireTypeId(parseInt(tyStr))).join(', ')}], [${candidateTypes.map((tyStr) => this._genService.getTypeSizeFromTypeId(parseInt(tyStr))).join(', ')}]);
+    }
+
     public getValue() {
         switch(this._sBuffer._dataView.getUint8(this._offset)) {
 ${candidateTypes.map((tyStr, index) => {
@@ -488,17 +887,18 @@ ${candidateTypes.map((tpStr, index) => {
         offsetStr = 'this._offset + 4';
         setStr = this._setValueForId(typeId, 'this._offset + 4', 'value');
     } else {
-        setStr = `const bufAddr = this.$_createSubBuffer(${tpSize});
-        this._sBuffer._dataView.setInt32(this._offset + 4, bufAddr);
+        // 与数组元素相同的对齐，见basestructs中的itemAlignment
+        setStr = `const bufAddr = this.$_createSubBuffer(${tpSize}, ${Math.min(tpSize & -tpSize, 8)});
+        this._sBuffer._dataView.setInt32(this._offset + 4, bufAddr, true);
         ${this._setValueForId(typeId, 'bufAddr', 'value')}`;
         offsetStr = 'this._sBuffer._dataView.getInt32(this._offset + 4, true)';
     }
     return `    public set${upperFirstName}(value: ${tsTpName}) {
-        this._sBuffer._dataView.setUint8(this._offset, ${index});
+        this._sBuffer._dataView.setUint8(this._offset, ${index + 1});
         ${setStr};
     }
     public is${upperFirstName}() {
-        return this._sBuffer._dataView.getUint8(this._offset) === ${index};
+        return this._sBuffer._dataView.getUint8(this._offset) === ${index + 1};
     }
     public get${upperFirstName}() {
         return ${this._getValueFromId(typeId, offsetStr)};
@@ -551,17 +951,25 @@ messageFactory.registerLoading(${desc.typeId}, ${desc.typeName});
         });
 
         const factoryContent = `
-import type { StructBase, StructBuffer, StructString } from './basestructs';
+import type { StructBase, StructBuffer, StructString, ICoalescePolicy } from './basestructs';
 ${importStr}
 type DerivedStructClass = {
     new (buf: ArrayBuffer | StructBuffer, offset: number): StructBase;
     byteLength(): number;
+    coalescePolicy?(): ICoalescePolicy;
 }
 class StructFactory {
     public registerLoading(typeId: number, cls: DerivedStructClass) {
         this._clasDefs[typeId] = cls;
     }
 
+    /**
+     * IDL中\`@coalesce\`的struct在\`CoalescingQueue\`中的合并方式
+     */
+    public coalescePolicy(typeId: number) {
+        return this._clasDefs[typeId]?.coalescePolicy?.();
+    }
+
 ${itCNames.map(pair => `
     public create(typeId: ${pair.id}, buf: ArrayBuffer | StructBuffer, offset: number): ${pair.cname};`).join('')}
     public create(typeId: number, buf: ArrayBuffer | StructBuffer, offset: number): StructBase {
@@ -582,7 +990,9 @@ ${itCNames.map(pair => `
         if (!clsDef) {
             throw new Error(\`Cannot find the def of typeId: \${typeId}\`);
         }
-        const offset = struct.$_createSubBuffer(clsDef.byteLength());
+        // 与数组元素一样按整除byteLength的最大2的幂(不超过8)对齐
+        const byteLength = clsDef.byteLength();
+        const offset = struct.$_createSubBuffer(byteLength, Math.min(byteLength & -byteLength, 8) || 1);
         return new clsDef(struct.$_structBuf(), offset);
     }
 
@@ -627,48 +1037,37 @@ export const messageFactory = new StructFactory();
                 }
             }
         }
-        return `const tmp = messageFactory.create(${typeId}, this._sBuffer, ${offsetStr}); ${valueStr}.copyToBuffer(this._sBuffer, ${offsetStr})`;
+        return `const tmp = messageFactory.create(${typeId}, this._sBuffer, ${offsetStr}); ${valueStr}.copyToBuffer(this._sBuffer, ${offsetStr}, messageFactory)`;
     }
 
     private _generateBinSearch(tsType: 'number' | 'string', schemaTypeName: string) {
         if (tsType === 'number') {
             const desc = literalToNativeTypeName[schemaTypeName];
             return `
-    private compareKey(keyValue: number, localAddr: number) {
-        const local = this._sBuffer._dataview.${desc.bufViewGet}(localAddr${['uint8', 'int8'].includes(schemaTypeName) ? '' : ', true'});
+    private compareKey(key: number, localAddr: number) {
+        const local = this._dataView.${desc.bufViewGet}(localAddr${['uint8', 'int8'].includes(schemaTypeName) ? '' : ', true'});
         if (key < local) { return 1; }
         else if (key > local) { return -1; }
         return 0;
     }
 
     private binSearchLocation(key: number) {
-        let mk = 0;
-        let mx = this.size;
-        while(mx - mk > 1) {
-            const nxt = Math.floor((mx - mk) / 2);
-            const compareOffset = dataOffset + nxt * (12 + this.valueByte);
+        const dataOffset = this.dataOffset;
+        const entryByte = this.keyByte + this.valueByte;
+        let lo = 0;
+        let hi = this.size;
+        while (lo < hi) {
+            const mid = (lo + hi) >>> 1;
+            const compareOffset = dataOffset + mid * entryByte;
             const rst = this.compareKey(key, compareOffset);
             if (rst === 0) {
                 return compareOffset;
-            } else if (rst < 0) {
-                mx = nxt - 1;
+            } else if (rst > 0) {
+                hi = mid;
             } else {
-                mk = nxt + 1;
+                lo = mid + 1;
             }
         }
-        let compareOffset = dataOffset + mx * (this.keyByte + this.valueByte);
-        let rst = this.compareKey(key, compareOffset);
-        if (rst === 0) {
-            return compareOffset;
-        }
-        if (mk == mx) {
-            return undefined;
-        }
-        compareOffset -= this.keyByte + this.valueByte;
-        rst = this.compareKey(key, compareOffset);
-        if (rst === 0) {
-            return compareOffset;
-        }
         return undefined;
     }
 `;
@@ -676,12 +1075,12 @@ export const messageFactory = new StructFactory();
             return `
     private compareKey(keyBuffer: Uint8Array, localAddr: number) {
         let localBuffer: Uint8Array;
-        const dataOffset = this._dataView.getInt32(localAddr, true);
+        const dataOffset = this._dataView.getInt32(localAddr);
         if (dataOffset > 0) {
             const len = this._dataView.getInt32(localAddr + 4, true);
             localBuffer = new Uint8Array(this._buffer, dataOffset, len);
         } else {
-            const len = this._dataView.getInt8(localAddr) & 0x7F;
+            const len = this._dataView.getUint8(localAddr) & 0x7F;
             localBuffer = new Uint8Array(this._buffer, localAddr + 1, len);
         }
 
@@ -703,35 +1102,22 @@ export const messageFactory = new StructFactory();
 
     private binSearchLocation(key: string) {
         const dataOffset = this.dataOffset;
+        const entryByte = this.keyByte + this.valueByte;
         const keyBuffer = this.toUint8Array(key);
-        let mk = 0;
-        let mx = this.size;
-        while(mx - mk > 1) {
-            const nxt = Math.floor((mx - mk) / 2);
-            const compareOffset = dataOffset + nxt * (12 + this.valueByte);
+        let lo = 0;
+        let hi = this.size;
+        while (lo < hi) {
+            const mid = (lo + hi) >>> 1;
+            const compareOffset = dataOffset + mid * entryByte;
             const rst = this.compareKey(keyBuffer, compareOffset);
             if (rst === 0) {
                 return compareOffset;
-            } else if (rst < 0) {
-                mx = nxt - 1;
+            } else if (rst > 0) {
+                hi = mid;
             } else {
-                mk = nxt + 1;
+                lo = mid + 1;
             }
         }
-
-        let compareOffset = dataOffset + mx * (12 + this.valueByte);
-        let rst = this.compareKey(keyBuffer, compareOffset);
-        if (rst === 0) {
-            return compareOffset;
-        }
-        if (mk == mx) {
-            return undefined;
-        }
-        compareOffset -= 12 + this.valueByte;
-        rst = this.compareKey(keyBuffer, compareOffset);
-        if (rst === 0) {
-            return compareOffset;
-        }
         return undefined;
     }
 `;
@@ -740,6 +1126,27 @@ export const messageFactory = new StructFactory();
         throw new Error('error.');
     }
 
+    /**
+     * 紧凑编码使用的typeId，enum按底层的native类型编码
+     */
+    private _wireTypeId(typeId: number) {
+        const desc = this._genService.idToDesc.get(typeId);
+        return desc?.type === 'enum' ? desc.dataType.typeId : typeId;
+    }
+
+    /**
+     * gc时需要继续遍历的类型返回typeId，native类型和enum返回0
+     */
+    private _gcTypeId(typeId: number) {
+        if (typeId === StringTypeId) {
+            return typeId;
+        }
+        if (NativeSupportTypes.find((tp) => tp.typeId === typeId)) {
+            return 0;
+        }
+        return this._genService.idToDesc.get(typeId)?.type === 'enum' ? 0 : typeId;
+    }
+
     /**
      * 将id转换到TS类型，主要为了往MSG中写入数据
      * @param id 类型的ID
@@ -0,0 +1,537 @@
+/**
+ * test/midls中消息的基准测试，与plain struct + memcpy的实现对比。
+ * 结果以JSON输出: ns/op, bytes/op(堆分配的字节数), allocs/op(堆分配的次数)以及消息的字节数。
+ *
+ * 用法: smessage_bench [--filter <子串>] [--min-time-ms <毫秒>] [--out <文件>]
+ */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "index.h"
+#include "builder.hpp"
+#include "gc.hpp"
+
+using namespace slime::message;
+
+// glibc下替换malloc系列函数统计分配，MessageBuilder的realloc和operator new都会经过这里
+#if defined(__GLIBC__) && !defined(__SANITIZE_ADDRESS__) && !defined(SMESSAGE_BENCH_NO_MALLOC_HOOK)
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t count, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+void __libc_free(void *ptr);
+}
+
+namespace {
+    constexpr bool allocsCounted = true;
+    uint64_t allocCount = 0;
+    uint64_t allocBytes = 0;
+
+    inline void countAlloc(size_t size) {
+        allocCount++;
+        allocBytes += size;
+    }
+}
+
+extern "C" {
+void *malloc(size_t size) {
+    countAlloc(size);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    countAlloc(count * size);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    countAlloc(size);
+    return __libc_realloc(ptr, size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size) {
+    countAlloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+void *memalign(size_t alignment, size_t size) {
+    countAlloc(size);
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size) {
+    countAlloc(size);
+    *ptr = __libc_memalign(alignment, size);
+    return *ptr ? 0 : ENOMEM;
+}
+
+void free(void *ptr) {
+    __libc_free(ptr);
+}
+}
+#else
+namespace {
+    /// 无法统计时bytes/op和allocs/op恒为0
+    constexpr bool allocsCounted = false;
+    uint64_t allocCount = 0;
+    uint64_t allocBytes = 0;
+}
+#endif
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    /// 阻止编译器把基准测试的结果优化掉
+    template <typename T>
+    inline void keep(const T &value) {
+#if defined(__GNUC__) || defined(__clang__)
+        asm volatile("" : : "r,m"(value) : "memory");
+#else
+        static volatile const void *sink;
+        sink = &value;
+#endif
+    }
+
+    struct Result {
+        std::string name;
+        uint64_t iterations;
+        double nsPerOp;
+        double bytesPerOp;
+        double allocsPerOp;
+        int64_t messageBytes;
+    };
+
+    struct Options {
+        std::string filter;
+        double minTimeMs = 200;
+        std::string out;
+    };
+
+    Options options;
+    std::vector<Result> results;
+
+    /**
+     * 以倍增的次数运行body，直到总耗时超过minTimeMs。
+     * `messageBytes`为一次操作产生或读取的消息大小，没有对应的消息时为0。
+     */
+    template <typename Body>
+    void bench(std::string name, int64_t messageBytes, Body &&body) {
+        if (!options.filter.empty() && name.find(options.filter) == std::string::npos) {
+            return;
+        }
+        body();
+        uint64_t iterations = 1;
+        for (;;) {
+            const uint64_t count = allocCount;
+            const uint64_t bytes = allocBytes;
+            const auto start = Clock::now();
+            for (uint64_t i = 0; i < iterations; i++) {
+                body();
+            }
+            const double elapsed = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+            if (elapsed >= options.minTimeMs * 1e6 || iterations >= (uint64_t(1) << 40)) {
+                const double n = static_cast<double>(iterations);
+                results.push_back(Result{std::move(name), iterations, elapsed / n, static_cast<double>(allocBytes - bytes) / n, static_cast<double>(allocCount - count) / n, messageBytes});
+                return;
+            }
+            iterations *= elapsed > 0 ? std::clamp<uint64_t>(static_cast<uint64_t>(options.minTimeMs * 1e6 * 1.2 / elapsed), 2, 100) : 100;
+        }
+    }
+
+    // ---------------- plain struct baseline ----------------
+
+    struct PlainPoint {
+        double x;
+        double y;
+    };
+
+    struct PlainMouseMove {
+        PlainPoint start;
+        PlainPoint end;
+        bool ctrlKey;
+        bool shiftKey;
+        bool optionKey;
+    };
+
+    struct PlainTitleButtonClick {
+        uint16_t buttonType;
+        std::vector<std::vector<PlainPoint>> points;
+    };
+
+    // ---------------- fixtures ----------------
+
+    constexpr int32_t mapEntries = 16;
+    constexpr int32_t rows = 8;
+    constexpr int32_t columns = 8;
+    constexpr int32_t chainDepth = 16;
+    constexpr int32_t growthPoints = 1024;
+
+    /// map的key按字节序升序，一半是inline的短字符串，一半超过11字节存放在子空间
+    std::vector<std::string> mapKeys() {
+        std::vector<std::string> keys;
+        for (int32_t i = 0; i < mapEntries; i++) {
+            char key[32];
+            std::snprintf(key, sizeof(key), i % 2 ? "cursor.position.%02d" : "pos%02d", i);
+            keys.emplace_back(key);
+        }
+        std::sort(keys.begin(), keys.end());
+        return keys;
+    }
+
+    const std::vector<std::string> keys = mapKeys();
+
+    void buildMouseMove(SMessage::MessageBuilder &builder, int32_t seed) {
+        auto move = builder.createRoot<base::MouseMove>();
+        move.getStart().setX(seed);
+        move.getStart().setY(seed + 1);
+        move.getEnd().setX(seed + 2);
+        move.getEnd().setY(seed + 3);
+        move.setCtrlKey(true);
+        move.setOptionKey(seed & 1);
+    }
+
+    /// C++ builder没有map的插入接口，按布局直接写入已排序的entry
+    void buildMouseDown(SMessage::MessageBuilder &builder) {
+        using Map = decltype(std::declval<base::MouseDown>().getPosition());
+        builder.createRoot<base::MouseDown>().setButton(base::MouseKey::left);
+        const int32_t mapOffset = SMessage::RootOffset + base::MouseDown::offsetPosition;
+        const int32_t data = builder.createSubBuffer(mapEntries * Map::entryByte(), 4);
+        SMessage::storeValue<int32_t>(builder.data(), mapOffset, mapEntries);
+        SMessage::storeValue<int32_t>(builder.data(), mapOffset + 4, mapEntries);
+        SMessage::storeValue<int32_t>(builder.data(), mapOffset + 8, data);
+        for (int32_t i = 0; i < mapEntries; i++) {
+            const int32_t entry = data + Map::entryByte() * i;
+            builder.setString(builder.view<SMessage::MsgString>(entry), keys[i]);
+            auto point = builder.create<base::Point2D>();
+            point.setX(i);
+            point.setY(-i);
+            SMessage::storeValue<uint8_t>(builder.data(), entry + Map::keyByte(), SMessage::combineIndexOf<base::Point2D, base::Point2D, SMessage::Accessory::MA_1_8>());
+            SMessage::storeValue<int32_t>(builder.data(), entry + Map::keyByte() + 4, point.offset());
+        }
+    }
+
+    void fillPoints(SMessage::MessageBuilder &builder, const SMessage::Accessory::MA_2_66 &points) {
+        builder.reserve(points, rows);
+        for (int32_t r = 0; r < rows; r++) {
+            const auto row = builder.emplaceBack(points);
+            builder.reserve(row, columns);
+            for (int32_t c = 0; c < columns; c++) {
+                auto point = builder.emplaceBack(row);
+                point.setX(r);
+                point.setY(c);
+            }
+        }
+    }
+
+    void buildTitleButtonClick(SMessage::MessageBuilder &builder) {
+        auto click = builder.createRoot<title::TitleButtonClick>();
+        click.setButtonType(title::TitleButtonEnum::Close);
+        fillPoints(builder, click.getPoints());
+    }
+
+    /// 长度为chainDepth的left链，right与left共享，每个节点的value都有rows × columns个点
+    void buildRecuTest(SMessage::MessageBuilder &builder) {
+        auto node = builder.createRoot<title::RecuTest>();
+        for (int32_t d = 0; d < chainDepth; d++) {
+            fillPoints(builder, builder.view<title::RecuTest>(node.offset()).getValue().getPoints());
+            const auto left = builder.createReference<title::RecuTest>(node, title::RecuTest::offsetLeft);
+            SMessage::storeValue<int32_t>(builder.data(), node.offset() + title::RecuTest::offsetRight, left.offset());
+            node = left;
+        }
+    }
+
+    PlainTitleButtonClick plainTitleButtonClick() {
+        PlainTitleButtonClick click{3, {}};
+        click.points.reserve(rows);
+        for (int32_t r = 0; r < rows; r++) {
+            auto &row = click.points.emplace_back();
+            row.reserve(columns);
+            for (int32_t c = 0; c < columns; c++) {
+                row.push_back(PlainPoint{static_cast<double>(r), static_cast<double>(c)});
+            }
+        }
+        return click;
+    }
+
+    double sumPoints(const SMessage::Accessory::MA_2_66 &points) {
+        double sum = 0;
+        const int32_t size = points.getSize();
+        for (int32_t r = 0; r < size; r++) {
+            const auto row = points.getItem(r);
+            const int32_t count = row.getSize();
+            for (int32_t c = 0; c < count; c++) {
+                const auto point = row.getItem(c);
+                sum += point.getX() + point.getY();
+            }
+        }
+        return sum;
+    }
+
+    // ---------------- benchmarks ----------------
+
+    void benchBuild() {
+        SMessage::MessageBuilder reused;
+        buildMouseMove(reused, 0);
+        const int64_t moveBytes = reused.size();
+        int32_t seed = 0;
+        bench("build/MouseMove", moveBytes, [&] {
+            SMessage::MessageBuilder builder;
+            buildMouseMove(builder, seed++);
+            keep(builder.data());
+        });
+        bench("build/MouseMove/reuse", moveBytes, [&] {
+            buildMouseMove(reused, seed++);
+            keep(reused.data());
+        });
+        SMessage::MessagePool pool;
+        bench("build/MouseMove/pool", moveBytes, [&] {
+            SMessage::MessageBuilder builder(pool);
+            buildMouseMove(builder, seed++);
+            keep(builder.finish<base::MouseMove>().offset());
+        });
+        alignas(8) uint8_t plainBytes[sizeof(PlainMouseMove)];
+        bench("baseline/build/MouseMove", sizeof(PlainMouseMove), [&] {
+            const double s = seed++;
+            const PlainMouseMove move{{s, s + 1}, {s + 2, s + 3}, true, false, (static_cast<int32_t>(s) & 1) != 0};
+            std::memcpy(plainBytes, &move, sizeof(move));
+            keep(plainBytes);
+        });
+
+        buildMouseDown(reused);
+        bench("build/MouseDown/map", reused.size(), [&] {
+            buildMouseDown(reused);
+            keep(reused.data());
+        });
+        buildTitleButtonClick(reused);
+        bench("build/TitleButtonClick/points", reused.size(), [&] {
+            buildTitleButtonClick(reused);
+            keep(reused.data());
+        });
+        bench("baseline/build/TitleButtonClick/points", sizeof(PlainPoint) * rows * columns, [&] {
+            const auto click = plainTitleButtonClick();
+            keep(click.points.data());
+        });
+        buildRecuTest(reused);
+        bench("build/RecuTest", reused.size(), [&] {
+            buildRecuTest(reused);
+            keep(reused.data());
+        });
+    }
+
+    void benchRead() {
+        SMessage::MessageBuilder builder;
+        buildMouseMove(builder, 1);
+        const auto move = builder.root<base::MouseMove>();
+        bench("read/MouseMove", builder.size(), [&] {
+            const double sum = move.getStart().getX() + move.getStart().getY() + move.getEnd().getX() + move.getEnd().getY() + move.getCtrlKey() + move.getShiftKey() + move.getOptionKey();
+            keep(sum);
+        });
+        const PlainMouseMove plainSource{{1, 2}, {3, 4}, true, false, true};
+        alignas(8) uint8_t plainBytes[sizeof(PlainMouseMove)];
+        std::memcpy(plainBytes, &plainSource, sizeof(plainSource));
+        keep(plainBytes);
+        bench("baseline/read/MouseMove", sizeof(PlainMouseMove), [&] {
+            PlainMouseMove plain;
+            std::memcpy(&plain, plainBytes, sizeof(plain));
+            const double sum = plain.start.x + plain.start.y + plain.end.x + plain.end.y + plain.ctrlKey + plain.shiftKey + plain.optionKey;
+            keep(sum);
+        });
+
+        SMessage::MessageBuilder click;
+        buildTitleButtonClick(click);
+        const auto points = click.root<title::TitleButtonClick>().getPoints();
+        bench("read/TitleButtonClick/points", click.size(), [&] {
+            keep(sumPoints(points));
+        });
+        const auto plainClick = plainTitleButtonClick();
+        bench("baseline/read/TitleButtonClick/points", sizeof(PlainPoint) * rows * columns, [&] {
+            double sum = 0;
+            for (const auto &row : plainClick.points) {
+                for (const auto &point : row) {
+                    sum += point.x + point.y;
+                }
+            }
+            keep(sum);
+        });
+
+        SMessage::MessageBuilder recu;
+        buildRecuTest(recu);
+        bench("read/RecuTest/chain", recu.size(), [&] {
+            double sum = 0;
+            for (auto node = recu.root<title::RecuTest>(); node; node = node.getLeft()) {
+                sum += sumPoints(node.getValue().getPoints());
+            }
+            keep(sum);
+        });
+    }
+
+    void benchMap() {
+        SMessage::MessageBuilder builder;
+        buildMouseDown(builder);
+        const auto position = builder.root<base::MouseDown>().getPosition();
+        size_t next = 0;
+        bench("map/MouseDown/find", builder.size(), [&] {
+            const auto it = position.find(keys[next++ % keys.size()]);
+            keep(it.value().get<base::Point2D>().getX());
+        });
+        bench("map/MouseDown/miss", builder.size(), [&] {
+            keep(position.contains("pos99"));
+        });
+
+        std::vector<std::pair<std::string, PlainPoint>> plain;
+        for (int32_t i = 0; i < mapEntries; i++) {
+            plain.emplace_back(keys[i], PlainPoint{static_cast<double>(i), static_cast<double>(-i)});
+        }
+        bench("baseline/map/MouseDown/find", 0, [&] {
+            const std::string_view key = keys[next++ % keys.size()];
+            const auto it = std::lower_bound(plain.begin(), plain.end(), key, [](const auto &entry, std::string_view k) { return std::string_view(entry.first) < k; });
+            keep(it->second.x);
+        });
+    }
+
+    void benchString() {
+        SMessage::MessageBuilder builder;
+        buildMouseDown(builder);
+        const auto position = builder.root<base::MouseDown>().getPosition();
+        SMessage::MsgString shortKey;
+        SMessage::MsgString longKey;
+        for (const auto entry : position) {
+            const SMessage::MsgString key(builder.data(), entry.entryOffset());
+            (key.isInline() ? shortKey : longKey) = key;
+        }
+        bench("string/inline/view", 0, [&] {
+            keep(shortKey.getStringView().size());
+        });
+        bench("string/outOfLine/view", 0, [&] {
+            keep(longKey.getStringView().size());
+        });
+        bench("string/outOfLine/copy", longKey.length(), [&] {
+            const std::string copy = longKey.getUtf8String();
+            keep(copy.data());
+        });
+        bench("string/set", 0, [&] {
+            builder.setString(longKey, "cursor.position.99");
+            keep(builder.data());
+        });
+        const std::string plain = longKey.getUtf8String();
+        bench("baseline/string/view", 0, [&] {
+            keep(std::string_view(plain).size());
+        });
+    }
+
+    void benchCopy() {
+        SMessage::MessageBuilder source;
+        buildRecuTest(source);
+        const int64_t size = source.size();
+        std::vector<uint8_t> target(static_cast<size_t>(size));
+        bench("copy/RecuTest/memcpy", size, [&] {
+            std::memcpy(target.data(), source.data(), static_cast<size_t>(size));
+            keep(target.data());
+        });
+        bench("copy/RecuTest/collect", size, [&] {
+            SMessage::MessageBuilder copy(static_cast<int32_t>(size));
+            std::memcpy(copy.data(), source.data(), static_cast<size_t>(size));
+            SMessage::collect<title::RecuTest>(copy);
+            keep(copy.data());
+        });
+        const auto plainClick = plainTitleButtonClick();
+        bench("baseline/copy/TitleButtonClick", sizeof(PlainPoint) * rows * columns, [&] {
+            const PlainTitleButtonClick copy = plainClick;
+            keep(copy.points.data());
+        });
+    }
+
+    void benchGrowth() {
+        int64_t size = 0;
+        {
+            SMessage::MessageBuilder builder(64);
+            auto row = builder.emplaceBack(builder.createRoot<title::TitleButtonClick>().getPoints());
+            for (int32_t i = 0; i < growthPoints; i++) {
+                builder.emplaceBack(row);
+            }
+            size = builder.size();
+        }
+        bench("growth/TitleButtonClick/emplaceBack", size, [&] {
+            SMessage::MessageBuilder builder(64);
+            const auto row = builder.emplaceBack(builder.createRoot<title::TitleButtonClick>().getPoints());
+            for (int32_t i = 0; i < growthPoints; i++) {
+                builder.emplaceBack(row).setX(i);
+            }
+            keep(builder.data());
+        });
+        bench("growth/TitleButtonClick/reserve", size, [&] {
+            SMessage::MessageBuilder builder(64);
+            const auto row = builder.emplaceBack(builder.createRoot<title::TitleButtonClick>().getPoints());
+            builder.reserve(row, growthPoints);
+            for (int32_t i = 0; i < growthPoints; i++) {
+                builder.emplaceBack(row).setX(i);
+            }
+            keep(builder.data());
+        });
+        bench("baseline/growth/push_back", sizeof(PlainPoint) * growthPoints, [&] {
+            std::vector<PlainPoint> points;
+            for (int32_t i = 0; i < growthPoints; i++) {
+                points.push_back(PlainPoint{static_cast<double>(i), 0});
+            }
+            keep(points.data());
+        });
+    }
+
+    void writeJson(FILE *file) {
+        std::fprintf(file, "{\n  \"runtime\": \"cpp\",\n  \"allocsCounted\": %s,\n  \"results\": [\n", allocsCounted ? "true" : "false");
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result &r = results[i];
+            std::fprintf(file, "    {\"name\": \"%s\", \"iterations\": %llu, \"nsPerOp\": %.3f, \"bytesPerOp\": %.1f, \"allocsPerOp\": %.3f, \"messageBytes\": %lld}%s\n", r.name.c_str(), static_cast<unsigned long long>(r.iterations), r.nsPerOp, r.bytesPerOp, r.allocsPerOp,
+                         static_cast<long long>(r.messageBytes), i + 1 < results.size() ? "," : "");
+        }
+        std::fprintf(file, "  ]\n}\n");
+    }
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i += 2) {
+        const std::string_view arg = argv[i];
+        if (i + 1 == argc) {
+            std::fprintf(stderr, "Missing value of %s.\n", argv[i]);
+            return 1;
+        }
+        if (arg == "--filter") {
+            options.filter = argv[i + 1];
+        } else if (arg == "--min-time-ms") {
+            options.minTimeMs = std::atof(argv[i + 1]);
+        } else if (arg == "--out") {
+            options.out = argv[i + 1];
+        } else {
+            std::fprintf(stderr, "Usage: %s [--filter name] [--min-time-ms ms] [--out file.json]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    benchBuild();
+    benchRead();
+    benchMap();
+    benchString();
+    benchCopy();
+    benchGrowth();
+
+    FILE *file = options.out.empty() ? stdout : std::fopen(options.out.c_str(), "w");
+    if (!file) {
+        std::fprintf(stderr, "Cannot open %s for write.\n", options.out.c_str());
+        return 1;
+    }
+    writeJson(file);
+    if (file != stdout) {
+        std::fclose(file);
+    }
+    return 0;
+}
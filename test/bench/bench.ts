@@ -0,0 +1,434 @@
+/**
+ * 与bench.cpp对应的TS基准测试，使用同一份test/midls生成的代码，输出相同格式的JSON。
+ * V8不提供分配次数，allocsPerOp为null；以--expose-gc运行时bytesPerOp为一次采样中堆和ArrayBuffer的增长。
+ *
+ * 用法: node --expose-gc dist/bench.js [--filter <子串>] [--min-time-ms <毫秒>] [--out <文件>]
+ */
+import * as fs from 'fs';
+import { messageFactory } from '../output';
+import { StructBase, StructBuffer, StructGC, StructString } from '../output/basestructs';
+import { MouseMove, MouseDown } from '../output/slime/message/base';
+import { TitleButtonClick, RecuTest } from '../output/slime/message/title';
+import { MA_2_66 } from '../output/arraystructs';
+
+type RootClass<T extends StructBase> = {
+    new (buf: ArrayBuffer | StructBuffer, offset: number): T;
+    typeId(): number;
+    byteLength(): number;
+};
+
+interface Result {
+    name: string;
+    iterations: number;
+    nsPerOp: number;
+    bytesPerOp: number | null;
+    allocsPerOp: number | null;
+    messageBytes: number;
+}
+
+const options = {
+    filter: '',
+    minTimeMs: 200,
+    out: '',
+};
+
+const results: Result[] = [];
+const gc = (globalThis as { gc?: () => void }).gc;
+
+/** 阻止JIT把基准测试的结果优化掉 */
+let sink: unknown;
+function keep(value: unknown) {
+    sink = value;
+}
+
+function allocatedBytes() {
+    const usage = process.memoryUsage();
+    return usage.heapUsed + usage.arrayBuffers;
+}
+
+/**
+ * 以倍增的次数运行body，直到总耗时超过minTimeMs。
+ * 之后gc一次再运行最多1000次，用堆的增长估算bytes/op，期间发生了gc(增长为负)时为null。
+ */
+function bench(name: string, messageBytes: number, body: () => void) {
+    if (options.filter && !name.includes(options.filter)) {
+        return;
+    }
+    body();
+    let iterations = 1;
+    for (;;) {
+        const start = process.hrtime.bigint();
+        for (let i = 0; i < iterations; i++) {
+            body();
+        }
+        const elapsed = Number(process.hrtime.bigint() - start);
+        if (elapsed >= options.minTimeMs * 1e6 || iterations >= 2 ** 40) {
+            results.push({ name, iterations, nsPerOp: elapsed / iterations, bytesPerOp: sampleBytes(body, Math.min(iterations, 1000)), allocsPerOp: null, messageBytes });
+            return;
+        }
+        iterations *= elapsed > 0 ? Math.min(Math.max(Math.floor((options.minTimeMs * 1e6 * 1.2) / elapsed), 2), 100) : 100;
+    }
+}
+
+function sampleBytes(body: () => void, count: number) {
+    if (!gc) {
+        return null;
+    }
+    gc();
+    const before = allocatedBytes();
+    for (let i = 0; i < count; i++) {
+        body();
+    }
+    const grown = allocatedBytes() - before;
+    return grown < 0 ? null : grown / count;
+}
+
+// ---------------- plain object baseline ----------------
+
+interface PlainPoint {
+    x: number;
+    y: number;
+}
+
+interface PlainMouseMove {
+    start: PlainPoint;
+    end: PlainPoint;
+    ctrlKey: boolean;
+    shiftKey: boolean;
+    optionKey: boolean;
+}
+
+// ---------------- fixtures ----------------
+
+const mapEntries = 16;
+const rows = 8;
+const columns = 8;
+const chainDepth = 16;
+const growthPoints = 1024;
+
+/** map的key按字节序升序，一半是inline的短字符串，一半超过11字节存放在子空间 */
+const keys = Array.from({ length: mapEntries }, (_, i) => (i % 2 ? `cursor.position.${String(i).padStart(2, '0')}` : `pos${String(i).padStart(2, '0')}`)).sort();
+
+function createRoot<T extends StructBase>(cls: RootClass<T>, capacity = 256) {
+    const sBuffer = new StructBuffer(new ArrayBuffer(Math.max(capacity, 12 + cls.byteLength())));
+    return resetRoot(cls, sBuffer);
+}
+
+/** 在已有的buffer上重新创建root，之前的数据都被丢弃。TS分配子空间时不清零，需要清掉之前用过的部分 */
+function resetRoot<T extends StructBase>(cls: RootClass<T>, sBuffer: StructBuffer) {
+    const end = 12 + cls.byteLength();
+    new Uint8Array(sBuffer._buffer, 0, Math.max(end, sBuffer._dataView.getInt32(8, true))).fill(0);
+    sBuffer._dataView.setInt32(0, cls.typeId(), true);
+    sBuffer._dataView.setInt32(8, end, true);
+    const root = new cls(sBuffer, 12);
+    sBuffer.setRootStruct(root);
+    return root;
+}
+
+function messageBytes(root: StructBase) {
+    return root.$_nextAvailableOffset;
+}
+
+function buildMouseMove(move: MouseMove, seed: number) {
+    move.start.x = seed;
+    move.start.y = seed + 1;
+    move.end.x = seed + 2;
+    move.end.y = seed + 3;
+    move.ctrlKey = true;
+    move.optionKey = (seed & 1) === 1;
+}
+
+/** StructMap没有插入接口，按布局直接写入已排序的entry */
+function buildMouseDown(down: MouseDown) {
+    const sBuffer = down.$_structBuf();
+    const entryByte = 20;
+    const data = down.$_createSubBuffer(mapEntries * entryByte);
+    sBuffer._dataView.setInt32(12, mapEntries, true);
+    sBuffer._dataView.setInt32(16, mapEntries, true);
+    sBuffer._dataView.setInt32(20, data, true);
+    for (let i = 0; i < mapEntries; i++) {
+        const entry = data + entryByte * i;
+        messageFactory.create(60, sBuffer, entry).setString(keys[i]);
+        const point = messageFactory.createInStruct(66, down);
+        point.x = i;
+        point.y = -i;
+        sBuffer._dataView.setUint8(entry + 12, 1);
+        sBuffer._dataView.setInt32(entry + 16, point.$_address, true);
+    }
+}
+
+function fillPoints(points: MA_2_66) {
+    points.reserve(rows);
+    for (let r = 0; r < rows; r++) {
+        const row = points.pushElement();
+        row.reserve(columns);
+        for (let c = 0; c < columns; c++) {
+            const point = row.pushElement();
+            point.x = r;
+            point.y = c;
+        }
+    }
+}
+
+/** 长度为chainDepth的left链，right与left共享，每个节点的value都有rows × columns个点 */
+function buildRecuTest(root: RecuTest) {
+    const sBuffer = root.$_structBuf();
+    let node = root;
+    for (let d = 0; d < chainDepth; d++) {
+        fillPoints(node.value.points);
+        const left = messageFactory.createInStruct(72, root);
+        sBuffer._dataView.setInt32(node.$_address, left.$_address, true);
+        sBuffer._dataView.setInt32(node.$_address + 4, left.$_address, true);
+        node = left;
+    }
+}
+
+function plainPoints() {
+    const points: PlainPoint[][] = [];
+    for (let r = 0; r < rows; r++) {
+        const row: PlainPoint[] = [];
+        for (let c = 0; c < columns; c++) {
+            row.push({ x: r, y: c });
+        }
+        points.push(row);
+    }
+    return points;
+}
+
+function sumPoints(points: MA_2_66) {
+    let sum = 0;
+    for (let r = 0; r < points.size; r++) {
+        const row = points.at(r);
+        for (let c = 0; c < row.size; c++) {
+            const point = row.at(c);
+            sum += point.x + point.y;
+        }
+    }
+    return sum;
+}
+
+// ---------------- benchmarks ----------------
+
+function benchBuild() {
+    const moveBytes = 12 + MouseMove.byteLength();
+    let seed = 0;
+    bench('build/MouseMove', moveBytes, () => {
+        const move = createRoot(MouseMove);
+        buildMouseMove(move, seed++);
+        keep(move);
+    });
+    const reused = new StructBuffer(new ArrayBuffer(256));
+    bench('build/MouseMove/reuse', moveBytes, () => {
+        buildMouseMove(resetRoot(MouseMove, reused), seed++);
+    });
+    const plainBytes = new Float64Array(4);
+    bench('baseline/build/MouseMove', 40, () => {
+        const s = seed++;
+        const move: PlainMouseMove = { start: { x: s, y: s + 1 }, end: { x: s + 2, y: s + 3 }, ctrlKey: true, shiftKey: false, optionKey: (s & 1) === 1 };
+        plainBytes[0] = move.start.x;
+        plainBytes[1] = move.start.y;
+        plainBytes[2] = move.end.x;
+        plainBytes[3] = move.end.y;
+        keep(plainBytes);
+    });
+
+    const down = resetRoot(MouseDown, reused);
+    buildMouseDown(down);
+    bench('build/MouseDown/map', messageBytes(down), () => {
+        buildMouseDown(resetRoot(MouseDown, reused));
+    });
+    const click = resetRoot(TitleButtonClick, reused);
+    fillPoints(click.points);
+    bench('build/TitleButtonClick/points', messageBytes(click), () => {
+        fillPoints(resetRoot(TitleButtonClick, reused).points);
+    });
+    bench('baseline/build/TitleButtonClick/points', 16 * rows * columns, () => {
+        keep(plainPoints());
+    });
+    const recu = createRoot(RecuTest);
+    buildRecuTest(recu);
+    const recuBuffer = recu.$_structBuf();
+    bench('build/RecuTest', messageBytes(recu), () => {
+        buildRecuTest(resetRoot(RecuTest, recuBuffer));
+    });
+}
+
+function benchRead() {
+    const move = createRoot(MouseMove);
+    buildMouseMove(move, 1);
+    bench('read/MouseMove', messageBytes(move), () => {
+        keep(move.start.x + move.start.y + move.end.x + move.end.y + Number(move.ctrlKey) + Number(move.shiftKey) + Number(move.optionKey));
+    });
+    const plain: PlainMouseMove = { start: { x: 1, y: 2 }, end: { x: 3, y: 4 }, ctrlKey: true, shiftKey: false, optionKey: true };
+    bench('baseline/read/MouseMove', 40, () => {
+        keep(plain.start.x + plain.start.y + plain.end.x + plain.end.y + Number(plain.ctrlKey) + Number(plain.shiftKey) + Number(plain.optionKey));
+    });
+
+    const click = createRoot(TitleButtonClick);
+    fillPoints(click.points);
+    bench('read/TitleButtonClick/points', messageBytes(click), () => {
+        keep(sumPoints(click.points));
+    });
+    const points = plainPoints();
+    bench('baseline/read/TitleButtonClick/points', 16 * rows * columns, () => {
+        let sum = 0;
+        for (const row of points) {
+            for (const point of row) {
+                sum += point.x + point.y;
+            }
+        }
+        keep(sum);
+    });
+
+    const recu = createRoot(RecuTest);
+    buildRecuTest(recu);
+    bench('read/RecuTest/chain', messageBytes(recu), () => {
+        let sum = 0;
+        for (let node: RecuTest | undefined = recu; node; node = node.left) {
+            sum += sumPoints(node.value.points);
+        }
+        keep(sum);
+    });
+}
+
+function benchMap() {
+    const down = createRoot(MouseDown);
+    buildMouseDown(down);
+    let next = 0;
+    bench('map/MouseDown/find', messageBytes(down), () => {
+        keep(down.position.get(keys[next++ % keys.length])?.getPoint2D().x);
+    });
+    bench('map/MouseDown/miss', messageBytes(down), () => {
+        keep(down.position.get('pos99'));
+    });
+    const plain = new Map(keys.map((key, i) => [key, { x: i, y: -i }]));
+    bench('baseline/map/MouseDown/find', 0, () => {
+        keep(plain.get(keys[next++ % keys.length])?.x);
+    });
+}
+
+function benchString() {
+    const down = createRoot(MouseDown);
+    buildMouseDown(down);
+    const sBuffer = down.$_structBuf();
+    const data = sBuffer._dataView.getInt32(20, true);
+    let shortKey: StructString | undefined;
+    let longKey: StructString | undefined;
+    for (let i = 0; i < mapEntries; i++) {
+        const key = messageFactory.create(60, sBuffer, data + 20 * i);
+        if (key.isInline) {
+            shortKey = key;
+        } else {
+            longKey = key;
+        }
+    }
+    if (!shortKey || !longKey) {
+        throw new Error('The map has no inline or out-of-line key.');
+    }
+    const inline = shortKey;
+    const outOfLine = longKey;
+    bench('string/inline/view', 0, () => {
+        keep(inline.getStringBuffer().length);
+    });
+    bench('string/outOfLine/view', 0, () => {
+        keep(outOfLine.getStringBuffer().length);
+    });
+    bench('string/outOfLine/copy', outOfLine.length, () => {
+        keep(outOfLine.getString());
+    });
+    bench('string/set', 0, () => {
+        outOfLine.setString('cursor.position.99');
+    });
+    const plain = outOfLine.getString();
+    bench('baseline/string/view', 0, () => {
+        keep(plain.length);
+    });
+}
+
+function benchCopy() {
+    const source = createRoot(RecuTest);
+    buildRecuTest(source);
+    const size = messageBytes(source);
+    const sourceBytes = new Uint8Array(source.$_structBuf()._buffer, 0, size);
+    const target = new Uint8Array(size);
+    bench('copy/RecuTest/memcpy', size, () => {
+        target.set(sourceBytes);
+        keep(target);
+    });
+    bench('copy/RecuTest/collect', size, () => {
+        const copy = new RecuTest(new StructBuffer(source.$_structBuf()._buffer.slice(0, size)), 12);
+        new StructGC(copy, messageFactory).run();
+        keep(copy);
+    });
+    const points = plainPoints();
+    bench('baseline/copy/TitleButtonClick', 16 * rows * columns, () => {
+        keep(points.map((row) => row.map((point) => ({ x: point.x, y: point.y }))));
+    });
+}
+
+function benchGrowth() {
+    const grown = createRoot(TitleButtonClick, 64);
+    const grownRow = grown.points.pushElement();
+    for (let i = 0; i < growthPoints; i++) {
+        grownRow.pushElement();
+    }
+    const size = messageBytes(grown);
+    bench('growth/TitleButtonClick/pushElement', size, () => {
+        const row = createRoot(TitleButtonClick, 64).points.pushElement();
+        for (let i = 0; i < growthPoints; i++) {
+            row.pushElement().x = i;
+        }
+        keep(row);
+    });
+    bench('growth/TitleButtonClick/reserve', size, () => {
+        const row = createRoot(TitleButtonClick, 64).points.pushElement();
+        row.reserve(growthPoints);
+        for (let i = 0; i < growthPoints; i++) {
+            row.pushElement().x = i;
+        }
+        keep(row);
+    });
+    bench('baseline/growth/push', 16 * growthPoints, () => {
+        const points: PlainPoint[] = [];
+        for (let i = 0; i < growthPoints; i++) {
+            points.push({ x: i, y: 0 });
+        }
+        keep(points);
+    });
+}
+
+function main() {
+    const args = process.argv.slice(2);
+    for (let i = 0; i < args.length; i += 2) {
+        if (i + 1 === args.length) {
+            console.error(`Missing value of ${args[i]}.`);
+            process.exit(1);
+        }
+        if (args[i] === '--filter') {
+            options.filter = args[i + 1];
+        } else if (args[i] === '--min-time-ms') {
+            options.minTimeMs = Number(args[i + 1]);
+        } else if (args[i] === '--out') {
+            options.out = args[i + 1];
+        } else {
+            console.error('Usage: node --expose-gc dist/bench.js [--filter name] [--min-time-ms ms] [--out file.json]');
+            process.exit(1);
+        }
+    }
+
+    benchBuild();
+    benchRead();
+    benchMap();
+    benchString();
+    benchCopy();
+    benchGrowth();
+
+    const json = JSON.stringify({ runtime: 'node', allocsCounted: false, results }, undefined, 2);
+    if (options.out) {
+        fs.writeFileSync(options.out, json + '\n');
+    } else {
+        console.log(json);
+    }
+}
+
+main();
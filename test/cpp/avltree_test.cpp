@@ -0,0 +1,156 @@
+/**
+ * avl_array / avl_dynamic_array: 随机的插入、删除和freeze与std::map对照，
+ * 覆盖build_sorted、lower_bound/upper_bound/equal_range以及8/16位的size_type
+ */
+#include <cassert>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "avltree.hpp"
+
+/// 查找结果与std::map一致
+template <typename Tree>
+static void checkLookup(Tree &tree, const std::map<int, int> &ref, int key) {
+    int value = 0;
+    const auto found = ref.find(key);
+    assert(tree.find(key, value) == (found != ref.end()));
+    assert(found == ref.end() || value == found->second);
+    assert((tree.find(key) == tree.end()) == (found == ref.end()));
+
+    const auto lower = tree.lower_bound(key);
+    const auto refLower = ref.lower_bound(key);
+    assert((lower == tree.end()) == (refLower == ref.end()));
+    assert(refLower == ref.end() || (lower.key() == refLower->first && *lower == refLower->second));
+
+    const auto upper = tree.upper_bound(key);
+    const auto refUpper = ref.upper_bound(key);
+    assert((upper == tree.end()) == (refUpper == ref.end()));
+    assert(refUpper == ref.end() || upper.key() == refUpper->first);
+
+    const auto range = tree.equal_range(key);
+    assert(range.first == lower && range.second == upper);
+}
+
+/// 迭代顺序与std::map一致
+template <typename Tree>
+static void checkOrder(Tree &tree, const std::map<int, int> &ref) {
+    auto expected = ref.begin();
+    for (auto it = tree.begin(); it != tree.end(); ++it, ++expected) {
+        assert(expected != ref.end() && it.key() == expected->first && *it == expected->second);
+    }
+    assert(expected == ref.end() && static_cast<size_t>(tree.size()) == ref.size());
+}
+
+/// capacity为树能容纳的元素数，keys为随机key的范围
+template <typename Tree>
+static void randomOps(Tree &tree, size_t capacity, int keys, unsigned seed) {
+    std::mt19937 rng(seed);
+    std::map<int, int> ref;
+    for (int step = 0; step < 4000; step++) {
+        const int op = static_cast<int>(rng() % 10);
+        const int key = static_cast<int>(rng() % static_cast<unsigned>(keys));
+        if (op < 4) {
+            const bool inserted = tree.insert(key, key * 3);
+            const bool fits = ref.size() < capacity || ref.count(key);
+            assert(inserted == fits);
+            if (fits) {
+                ref[key] = key * 3;
+            }
+        } else if (op < 6) {
+            assert(tree.erase(key) == (ref.erase(key) == 1));
+        } else if (op == 6) {
+            tree.freeze();
+            assert(tree.frozen() == !ref.empty());
+            checkOrder(tree, ref);
+        } else {
+            checkLookup(tree, ref, key);
+        }
+        assert(tree.check());
+    }
+
+    // 填满后freeze，冻结状态下查找所有key以及key之间的值
+    for (int key = 0; ref.size() < capacity && key < keys; key++) {
+        assert(tree.insert(key, key * 3));
+        ref[key] = key * 3;
+    }
+    tree.freeze();
+    assert(tree.frozen() && tree.check());
+    for (int key = -1; key <= keys; key++) {
+        checkLookup(tree, ref, key);
+    }
+    checkOrder(tree, ref);
+
+    // 修改后离开冻结状态，仍是合法的AVL树
+    assert(tree.erase(ref.begin()->first));
+    ref.erase(ref.begin());
+    assert(!tree.frozen() && tree.check());
+    checkOrder(tree, ref);
+}
+
+/// count个偶数key，build_sorted的结果是冻结的，奇数key落在两个元素之间
+template <typename Tree>
+static void buildSorted(Tree &tree, int count) {
+    std::vector<int> keys, values;
+    std::map<int, int> ref;
+    for (int i = 0; i < count; i++) {
+        keys.push_back(i * 2);
+        values.push_back(i);
+        ref[i * 2] = i;
+    }
+    assert(tree.build_sorted(keys.data(), values.data(), count));
+    assert(tree.frozen() == (count > 0) && tree.check() && static_cast<size_t>(tree.size()) == static_cast<size_t>(count));
+    for (int key = -1; key <= count * 2; key++) {
+        checkLookup(tree, ref, key);
+    }
+    checkOrder(tree, ref);
+
+    // 未排序的输入被拒绝，内容不变
+    if (count >= 2) {
+        std::swap(keys[0], keys[1]);
+        assert(!tree.build_sorted(keys.data(), values.data(), count));
+        checkOrder(tree, ref);
+    }
+
+    assert(tree.build_sorted(keys.data(), values.data(), 0));
+    assert(tree.empty() && !tree.frozen() && tree.begin() == tree.end());
+}
+
+int main() {
+    for (unsigned seed = 1; seed <= 8; seed++) {
+        avl_array<int, int, int, 257> wide;
+        randomOps(wide, 257, 600, seed);
+
+        // 2 * Size + 1超过size_type的范围
+        avl_array<int, int, std::uint8_t, 250> narrow;
+        randomOps(narrow, 250, 500, seed);
+        avl_array<int, int, std::uint16_t, 40000> narrow16;
+        randomOps(narrow16, 40000, 45000, seed);
+        avl_array<int, int, std::uint8_t, 200, false> slim;
+        randomOps(slim, 200, 400, seed);
+
+        avl_dynamic_array<int, int, std::uint8_t> dynamic;
+        randomOps(dynamic, 254, 500, seed);
+        avl_dynamic_array<int, int, std::uint32_t> grows(4U);
+        randomOps(grows, 1U << 30, 3000, seed);
+    }
+
+    avl_array<int, int, std::uint8_t, 250> narrow;
+    for (int count : {0, 1, 2, 3, 7, 128, 200, 250}) {
+        buildSorted(narrow, count);
+    }
+    std::vector<int> keys(251);
+    for (int i = 0; i < 251; i++) {
+        keys[i] = i;
+    }
+    assert(!narrow.build_sorted(keys.data(), keys.data(), 251));
+
+    auto narrow16 = std::make_unique<avl_array<int, int, std::uint16_t, 65000>>();
+    buildSorted(*narrow16, 65000);
+    avl_dynamic_array<int, int, std::uint16_t> dynamic16;
+    buildSorted(dynamic16, 60000);
+    std::printf("avltree_test passed\n");
+    return 0;
+}
@@ -0,0 +1,128 @@
+/**
+ * BatchBuilder/MessageBatch: begin/end构建的batch与TS的MessageBatch字节相同，
+ * forEach和get<T>读取每个消息，包括索引扩容被移动到末尾的情况
+ */
+#include <cassert>
+#include <cstdio>
+#include <string>
+
+#include "messages.hpp"
+#include "batch.hpp"
+
+using namespace SMessageTest;
+
+/// 第i个消息: 奇数为MouseMove，偶数为i / 2行的TitleButtonClick
+static void append(BatchBuilder &batch, int i) {
+    if (i % 2 == 0) {
+        auto c = batch.begin<title::TitleButtonClick>();
+        for (int r = 0; r < i / 2; r++) {
+            auto p = batch.builder().emplaceBack(batch.builder().emplaceBack(c.getPoints()));
+            p.setX(i);
+            p.setY(r);
+        }
+    } else {
+        auto m = batch.begin<base::MouseMove>();
+        m.getStart().setX(i);
+        m.getEnd().setY(2 * i);
+        m.setCtrlKey(true);
+    }
+    batch.end();
+}
+
+static void expectMessage(const MessageBatch &batch, int32_t index) {
+    const int i = index + 1;
+    const BatchIndexEntry entry = batch.entry(index);
+    assert(entry.getOffset() % 8 == 0 && entry.getOffset() + entry.getLength() <= batch.nextAvailableOffset());
+    assert(batch.bytesOf(index).size() == static_cast<size_t>(entry.getLength()));
+    if (i % 2 == 0) {
+        assert(entry.getTypeId() == title::TitleButtonClick::typeId);
+        const auto c = batch.get<title::TitleButtonClick>(index);
+        const auto rows = c.getPoints();
+        assert(rows.getSize() == i / 2);
+        for (int32_t r = 0; r < rows.getSize(); r++) {
+            assert(rows.getItem(r).getSize() == 1);
+            assert(rows.getItem(r).getItem(0).getX() == i && rows.getItem(r).getItem(0).getY() == r);
+        }
+    } else {
+        assert(entry.getTypeId() == base::MouseMove::typeId);
+        const auto m = batch.get<base::MouseMove>(index);
+        assert(m.getStart().getX() == i && m.getEnd().getY() == 2 * i && m.getCtrlKey());
+    }
+}
+
+static void expectBatch(const MessageBatch &batch, int32_t count) {
+    assert(batch.isBatch() && batch.size() == count);
+    int32_t index = 0;
+    batch.forEach([&](const BatchIndexEntry &entry) {
+        assert(entry.getOffset() == batch.entry(index).getOffset());
+        expectMessage(batch, index++);
+    });
+    assert(index == count);
+}
+
+static Bytes fromHex(const std::string &hex) {
+    Bytes bytes;
+    for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+        bytes.push_back(static_cast<uint8_t>(std::stoi(hex.substr(i, 2), nullptr, 16)));
+    }
+    return bytes;
+}
+
+/**
+ * TS中`MessageBatch.create(64)`后用begin/end追加同样的5个消息得到的字节。
+ * 索引多次扩容，每次都移动到末尾，旧的索引和扩容前的行数组计入trash。
+ */
+static const char *tsBatch =
+    "3a00000060000000c4010000640100000500000008000000000000000000f03f0000000000000000000000000000000000000000000000400100000043000000"
+    "18000000230000000000000058000000010000000100000068000000010000000100000000000000000000000000004000000000000000004300000018000000"
+    "23000000470000004800000030000000000000000000084000000000000000000000000000000000000000000000184001000000430000001800000023000000"
+    "47000000480000003000000043000000900000002300000047000000e80000005800000000000000000000001801000002000000020000000801000001000000"
+    "0100000000000000000000000000104000000000000000000801000001000000010000003001000001000000010000000000000000001040000000000000f03f"
+    "00000000000014400000000000000000000000000000000000000000000024400100000043000000180000002300000047000000480000003000000043000000"
+    "900000002300000047000000e8000000580000004300000040010000230000000000000000000000000000000000000000000000000000000000000000000000"
+    "00000000";
+
+static void sameAsTs() {
+    BatchBuilder batch(64);
+    for (int i = 1; i <= 5; i++) {
+        append(batch, i);
+    }
+    const std::span<const uint8_t> bytes = batch.bytes();
+    assert(Bytes(bytes.begin(), bytes.end()) == fromHex(tsBatch));
+    assert(batch.builder().trashLength() > 0);
+    expectBatch(batch.batch(), 5);
+}
+
+/// 预先reserve的索引不移动；不reserve时索引反复扩容，两者读取的消息相同
+static void growIndex() {
+    constexpr int32_t count = 100;
+    BatchBuilder reserved;
+    reserved.reserve(count);
+    const int32_t indexOffset = reserved.batch().getIndex().getStartOffset();
+    BatchBuilder grown(64);
+    for (int i = 1; i <= count; i++) {
+        append(reserved, i);
+        append(grown, i);
+        assert(grown.count() == i);
+        expectMessage(grown.batch(), i - 1);
+    }
+    // 两者的行数组扩容产生相同的trash，grown还有旧的索引
+    assert(reserved.batch().getIndex().getStartOffset() == indexOffset);
+    assert(grown.builder().trashLength() > reserved.builder().trashLength());
+    expectBatch(reserved.batch(), count);
+    expectBatch(grown.batch(), count);
+
+    // 每个消息从8字节对齐处开始，长度与索引的位置无关
+    for (int32_t i = 0; i < count; i++) {
+        assert(reserved.batch().entry(i).getLength() == grown.batch().entry(i).getLength());
+    }
+    const PooledMessage<MessageBatch> message = grown.finish();
+    expectBatch(message, count);
+}
+
+int main() {
+    sameAsTs();
+    growIndex();
+    std::printf("batch_test passed\n");
+    return 0;
+}
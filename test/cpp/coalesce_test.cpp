@@ -0,0 +1,162 @@
+/**
+ * CoalescingQueue: MouseMove按类型(@coalesce)、KeyEvent按code(@coalesce(code))合并，
+ * 其他消息按顺序追加；条数和字节上限(包括替换为更大的消息)以及按类型的计数
+ */
+#include <cassert>
+#include <cstdio>
+
+#include "messages.hpp"
+#include "batch.hpp"
+#include "coalesce.hpp"
+#include "dispatch.h"
+
+using namespace SMessageTest;
+
+using Queue = CoalescingQueue<Dispatch::MessageTypes>;
+
+/// extra为root之后额外分配的字节，用于改变消息的长度
+static PooledMessage<base::MouseMove> move(MessagePool &pool, double x, int32_t extra = 0) {
+    MessageBuilder b(pool);
+    b.createRoot<base::MouseMove>().getEnd().setX(x);
+    if (extra) {
+        b.createSubBuffer(extra);
+    }
+    return b.finish<base::MouseMove>();
+}
+
+static PooledMessage<track::KeyEvent> key(MessagePool &pool, uint8_t code, double time) {
+    MessageBuilder b(pool);
+    auto e = b.createRoot<track::KeyEvent>();
+    e.setCode(code);
+    e.setTime(time);
+    return b.finish<track::KeyEvent>();
+}
+
+static PooledMessage<title::TitleButtonClick> click(MessagePool &pool, int rows) {
+    MessageBuilder b(pool);
+    load(b, buttonClick(std::vector<int>(static_cast<size_t>(rows), 1), rows));
+    return b.finish<title::TitleButtonClick>();
+}
+
+static size_t bytesOf(const PooledMessage<base::MouseMove> &message) {
+    return static_cast<size_t>(message.nextAvailableOffset());
+}
+
+static double popMove(Queue &queue) {
+    PoolBuffer out;
+    assert(queue.pop(out) && loadValue<int32_t>(out.data(), MainTypeIdOffset) == base::MouseMove::typeId);
+    return base::MouseMove(out.data(), RootOffset).getEnd().getX();
+}
+
+static void expectCounters(const Queue &queue, int32_t typeId, uint64_t queued, uint64_t merged, uint64_t dropped) {
+    const Queue::Counters counters = queue.counters(typeId);
+    assert(counters.queued == queued && counters.merged == merged && counters.dropped == dropped);
+}
+
+/// MouseMove替换队列中的旧消息且位置不变，取走之后再次排队
+static void perType() {
+    MessagePool pool;
+    Queue queue(16);
+    assert(queue.push(move(pool, 1)) == CoalesceResult::Queued);
+    assert(queue.push(click(pool, 2)) == CoalesceResult::Queued);
+    assert(queue.push(move(pool, 2)) == CoalesceResult::Merged);
+    assert(queue.push(move(pool, 3)) == CoalesceResult::Merged);
+    assert(queue.push(click(pool, 3)) == CoalesceResult::Queued);
+    assert(queue.size() == 3 && queue.bytes() == bytesOf(move(pool, 0)) + click(pool, 2).nextAvailableOffset() + click(pool, 3).nextAvailableOffset());
+
+    assert(popMove(queue) == 3);
+    assert(queue.push(move(pool, 4)) == CoalesceResult::Queued);
+    size_t count = 0;
+    assert(queue.drain([&](PoolBuffer buffer) {
+        assert(loadValue<int32_t>(buffer.data(), MainTypeIdOffset) == title::TitleButtonClick::typeId);
+        assert(title::TitleButtonClick(buffer.data(), RootOffset).getPoints().getSize() == static_cast<int32_t>(count + 2));
+        count++;
+    }, 2) == 2);
+    assert(popMove(queue) == 4 && queue.size() == 0 && queue.bytes() == 0);
+
+    expectCounters(queue, base::MouseMove::typeId, 2, 2, 0);
+    expectCounters(queue, title::TitleButtonClick::typeId, 2, 0, 0);
+}
+
+/// KeyEvent只替换code相同的消息
+static void keyed() {
+    MessagePool pool;
+    Queue queue(16);
+    assert(queue.push(key(pool, 1, 10)) == CoalesceResult::Queued);
+    assert(queue.push(key(pool, 2, 20)) == CoalesceResult::Queued);
+    assert(queue.push(key(pool, 1, 11)) == CoalesceResult::Merged);
+    assert(queue.push(key(pool, 3, 30)) == CoalesceResult::Queued);
+    assert(queue.push(key(pool, 2, 21)) == CoalesceResult::Merged);
+    assert(queue.push(key(pool, 2, 22)) == CoalesceResult::Merged);
+    assert(queue.size() == 3);
+
+    const double expected[][2] = {{1, 11}, {2, 22}, {3, 30}};
+    PoolBuffer out;
+    for (const auto &item : expected) {
+        assert(queue.pop(out));
+        const track::KeyEvent e(out.data(), RootOffset);
+        assert(e.getCode() == item[0] && e.getTime() == item[1]);
+    }
+    // code 2已经取走，再次排队
+    assert(queue.push(key(pool, 2, 23)) == CoalesceResult::Queued);
+    expectCounters(queue, track::KeyEvent::typeId, 4, 3, 0);
+}
+
+/// 条数上限只限制追加，替换不需要新的位置；不在类型列表中的batch共用一组计数
+static void maxMessages() {
+    MessagePool pool;
+    Queue queue(2);
+    assert(queue.push(move(pool, 1)) == CoalesceResult::Queued);
+    assert(queue.push(click(pool, 1)) == CoalesceResult::Queued);
+    assert(queue.push(click(pool, 2)) == CoalesceResult::Dropped);
+    assert(queue.push(key(pool, 1, 0)) == CoalesceResult::Dropped);
+    assert(queue.push(move(pool, 2)) == CoalesceResult::Merged);
+
+    BatchBuilder batch(pool);
+    batch.begin<base::MouseMove>();
+    batch.end();
+    assert(queue.push(batch.finish()) == CoalesceResult::Dropped);
+    assert(popMove(queue) == 2);
+    BatchBuilder next(pool);
+    assert(queue.push(next.finish()) == CoalesceResult::Queued);
+
+    expectCounters(queue, base::MouseMove::typeId, 1, 1, 0);
+    expectCounters(queue, title::TitleButtonClick::typeId, 1, 0, 1);
+    expectCounters(queue, track::KeyEvent::typeId, 0, 0, 1);
+    expectCounters(queue, BatchTypeId, 1, 0, 1);
+}
+
+/// 字节上限: 更大的新消息替换后放不下时丢弃新消息，队列中的旧消息和字节数不变
+static void maxBytes() {
+    MessagePool pool;
+    const size_t small = bytesOf(move(pool, 0));
+    const size_t large = bytesOf(move(pool, 0, 16));
+    const size_t clickBytes = static_cast<size_t>(click(pool, 1).nextAvailableOffset());
+    Queue queue(16, large + clickBytes);
+    assert(queue.push(move(pool, 1)) == CoalesceResult::Queued);
+    assert(queue.push(click(pool, 1)) == CoalesceResult::Queued);
+    assert(queue.push(click(pool, 1)) == CoalesceResult::Dropped);
+
+    assert(queue.push(move(pool, 2, 24)) == CoalesceResult::Dropped);
+    assert(queue.bytes() == small + clickBytes);
+    // 恰好放下
+    assert(queue.push(move(pool, 3, 16)) == CoalesceResult::Merged);
+    assert(queue.bytes() == large + clickBytes);
+    // 替换为更小的消息，字节数减少
+    assert(queue.push(move(pool, 4)) == CoalesceResult::Merged);
+    assert(queue.bytes() == small + clickBytes);
+
+    assert(popMove(queue) == 4);
+    assert(queue.bytes() == clickBytes);
+    expectCounters(queue, base::MouseMove::typeId, 1, 2, 1);
+    expectCounters(queue, title::TitleButtonClick::typeId, 1, 0, 1);
+}
+
+int main() {
+    perType();
+    keyed();
+    maxMessages();
+    maxBytes();
+    std::printf("coalesce_test passed\n");
+    return 0;
+}
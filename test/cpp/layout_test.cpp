@@ -0,0 +1,100 @@
+/**
+ * 成员布局: 普通struct按声明顺序最多4字节对齐，@packed的struct按对齐从大到小重排；
+ * 引用的struct在builder、gc、patch和紧凑编码分配时按itemAlignment对齐
+ */
+#include <cassert>
+#include <cstdio>
+
+#include "messages.hpp"
+#include "gc.hpp"
+#include "patch.hpp"
+#include "wire.hpp"
+
+using namespace SMessageTest;
+
+// 普通struct不受影响
+static_assert(base::MouseMove::offsetStart == 0 && base::MouseMove::offsetEnd == 16 && base::MouseMove::offsetCtrlKey == 32);
+static_assert(base::MouseMove::byteLength == 35);
+
+// 8字节的成员在前并按8字节对齐，bool和enum填在最后，byteLength按8取整
+static_assert(track::MouseTrack::offsetX == 0 && track::MouseTrack::offsetY == 8 && track::MouseTrack::offsetTime == 16);
+static_assert(track::MouseTrack::offsetEnd == 24);
+static_assert(track::MouseTrack::offsetCtrlKey == 40 && track::MouseTrack::offsetShiftKey == 41 && track::MouseTrack::offsetButton == 42);
+static_assert(track::MouseTrack::byteLength == 48);
+
+// 普通struct中内嵌的@packed struct仍按4字节对齐
+static_assert(track::KeyState::byteLength == 2);
+static_assert(track::KeyEvent::offsetCode == 0 && track::KeyEvent::offsetKeys == 4 && track::KeyEvent::offsetTime == 8);
+
+// 引用自身的@packed struct，float64在前，byteLength按8取整
+static_assert(track::TrackSegment::offsetTime == 0 && track::TrackSegment::offsetNext == 8 && track::TrackSegment::offsetPressure == 12);
+static_assert(track::TrackSegment::byteLength == 16 && itemAlignment<track::TrackSegment>() == 8);
+
+/// depth个TrackSegment的next链，每次分配前先分配pad字节打乱对齐
+static Bytes segments(int depth, int32_t pad) {
+    MessageBuilder b;
+    auto segment = b.createRoot<track::TrackSegment>();
+    segment.setTime(1);
+    for (int d = 1; d < depth; d++) {
+        b.createSubBuffer(pad);
+        segment = b.createReference<track::TrackSegment>(segment, track::TrackSegment::offsetNext);
+        segment.setTime(d + 1);
+        segment.setPressure(static_cast<float>(d));
+    }
+    return bytesOf(b);
+}
+
+/// root之外的每个TrackSegment都按8字节对齐，time依次为1..depth
+static void checkSegments(const uint8_t *data, int depth) {
+    track::TrackSegment segment(const_cast<uint8_t*>(data), RootOffset);
+    for (int d = 1; d <= depth; d++) {
+        assert(segment && segment.getTime() == d);
+        assert(d == 1 || segment.offset() % 8 == 0);
+        segment = segment.getNext();
+    }
+    assert(!segment);
+}
+
+static void referenceAlignment() {
+    const Bytes built = segments(4, 3);
+    checkSegments(built.data(), 4);
+
+    MessageBuilder b;
+    b.createRoot<track::TrackSegment>();
+    b.createSubBuffer(1);
+    assert(b.create<track::TrackSegment>().offset() % 8 == 0);
+
+    // gc按新buffer中的位置重新补齐
+    MessageBuilder collected;
+    load(collected, segments(5, 1));
+    collected.createSubBuffer(5);
+    collect<track::TrackSegment>(collected);
+    checkSegments(collected.data(), 5);
+
+    Bytes wire;
+    bool ok = encodeWire<track::TrackSegment>(built.data(), wire);
+    assert(ok);
+    MessageBuilder decoded;
+    ok = decodeWire<track::TrackSegment>(wire, decoded);
+    assert(ok);
+    checkSegments(decoded.data(), 4);
+
+    // patch在接收端消息末尾分配新的引用
+    MessageBuilder patch;
+    const Bytes base = segments(1, 0);
+    MessageBuilder message;
+    load(message, base);
+    message.createSubBuffer(3);
+    const Bytes padded = bytesOf(message);
+    ok = diffMessage<track::TrackSegment>(padded.data(), built.data(), patch);
+    assert(ok);
+    ok = applyPatch(message, patch.data(), patch.size());
+    assert(ok);
+    checkSegments(message.data(), 4);
+}
+
+int main() {
+    referenceAlignment();
+    std::printf("layout_test passed\n");
+    return 0;
+}
@@ -0,0 +1,166 @@
+/**
+ * 测试用例共用的test/midls消息构建函数，覆盖数组、二维数组、map、combine和引用
+ */
+#pragma once
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "index.h"
+#include "builder.hpp"
+
+namespace SMessageTest {
+    using namespace slime::message;
+    using namespace SMessage;
+
+    using Bytes = std::vector<uint8_t>;
+
+    inline Bytes bytesOf(const MessageBuilder &b) {
+        return Bytes(b.data(), b.data() + b.size());
+    }
+
+    /// 把消息的字节放进一个新的builder，作为接收端持有的消息
+    inline void load(MessageBuilder &b, const Bytes &bytes) {
+        b.createSubBuffer(static_cast<int32_t>(bytes.size()) - RootOffset);
+        std::memcpy(b.data(), bytes.data(), bytes.size());
+    }
+
+    inline Bytes mouseMove(double x, bool ctrl) {
+        MessageBuilder b;
+        auto m = b.createRoot<base::MouseMove>();
+        m.getStart().setX(1);
+        m.getStart().setY(2);
+        m.getEnd().setX(x);
+        m.getEnd().setY(4);
+        m.setCtrlKey(ctrl);
+        return bytesOf(b);
+    }
+
+    /// rows为每行的点数
+    inline Bytes buttonClick(const std::vector<int> &rows, int seed) {
+        MessageBuilder b;
+        b.createRoot<title::TitleButtonClick>().setButtonType(title::TitleButtonEnum(seed & 1));
+        for (int r : rows) {
+            auto row = b.emplaceBack(b.root<title::TitleButtonClick>().getPoints());
+            for (int i = 0; i < r; i++) {
+                auto p = b.emplaceBack(row);
+                p.setX(i + seed);
+                p.setY(r);
+            }
+        }
+        return bytesOf(b);
+    }
+
+    /// outline为@soa数组
+    inline Bytes hitArea(int count, int seed) {
+        MessageBuilder b;
+        b.createRoot<title::TitleHitArea>().setButton(title::TitleButtonEnum::Close);
+        for (int i = 0; i < count; i++) {
+            auto p = b.emplaceBack(b.root<title::TitleHitArea>().getOutline());
+            p.setX(i + seed);
+            p.setY(-i);
+        }
+        return bytesOf(b);
+    }
+
+    /// kind: 0 没有值，1 Point2D，2 float32[]
+    struct Entry {
+        std::string key;
+        int kind;
+        double x;
+        std::vector<float> values;
+    };
+
+    /// 在b的map处写入MouseDown.position，map的entry按key排序
+    inline void buildPosition(MessageBuilder &b, int32_t map, std::vector<Entry> entries) {
+        using Map = decltype(std::declval<base::MouseDown>().getPosition());
+        std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) { return a.key < b.key; });
+        const int32_t count = static_cast<int32_t>(entries.size());
+        const int32_t data = b.createSubBuffer(Map::entryByte() * count, 4);
+        storeValue<int32_t>(b.data(), map, count);
+        storeValue<int32_t>(b.data(), map + 4, count);
+        storeValue<int32_t>(b.data(), map + 8, data);
+        for (int32_t i = 0; i < count; i++) {
+            const Entry &entry = entries[i];
+            const int32_t e = data + Map::entryByte() * i;
+            b.setString(MsgString(b.data(), e), entry.key);
+            const int32_t value = e + Map::keyByte();
+            if (entry.kind == 1) {
+                const int32_t p = b.createSubBuffer(base::Point2D::byteLength, 8);
+                b.view<base::Point2D>(p).setX(entry.x);
+                storeValue<uint8_t>(b.data(), value, 1);
+                storeValue<int32_t>(b.data(), value + 4, p);
+            } else if (entry.kind == 2) {
+                const int32_t v = b.createSubBuffer(MsgVector<float>::byteLength, 4);
+                storeValue<uint8_t>(b.data(), value, 2);
+                storeValue<int32_t>(b.data(), value + 4, v);
+                b.append(MsgVector<float>(b.data(), v), entry.values.data(), entry.values.data() + entry.values.size());
+            }
+        }
+    }
+
+    inline Bytes mouseDown(const std::vector<Entry> &entries) {
+        MessageBuilder b;
+        b.createRoot<base::MouseDown>().setButton(base::MouseKey::right);
+        buildPosition(b, RootOffset + base::MouseDown::offsetPosition, entries);
+        return bytesOf(b);
+    }
+
+    /// depth层的left链，share时right与left指向同一个struct
+    inline Bytes recu(int depth, int seed, bool share) {
+        MessageBuilder b;
+        b.createRoot<title::RecuTest>();
+        int32_t cur = RootOffset;
+        for (int d = 0; d < depth; d++) {
+            auto row = b.emplaceBack(b.view<title::RecuTest>(cur).getValue().getPoints());
+            for (int i = 0; i <= (d + seed) % 3; i++) {
+                b.emplaceBack(row).setX(d * 10 + i + seed);
+            }
+            if (d + 1 == depth) {
+                break;
+            }
+            auto child = b.createReference<title::RecuTest>(b.view<title::RecuTest>(cur), title::RecuTest::offsetLeft);
+            if (share) {
+                storeValue<int32_t>(b.data(), cur + title::RecuTest::offsetRight, child.offset());
+            }
+            cur = child.offset();
+        }
+        return bytesOf(b);
+    }
+
+    /**
+     * 在b的path处的WorkingArea.path末尾追加combine
+     * @param kinds 0 空，1 float64，n >= 2 有n行的Point2D[][]
+     */
+    inline void appendPath(MessageBuilder &b, int32_t pathOffset, const std::vector<int> &kinds) {
+        using Path = decltype(std::declval<base::WorkingArea>().getPath());
+        using Rows = MsgVector<MsgVector<base::Point2D>>;
+        for (int kind : kinds) {
+            b.emplaceBack(Path(b.data(), pathOffset));
+            const Path path(b.data(), pathOffset);
+            const int32_t value = path.getStartOffset() + path.itemSize() * (path.getSize() - 1);
+            if (kind == 1) {
+                const int32_t d = b.createSubBuffer(8, 8);
+                storeValue<double>(b.data(), d, 1.5);
+                storeValue<uint8_t>(b.data(), value, 1);
+                storeValue<int32_t>(b.data(), value + 4, d);
+            } else if (kind >= 2) {
+                const int32_t rows = b.createSubBuffer(Rows::byteLength, 4);
+                storeValue<uint8_t>(b.data(), value, 2);
+                storeValue<int32_t>(b.data(), value + 4, rows);
+                for (int r = 0; r < kind; r++) {
+                    b.emplaceBack(b.emplaceBack(Rows(b.data(), rows))).setY(r);
+                }
+            }
+        }
+    }
+
+    inline Bytes workingArea(const std::vector<int> &kinds, float fov) {
+        MessageBuilder b;
+        b.createRoot<base::WorkingArea>();
+        appendPath(b, RootOffset + base::WorkingArea::offsetPath, kinds);
+        b.root<base::WorkingArea>().getFov().set<float>(fov);
+        return bytesOf(b);
+    }
+}
@@ -0,0 +1,205 @@
+/**
+ * MessageLog: segment切换、seekSequence/seekTime、读取正在写入的日志，
+ * 以及重新打开时截掉不完整的尾部和空闲后的syncIfDue
+ */
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+#include <sys/stat.h>
+
+#include "messages.hpp"
+#include "msglog.hpp"
+
+using namespace SMessageTest;
+
+static constexpr int64_t timeStep = 10;
+
+/// 第i条消息: 行数随i变化，长度各不相同
+static Bytes message(int i) {
+    return buttonClick({i % 4, (i * 7) % 5}, i);
+}
+
+static int64_t timestampOf(int i) {
+    return 1000 + i * timeStep;
+}
+
+static std::string tempDir() {
+    char path[] = "/tmp/smessage-log-XXXXXX";
+    assert(mkdtemp(path));
+    return path;
+}
+
+static void removeDir(const std::string &dir) {
+    const std::string command = "rm -rf '" + dir + "'";
+    assert(std::system(command.c_str()) == 0);
+}
+
+static void expectRecord(const LogRecord &record, int i) {
+    const Bytes expected = message(i);
+    assert(record.sequence == static_cast<uint64_t>(i) && record.timestamp == timestampOf(i));
+    assert(record.typeId == title::TitleButtonClick::typeId);
+    assert(Bytes(record.data.begin(), record.data.end()) == expected);
+    assert(record.root<title::TitleButtonClick>().getPoints().getSize() == 2);
+}
+
+static void appendRange(MessageLogWriter &writer, int from, int to) {
+    for (int i = from; i < to; i++) {
+        const Bytes bytes = message(i);
+        assert(writer.append(bytes, timestampOf(i)) == static_cast<uint64_t>(i));
+    }
+}
+
+static void expectAll(MessageLogReader &reader, int count) {
+    reader.rewind();
+    int i = 0;
+    reader.replay([&](const LogRecord &record) {
+        expectRecord(record, i++);
+    });
+    assert(i == count && !reader.corrupted());
+}
+
+/// 小segment写入多个文件，按sequence和时间定位
+static void rollAndSeek() {
+    const std::string dir = tempDir();
+    MessageLogOptions options;
+    options.segmentSize = 4096;
+    options.indexInterval = 256;
+    constexpr int count = 400;
+    {
+        MessageLogWriter writer = MessageLogWriter::open(dir, options);
+        appendRange(writer, 0, count);
+        writer.close();
+    }
+    assert(Detail::listLogSegments(dir).size() > 5);
+
+    MessageLogReader reader = MessageLogReader::open(dir);
+    expectAll(reader, count);
+
+    LogRecord record;
+    for (int i : {0, 1, 17, 63, 64, 200, count - 1}) {
+        assert(reader.seekSequence(static_cast<uint64_t>(i)) && reader.sequence() == static_cast<uint64_t>(i));
+        assert(reader.next(record));
+        expectRecord(record, i);
+    }
+    assert(!reader.seekSequence(count));
+
+    for (int i : {0, 5, 150, count - 1}) {
+        // 恰好等于以及略早于某条消息的时间都定位到这条消息
+        assert(reader.seekTime(timestampOf(i)) && reader.next(record));
+        expectRecord(record, i);
+        assert(reader.seekTime(timestampOf(i) - timeStep / 2) && reader.next(record));
+        expectRecord(record, i);
+    }
+    assert(reader.seekTime(0) && reader.sequence() == 0);
+    assert(!reader.seekTime(timestampOf(count)));
+    removeDir(dir);
+}
+
+/// 末尾留下写了一半的记录，重新打开时截掉，之后继续追加
+static void tornTail() {
+    const std::string dir = tempDir();
+    constexpr int count = 20;
+    uint64_t end = sizeof(Detail::LogSegmentHeader);
+    {
+        MessageLogWriter writer = MessageLogWriter::open(dir);
+        appendRange(writer, 0, count);
+    }
+    for (int i = 0; i < count; i++) {
+        end += Detail::logRecordStride(message(i).size());
+    }
+
+    // length已写入但sequence不对，后面还有残留的字节
+    const std::string path = Detail::logSegmentPath(dir, 0, ".smlog");
+    const int fd = ::open(path.c_str(), O_RDWR);
+    assert(fd >= 0);
+    const Detail::LogRecordHeader torn{64, title::TitleButtonClick::typeId, 12345, timestampOf(count)};
+    assert(pwrite(fd, &torn, sizeof(torn), static_cast<off_t>(end)) == sizeof(torn));
+    const Bytes garbage(40, 0xAB);
+    assert(pwrite(fd, garbage.data(), garbage.size(), static_cast<off_t>(end + sizeof(torn))) == static_cast<ssize_t>(garbage.size()));
+    ::close(fd);
+
+    {
+        MessageLogReader reader = MessageLogReader::open(dir);
+        LogRecord record;
+        int read = 0;
+        while (reader.next(record)) {
+            read++;
+        }
+        assert(read == count && reader.corrupted());
+    }
+
+    {
+        MessageLogWriter writer = MessageLogWriter::open(dir);
+        assert(writer.nextSequence() == count);
+        appendRange(writer, count, count * 2);
+    }
+    MessageLogReader reader = MessageLogReader::open(dir);
+    expectAll(reader, count * 2);
+    removeDir(dir);
+}
+
+/// reader与writer同时打开，writer追加(包括切换segment)后reader继续读取
+static void tailLiveWriter() {
+    const std::string dir = tempDir();
+    MessageLogOptions options;
+    options.segmentSize = 2048;
+    MessageLogWriter writer = MessageLogWriter::open(dir, options);
+    MessageLogReader reader = MessageLogReader::open(dir);
+    LogRecord record;
+    assert(!reader.next(record));
+
+    int read = 0;
+    for (int batch = 0; batch < 10; batch++) {
+        appendRange(writer, batch * 15, batch * 15 + 15);
+        while (reader.next(record)) {
+            expectRecord(record, read++);
+        }
+        assert(read == batch * 15 + 15 && !reader.corrupted());
+    }
+    assert(Detail::listLogSegments(dir).size() > 2);
+    writer.close();
+    removeDir(dir);
+}
+
+static off_t indexLength(const std::string &dir) {
+    struct stat st;
+    return stat(Detail::logSegmentPath(dir, 0, ".smidx").c_str(), &st) == 0 ? st.st_size : -1;
+}
+
+/// 突发写入后空闲: 不再追加时由syncIfDue按时间sync，索引随之写入
+static void syncWhenIdle() {
+    const std::string dir = tempDir();
+    MessageLogOptions options;
+    options.syncEveryRecords = 0;
+    options.syncInterval = std::chrono::milliseconds(200);
+    MessageLogWriter writer = MessageLogWriter::open(dir, options);
+    assert(!writer.syncIfDue());
+    appendRange(writer, 0, 5);
+    assert(indexLength(dir) == 0 && !writer.syncIfDue());
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    assert(writer.syncIfDue() && indexLength(dir) > 0);
+    assert(!writer.syncIfDue());
+
+    options.syncEveryRecords = 3;
+    options.syncInterval = std::chrono::milliseconds(0);
+    const std::string countedDir = tempDir();
+    MessageLogWriter counted = MessageLogWriter::open(countedDir, options);
+    appendRange(counted, 0, 2);
+    assert(!counted.syncIfDue());
+    appendRange(counted, 2, 3);
+    assert(!counted.syncIfDue() && indexLength(countedDir) > 0);
+    removeDir(dir);
+    removeDir(countedDir);
+}
+
+int main() {
+    rollAndSeek();
+    tornTail();
+    tailLiveWriter();
+    syncWhenIdle();
+    std::printf("msglog_test passed\n");
+    return 0;
+}
@@ -0,0 +1,171 @@
+/**
+ * diff→apply: 在base的副本上应用patch后，结果与target再diff不应有任何改动
+ */
+#include <cassert>
+#include <cstdio>
+
+#include "messages.hpp"
+#include "verifier.hpp"
+#include "patch.hpp"
+
+using namespace SMessageTest;
+
+template <typename Root>
+static Bytes diff(const Bytes &base, const Bytes &target) {
+    MessageBuilder patch;
+    const bool ok = diffMessage<Root>(base.data(), target.data(), patch);
+    assert(ok);
+    return bytesOf(patch);
+}
+
+template <typename Root>
+static void roundTrip(const char *name, const Bytes &base, const Bytes &target) {
+    const Bytes patch = diff<Root>(base, target);
+    MessageBuilder message;
+    load(message, base);
+    bool ok = applyPatch(message, patch.data(), patch.size());
+    assert(ok);
+    assert(verifyMessage<Root>(message.data(), message.size()).error == VerifyError::None);
+
+    const Bytes again = diff<Root>(bytesOf(message), target);
+    const MessagePatch check(const_cast<uint8_t*>(again.data()));
+    assert(check.rangeCount() == 0 && check.getLength() == message.size());
+
+    // 应用后nextAvailableOffset改变，同一个patch不能再应用
+    const MessagePatch applied(const_cast<uint8_t*>(patch.data()));
+    ok = applyPatch(message, patch.data(), patch.size());
+    assert(!ok || applied.getLength() == applied.getBaseLength());
+    std::printf("%-20s base %5zu target %5zu patch %5zu\n", name, base.size(), target.size(), patch.size());
+}
+
+/// 在消息末尾多分配bytes字节，使之后的子空间需要补齐对齐
+static Bytes padded(const Bytes &message, int32_t bytes) {
+    MessageBuilder b;
+    load(b, message);
+    b.createSubBuffer(bytes);
+    return bytesOf(b);
+}
+
+/// patch新分配的数组和combine的值与builder一样按itemAlignment对齐
+static void checkAlignment() {
+    const Bytes base = padded(buttonClick({1}, 0), 3);
+    const Bytes patch = diff<title::TitleButtonClick>(base, buttonClick({2, 3, 1}, 1));
+    MessageBuilder message;
+    load(message, base);
+    bool ok = applyPatch(message, patch.data(), patch.size());
+    assert(ok);
+    const auto rows = message.root<title::TitleButtonClick>().getPoints();
+    assert(rows.getStartOffset() % itemAlignment<decltype(rows.getItem(0))>() == 0);
+    for (int32_t i = 0; i < rows.getSize(); i++) {
+        assert(rows.getItem(i).getStartOffset() % itemAlignment<base::Point2D>() == 0);
+    }
+
+    const Bytes area = padded(workingArea({0}, 1), 1);
+    const Bytes areaPatch = diff<base::WorkingArea>(area, workingArea({1, 1}, 1));
+    MessageBuilder areaMessage;
+    load(areaMessage, area);
+    ok = applyPatch(areaMessage, areaPatch.data(), areaPatch.size());
+    assert(ok);
+    const auto path = areaMessage.root<base::WorkingArea>().getPath();
+    for (int32_t i = 0; i < path.getSize(); i++) {
+        assert(loadValue<int32_t>(areaMessage.data(), path.getStartOffset() + path.itemSize() * i + 4) % itemAlignment<double>() == 0);
+    }
+}
+
+/// 损坏的patch被拒绝，消息保持不变
+static void rejectCorrupt() {
+    const Bytes base = buttonClick({1, 2}, 0);
+    const Bytes patch = diff<title::TitleButtonClick>(base, buttonClick({1, 2, 5}, 1));
+    const int32_t ranges = RootOffset + MessagePatch::offsetRanges;
+    const int32_t data = RootOffset + MessagePatch::offsetData;
+
+    auto expectRejected = [&](const Bytes &corrupt) {
+        MessageBuilder message;
+        load(message, base);
+        assert(!applyPatch(message, corrupt.data(), corrupt.size()));
+        assert(bytesOf(message) == base);
+        // 不经过verifier时，applyPatch自己的范围检查也要拒绝
+        assert(!applyPatch(message, MessagePatch(const_cast<uint8_t*>(corrupt.data()))));
+        assert(bytesOf(message) == base);
+    };
+
+    Bytes corrupt = patch;
+    storeValue<int32_t>(corrupt.data(), ranges, static_cast<int32_t>(corrupt.size()) - 4);
+    expectRejected(corrupt);
+
+    corrupt = patch;
+    storeValue<int32_t>(corrupt.data(), data + 4, loadValue<int32_t>(corrupt.data(), data + 4) + 64);
+    storeValue<int32_t>(corrupt.data(), data + 8, loadValue<int32_t>(corrupt.data(), data + 4));
+    expectRejected(corrupt);
+
+    corrupt = patch;
+    storeValue<int32_t>(corrupt.data(), ranges + 4, loadValue<int32_t>(corrupt.data(), ranges + 4) - 1);
+    expectRejected(corrupt);
+
+    corrupt = patch;
+    // 第一个范围的起点移到消息末尾之后
+    const int32_t rangeData = loadValue<int32_t>(corrupt.data(), ranges);
+    storeValue<int32_t>(corrupt.data(), rangeData, MessagePatch(corrupt.data()).getLength());
+    expectRejected(corrupt);
+
+    corrupt = Bytes(patch.begin(), patch.end() - 1);
+    MessageBuilder message;
+    load(message, base);
+    assert(!applyPatch(message, corrupt.data(), corrupt.size()));
+    assert(bytesOf(message) == base);
+}
+
+/// 类型和nextAvailableOffset相同但内容不同的base不能应用patch，trash不参与比较
+static void rejectOtherBase() {
+    const Bytes base = buttonClick({1, 2}, 0);
+    const Bytes other = buttonClick({1, 2}, 3);
+    assert(base.size() == other.size() && base != other);
+    const Bytes patch = diff<title::TitleButtonClick>(base, buttonClick({1, 2, 5}, 1));
+
+    MessageBuilder message;
+    load(message, other);
+    assert(!applyPatch(message, patch.data(), patch.size()));
+    assert(bytesOf(message) == other);
+
+    load(message, base);
+    storeValue<int32_t>(message.data(), TrashLengthOffset, 100);
+    assert(applyPatch(message, patch.data(), patch.size()));
+}
+
+int main() {
+    roundTrip<base::MouseMove>("mousemove same", mouseMove(3, false), mouseMove(3, false));
+    roundTrip<base::MouseMove>("mousemove field", mouseMove(3, false), mouseMove(5, true));
+
+    roundTrip<title::TitleButtonClick>("rows grow", buttonClick({1, 2}, 0), buttonClick({1, 2, 5, 3}, 1));
+    roundTrip<title::TitleButtonClick>("rows shrink", buttonClick({4, 4, 4}, 0), buttonClick({2}, 0));
+    roundTrip<title::TitleButtonClick>("rows clear", buttonClick({4, 4, 4}, 0), buttonClick({}, 0));
+    roundTrip<title::TitleButtonClick>("rows values", buttonClick({3, 3, 3}, 0), buttonClick({3, 3, 3}, 7));
+
+    const std::string longKey(40, 'k');
+    const std::vector<Entry> entries = {{"a", 1, 1, {}}, {longKey, 2, 0, {1, 2, 3}}, {"c", 0, 0, {}}};
+    std::vector<Entry> changed = entries;
+    changed[0].x = 9;
+    changed[1].values = {1, 2, 3, 4, 5, 6};
+    changed[2] = {"c", 1, 2, {}};
+    roundTrip<base::MouseDown>("map values", mouseDown(entries), mouseDown(changed));
+    changed = entries;
+    changed.push_back({longKey + "z", 2, 0, {7}});
+    changed[0] = {"a", 2, 0, {5}};
+    roundTrip<base::MouseDown>("map keys", mouseDown(entries), mouseDown(changed));
+    roundTrip<base::MouseDown>("map clear", mouseDown(entries), mouseDown({}));
+
+    roundTrip<title::RecuTest>("refs values", recu(8, 0, false), recu(8, 1, false));
+    roundTrip<title::RecuTest>("refs deeper", recu(4, 0, false), recu(9, 0, false));
+    roundTrip<title::RecuTest>("refs shallower", recu(9, 0, false), recu(3, 2, false));
+    roundTrip<title::RecuTest>("refs shared", recu(6, 0, false), recu(6, 0, true));
+
+    roundTrip<base::WorkingArea>("combine kinds", workingArea({0, 1, 2}, 1), workingArea({2, 0, 1}, 2));
+    roundTrip<base::WorkingArea>("combine grow", workingArea({1}, 1), workingArea({3, 3, 1, 2}, 1));
+    roundTrip<base::WorkingArea>("combine clear", workingArea({3, 1}, 1), workingArea({}, 0));
+
+    checkAlignment();
+    rejectCorrupt();
+    rejectOtherBase();
+    std::printf("patch_test passed\n");
+    return 0;
+}
@@ -0,0 +1,179 @@
+/**
+ * MessagePool: 线程本地缓存的复用、跨线程释放，以及pool析构时其他线程仍然缓存着它。
+ * SharedMessage: 多线程分发时的计数、写时拷贝的detach，buffer只回到pool一次
+ */
+#include <barrier>
+#include <cassert>
+#include <cstdio>
+#include <set>
+#include <thread>
+#include <vector>
+
+#include "messages.hpp"
+#include "pool.hpp"
+
+using namespace SMessageTest;
+
+static constexpr int threadCount = 4;
+static constexpr size_t smallBytes = 100;
+
+/// 释放后再分配同一个size class不需要向系统申请
+static void reuse() {
+    MessagePool pool;
+    PoolBuffer a = pool.acquire(smallBytes);
+    assert(a.capacity() >= smallBytes && a.unique() && a.pool() == &pool);
+    const uint8_t *data = a.data();
+    a.reset();
+    PoolBuffer b = pool.acquire(smallBytes - 1);
+    assert(b.data() == data && pool.systemAllocations() == 1);
+
+    // 超过最大size class的直接分配，释放后不复用
+    PoolBuffer large = pool.acquire(size_t(1) << MessagePool::maxClassShift);
+    assert(large.capacity() == size_t(1) << MessagePool::maxClassShift);
+    large.reset();
+    large = pool.acquire(size_t(1) << MessagePool::maxClassShift);
+    assert(pool.systemAllocations() == 3);
+}
+
+/// 每个线程分配一批buffer，一半自己释放，一半交给handoff由其他线程释放
+static void churn(MessagePool &pool, std::vector<PoolBuffer> &handoff, int seed) {
+    std::vector<PoolBuffer> held;
+    for (int round = 0; round < 200; round++) {
+        for (int i = 0; i < 16; i++) {
+            PoolBuffer buffer = pool.acquire(smallBytes << ((round + i + seed) % 6));
+            buffer.data()[0] = static_cast<uint8_t>(seed);
+            held.push_back(std::move(buffer));
+        }
+        for (size_t i = 0; i < held.size(); i += 2) {
+            held[i].reset();
+        }
+        for (size_t i = 1; i < held.size(); i += 2) {
+            assert(held[i].data()[0] == static_cast<uint8_t>(seed));
+        }
+        held.clear();
+    }
+    for (int i = 0; i < 32; i++) {
+        handoff.push_back(pool.acquire(smallBytes));
+    }
+}
+
+/**
+ * 各线程缓存着pool A时析构A，再在(可能相同的)地址上创建B继续使用。
+ * A不能被线程退出时的flush访问，线程缓存中A的块也不能被B复用。
+ */
+static void destroyWhileCached() {
+    MessagePool *pool = new MessagePool();
+    std::vector<std::vector<PoolBuffer>> handoff(threadCount);
+    std::barrier sync(threadCount + 1);
+    uint64_t allocationsB = 0;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.emplace_back([&, t]() {
+            churn(*pool, handoff[t], t);
+            sync.arrive_and_wait();
+            // 主线程释放其他线程的buffer，然后析构A并创建B
+            sync.arrive_and_wait();
+            churn(*pool, handoff[t], t + threadCount);
+            sync.arrive_and_wait();
+        });
+    }
+
+    sync.arrive_and_wait();
+    for (int t = 0; t < threadCount; t++) {
+        // 跨线程释放: 放进主线程自己的缓存
+        handoff[(t + 1) % threadCount].clear();
+    }
+    delete pool;
+    pool = new MessagePool();
+    sync.arrive_and_wait();
+    sync.arrive_and_wait();
+    for (auto &buffers : handoff) {
+        buffers.clear();
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    // 线程退出时缓存归还B的全局链表，之后的分配不需要向系统申请
+    allocationsB = pool->systemAllocations();
+    std::vector<PoolBuffer> again;
+    for (int i = 0; i < 16; i++) {
+        again.push_back(pool->acquire(smallBytes));
+        assert(again.back().pool() == pool);
+    }
+    assert(pool->systemAllocations() == allocationsB);
+    again.clear();
+    delete pool;
+}
+
+using SharedClick = SharedMessage<title::TitleButtonClick>;
+
+/**
+ * 一个消息分发给多个线程，各线程反复拷贝和释放句柄，然后在所有句柄都存在时detach并修改自己的副本。
+ * 原消息不变，全部释放后pool中的每个块只能被取出一次。
+ */
+static void shareAcrossThreads() {
+    MessagePool pool;
+    const Bytes original = buttonClick({3, 2}, 1);
+    MessageBuilder builder(pool);
+    load(builder, original);
+    SharedClick shared = builder.finish<title::TitleButtonClick>().share();
+    const uint8_t *data = shared.bytes().data();
+    assert(shared.useCount() == 1 && shared->getPoints().getSize() == 2);
+
+    std::barrier sync(threadCount + 1);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+        threads.emplace_back([&, t, handle = shared]() {
+            sync.arrive_and_wait();
+            for (int i = 0; i < 1000; i++) {
+                const SharedClick copy = handle;
+                assert(copy.useCount() > 1 && copy->getPoints().getItem(0).getSize() == 3);
+            }
+            PoolBuffer own = SharedClick(handle).detach();
+            assert(own.unique() && own.pool() == &pool && own.data() != data);
+            assert(Bytes(own.data(), own.data() + original.size()) == original);
+            MessageBuilder writer(std::move(own));
+            writer.root<title::TitleButtonClick>().getPoints().getItem(0).getItem(0).setX(100 + t);
+            sync.arrive_and_wait();
+            // 其他线程的修改只写入各自的副本
+            assert(Bytes(handle.bytes().begin(), handle.bytes().end()) == original);
+            assert(writer.root<title::TitleButtonClick>().getPoints().getItem(0).getItem(0).getX() == 100 + t);
+        });
+    }
+    assert(shared.useCount() == threadCount + 1);
+    sync.arrive_and_wait();
+    sync.arrive_and_wait();
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    // 唯一的句柄detach时直接交出buffer，之后句柄为空
+    assert(shared.useCount() == 1);
+    SharedClick last = shared;
+    shared = SharedClick();
+    PoolBuffer buffer = std::move(last).detach();
+    assert(!last && buffer.data() == data && buffer.unique());
+    buffer.reset();
+
+    // 原消息和threadCount个副本都已回到pool: 重新取出不需要向系统申请，且没有重复的块
+    const uint64_t allocations = pool.systemAllocations();
+    std::vector<PoolBuffer> again;
+    std::set<const uint8_t*> distinct;
+    for (int i = 0; i < threadCount * 4; i++) {
+        again.push_back(pool.acquire(i % 2 ? original.size() : static_cast<size_t>(MessageBuilder::defaultCapacity)));
+        assert(distinct.insert(again.back().data()).second);
+    }
+    assert(pool.systemAllocations() - allocations <= static_cast<uint64_t>(threadCount * 4 - threadCount - 1));
+}
+
+int main() {
+    reuse();
+    shareAcrossThreads();
+    for (int i = 0; i < 4; i++) {
+        destroyWhileCached();
+    }
+    std::printf("pool_test passed\n");
+    return 0;
+}
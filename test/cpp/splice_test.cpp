@@ -0,0 +1,202 @@
+/**
+ * splice/spliceAppend: 在arena中构建→拼接到父消息→校验，与直接在父消息中构建的值相同(比较紧凑编码)。
+ * 覆盖共享的引用、指回arena root的引用、字符串/map/combine的地址改写和splicePadding
+ */
+#include <cassert>
+#include <cstdio>
+#include <thread>
+#include <vector>
+
+#include "messages.hpp"
+#include "splice.hpp"
+#include "verifier.hpp"
+#include "wire.hpp"
+
+using namespace SMessageTest;
+
+using Rows = decltype(std::declval<title::TitleButtonClick>().getPoints());
+using Path = decltype(std::declval<base::WorkingArea>().getPath());
+using Position = decltype(std::declval<base::MouseDown>().getPosition());
+
+/// 校验后与serial的值相同
+template <typename Root>
+static void expectSame(const MessageBuilder &spliced, const Bytes &serial) {
+    assert(verifyMessage<Root>(spliced.data(), spliced.size()));
+    Bytes wire, expected;
+    bool ok = encodeWire<Root>(spliced.data(), wire);
+    assert(ok);
+    ok = encodeWire<Root>(serial.data(), expected);
+    assert(ok && wire == expected);
+}
+
+/// 在父消息末尾留下bytes字节，使之后拼接的T的子空间需要padding
+template <typename T>
+static void misalign(MessageBuilder &parent, int32_t bytes) {
+    parent.createSubBuffer(bytes);
+    assert(Detail::splicePadding(parent.nextAvailableOffset(), MessageArena<T>::dataOffset()) != 0);
+}
+
+static void padding() {
+    for (int32_t at = RootOffset; at < RootOffset + 16; at++) {
+        for (int32_t from : {RootOffset, RootOffset + 4, RootOffset + 12}) {
+            const int32_t pad = Detail::splicePadding(at, from);
+            assert(pad >= 0 && pad < Detail::spliceAlignment && (at + pad - from) % Detail::spliceAlignment == 0);
+        }
+    }
+}
+
+static void appendRow(MessageBuilder &b, Rows rows, int count, int seed) {
+    auto row = b.emplaceBack(rows);
+    for (int i = 0; i < count; i++) {
+        auto p = b.emplaceBack(row);
+        p.setX(i + seed);
+        p.setY(count);
+    }
+}
+
+/// 每个线程在自己的arena中构建几行，按顺序追加到已有一行的points之后
+static void appendRowsInThreads() {
+    const std::vector<std::vector<int>> parts = {{2, 0, 3}, {}, {5}, {1, 4}};
+    std::vector<MessageArena<Rows>> arenas(parts.size());
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < parts.size(); t++) {
+        threads.emplace_back([&, t]() {
+            for (int count : parts[t]) {
+                appendRow(arenas[t].builder(), arenas[t].value(), count, 1);
+            }
+        });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    MessageBuilder parent;
+    parent.createRoot<title::TitleButtonClick>().setButtonType(title::TitleButtonEnum(1));
+    appendRow(parent, parent.root<title::TitleButtonClick>().getPoints(), 3, 1);
+    misalign<Rows>(parent, 3);
+    spliceAppend(parent, parent.root<title::TitleButtonClick>().getPoints(), std::span<const MessageArena<Rows>>(arenas));
+
+    expectSame<title::TitleButtonClick>(parent, buttonClick({3, 2, 0, 3, 5, 1, 4}, 1));
+    const auto rows = parent.root<title::TitleButtonClick>().getPoints();
+    for (int32_t i = 0; i < rows.getSize(); i++) {
+        assert(rows.getItem(i).getSize() == 0 || rows.getItem(i).getStartOffset() % itemAlignment<base::Point2D>() == 0);
+    }
+    // arena中原来的行数组不再可达
+    assert(parent.trashLength() > 0);
+}
+
+/// combine的值(float64和二维数组)在arena中分配，拼接后地址改写并保持对齐
+static void appendPathInThreads() {
+    const std::vector<std::vector<int>> parts = {{1, 2}, {0, 3, 1}, {4}};
+    std::vector<MessageArena<Path>> arenas(parts.size());
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < parts.size(); t++) {
+        threads.emplace_back([&, t]() { appendPath(arenas[t].builder(), RootOffset, parts[t]); });
+    }
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    MessageBuilder parent;
+    parent.createRoot<base::WorkingArea>();
+    appendPath(parent, RootOffset + base::WorkingArea::offsetPath, {2});
+    misalign<Path>(parent, 5);
+    spliceAppend(parent, parent.root<base::WorkingArea>().getPath(), std::span<const MessageArena<Path>>(arenas));
+    parent.root<base::WorkingArea>().getFov().set<float>(2.5f);
+
+    expectSame<base::WorkingArea>(parent, workingArea({2, 1, 2, 0, 3, 1, 4}, 2.5f));
+    const auto path = parent.root<base::WorkingArea>().getPath();
+    for (int32_t i = 0; i < path.getSize(); i++) {
+        const int32_t value = loadValue<int32_t>(parent.data(), path.getStartOffset() + path.itemSize() * i + 4);
+        assert(path.getItem(i).index() != 1 || value % itemAlignment<double>() == 0);
+    }
+}
+
+/// map的长key(out-of-line字符串)、Point2D和float32[]的combine值
+static void spliceMap() {
+    const std::string longKey(40, 'k');
+    const std::vector<Entry> entries = {{"a", 1, 1, {}}, {longKey, 2, 0, {1, 2, 3}}, {"c", 0, 0, {}}, {longKey + "z", 1, 7, {}}};
+    MessageArena<Position> arena;
+    buildPosition(arena.builder(), RootOffset, entries);
+
+    MessageBuilder parent;
+    parent.createRoot<base::MouseDown>().setButton(base::MouseKey::right);
+    misalign<Position>(parent, 1);
+    splice(parent, RootOffset + base::MouseDown::offsetPosition, arena);
+    expectSame<base::MouseDown>(parent, mouseDown(entries));
+
+    const auto position = parent.root<base::MouseDown>().getPosition();
+    assert(position.contains(longKey + "z") && position.contains("a"));
+    for (const auto &entry : position) {
+        const int32_t value = entry.entryOffset() + Position::keyByte();
+        if (loadValue<uint8_t>(parent.data(), value) == 1) {
+            assert(loadValue<int32_t>(parent.data(), value + 4) % itemAlignment<base::Point2D>() == 0);
+        }
+    }
+}
+
+/**
+ * 从at处的RecuTest开始构建depth层的left链，right与left共享，最后一层的right指回at。
+ * 在arena中at为root，拼接后指回arena root的引用改为指向拼接的位置。
+ */
+static void buildChain(MessageBuilder &b, int32_t at, int depth) {
+    int32_t cur = at;
+    for (int d = 0; d < depth; d++) {
+        appendRow(b, b.view<title::RecuTest>(cur).getValue().getPoints(), d % 3 + 1, d * 10);
+        if (d + 1 == depth) {
+            storeValue<int32_t>(b.data(), cur + title::RecuTest::offsetRight, at);
+            break;
+        }
+        const int32_t child = b.createReference<title::RecuTest>(b.view<title::RecuTest>(cur), title::RecuTest::offsetLeft).offset();
+        storeValue<int32_t>(b.data(), cur + title::RecuTest::offsetRight, child);
+        cur = child;
+    }
+}
+
+static void spliceStruct() {
+    constexpr int depth = 6;
+    MessageBuilder serial;
+    serial.createRoot<title::RecuTest>();
+    appendRow(serial, serial.root<title::RecuTest>().getValue().getPoints(), 2, 100);
+    const int32_t serialLeft = serial.createReference<title::RecuTest>(serial.root<title::RecuTest>(), title::RecuTest::offsetLeft).offset();
+    buildChain(serial, serialLeft, depth);
+
+    MessageArena<title::RecuTest> arena;
+    buildChain(arena.builder(), RootOffset, depth);
+    MessageBuilder parent;
+    parent.createRoot<title::RecuTest>();
+    appendRow(parent, parent.root<title::RecuTest>().getValue().getPoints(), 2, 100);
+    const int32_t left = parent.createReference<title::RecuTest>(parent.root<title::RecuTest>(), title::RecuTest::offsetLeft).offset();
+    misalign<title::RecuTest>(parent, 7);
+    splice(parent, left, arena);
+    expectSame<title::RecuTest>(parent, bytesOf(serial));
+
+    // 共享的struct只改写一次，最后一层指回拼接的位置
+    int32_t cur = left;
+    for (int d = 0; d + 1 < depth; d++) {
+        const int32_t next = loadValue<int32_t>(parent.data(), cur + title::RecuTest::offsetLeft);
+        assert(next > left && loadValue<int32_t>(parent.data(), cur + title::RecuTest::offsetRight) == next);
+        cur = next;
+    }
+    assert(loadValue<int32_t>(parent.data(), cur + title::RecuTest::offsetRight) == left);
+
+    // 拼接为root: 指回arena root的引用指向父消息的root
+    MessageBuilder root;
+    root.createRoot<title::RecuTest>();
+    misalign<title::RecuTest>(root, 2);
+    splice(root, RootOffset, arena);
+    MessageBuilder serialRoot;
+    serialRoot.createRoot<title::RecuTest>();
+    buildChain(serialRoot, RootOffset, depth);
+    expectSame<title::RecuTest>(root, bytesOf(serialRoot));
+}
+
+int main() {
+    padding();
+    appendRowsInThreads();
+    appendPathInThreads();
+    spliceMap();
+    spliceStruct();
+    std::printf("splice_test passed\n");
+    return 0;
+}
@@ -0,0 +1,202 @@
+/**
+ * ShmRing: fork出的生产者进程通过memfd发布消息，父进程消费。
+ * 覆盖SPSC/MPSC、批量发布、满/空时的futex等待，以及对端写坏共享内存时消费者不越界。
+ */
+#include <cassert>
+#include <cstdio>
+#include <vector>
+
+#include <sys/wait.h>
+
+#include "transport.hpp"
+
+using namespace SMessage;
+
+using Bytes = std::vector<uint8_t>;
+
+static constexpr uint32_t slotSize = 128;
+
+/// [producer, sequence, 填充...]，长度随sequence变化
+static Bytes payload(uint32_t producer, uint32_t sequence) {
+    Bytes bytes(8 + sequence % 64, static_cast<uint8_t>(sequence));
+    std::memcpy(bytes.data(), &producer, 4);
+    std::memcpy(bytes.data() + 4, &sequence, 4);
+    return bytes;
+}
+
+static void checkPayload(std::span<const uint8_t> message, std::vector<uint32_t> &next) {
+    uint32_t producer, sequence;
+    assert(message.size() >= 8);
+    std::memcpy(&producer, message.data(), 4);
+    std::memcpy(&sequence, message.data() + 4, 4);
+    assert(producer < next.size() && sequence == next[producer]);
+    assert(Bytes(message.begin(), message.end()) == payload(producer, sequence));
+    next[producer]++;
+}
+
+/// 在子进程中运行body，之后立即退出，断言失败时子进程异常退出
+template <typename Body>
+static pid_t spawn(Body &&body) {
+    const pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        body();
+        _exit(0);
+    }
+    return pid;
+}
+
+static void expectExited(pid_t pid) {
+    int status = 0;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/// 生产者交替使用阻塞的publish和批量发布，ring很小，生产者经常需要等待空间
+static void produce(ShmRing &ring, uint32_t producer, uint32_t count) {
+    uint32_t sequence = 0;
+    while (sequence < count) {
+        if (sequence % 3 == 0) {
+            std::vector<Bytes> batch;
+            for (uint32_t i = 0; i < 3 && sequence + i < count; i++) {
+                batch.push_back(payload(producer, sequence + i));
+            }
+            std::vector<std::span<const uint8_t>> messages(batch.begin(), batch.end());
+            while (!ring.tryPublishBatch(messages)) {
+                usleep(100);
+            }
+            sequence += static_cast<uint32_t>(batch.size());
+        } else {
+            assert(ring.publish(payload(producer, sequence)));
+            sequence++;
+        }
+    }
+}
+
+/// 消费者通过attach映射同一个fd，用wait等待数据
+static void consumeAll(int fd, uint32_t producers, uint32_t count) {
+    ShmRing consumer = ShmRing::attach(dup(fd));
+    assert(consumer.slotSize() == slotSize);
+    std::vector<uint32_t> next(producers, 0);
+    size_t total = 0;
+    while (total < static_cast<size_t>(producers) * count) {
+        assert(consumer.wait(std::chrono::seconds(10)));
+        total += consumer.consume([&](std::span<const uint8_t> message) {
+            checkPayload(message, next);
+        }, 5);
+    }
+    for (uint32_t n : next) {
+        assert(n == count);
+    }
+    assert(!consumer.readable() && consumer.size() == 0);
+}
+
+static void spsc() {
+    ShmRing ring = ShmRing::create(4, slotSize, RingMode::SPSC);
+    const pid_t pid = spawn([&] { produce(ring, 0, 2000); });
+    consumeAll(ring.fd(), 1, 2000);
+    expectExited(pid);
+}
+
+static void mpsc() {
+    constexpr uint32_t producers = 3;
+    ShmRing ring = ShmRing::create(8, slotSize, RingMode::MPSC);
+    std::vector<pid_t> pids;
+    for (uint32_t p = 0; p < producers; p++) {
+        pids.push_back(spawn([&] { produce(ring, p, 1000); }));
+    }
+    consumeAll(ring.fd(), producers, 1000);
+    for (pid_t pid : pids) {
+        expectExited(pid);
+    }
+}
+
+/// 消费者先进入futex等待，生产者稍后发布；满时生产者等待，消费者释放后被唤醒
+static void wakeups() {
+    ShmRing ring = ShmRing::create(2, slotSize);
+    assert(!ring.wait(std::chrono::milliseconds(20)));
+    const pid_t pid = spawn([&] {
+        usleep(50 * 1000);
+        assert(ring.publish(payload(0, 0)));
+        assert(ring.publish(payload(0, 1)));
+        // ring已满，等待父进程消费
+        assert(!ring.tryPublish(payload(0, 2)));
+        assert(ring.publish(payload(0, 2), std::chrono::seconds(10)));
+    });
+    std::vector<uint32_t> next(1, 0);
+    assert(ring.wait());
+    usleep(50 * 1000);
+    while (next[0] < 3) {
+        assert(ring.wait(std::chrono::seconds(10)));
+        ring.consume([&](std::span<const uint8_t> message) { checkPayload(message, next); });
+    }
+    expectExited(pid);
+}
+
+/// 对端修改共享的header和slot长度: 消费者使用attach时的几何参数，超长的slot被拒绝
+static void corruptPeer() {
+    ShmRing ring = ShmRing::create(4, slotSize);
+    ShmRing consumer = ShmRing::attach(dup(ring.fd()));
+    const size_t length = static_cast<size_t>(lseek(ring.fd(), 0, SEEK_END));
+    void *mem = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, ring.fd(), 0);
+    assert(mem != MAP_FAILED);
+    auto *header = static_cast<Detail::RingHeader*>(mem);
+    const uint32_t stride = header->slotStride;
+    auto slot = [&](uint32_t index) {
+        return reinterpret_cast<Detail::RingSlotHeader*>(static_cast<uint8_t*>(mem) + sizeof(Detail::RingHeader) + static_cast<size_t>(index) * stride);
+    };
+
+    assert(ring.tryPublish(payload(0, 0)));
+    assert(ring.tryPublish(payload(0, 1)));
+    header->slotCount = 1u << 30;
+    header->slotStride = 1u << 30;
+    header->slotSize = UINT32_MAX;
+    slot(1)->length = slotSize + 1;
+
+    std::vector<uint32_t> next(1, 0);
+    bool thrown = false;
+    try {
+        consumer.consume([&](std::span<const uint8_t> message) { checkPayload(message, next); });
+    } catch (const std::system_error &e) {
+        thrown = e.code().value() == EBADMSG;
+    }
+    // 损坏之前的消息已经处理并释放
+    assert(thrown && next[0] == 1 && consumer.slotCount() == 4 && consumer.slotSize() == slotSize);
+    assert(slot(0)->sequence.load() == 4);
+
+    slot(1)->length = UINT32_MAX;
+    thrown = false;
+    try {
+        consumer.consume([&](std::span<const uint8_t>) { assert(false); });
+    } catch (const std::system_error &e) {
+        thrown = e.code().value() == EBADMSG;
+    }
+    assert(thrown);
+
+    // 修好之后可以继续读取
+    slot(1)->length = static_cast<uint32_t>(payload(0, 1).size());
+    assert(consumer.consume([&](std::span<const uint8_t> message) { checkPayload(message, next); }) == 1);
+    munmap(mem, length);
+
+    // attach时header中的几何参数与映射不符
+    ShmRing bad = ShmRing::create(4, slotSize);
+    void *badMem = mmap(nullptr, sizeof(Detail::RingHeader), PROT_READ | PROT_WRITE, MAP_SHARED, bad.fd(), 0);
+    static_cast<Detail::RingHeader*>(badMem)->slotSize = 1u << 20;
+    thrown = false;
+    try {
+        ShmRing::attach(dup(bad.fd()));
+    } catch (const std::system_error &e) {
+        thrown = e.code().value() == EINVAL;
+    }
+    assert(thrown);
+    munmap(badMem, sizeof(Detail::RingHeader));
+}
+
+int main() {
+    spsc();
+    mpsc();
+    wakeups();
+    corruptPeer();
+    std::printf("transport_test passed\n");
+    return 0;
+}
@@ -0,0 +1,153 @@
+/**
+ * MessageVerifier: 构建的消息通过校验，改坏其中一处后返回对应的错误和位置
+ */
+#include <cassert>
+#include <cstdio>
+
+#include "messages.hpp"
+#include "verifier.hpp"
+
+using namespace SMessageTest;
+
+template <typename Root>
+static void expectError(const Bytes &message, VerifyError error, int32_t offset, int32_t maxDepth = MessageVerifier::defaultMaxDepth) {
+    const VerifyResult result = verifyMessage<Root>(message.data(), message.size(), maxDepth);
+    assert(result.error == error && result.offset == offset);
+}
+
+template <typename Root>
+static void expectValid(const Bytes &message, int32_t maxDepth = MessageVerifier::defaultMaxDepth) {
+    assert(verifyMessage<Root>(message.data(), message.size(), maxDepth));
+}
+
+static void header() {
+    const Bytes message = mouseMove(3, true);
+    expectValid<base::MouseMove>(message);
+    expectError<base::MouseMove>(Bytes(message.begin(), message.end() - 1), VerifyError::Header, 0);
+    Bytes corrupt = message;
+    storeValue<int32_t>(corrupt.data(), NextAvailableOffset, static_cast<int32_t>(message.size()) + 1);
+    expectError<base::MouseMove>(corrupt, VerifyError::Header, NextAvailableOffset);
+    expectError<base::MouseMove>(Bytes(message.begin(), message.begin() + RootOffset), VerifyError::Header, 0);
+    expectError<title::TitleButtonClick>(message, VerifyError::Header, 0);
+}
+
+/// 引用指向nextAvailableOffset之后、header之内，或者struct跨过末尾
+static void reference() {
+    const Bytes message = recu(3, 0, false);
+    expectValid<title::RecuTest>(message);
+    const int32_t left = RootOffset + title::RecuTest::offsetLeft;
+    const int32_t end = static_cast<int32_t>(message.size());
+    for (int32_t addr : {end, end - title::RecuTest::byteLength + 4, 4, -RootOffset}) {
+        Bytes corrupt = message;
+        storeValue<int32_t>(corrupt.data(), left, addr);
+        expectError<title::RecuTest>(corrupt, VerifyError::Reference, addr);
+    }
+}
+
+/// map的长key: capacity小于length，或者数据区超出buffer
+static void string() {
+    const std::string longKey(40, 'k');
+    const Bytes message = mouseDown({{longKey, 0, 0, {}}});
+    expectValid<base::MouseDown>(message);
+    const int32_t key = loadValue<int32_t>(message.data(), RootOffset + base::MouseDown::offsetPosition + 8);
+    const MsgString str(const_cast<uint8_t*>(message.data()), key);
+    assert(!str.isInline() && str.length() == 40);
+
+    Bytes corrupt = message;
+    MsgString(corrupt.data(), key).setOutOfLine(str.getDataOffset(), 40, 39);
+    expectError<base::MouseDown>(corrupt, VerifyError::String, key);
+
+    corrupt = message;
+    MsgString(corrupt.data(), key).setOutOfLine(static_cast<int32_t>(message.size()) - 20, 40, 40);
+    expectError<base::MouseDown>(corrupt, VerifyError::String, static_cast<int32_t>(message.size()) - 20);
+
+    // inline字符串的长度超过11
+    corrupt = message;
+    storeValue<uint8_t>(corrupt.data(), key, 0x80 | 12);
+    expectError<base::MouseDown>(corrupt, VerifyError::String, key);
+}
+
+/// native数组和@soa数据区的地址没有按元素/8对齐，capacity小于size
+static void misalignedVector() {
+    const Bytes message = mouseDown({{"a", 2, 0, {1, 2, 3}}});
+    expectValid<base::MouseDown>(message);
+    const int32_t entry = loadValue<int32_t>(message.data(), RootOffset + base::MouseDown::offsetPosition + 8);
+    using Map = decltype(std::declval<base::MouseDown>().getPosition());
+    const int32_t values = loadValue<int32_t>(message.data(), entry + Map::keyByte() + 4);
+    Bytes corrupt = message;
+    storeValue<int32_t>(corrupt.data(), values, loadValue<int32_t>(message.data(), values) + 1);
+    expectError<base::MouseDown>(corrupt, VerifyError::Vector, values);
+
+    corrupt = message;
+    storeValue<int32_t>(corrupt.data(), values + 8, 2);
+    expectError<base::MouseDown>(corrupt, VerifyError::Vector, values);
+
+    const Bytes area = hitArea(5, 0);
+    expectValid<title::TitleHitArea>(area);
+    const int32_t outline = RootOffset + title::TitleHitArea::offsetOutline;
+    corrupt = area;
+    storeValue<int32_t>(corrupt.data(), outline, loadValue<int32_t>(area.data(), outline) + 4);
+    expectError<title::TitleHitArea>(corrupt, VerifyError::Vector, outline);
+}
+
+/// combine的index超出候选类型，或者值的地址超出buffer
+static void combine() {
+    const Bytes message = workingArea({1, 2}, 1);
+    expectValid<base::WorkingArea>(message);
+    const auto path = base::WorkingArea(const_cast<uint8_t*>(message.data()), RootOffset).getPath();
+    const int32_t first = path.getStartOffset();
+
+    Bytes corrupt = message;
+    storeValue<uint8_t>(corrupt.data(), first, 3);
+    expectError<base::WorkingArea>(corrupt, VerifyError::Combine, first);
+
+    corrupt = message;
+    storeValue<int32_t>(corrupt.data(), first + 4, static_cast<int32_t>(message.size()) - 4);
+    expectError<base::WorkingArea>(corrupt, VerifyError::Combine, static_cast<int32_t>(message.size()) - 4);
+
+    // fov的float32直接保存在combine中，index同样检查
+    corrupt = message;
+    storeValue<uint8_t>(corrupt.data(), RootOffset + base::WorkingArea::offsetFov, 7);
+    expectError<base::WorkingArea>(corrupt, VerifyError::Combine, RootOffset + base::WorkingArea::offsetFov);
+}
+
+/// RecuTest的引用链超过maxDepth
+static void depth() {
+    const Bytes message = recu(100, 0, false);
+    assert(verifyMessage<title::RecuTest>(message.data(), message.size()).error == VerifyError::Depth);
+    expectValid<title::RecuTest>(message, 1000);
+    expectValid<title::RecuTest>(recu(20, 0, true));
+}
+
+/**
+ * 每个引用都在buffer之内，但所有行都指向第一行的数据区，子空间的总长度超过buffer。
+ * 这样构造的buffer如果不检查，遍历的次数可以远大于buffer长度。
+ */
+static void budget() {
+    std::vector<int> rows(12, 1);
+    rows[0] = 40;
+    const Bytes message = buttonClick(rows, 0);
+    expectValid<title::TitleButtonClick>(message);
+    const auto points = title::TitleButtonClick(const_cast<uint8_t*>(message.data()), RootOffset).getPoints();
+    const int32_t start = points.getStartOffset();
+    const int32_t rowBytes = byteLengthOf<MsgVector<base::Point2D>>();
+
+    Bytes corrupt = message;
+    for (int32_t i = 1; i < points.getSize(); i++) {
+        std::memcpy(corrupt.data() + start + rowBytes * i, message.data() + start, static_cast<size_t>(rowBytes));
+    }
+    const VerifyResult result = verifyMessage<title::TitleButtonClick>(corrupt.data(), corrupt.size());
+    assert(result.error == VerifyError::Budget && result.offset == loadValue<int32_t>(message.data(), start));
+}
+
+int main() {
+    header();
+    reference();
+    string();
+    misalignedVector();
+    combine();
+    depth();
+    budget();
+    std::printf("verifier_test passed\n");
+    return 0;
+}
@@ -0,0 +1,113 @@
+/**
+ * 紧凑编码: 编码→解码后再编码得到相同的字节，解码的消息通过校验；map的key不递增时拒绝，@flat解码后连续，
+ * 解码后的消息受maxDecodedBytes限制
+ */
+#include <cassert>
+#include <cstdio>
+#include <utility>
+
+#include "messages.hpp"
+#include "verifier.hpp"
+#include "wire.hpp"
+
+using namespace SMessageTest;
+
+template <typename Root>
+static Bytes roundTrip(const char *name, const Bytes &message) {
+    Bytes wire;
+    bool ok = encodeWire<Root>(message.data(), wire);
+    assert(ok);
+    MessageBuilder decoded;
+    ok = decodeWire<Root>(wire, decoded);
+    assert(ok);
+    assert(verifyMessage<Root>(decoded.data(), decoded.size()));
+
+    Bytes again;
+    ok = encodeWire<Root>(decoded.data(), again);
+    assert(ok && again == wire);
+    std::printf("%-20s message %5zu wire %5zu\n", name, message.size(), wire.size());
+    return bytesOf(decoded);
+}
+
+/// 交换map中的两个entry或把后一个key改成与前一个相同，编码后解码失败
+static void rejectUnorderedKeys() {
+    using Map = decltype(std::declval<base::MouseDown>().getPosition());
+    const Bytes message = mouseDown({{"a", 1, 1, {}}, {"b", 2, 0, {1, 2}}, {"c", 0, 0, {}}});
+    const int32_t data = loadValue<int32_t>(message.data(), RootOffset + base::MouseDown::offsetPosition + 8);
+
+    auto expectRejected = [](const Bytes &corrupt) {
+        Bytes wire;
+        const bool ok = encodeWire<base::MouseDown>(corrupt.data(), wire);
+        assert(ok);
+        MessageBuilder decoded;
+        assert(!decodeWire<base::MouseDown>(wire, decoded));
+    };
+
+    Bytes corrupt = message;
+    std::swap_ranges(corrupt.begin() + data, corrupt.begin() + data + Map::entryByte(), corrupt.begin() + data + Map::entryByte());
+    expectRejected(corrupt);
+
+    corrupt = message;
+    std::copy_n(corrupt.begin() + data, Map::keyByte(), corrupt.begin() + data + Map::entryByte());
+    expectRejected(corrupt);
+}
+
+/// 解码后的消息恰好不超过maxDecodedBytes时成功，小1字节时失败
+static void limitDecodedBytes() {
+    Bytes wire;
+    bool ok = encodeWire<title::RecuTest>(recu(200, 0, false).data(), wire);
+    assert(ok);
+    MessageBuilder decoded;
+    ok = decodeWire<title::RecuTest>(wire, decoded);
+    assert(ok);
+    const int32_t length = decoded.nextAvailableOffset();
+    assert(decodeWire<title::RecuTest>(wire, decoded, length));
+    assert(!decodeWire<title::RecuTest>(wire, decoded, length - 1));
+
+    // 字符串同样计入
+    const std::string longKey(40, 'k');
+    wire.clear();
+    ok = encodeWire<base::MouseDown>(mouseDown({{longKey, 2, 0, {}}}).data(), wire);
+    assert(ok);
+    ok = decodeWire<base::MouseDown>(wire, decoded);
+    assert(ok);
+    const int32_t mapLength = decoded.nextAvailableOffset();
+    assert(decodeWire<base::MouseDown>(wire, decoded, mapLength));
+    assert(!decodeWire<base::MouseDown>(wire, decoded, mapLength - 1));
+}
+
+int main() {
+    roundTrip<base::MouseMove>("mousemove", mouseMove(3, true));
+    // @flat的各行按行顺序分配，解码后是连续的块
+    const Bytes rows = roundTrip<title::TitleButtonClick>("rows", buttonClick({1, 0, 5, 3}, 1));
+    assert(!title::TitleButtonClick(const_cast<uint8_t*>(buttonClick({1, 0, 5, 3}, 1).data()), RootOffset).getPointsRows().isFlat());
+    const title::TitleButtonClick click(const_cast<uint8_t*>(rows.data()), RootOffset);
+    assert(click.getPointsRows().isFlat());
+    for (int32_t i = 0; i < click.getPoints().getSize(); i++) {
+        assert(click.getPoints().getItem(i).getStartOffset() % itemAlignment<base::Point2D>() == 0);
+    }
+
+    const std::string longKey(40, 'k');
+    roundTrip<base::MouseDown>("map", mouseDown({{"a", 1, 1, {}}, {longKey, 2, 0, {1, 2, 3}}, {"c", 0, 0, {}}, {longKey + "z", 1, 7, {}}}));
+    roundTrip<base::MouseDown>("map empty", mouseDown({}));
+
+    // 共享的struct解码后仍然共享
+    const Bytes shared = roundTrip<title::RecuTest>("refs shared", recu(6, 0, true));
+    assert(loadValue<int32_t>(shared.data(), RootOffset + title::RecuTest::offsetLeft) == loadValue<int32_t>(shared.data(), RootOffset + title::RecuTest::offsetRight));
+    roundTrip<title::RecuTest>("refs chain", recu(9, 1, false));
+
+    const Bytes area = roundTrip<base::WorkingArea>("combine", workingArea({0, 1, 2, 3}, 2));
+    // 解码分配的数组和combine的值按itemAlignment对齐
+    const auto path = base::WorkingArea(const_cast<uint8_t*>(area.data()), RootOffset).getPath();
+    assert(path.getItem(2).index() == 2);
+    assert(loadValue<int32_t>(area.data(), path.getStartOffset() + path.itemSize() + 4) % itemAlignment<double>() == 0);
+
+    const Bytes soa = roundTrip<title::TitleHitArea>("soa", hitArea(5, 3));
+    const auto outline = title::TitleHitArea(const_cast<uint8_t*>(soa.data()), RootOffset).getOutline();
+    assert(outline.getSize() == 5 && outline.getItem(4).getX() == 7 && outline.getItem(4).getY() == -4);
+
+    rejectUnorderedKeys();
+    limitDecodedBytes();
+    std::printf("wire_test passed\n");
+    return 0;
+}
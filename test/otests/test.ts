@@ -1,4 +1,6 @@
 import { messageFactory } from '../output';
+import { StructBuffer } from '../output/basestructs';
+import { MouseDown } from '../output/slime/message/base';
 
 function test() {
     const rst = messageFactory.create(71, new ArrayBuffer(1024), 0);
@@ -11,5 +13,56 @@ function test() {
     console.log(`(${pnt.x}, ${pnt.y})`);
 }
 
-test();
+function check(ok: boolean, message: string) {
+    if (!ok) {
+        throw new Error(message);
+    }
+}
+
+/** MouseDown.position中写入已排序的count个key(一半超过11字节)，第i个的值为Point2D(i, -i) */
+function mouseDownWithKeys(count: number) {
+    const keys = Array.from({ length: count }, (_, i) => (i % 2 ? `cursor.position.${String(i * 2).padStart(2, '0')}` : `pos${String(i * 2).padStart(2, '0')}`)).sort();
+    const sBuffer = new StructBuffer(new ArrayBuffer(4096));
+    sBuffer._dataView.setInt32(0, MouseDown.typeId(), true);
+    sBuffer._dataView.setInt32(8, 12 + MouseDown.byteLength(), true);
+    const down = new MouseDown(sBuffer, 12);
+    sBuffer.setRootStruct(down);
+
+    // StructMap没有插入接口，按布局直接写入entry
+    const entryByte = 20;
+    const data = down.$_createSubBuffer(count * entryByte);
+    sBuffer._dataView.setInt32(12, count, true);
+    sBuffer._dataView.setInt32(16, count, true);
+    sBuffer._dataView.setInt32(20, data, true);
+    keys.forEach((key, i) => {
+        const entry = data + entryByte * i;
+        messageFactory.create(60, sBuffer, entry).setString(key);
+        const point = messageFactory.createInStruct(66, down);
+        point.x = i;
+        point.y = -i;
+        sBuffer._dataView.setUint8(entry + 12, 1);
+        sBuffer._dataView.setInt32(entry + 16, point.$_address, true);
+    });
+    return { down, keys };
+}
+
+/**
+ * StructMap.get: 多于一个entry时二分查找曾经不终止，找到后曾经返回key而不是value的地址。
+ * 每个key都能找到对应的值，排在第一个之前、两个key之间和最后一个之后的key都找不到。
+ */
+function mapLookup() {
+    for (const count of [0, 1, 2, 3, 7, 16]) {
+        const { down, keys } = mouseDownWithKeys(count);
+        keys.forEach((key, i) => {
+            const point = down.position.get(key)?.getPoint2D();
+            check(point !== undefined && point.x === i && point.y === -i, `position.get('${key}') of ${count} entries`);
+        });
+        for (const miss of ['', 'a', 'cursor', 'cursor.position.03', 'pos', 'pos03', 'zzz']) {
+            check(down.position.get(miss) === undefined, `position.get('${miss}') of ${count} entries`);
+        }
+    }
+    console.log('mapLookup passed');
+}
 
+test();
+mapLookup();
@@ -8,7 +8,8 @@ const config = {
     mode: 'development',
     target: 'node',
     entry: {
-        test: './test/otests/test.ts'
+        test: './test/otests/test.ts',
+        bench: './test/bench/bench.ts',
     },
     output: {
         path: path.resolve(__dirname, './dist'),